@@ -0,0 +1,120 @@
+// admin.cpp
+// twmail-admin: offline maintenance tool for a mail spool (server does not need to run)
+//
+// Usage:
+//   twmail-admin <mail-spool-dir> train-dict
+//   twmail-admin <mail-spool-dir> recompress <username>
+//   twmail-admin <mail-spool-dir> archive <days>
+//   twmail-admin <mail-spool-dir> import <username> mbox|maildir <path|-> [--threads=N] [--layout=..] [--compress]
+//   twmail-admin <mail-spool-dir> export <username> mbox|maildir <path|-> [--threads=N]
+//   twmail-admin <mail-spool-dir> revoke-sessions [<username>]
+
+#include "serverfunctions.cpp"
+#include "bulkio.cpp"
+
+void usage() {
+    cerr << "Usage:\n"
+         << "  twmail-admin <mail-spool-dir> train-dict             train a new zstd dictionary from all mails\n"
+         << "  twmail-admin <mail-spool-dir> recompress <username>  rewrite a mailbox with the current dictionary\n"
+         << "  twmail-admin <mail-spool-dir> archive <days>         pack mails older than <days> into archive segments\n"
+         << "  twmail-admin <mail-spool-dir> import <username> mbox|maildir <path|->\n"
+         << "                                                       import an mbox file or Maildir into a mailbox\n"
+         << "  twmail-admin <mail-spool-dir> export <username> mbox|maildir <path|->\n"
+         << "                                                       write a mailbox as mbox file or Maildir\n"
+         << "  twmail-admin <mail-spool-dir> revoke-sessions [<username>]\n"
+         << "                                                       invalidate the session tokens of a user (default: all users)\n"
+         << "Options (import/export):\n"
+         << "  --threads=N       parser/writer threads (default: number of cores)\n"
+         << "  --layout=NAME     spool layout of imported mails (flat or hashed)\n"
+         << "  --compress        store imported bodies compressed\n";
+}
+
+int main(int argc, char* argv[]) {
+    // "--name=value" options, the rest are positional arguments
+    vector<string> args;
+    unsigned threads = max(1u, thread::hardware_concurrency());
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) != 0) {
+            args.push_back(arg);
+        } else if (arg.rfind("--threads=", 0) == 0) {
+            threads = max(1ul, strtoul(arg.c_str() + 10, nullptr, 10));
+        } else if (arg.rfind("--layout=", 0) == 0) {
+            if (!set_layout(arg.substr(9))) {
+                cerr << "Unknown layout " << arg.substr(9) << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--compress") {
+            set_compression(true);
+        } else {
+            usage();
+            return EXIT_FAILURE;
+        }
+    }
+    argc = (int)args.size() + 1;
+
+    if (argc < 3) {
+        usage();
+        return EXIT_FAILURE;
+    }
+
+    set_base_dir(args[0]);
+    string cmd = args[1];
+
+    if (!fs::is_directory(get_base_dir())) {
+        cerr << "Mail-Spool-Directory " << get_base_dir() << " not found" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (cmd == "train-dict") {
+        string err;
+        if (!train_dictionary(err)) {
+            cerr << "train-dict: " << err << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (cmd == "recompress" && argc >= 4) {
+        set_compression(true);
+        load_current_dictionary();
+        int count = recompress_mailbox(args[2]);
+        if (count < 0) {
+            cerr << "recompress: mailbox '" << args[2] << "' not found" << endl;
+            return EXIT_FAILURE;
+        }
+        cout << "recompress: rewrote " << count << " mails of '" << args[2] << "'" << endl;
+        return EXIT_SUCCESS;
+    }
+
+    if (cmd == "archive" && argc >= 4) {
+        load_current_dictionary();
+        int count = archive_all(strtoul(args[2].c_str(), nullptr, 10));
+        cout << "archive: packed " << count << " mails" << endl;
+        return EXIT_SUCCESS;
+    }
+
+    if ((cmd == "import" || cmd == "export") && argc >= 6) {
+        string format = args[3];
+        if (format != "mbox" && format != "maildir") {
+            usage();
+            return EXIT_FAILURE;
+        }
+        load_current_dictionary();
+        bool ok = (cmd == "import") ? import_mailbox(args[2], format, args[4], threads)
+                                    : export_mailbox(args[2], format, args[4], threads);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    if (cmd == "revoke-sessions") {
+        string user = (argc >= 4) ? args[2] : SESSION_REVOKED_ALL;
+        if (!revoke_sessions(user)) {
+            cerr << "revoke-sessions: failed to write " << session_revoked_path() << endl;
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    usage();
+    return EXIT_FAILURE;
+}
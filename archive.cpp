@@ -0,0 +1,487 @@
+// archive.cpp
+// Hot/cold tiering: mails older than --archive-after days are packed into per-mailbox
+// archive segments, so mailbox directories only hold the working set and an old mail
+// no longer costs an inode of its own. Archived mails stay in LIST/READ/DELETE.
+//
+//   <BASE_DIR>/.archive/<mailbox>/<name>.seg   one zstd frame per mail (the stored
+//                                              file as is), each frame seekable
+//   <BASE_DIR>/.archive/<mailbox>/<name>.idx   "TWAR" | u32 version | u32 count |
+//       per mail: str id | str sender | str subject | str date | i64 date_ms |
+//                 u64 size | u64 offset | u32 length | u32 dict id
+//       | u64 checksum of everything before        (str, checksum: snapshot.cpp)
+//
+// The .idx is written last and commits the segment, the mail files are unlinked only
+// afterwards. LIST is served from the index (nothing is decompressed), READ reads and
+// decompresses a single frame. Deleting an archived mail rewrites the .idx without it;
+// segments that are less than half alive are repacked on the next pass.
+
+#define ARCHIVE_DIR ".archive"
+#define ARCHIVE_MAGIC "TWAR"
+#define ARCHIVE_VERSION 1
+#define ARCHIVE_MIN_MAILS 16                   // fewer old mails stay files
+#define ARCHIVE_SEGMENT_MAILS 4096
+#define ARCHIVE_SEGMENT_BYTES (64 * 1024 * 1024)
+#define ARCHIVE_PASS_INTERVAL 3600             // seconds between tiering passes
+#define ARCHIVE_PAUSE_MS 10                    // between two mailboxes
+
+struct ArchivedMail {
+	MailEntry entry;
+	uint64_t offset = 0;   // of the frame in the .seg file
+	uint32_t length = 0;
+	uint32_t dict_id = 0;
+};
+
+struct ArchiveSegment {
+	string name;               // file names without extension
+	uint64_t bytes = 0;        // size of the .seg file
+	uint64_t live_bytes = 0;   // frames still referenced by the index
+	vector<ArchivedMail> mails; // sorted by id
+};
+
+struct ArchiveBox {
+	mutex lock;
+	bool loaded = false;
+	vector<ArchiveSegment> segments;
+};
+
+static mutex archive_boxes_mutex;
+static unordered_map<string, shared_ptr<ArchiveBox>> archive_boxes;
+static unsigned ARCHIVE_AFTER_DAYS = 0;
+static atomic<unsigned long> archive_packed(0);
+static atomic<unsigned long> archive_segments_written(0);
+static atomic<unsigned long> archive_reads(0);
+static atomic<unsigned long> archive_removed(0);
+
+static bool is_tombstoned(const string& id); // reclaim.cpp
+void attach_release_mail(const string& content); // attach.cpp
+
+// set_archive_after: age in days after which mails are archived, 0 disables tiering
+void set_archive_after(unsigned days) {
+	ARCHIVE_AFTER_DAYS = days;
+}
+
+static fs::path archive_dir(const string& username) {
+	return BASE_DIR / ARCHIVE_DIR / username;
+}
+
+static fs::path segment_file(const string& username, const string& name, const char* ext) {
+	return archive_dir(username) / (name + ext);
+}
+
+static string encode_segment_index(const ArchiveSegment& seg) {
+	string out(ARCHIVE_MAGIC);
+	put_u32(out, ARCHIVE_VERSION);
+	put_u32(out, (uint32_t)seg.mails.size());
+	for (const ArchivedMail& m : seg.mails) {
+		put_str(out, m.entry.id);
+		put_str(out, m.entry.sender);
+		put_str(out, m.entry.subject);
+		put_str(out, m.entry.date);
+		put_u64(out, (uint64_t)m.entry.date_ms);
+		put_u64(out, (uint64_t)m.entry.size);
+		put_u64(out, m.offset);
+		put_u32(out, m.length);
+		put_u32(out, m.dict_id);
+	}
+	put_u64(out, snapshot_checksum(out.data(), out.size()));
+	return out;
+}
+
+static bool decode_segment_index(const string& data, ArchiveSegment& seg) {
+	if (data.size() < 4 + 8 + 8 || data.compare(0, 4, ARCHIVE_MAGIC) != 0) return false;
+	uint64_t checksum;
+	memcpy(&checksum, data.data() + data.size() - 8, 8);
+	if (snapshot_checksum(data.data(), data.size() - 8) != checksum) return false;
+
+	SnapshotReader reader{data.data() + 4, data.data() + data.size() - 8};
+	if (reader.get<uint32_t>() != ARCHIVE_VERSION) return false;
+	uint32_t count = reader.get<uint32_t>();
+	seg.mails.clear();
+	seg.live_bytes = 0;
+	for (uint32_t i = 0; i < count && reader.ok; ++i) {
+		ArchivedMail m;
+		m.entry.id = reader.get_str();
+		m.entry.sender = reader.get_str();
+		m.entry.subject = reader.get_str();
+		m.entry.date = reader.get_str();
+		m.entry.date_ms = reader.get<int64_t>();
+		m.entry.size = reader.get<uint64_t>();
+		m.offset = reader.get<uint64_t>();
+		m.length = reader.get<uint32_t>();
+		m.dict_id = reader.get<uint32_t>();
+		seg.live_bytes += m.length;
+		seg.mails.push_back(move(m));
+	}
+	return reader.ok;
+}
+
+// write_file_synced: like write_file_atomic, but on disk before the rename (the mail
+// files are unlinked right after a segment is committed)
+static bool write_file_synced(const fs::path& path, const string& data) {
+	fs::path tmp = path;
+	tmp += ".tmp";
+	int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) return false;
+	bool ok = write(fd, data.data(), data.size()) == (ssize_t)data.size() && fdatasync(fd) == 0;
+	close(fd);
+	error_code ec;
+	if (ok) fs::rename(tmp, path, ec);
+	if (!ok || ec) {
+		fs::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+// get_archive: archive segments of `username`, index files read on first access
+static shared_ptr<ArchiveBox> get_archive(const string& username) {
+	shared_ptr<ArchiveBox> box;
+	{
+		lock_guard<mutex> lock(archive_boxes_mutex);
+		shared_ptr<ArchiveBox>& slot = archive_boxes[username];
+		if (!slot) slot = make_shared<ArchiveBox>();
+		box = slot;
+	}
+	lock_guard<mutex> lock(box->lock);
+	if (box->loaded) return box;
+	box->loaded = true;
+
+	error_code ec;
+	for (const auto& e : fs::directory_iterator(archive_dir(username), ec)) {
+		if (e.path().extension() != ".idx") continue;
+		ArchiveSegment seg;
+		seg.name = e.path().stem().string();
+		string data;
+		if (!read_file(e.path(), data) || !decode_segment_index(data, seg)) {
+			cerr << "archive: damaged index " << e.path() << "\n";
+			continue;
+		}
+		seg.bytes = fs::file_size(segment_file(username, seg.name, ".seg"), ec);
+		if (ec) {
+			cerr << "archive: segment of " << e.path() << " is missing\n";
+			continue;
+		}
+		box->segments.push_back(move(seg));
+	}
+	sort(box->segments.begin(), box->segments.end(),
+	     [](const ArchiveSegment& a, const ArchiveSegment& b) { return a.name < b.name; });
+	return box;
+}
+
+// find_archived: position of `id` in `seg`, -1 if it is not in there
+static long find_archived(const ArchiveSegment& seg, const string& id) {
+	auto it = lower_bound(seg.mails.begin(), seg.mails.end(), id,
+	                      [](const ArchivedMail& m, const string& key) { return m.entry.id < key; });
+	return (it != seg.mails.end() && it->entry.id == id) ? it - seg.mails.begin() : -1;
+}
+
+// read_frame: the stored mail file of an archived mail (as it was before archiving)
+static bool read_frame(const fs::path& seg_path, const ArchivedMail& m, string& raw) {
+	int fd = open(seg_path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	string frame(m.length, '\0');
+	bool ok = pread(fd, &frame[0], m.length, m.offset) == (ssize_t)m.length;
+	close(fd);
+	return ok && decompress_body(frame, m.dict_id, raw);
+}
+
+// archive_list: appends the metadata of all archived mails of `username`.
+// Returns false if the mailbox has no archive.
+bool archive_list(const string& username, vector<MailEntry>& mails) {
+	shared_ptr<ArchiveBox> box = get_archive(username);
+	lock_guard<mutex> lock(box->lock);
+	for (const ArchiveSegment& seg : box->segments) {
+		for (const ArchivedMail& m : seg.mails) mails.push_back(m.entry);
+	}
+	return !box->segments.empty();
+}
+
+// archive_load: reads archived mail `id` of `username` as plain text
+bool archive_load(const string& username, const string& id, string& content) {
+	shared_ptr<ArchiveBox> box = get_archive(username);
+	string raw;
+	{
+		// held during the read: a repack must not remove the segment underneath
+		lock_guard<mutex> lock(box->lock);
+		bool found = false;
+		for (const ArchiveSegment& seg : box->segments) {
+			long i = find_archived(seg, id);
+			if (i < 0) continue;
+			if (!read_frame(segment_file(username, seg.name, ".seg"), seg.mails[i], raw)) {
+				cerr << "archive: failed to read " << id << " from segment " << seg.name << "\n";
+				return false;
+			}
+			found = true;
+			break;
+		}
+		if (!found) return false;
+	}
+	archive_reads++;
+	return decode_mail_file(raw, content) && resolve_blob(content, id);
+}
+
+// erase_archived: drops `id` from the segments of `box` and rewrites their index,
+// `dropped` (if set) gets the raw dropped copies, whose blob and attachment references
+// the caller releases. Caller holds box.lock.
+static bool erase_archived(const string& username, ArchiveBox& box, const string& id, vector<string>* dropped) {
+	bool found = false;
+	for (size_t s = 0; s < box.segments.size();) {
+		ArchiveSegment& seg = box.segments[s];
+		long i = find_archived(seg, id);
+		if (i < 0) {
+			s++;
+			continue;
+		}
+		string raw;
+		if (dropped && read_frame(segment_file(username, seg.name, ".seg"), seg.mails[i], raw)) dropped->push_back(move(raw));
+		seg.live_bytes -= seg.mails[i].length;
+		seg.mails.erase(seg.mails.begin() + i);
+		found = true;
+
+		error_code ec;
+		if (seg.mails.empty()) {
+			fs::remove(segment_file(username, seg.name, ".idx"), ec);
+			fs::remove(segment_file(username, seg.name, ".seg"), ec);
+			box.segments.erase(box.segments.begin() + s);
+			continue;
+		}
+		if (!write_file_synced(segment_file(username, seg.name, ".idx"), encode_segment_index(seg)))
+			cerr << "archive: failed to rewrite index of segment " << seg.name << "\n";
+		s++;
+	}
+	return found;
+}
+
+// archive_remove: drops deleted mail `id` from the archive of `username` (reclaimer).
+// Returns false if it was not archived.
+bool archive_remove(const string& username, const string& id) {
+	shared_ptr<ArchiveBox> box = get_archive(username);
+	vector<string> dropped;
+	bool found = false;
+	{
+		lock_guard<mutex> lock(box->lock);
+		found = erase_archived(username, *box, id, &dropped);
+	}
+	// the archived copy held the references (a crash before this leaks them, never loses data)
+	for (const string& raw : dropped) {
+		string hash = blob_reference(raw);
+		if (!hash.empty()) blob_release(hash);
+		attach_release_mail(raw);
+	}
+	if (found) archive_removed++;
+	return found;
+}
+
+// one mail on its way into a new segment: a mail file, or a frame of a segment to repack
+struct ArchiveSource {
+	MailEntry entry;
+	fs::path file;
+	string segment; // repacked from this segment, empty for files
+	ArchivedMail frame;
+};
+
+// pack_segment: writes `sources` as one new segment `seg` without publishing it,
+// `packed` gets the sources that went into it. Runs without box.lock.
+static bool pack_segment(const string& username, const vector<ArchiveSource>& sources, ArchiveSegment& seg,
+                         vector<ArchiveSource>& packed) {
+	seg.name = sources.front().entry.id + "-" + to_string(epoch_ms_now());
+	string data;
+	for (const ArchiveSource& src : sources) {
+		ArchivedMail m;
+		m.entry = src.entry;
+		m.offset = data.size();
+		string frame;
+		if (!src.segment.empty()) {
+			// repacked frames are copied as they are
+			int fd = open(segment_file(username, src.segment, ".seg").c_str(), O_RDONLY | O_CLOEXEC);
+			frame.assign(src.frame.length, '\0');
+			bool ok = fd >= 0 && pread(fd, &frame[0], frame.size(), src.frame.offset) == (ssize_t)frame.size();
+			if (fd >= 0) close(fd);
+			if (!ok) return false;
+			m.dict_id = src.frame.dict_id;
+		} else {
+			string raw;
+			if (!read_file(src.file, raw)) continue; // deleted/moved meanwhile, stays where it is
+			frame = compress_body(raw, m.dict_id);
+			if (frame.empty()) return false;
+		}
+		m.length = (uint32_t)frame.size();
+		data += frame;
+		seg.live_bytes += m.length;
+		seg.mails.push_back(move(m));
+		packed.push_back(src);
+	}
+	if (seg.mails.empty()) return true;
+	seg.bytes = data.size();
+
+	error_code ec;
+	fs::create_directories(archive_dir(username), ec);
+	if (!write_file_synced(segment_file(username, seg.name, ".seg"), data) ||
+	    !write_file_synced(segment_file(username, seg.name, ".idx"), encode_segment_index(seg))) {
+		cerr << "archive: failed to write segment " << seg.name << " of '" << username << "'\n";
+		fs::remove(segment_file(username, seg.name, ".seg"), ec);
+		return false;
+	}
+	archive_segments_written++;
+	return true;
+}
+
+// archive_mailbox: packs the mails of `username` last modified before `cutoff`
+// (epoch seconds) and repacks sparse segments. Returns the number of archived mails.
+//
+// Scanning, compressing and writing run on a copy of the segment list, box->lock is
+// only taken to publish the new segments and drop the sources, so LIST/READ of the
+// mailbox are not stalled by a pass (one pass at a time: the archiver thread).
+//
+// The blob reference of a mail belongs to its file until the archiver unlinks it,
+// then to the archived copy. A mail deleted (tombstoned) or removed/moved while it
+// was packed keeps its file and its copy is dropped again, so the reclaimer releases
+// the reference exactly once. The same goes for a repacked mail the reclaimer erased
+// from its old segment meanwhile.
+int archive_mailbox(const string& username, time_t cutoff) {
+	// snapshots skip the mailbox while its files go away (taken before box->lock:
+	// a mailbox load holds the index lock while it reads the archive)
+	shared_ptr<Mailbox> change = begin_change(username);
+	shared_ptr<ArchiveBox> box = get_archive(username);
+	vector<ArchiveSegment> segments;
+	{
+		lock_guard<mutex> lock(box->lock);
+		segments = box->segments;
+	}
+
+	vector<ArchiveSource> sources;
+	vector<fs::path> leftovers; // archived, but the unlink did not happen (crash)
+	for (const fs::path& dir : mailbox_dirs(username)) {
+		error_code ec;
+		for (const auto& e : fs::directory_iterator(dir, ec)) {
+			if (!e.is_regular_file() || e.path().extension() != ".txt") continue;
+			struct stat st;
+			if (stat(e.path().c_str(), &st) != 0 || st.st_mtime >= cutoff) continue;
+			string id = e.path().stem().string();
+			if (is_tombstoned(id)) continue;
+
+			bool archived = false;
+			for (const ArchiveSegment& seg : segments) archived = archived || find_archived(seg, id) >= 0;
+			if (archived) {
+				leftovers.push_back(e.path());
+				continue;
+			}
+			ArchiveSource src;
+			if (!parse_mail_headers(e.path(), src.entry)) continue;
+			src.file = e.path();
+			sources.push_back(move(src));
+		}
+	}
+	size_t new_mails = sources.size();
+	if (new_mails < ARCHIVE_MIN_MAILS) sources.clear();
+
+	vector<string> sparse;
+	for (const ArchiveSegment& seg : segments) {
+		if (seg.live_bytes * 2 >= seg.bytes) continue;
+		sparse.push_back(seg.name);
+		for (const ArchivedMail& m : seg.mails) {
+			ArchiveSource src;
+			src.entry = m.entry;
+			src.segment = seg.name;
+			src.frame = m;
+			sources.push_back(move(src));
+		}
+	}
+	sort(sources.begin(), sources.end(),
+	     [](const ArchiveSource& a, const ArchiveSource& b) { return a.entry.id < b.entry.id; });
+
+	// new segments first, nothing is removed before they are committed
+	vector<ArchiveSegment> written;
+	vector<ArchiveSource> packed_sources;
+	bool ok = true;
+	size_t start = 0;
+	while (ok && start < sources.size()) {
+		size_t end = start;
+		uint64_t bytes = 0;
+		while (end < sources.size() && end - start < ARCHIVE_SEGMENT_MAILS && bytes < ARCHIVE_SEGMENT_BYTES) {
+			bytes += sources[end].entry.size;
+			end++;
+		}
+		ArchiveSegment seg;
+		vector<ArchiveSource> packed;
+		ok = pack_segment(username, vector<ArchiveSource>(sources.begin() + start, sources.begin() + end), seg, packed);
+		if (ok && !seg.mails.empty()) {
+			written.push_back(move(seg));
+			packed_sources.insert(packed_sources.end(), packed.begin(), packed.end());
+		}
+		start = end;
+	}
+
+	// committed: publish the segments, then the originals can go (segments packed
+	// before a failure included, sparse segments are only dropped if everything went through)
+	lock_guard<mutex> lock(box->lock);
+	for (ArchiveSegment& seg : written) box->segments.push_back(move(seg));
+	error_code ec;
+	int packed = 0;
+	for (const ArchiveSource& src : packed_sources) {
+		if (!src.segment.empty()) {
+			auto old = find_if(box->segments.begin(), box->segments.end(),
+			                   [&](const ArchiveSegment& s) { return s.name == src.segment; });
+			if (old != box->segments.end() && find_archived(*old, src.entry.id) >= 0) continue;
+			// erased from the old segment while it was copied, the reclaimer released it
+			erase_archived(username, *box, src.entry.id, nullptr);
+			continue;
+		}
+		if (!is_tombstoned(src.entry.id) && fs::remove(src.file, ec)) {
+			packed++;
+			continue;
+		}
+		// deleted meanwhile, or the reclaimer/migrator got to the file first
+		erase_archived(username, *box, src.entry.id, nullptr);
+	}
+	for (const fs::path& file : leftovers) fs::remove(file, ec);
+	archive_packed += packed;
+	end_change(change);
+	if (!ok) return packed;
+
+	for (const string& name : sparse) {
+		auto it = find_if(box->segments.begin(), box->segments.end(),
+		                  [&](const ArchiveSegment& s) { return s.name == name; });
+		if (it == box->segments.end()) continue; // emptied by the reclaimer meanwhile
+		fs::remove(segment_file(username, name, ".idx"), ec);
+		fs::remove(segment_file(username, name, ".seg"), ec);
+		box->segments.erase(it);
+	}
+	return packed;
+}
+
+// archive_all: one tiering pass over the whole spool, returns the number of archived mails
+int archive_all(unsigned days) {
+	vector<string> users;
+	for_each_mailbox([&](const string& user) { users.push_back(user); });
+	sort(users.begin(), users.end());
+	users.erase(unique(users.begin(), users.end()), users.end());
+
+	time_t cutoff = time(nullptr) - (time_t)days * 24 * 3600;
+	int total = 0;
+	for (const string& user : users) {
+		total += archive_mailbox(user, cutoff);
+		this_thread::sleep_for(chrono::milliseconds(ARCHIVE_PAUSE_MS));
+	}
+	return total;
+}
+
+// start_archiver: tiering pass at startup and then every ARCHIVE_PASS_INTERVAL seconds
+void start_archiver() {
+	if (ARCHIVE_AFTER_DAYS == 0) return;
+	thread([]() {
+		for (;;) {
+			int packed = archive_all(ARCHIVE_AFTER_DAYS);
+			if (packed > 0) cout << "archive: packed " << packed << " mails older than " << ARCHIVE_AFTER_DAYS << " days\n";
+			this_thread::sleep_for(chrono::seconds(ARCHIVE_PASS_INTERVAL));
+		}
+	}).detach();
+}
+
+string archive_stats() {
+	ostringstream oss;
+	oss << "archive: after=" << ARCHIVE_AFTER_DAYS << "d packed=" << archive_packed
+	    << " segments_written=" << archive_segments_written << " reads=" << archive_reads
+	    << " removed=" << archive_removed << "\n";
+	return oss.str();
+}
@@ -0,0 +1,527 @@
+// attach.cpp
+// Attachments: binary files stored out of line, uploaded and downloaded in
+// checksummed chunks, both resumable after a disconnect.
+//
+//   ATTACH|<name>|<size>|<crc32c>            start or resume an upload
+//                                            -> OK|<upload-id>|<offset to continue at>
+//   APUT|<upload-id>|<offset>|<length>|<crc32c>|<bytes>
+//                                            one chunk of <length> (<= ATTACH_CHUNK_MAX) bytes
+//                                            -> OK|<offset> or OK|<size>|complete
+//   SENDATT|<recipients>|<subject>|<upload-id>[,<upload-id>...]|<message>
+//                                            SEND with completed uploads attached
+//   AGET|<message-id>|<n>|<offset>[|<length>]
+//                                            chunk of the n-th attachment of a mail
+//                                            -> OK|<offset>|<length>|<size>|<chunk crc32c>|<file crc32c>|<bytes>
+//
+// Checksums are CRC-32C (crc32c.cpp, hex). The upload id is derived from user, name,
+// size and checksum, so sending the same ATTACH again after a disconnect returns
+// the id and the offset the server has durably stored; chunks must arrive in order.
+// The finished file is checked against the announced checksum.
+//
+// Uploads live in <BASE_DIR>/.attachments/.uploads/<upload-id> (+ .meta) until a
+// SENDATT claims them. A user may have ATTACH_MAX_OPEN_UPLOADS of them at once, the
+// reclaimer (reclaim.cpp) removes uploads untouched for ATTACH_UPLOAD_TTL. The file then moves to <BASE_DIR>/.attachments/<xx>/<sha256>
+// (stored once per content). <sha256>.ref counts the mails that reference it, like
+// blob records (blobstore.cpp). The mail itself only gets one header line per
+// attachment:
+//
+//   Attachment: <sha256> <size> <crc32c> <name>
+//
+// Deleting the mail file releases the references. Chunks are written with pwrite
+// and read with pread/sendfile, a transfer never holds more than one chunk in memory.
+
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#include "crc32c.cpp"
+
+#define ATTACH_DIR ".attachments"
+#define ATTACH_UPLOAD_DIR ".uploads"
+#define ATTACH_PREFIX "Attachment: "
+#define ATTACH_CHUNK_MAX (1024 * 1024)
+#define ATTACH_MAX_SIZE (2048ull * 1024 * 1024)
+#define ATTACH_MAX_PER_MAIL 8          // header lines of a mail are limited (MAX_HEADER_LINES)
+#define ATTACH_IO_SIZE (64 * 1024)      // checksum passes read the file in pieces of this size
+#define ATTACH_ID_LENGTH 32
+#define ATTACH_MAX_OPEN_UPLOADS 16      // per user, started but not claimed by a SENDATT
+#define ATTACH_UPLOAD_TTL (7 * 24 * 3600) // seconds without a chunk until an upload expires
+
+struct Attachment {
+	string hash;   // sha256 of the content, name in the store
+	uint64_t size = 0;
+	uint32_t crc = 0;
+	string name;
+};
+
+struct UploadMeta {
+	string owner;
+	string name;
+	uint64_t size = 0;
+	uint32_t crc = 0;
+	string hash; // set once the upload is complete
+};
+
+static mutex attach_mutex; // guards refcount files and moves into the store
+static unordered_map<string, unsigned> attach_open_uploads; // per owner, recounted by every sweep (attach_mutex)
+static atomic<unsigned long> attach_expired_uploads(0);
+static atomic<unsigned long> attach_uploaded_bytes(0);
+static atomic<unsigned long> attach_sent_bytes(0);
+static atomic<unsigned long> attach_checksum_errors(0);
+
+static fs::path attach_dir() {
+	return BASE_DIR / ATTACH_DIR;
+}
+
+static fs::path upload_path(const string& id) {
+	return attach_dir() / ATTACH_UPLOAD_DIR / id;
+}
+
+static fs::path upload_meta_path(const string& id) {
+	fs::path p = upload_path(id);
+	p += ".meta";
+	return p;
+}
+
+static fs::path attach_path(const string& hash) {
+	return attach_dir() / hash.substr(0, 2) / hash;
+}
+
+static fs::path attach_ref_path(const string& hash) {
+	fs::path p = attach_path(hash);
+	p += ".ref";
+	return p;
+}
+
+static bool parse_u64(string_view s, uint64_t& out) {
+	auto result = from_chars(s.data(), s.data() + s.size(), out);
+	return !s.empty() && result.ec == errc() && result.ptr == s.data() + s.size();
+}
+
+// valid_upload_id: ids become file names, only our own hex ids are accepted
+static bool valid_upload_id(string_view id) {
+	return id.size() == ATTACH_ID_LENGTH && id.find_first_not_of("0123456789abcdef") == string_view::npos;
+}
+
+// attachment_name: file name part only, without characters that break the
+// header line or the protocol
+static string attachment_name(string_view raw) {
+	size_t slash = raw.find_last_of("/\\");
+	if (slash != string_view::npos) raw.remove_prefix(slash + 1);
+	string name;
+	for (char c : raw) name += ((unsigned char)c < 0x20 || c == '|') ? '_' : c;
+	if (name.size() > 255) name.resize(255);
+	return name;
+}
+
+static bool read_upload_meta(const string& id, UploadMeta& meta) {
+	string data;
+	if (!read_file(upload_meta_path(id), data)) return false;
+	istringstream in(data);
+	string size, crc;
+	if (!getline(in, meta.owner) || !getline(in, meta.name) || !getline(in, size) || !getline(in, crc)) return false;
+	getline(in, meta.hash);
+	return parse_u64(size, meta.size) && parse_crc32c(crc, meta.crc);
+}
+
+static bool write_upload_meta(const string& id, const UploadMeta& meta) {
+	return write_file_atomic(upload_meta_path(id), meta.owner + "\n" + meta.name + "\n" + to_string(meta.size) + "\n" +
+	                                                   crc32c_hex(meta.crc) + "\n" + meta.hash + (meta.hash.empty() ? "" : "\n"));
+}
+
+// attach_begin: ATTACH, creates the upload or reports how far it got
+string attach_begin(const string& username, string_view name_field, string_view size_field, string_view crc_field) {
+	UploadMeta meta;
+	meta.owner = username;
+	meta.name = attachment_name(name_field);
+	if (meta.name.empty()) return string(ERR) + "Invalid attachment name";
+	if (!parse_u64(size_field, meta.size) || meta.size == 0 || meta.size > ATTACH_MAX_SIZE)
+		return string(ERR) + "Invalid attachment size";
+	if (!parse_crc32c(crc_field, meta.crc)) return string(ERR) + "Invalid checksum";
+
+	string id = sha256_hex(username + "\n" + meta.name + "\n" + to_string(meta.size) + "\n" + crc32c_hex(meta.crc))
+	                .substr(0, ATTACH_ID_LENGTH);
+	UploadMeta existing;
+	if (read_upload_meta(id, existing)) {
+		if (existing.owner != username) return string(ERR) + "Upload belongs to another user";
+		if (!existing.hash.empty()) return string(ACK) + "|" + id + "|" + to_string(existing.size);
+	} else {
+		lock_guard<mutex> lock(attach_mutex);
+		unsigned& open_uploads = attach_open_uploads[username];
+		if (open_uploads >= ATTACH_MAX_OPEN_UPLOADS) return string(ERR) + "Too many open uploads";
+		error_code ec;
+		fs::create_directories(upload_path(id).parent_path(), ec);
+		int fd = open(upload_path(id).c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+		if (fd < 0 || !write_upload_meta(id, meta)) {
+			if (fd >= 0) close(fd);
+			cerr << "attach_begin: failed to create upload " << id << "\n";
+			return string(ERR) + "Failed to create upload";
+		}
+		close(fd);
+		open_uploads++;
+		cout << "attach_begin: upload " << id << " (" << meta.name << ", " << meta.size << " bytes) for '" << username << "'\n";
+	}
+
+	struct stat st;
+	if (stat(upload_path(id).c_str(), &st) != 0) return string(ERR) + "Upload not found";
+	return string(ACK) + "|" + id + "|" + to_string(st.st_size);
+}
+
+// checksum_file: CRC-32C and SHA-256 of an open file, read in ATTACH_IO_SIZE pieces
+static bool checksum_file(int fd, uint64_t size, uint32_t& crc, string& hash) {
+	vector<char> buf(ATTACH_IO_SIZE);
+	EVP_MD_CTX* ctx = EVP_MD_CTX_new();
+	EVP_DigestInit_ex(ctx, EVP_sha256(), nullptr);
+	crc = 0;
+	bool ok = true;
+	for (uint64_t off = 0; off < size && ok;) {
+		ssize_t n = pread(fd, buf.data(), min<uint64_t>(buf.size(), size - off), off);
+		if (n <= 0) {
+			ok = false;
+			break;
+		}
+		crc = crc32c_update(crc, buf.data(), n);
+		EVP_DigestUpdate(ctx, buf.data(), n);
+		off += n;
+	}
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_DigestFinal_ex(ctx, digest, &len);
+	EVP_MD_CTX_free(ctx);
+
+	static const char hex[] = "0123456789abcdef";
+	hash.clear();
+	for (unsigned int i = 0; i < len; ++i) {
+		hash += hex[digest[i] >> 4];
+		hash += hex[digest[i] & 0x0f];
+	}
+	return ok;
+}
+
+// attach_put: APUT, appends one chunk at `offset` (must be the stored size)
+string attach_put(const string& username, string_view id_field, string_view offset_field, string_view length_field,
+                  string_view crc_field, string_view data) {
+	TraceSpan span("attach_put");
+	string id(id_field);
+	UploadMeta meta;
+	if (!valid_upload_id(id) || !read_upload_meta(id, meta) || meta.owner != username) return string(ERR) + "Unknown upload";
+	if (!meta.hash.empty()) return string(ERR) + "Upload already complete";
+
+	uint64_t offset, length;
+	uint32_t crc;
+	if (!parse_u64(offset_field, offset) || !parse_u64(length_field, length) || !parse_crc32c(crc_field, crc)) {
+		return string(ERR) + "Invalid chunk header";
+	}
+	if (length > ATTACH_CHUNK_MAX) return string(ERR) + "Chunk too large";
+	if (data.size() != length) return string(ERR) + "Chunk length mismatch"; // truncated or trailing bytes
+	if (crc32c_update(0, data.data(), data.size()) != crc) {
+		attach_checksum_errors++;
+		return string(ERR) + "Chunk checksum mismatch";
+	}
+
+	int fd = open(upload_path(id).c_str(), O_RDWR | O_CLOEXEC);
+	if (fd < 0) return string(ERR) + "Unknown upload";
+	// one writer per upload (the same client may reconnect while its old connection still writes)
+	flock(fd, LOCK_EX);
+	struct stat st;
+	string resp;
+	if (fstat(fd, &st) != 0) {
+		resp = string(ERR) + "Upload not readable";
+	} else if ((uint64_t)st.st_size != offset) {
+		resp = string(ERR) + "Offset mismatch, upload is at " + to_string(st.st_size);
+	} else if (offset + data.size() > meta.size) {
+		resp = string(ERR) + "Chunk exceeds attachment size";
+	} else {
+		size_t written = 0;
+		while (written < data.size()) {
+			ssize_t n = pwrite(fd, data.data() + written, data.size() - written, offset + written);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) break;
+			written += n;
+		}
+		// the acknowledged offset has to survive a crash, a resume continues there
+		if (written != data.size() || fdatasync(fd) != 0) {
+			if (ftruncate(fd, offset) != 0) {}
+			resp = string(ERR) + "Failed to store chunk";
+		} else {
+			attach_uploaded_bytes += written;
+			offset += written;
+			resp = string(ACK) + "|" + to_string(offset);
+		}
+	}
+
+	if (resp.rfind(ACK, 0) == 0 && offset == meta.size) {
+		uint32_t file_crc;
+		string hash;
+		if (!checksum_file(fd, meta.size, file_crc, hash)) {
+			resp = string(ERR) + "Failed to verify upload";
+		} else if (file_crc != meta.crc) {
+			// chunks were fine but do not add up to the announced file: start over
+			attach_checksum_errors++;
+			if (ftruncate(fd, 0) != 0) {}
+			resp = string(ERR) + "File checksum mismatch, upload restarted";
+		} else {
+			meta.hash = hash;
+			resp = write_upload_meta(id, meta) ? string(ACK) + "|" + to_string(meta.size) + "|complete"
+			                                   : string(ERR) + "Failed to complete upload";
+		}
+	}
+	close(fd);
+	return resp;
+}
+
+// caller holds attach_mutex
+static long attach_refcount(const string& hash) {
+	string data;
+	if (!read_file(attach_ref_path(hash), data)) return 0;
+	return strtol(data.c_str(), nullptr, 10);
+}
+
+// attach_release: drops one reference, removes the attachment with the last one
+void attach_release(const string& hash) {
+	lock_guard<mutex> lock(attach_mutex);
+	long count = attach_refcount(hash) - 1;
+	error_code ec;
+	if (count <= 0) {
+		fs::remove(attach_path(hash), ec);
+		fs::remove(attach_ref_path(hash), ec);
+		return;
+	}
+	write_file_atomic(attach_ref_path(hash), to_string(count));
+}
+
+// parse_attachment: "<sha256> <size> <crc32c> <name>" (header value)
+static bool parse_attachment(string_view value, Attachment& a) {
+	size_t s1 = value.find(' '), s2 = value.find(' ', s1 + 1), s3 = value.find(' ', s2 + 1);
+	if (s3 == string_view::npos) return false;
+	a.hash = string(value.substr(0, s1));
+	a.name = string(value.substr(s3 + 1));
+	return a.hash.size() == 64 && a.hash.find_first_not_of("0123456789abcdef") == string::npos &&
+	       parse_u64(value.substr(s1 + 1, s2 - s1 - 1), a.size) && parse_crc32c(value.substr(s2 + 1, s3 - s2 - 1), a.crc);
+}
+
+// mail_attachments: attachments listed in the headers of a stored mail
+static vector<Attachment> mail_attachments(const string& content) {
+	string_view lines[MAX_HEADER_LINES];
+	size_t body;
+	size_t n = scan_headers(content.data(), content.size(), lines, MAX_HEADER_LINES, body);
+	vector<Attachment> out;
+	for (size_t i = 0; i < n; ++i) {
+		Attachment a;
+		if (lines[i].rfind(ATTACH_PREFIX, 0) == 0 && parse_attachment(lines[i].substr(strlen(ATTACH_PREFIX)), a))
+			out.push_back(a);
+	}
+	return out;
+}
+
+// attach_release_mail: releases the attachments of a mail file that is removed
+void attach_release_mail(const string& content) {
+	for (const Attachment& a : mail_attachments(content)) attach_release(a.hash);
+}
+
+// attach_stored: the file of `hash` is in the store
+bool attach_stored(const string& hash) {
+	error_code ec;
+	return fs::exists(attach_path(hash), ec);
+}
+
+// attach_fetch_path: where a replication follower downloads a missing attachment to
+fs::path attach_fetch_path() {
+	error_code ec;
+	fs::create_directories(attach_dir() / ATTACH_UPLOAD_DIR, ec);
+	return attach_dir() / ATTACH_UPLOAD_DIR / "replica.fetch";
+}
+
+// attach_adopt: (replication follower) `refs` more references to `a`. `fetched` is the
+// file downloaded from the leader if it was not stored yet (empty otherwise), it must
+// match the size and checksums of the header line.
+bool attach_adopt(const Attachment& a, const fs::path& fetched, int refs) {
+	error_code ec;
+	if (!fetched.empty()) {
+		int fd = open(fetched.c_str(), O_RDONLY | O_CLOEXEC);
+		struct stat st;
+		uint32_t crc = 0;
+		string hash;
+		bool ok = fd >= 0 && fstat(fd, &st) == 0 && (uint64_t)st.st_size == a.size && checksum_file(fd, a.size, crc, hash) &&
+		          crc == a.crc && hash == a.hash;
+		if (fd >= 0) close(fd);
+		if (!ok) {
+			attach_checksum_errors++;
+			fs::remove(fetched, ec);
+			return false;
+		}
+	}
+
+	lock_guard<mutex> lock(attach_mutex);
+	if (!fetched.empty()) {
+		if (fs::exists(attach_path(a.hash), ec)) {
+			fs::remove(fetched, ec);
+		} else {
+			fs::create_directories(attach_path(a.hash).parent_path(), ec);
+			fs::rename(fetched, attach_path(a.hash), ec);
+			if (ec) return false;
+		}
+	}
+	return write_file_atomic(attach_ref_path(a.hash), to_string(attach_refcount(a.hash) + refs));
+}
+
+// attach_claim: moves the completed uploads `ids_field` ("id,id,...") of `username`
+// into the store with `refs` references each. Sets the header lines for the mail and
+// the hashes to release if a mailbox could not be written.
+bool attach_claim(const string& username, string_view ids_field, int refs, string& headers, vector<string>& hashes,
+                  string& err) {
+	vector<string> ids;
+	size_t start = 0;
+	while (start <= ids_field.size()) {
+		size_t comma = ids_field.find(',', start);
+		if (comma == string_view::npos) comma = ids_field.size();
+		string id(ids_field.substr(start, comma - start));
+		id.erase(0, id.find_first_not_of(" \t"));
+		id.erase(id.find_last_not_of(" \t") + 1);
+		if (!id.empty() && find(ids.begin(), ids.end(), id) == ids.end()) ids.push_back(id);
+		start = comma + 1;
+	}
+	if (ids.empty() || ids.size() > ATTACH_MAX_PER_MAIL) {
+		err = "between 1 and " + to_string(ATTACH_MAX_PER_MAIL) + " attachments per mail";
+		return false;
+	}
+
+	// check all uploads before claiming any
+	vector<UploadMeta> metas(ids.size());
+	for (size_t i = 0; i < ids.size(); ++i) {
+		if (!valid_upload_id(ids[i]) || !read_upload_meta(ids[i], metas[i]) || metas[i].owner != username) {
+			err = "unknown upload " + ids[i];
+			return false;
+		}
+		if (metas[i].hash.empty()) {
+			err = "upload " + ids[i] + " is not complete";
+			return false;
+		}
+	}
+
+	lock_guard<mutex> lock(attach_mutex);
+	for (size_t i = 0; i < ids.size(); ++i) {
+		const UploadMeta& m = metas[i];
+		error_code ec;
+		long count = attach_refcount(m.hash);
+		if (count == 0 && !fs::exists(attach_path(m.hash))) {
+			fs::create_directories(attach_path(m.hash).parent_path(), ec);
+			fs::rename(upload_path(ids[i]), attach_path(m.hash), ec);
+		} else {
+			fs::remove(upload_path(ids[i]), ec); // same content is stored already
+		}
+		if (ec || !write_file_atomic(attach_ref_path(m.hash), to_string(count + refs))) {
+			err = "failed to store attachment " + m.name;
+			for (const string& h : hashes) {
+				long c = attach_refcount(h) - refs;
+				if (c > 0) {
+					write_file_atomic(attach_ref_path(h), to_string(c));
+				} else {
+					fs::remove(attach_path(h), ec);
+					fs::remove(attach_ref_path(h), ec);
+				}
+			}
+			hashes.clear();
+			return false;
+		}
+		fs::remove(upload_meta_path(ids[i]), ec);
+		auto open_uploads = attach_open_uploads.find(username);
+		if (open_uploads != attach_open_uploads.end() && open_uploads->second > 0) open_uploads->second--;
+		hashes.push_back(m.hash);
+		headers += ATTACH_PREFIX + m.hash + " " + to_string(m.size) + " " + crc32c_hex(m.crc) + " " + m.name + "\n";
+	}
+	return true;
+}
+
+// attach_find: attachment `index` (1-based) of mail `id` in the mailbox of `username`
+bool attach_find(const string& username, const string& id, int index, Attachment& out, string& err) {
+	string mailbox, content;
+	if (!find_message(id, username, mailbox)) err = "Unknown message id";
+	else if (mailbox != username) err = "Message belongs to another mailbox";
+	else if (!load_mail_by_id(mailbox, id, content)) err = "Failed to open mail";
+	if (!err.empty()) return false;
+
+	vector<Attachment> attachments = mail_attachments(content);
+	if (index < 1 || index > (int)attachments.size()) {
+		err = "Attachment index out of range";
+		return false;
+	}
+	out = attachments[index - 1];
+	return true;
+}
+
+// attach_open: the stored file of `a` for reading
+int attach_open(const Attachment& a) {
+	int fd = open(attach_path(a.hash).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd >= 0) posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	return fd;
+}
+
+// attach_range_crc: CRC-32C of `length` bytes at `offset` (read from disk in pieces)
+bool attach_range_crc(int fd, uint64_t offset, uint64_t length, uint32_t& crc) {
+	char buf[ATTACH_IO_SIZE];
+	crc = 0;
+	while (length > 0) {
+		ssize_t n = pread(fd, buf, min<uint64_t>(sizeof(buf), length), offset);
+		if (n <= 0) return false;
+		crc = crc32c_update(crc, buf, n);
+		offset += n;
+		length -= n;
+	}
+	return true;
+}
+
+// attach_expire_uploads: removes uploads without a chunk for ATTACH_UPLOAD_TTL (also
+// leftovers of an upload whose data or .meta file is missing) and recounts the open
+// uploads per user.
+// An upload a connection is writing to right now (flock) is left alone.
+void attach_expire_uploads() {
+	fs::path dir = attach_dir() / ATTACH_UPLOAD_DIR;
+	time_t cutoff = time(nullptr) - ATTACH_UPLOAD_TTL;
+	unordered_map<string, unsigned> open_uploads;
+	unsigned long expired = 0;
+
+	lock_guard<mutex> lock(attach_mutex);
+	error_code ec;
+	for (fs::directory_iterator it(dir, ec), end; !ec && it != end; it.increment(ec)) {
+		string id = it->path().filename().string();
+		bool meta_entry = id.size() > 5 && id.compare(id.size() - 5, 5, ".meta") == 0;
+		if (meta_entry) id.resize(id.size() - 5);
+		if (!valid_upload_id(id)) continue;
+		error_code exists_ec;
+		if (meta_entry && fs::exists(upload_path(id), exists_ec)) continue; // handled with its data file
+		UploadMeta meta;
+		bool has_meta = read_upload_meta(id, meta);
+		struct stat data_st, meta_st;
+		bool has_data = stat(upload_path(id).c_str(), &data_st) == 0;
+		bool has_meta_file = stat(upload_meta_path(id).c_str(), &meta_st) == 0;
+		if (!has_data && !has_meta_file) continue; // removed earlier in this pass
+		time_t touched = max(has_data ? data_st.st_mtime : 0, has_meta_file ? meta_st.st_mtime : 0);
+		if (touched >= cutoff) {
+			if (has_meta) open_uploads[meta.owner]++;
+			continue;
+		}
+
+		int fd = open(upload_path(id).c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+			close(fd);
+			if (has_meta) open_uploads[meta.owner]++;
+			continue;
+		}
+		error_code rm;
+		fs::remove(upload_path(id), rm);
+		fs::remove(upload_meta_path(id), rm);
+		if (fd >= 0) close(fd);
+		expired++;
+	}
+	attach_open_uploads.swap(open_uploads);
+	if (expired) {
+		attach_expired_uploads += expired;
+		cout << "attach: " << expired << " expired uploads removed\n";
+	}
+}
+
+string attach_stats() {
+	return "attach: uploaded=" + to_string(attach_uploaded_bytes) + " sent=" + to_string(attach_sent_bytes) +
+	       " checksum_errors=" + to_string(attach_checksum_errors) + " expired_uploads=" + to_string(attach_expired_uploads) +
+	       "\n";
+}
@@ -0,0 +1,94 @@
+// bench_parser.cpp
+// Microbenchmark for parser.cpp: parse time per command, heap allocations per
+// parsed command (global operator new is counted) and the header block scanner.
+//
+// Build/run: make bench
+
+#include <iostream>
+#include <chrono>
+#include <cstdlib>
+#include <new>
+#include <atomic>
+#include <string>
+
+#include "parser.cpp"
+
+static std::atomic<unsigned long> allocations(0);
+
+void* operator new(size_t size) {
+    allocations++;
+    void* p = malloc(size ? size : 1);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+void operator delete(void* p) noexcept {
+    free(p);
+}
+void operator delete(void* p, size_t) noexcept {
+    free(p);
+}
+
+template <typename Fn>
+static double ns_per_op(int rounds, Fn fn) {
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < rounds; ++i) fn();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / rounds;
+}
+
+static unsigned long sink = 0;
+
+// bench_headers: ns per header block of a stored mail (scan_headers)
+static void bench_headers() {
+    std::string body(2000, 'x');
+    for (size_t i = 70; i < body.size(); i += 71) body[i] = '\n';
+    std::string mail = "Sender: alice\nRecipient: bob,carol\nSubject: weekly report\n"
+                       "Date: 1761904462714\nMessage:\n" + body;
+    const int ROUNDS = 200000;
+    std::cout << "ns per header block: "
+              << ns_per_op(ROUNDS, [&]() { std::string_view l[16]; size_t b; sink += scan_headers(mail.data(), mail.size(), l, 16, b); })
+              << "\n";
+}
+
+int main() {
+    const char* commands[] = {
+        "SEND|alice,bob|weekly report|Hello,\nthe report is attached | see below\n",
+        "READ|testuser|42",
+        "DELETE|testuser|7",
+        "LIST",
+        "quit",
+        "STATS",
+    };
+    const size_t lengths[] = {
+        strlen(commands[0]), strlen(commands[1]), strlen(commands[2]),
+        strlen(commands[3]), strlen(commands[4]), strlen(commands[5]),
+    };
+    const int ROUNDS = 2000000;
+
+    unsigned long checksum = 0;
+    unsigned long before = allocations;
+    auto start = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < ROUNDS; ++i) {
+        for (size_t c = 0; c < 6; ++c) {
+            Request req;
+            parse_request(commands[c], lengths[c], req);
+            int index = 0;
+            if (req.op == Opcode::READ || req.op == Opcode::DELETE) parse_index(req.fields[1], index);
+            checksum += (unsigned long)req.op + req.field_count + index;
+        }
+    }
+
+    auto end = std::chrono::steady_clock::now();
+    unsigned long allocs = allocations - before;
+    double total = (double)ROUNDS * 6;
+    double ns = std::chrono::duration<double, std::nano>(end - start).count();
+
+    std::cout << "parsed commands:      " << (unsigned long)total << "\n";
+    std::cout << "ns per command:       " << ns / total << "\n";
+    std::cout << "allocations:          " << allocs << " (" << allocs / total << " per command)\n";
+    std::cout << "checksum:             " << checksum << "\n";
+
+    bench_headers();
+    return allocs == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
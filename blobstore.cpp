@@ -0,0 +1,147 @@
+// blobstore.cpp
+// Content-addressed storage for mail bodies that are sent to several recipients.
+// The body is stored once under <BASE_DIR>/.blobs/<xx>/<sha256>, every recipient
+// only gets a small reference record:
+//
+//   Sender: ...
+//   Recipient: a, b, c
+//   Subject: ...
+//   Date: ...
+//   Blob: <sha256>
+//   Message:
+//
+// <sha256>.ref holds the number of mailboxes referencing the blob. Deleting a
+// reference record drops the count, the blob is removed when it reaches 0.
+
+#include <openssl/evp.h>
+
+#define BLOB_DIR ".blobs"
+#define BLOB_PREFIX "Blob: "
+
+static mutex blob_mutex; // guards refcount files (read-modify-write)
+
+void attach_release_mail(const string& content); // attach.cpp
+
+static string sha256_hex(const string& data) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_Digest(data.data(), data.size(), digest, &len, EVP_sha256(), nullptr);
+
+	static const char hex[] = "0123456789abcdef";
+	string out;
+	out.reserve(len * 2);
+	for (unsigned int i = 0; i < len; ++i) {
+		out += hex[digest[i] >> 4];
+		out += hex[digest[i] & 0x0f];
+	}
+	return out;
+}
+
+static fs::path blob_path(const string& hash) {
+	return BASE_DIR / BLOB_DIR / hash.substr(0, 2) / hash;
+}
+
+static fs::path blob_ref_path(const string& hash) {
+	fs::path p = blob_path(hash);
+	p += ".ref";
+	return p;
+}
+
+// caller holds blob_mutex
+static long blob_refcount(const string& hash) {
+	string data;
+	if (!read_file(blob_ref_path(hash), data)) return 0;
+	return strtol(data.c_str(), nullptr, 10);
+}
+
+// blob_put: stores `body` (once) and adds `refs` references to it.
+// Returns the hash of the body, empty string on error.
+string blob_put(const string& body, int refs) {
+	TraceSpan span("blob_put");
+	string hash = sha256_hex(body);
+	lock_guard<mutex> lock(blob_mutex);
+
+	long count = blob_refcount(hash);
+	if (count == 0) {
+		error_code ec;
+		fs::create_directories(blob_path(hash).parent_path(), ec);
+		// blob has the same layout as a mail body -> compression applies here as well
+		if (!write_file_atomic(blob_path(hash), compose_mail_file("", body))) {
+			cerr << "blob_put: failed to write blob " << hash << "\n";
+			return "";
+		}
+	}
+	if (!write_file_atomic(blob_ref_path(hash), to_string(count + refs))) {
+		cerr << "blob_put: failed to update refcount of " << hash << "\n";
+		return "";
+	}
+	return hash;
+}
+
+// blob_get: reads the (decompressed) body stored under `hash`
+bool blob_get(const string& hash, string& body) {
+	string content;
+	if (!read_mail_file(blob_path(hash), content)) return false;
+	body = mail_body(content);
+	return true;
+}
+
+// blob_release: drops one reference, removes the blob with the last one
+void blob_release(const string& hash) {
+	lock_guard<mutex> lock(blob_mutex);
+
+	long count = blob_refcount(hash) - 1;
+	error_code ec;
+	if (count <= 0) {
+		fs::remove(blob_path(hash), ec);
+		fs::remove(blob_ref_path(hash), ec);
+		return;
+	}
+	write_file_atomic(blob_ref_path(hash), to_string(count));
+}
+
+// blob_reference: returns the blob hash of a reference record, empty if the mail is stored inline
+static string blob_reference(const string& content) {
+	size_t pos = content.find("\n" BLOB_PREFIX);
+	size_t msg = content.find("\n" MESSAGE_MARKER);
+	if (pos == string::npos || (msg != string::npos && pos > msg)) return "";
+	pos += 1 + strlen(BLOB_PREFIX);
+	return content.substr(pos, content.find('\n', pos) - pos);
+}
+
+// resolve_blob: replaces the blob reference of a decoded mail with the body.
+// `origin` names the mail in error messages.
+static bool resolve_blob(string& content, const string& origin) {
+	string hash = blob_reference(content);
+	if (hash.empty()) return true;
+
+	string body;
+	if (!blob_get(hash, body)) {
+		cerr << "load_mail: blob " << hash << " referenced by " << origin << " is missing\n";
+		return false;
+	}
+	string headers, unused;
+	split_mail_file(content, headers, unused);
+	headers.erase(headers.find(BLOB_PREFIX), strlen(BLOB_PREFIX) + hash.size() + 1);
+	content = headers + MESSAGE_MARKER + body;
+	return true;
+}
+
+// load_mail: reads a stored mail as plain text, resolving blob references
+// and compressed bodies
+bool load_mail(const fs::path& path, string& content) {
+	return read_mail_file(path, content) && resolve_blob(content, path.string());
+}
+
+// delete_mail_file: removes a stored mail and releases its blob and attachment references
+bool delete_mail_file(const fs::path& path, error_code& ec) {
+	string content;
+	string hash;
+	if (read_file(path, content)) hash = blob_reference(content);
+
+	fs::remove(path, ec);
+	if (ec) return false;
+	if (!hash.empty()) blob_release(hash);
+	attach_release_mail(content);
+	return true;
+}
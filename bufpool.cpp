@@ -0,0 +1,521 @@
+// bufpool.cpp
+// Slab-based I/O buffer pool with size classes, per-thread free lists and
+// chained buffers for large requests. Every block handed out is charged to the
+// connection that uses it (ConnMemory) and to a global memory budget; when the
+// budget is used up, allocation waits (backpressure) instead of growing further.
+//
+// Requests framed as "#<length>|<bytes>" are read exactly; unframed requests (older
+// clients) end where no more data arrives within RECV_MORE_TIMEOUT_MS. Replies are
+// collected in the same pooled blocks (Reply) and framed the same way as the request.
+// A client sends its next request only after the reply to the previous one.
+
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <poll.h>
+#include <new>
+#include <climits>
+#include <strings.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+
+#define POOL_CLASSES 4
+#define POOL_SLAB_BYTES (256 * 1024)
+#define POOL_THREAD_CACHE 32          // max cached blocks per class and thread
+#define POOL_DEFAULT_BUDGET_MB 256
+#define POOL_WAIT_MS 2000             // max backpressure wait per allocation
+#define MAX_REQUEST_SIZE (16 * 1024 * 1024)
+#define RECV_MORE_TIMEOUT_MS 50       // unframed requests: wait for the rest of a request that filled a block
+#define RECV_MIN_SPACE 256            // smaller rests of a block are not worth a recv()
+#define FRAME_MARK '#'
+#define FRAME_HEADER_MAX 24           // "#<length>|"
+
+static const size_t POOL_CLASS_SIZES[POOL_CLASSES] = {1024, 4096, 16384, 65536};
+
+struct PoolBlock {
+	PoolBlock* next = nullptr; // free list / chain link
+	size_t capacity = 0;
+	size_t length = 0;
+	int size_class = -1;       // -1 = large block, malloc'd directly
+	char* data() { return (char*)(this + 1); }
+};
+
+// per-connection memory accounting (only touched by the connection's thread)
+struct ConnMemory {
+	size_t used = 0;
+	size_t peak = 0;
+};
+
+static mutex pool_mutex;
+static condition_variable pool_released;
+static PoolBlock* pool_free_lists[POOL_CLASSES] = {};
+static size_t pool_budget = (size_t)POOL_DEFAULT_BUDGET_MB * 1024 * 1024;
+static atomic<size_t> pool_used(0);
+static atomic<size_t> pool_reserved(0);          // bytes held in slabs
+static atomic<unsigned long> pool_slabs(0);
+static atomic<unsigned long> pool_backpressure_waits(0);
+static atomic<unsigned long> pool_rejected(0);
+static atomic<unsigned> pool_waiters(0);         // allocations waiting for the budget
+static atomic<size_t> pool_conn_peak(0);         // largest per-connection peak so far
+
+void set_memory_budget(size_t mb) {
+	pool_budget = mb * 1024 * 1024;
+}
+
+// thread-local free lists, returned to the global lists when the thread ends
+struct ThreadCache {
+	PoolBlock* head[POOL_CLASSES] = {};
+	size_t count[POOL_CLASSES] = {};
+
+	~ThreadCache() {
+		lock_guard<mutex> lock(pool_mutex);
+		for (int c = 0; c < POOL_CLASSES; ++c) {
+			while (head[c]) {
+				PoolBlock* b = head[c];
+				head[c] = b->next;
+				b->next = pool_free_lists[c];
+				pool_free_lists[c] = b;
+			}
+		}
+	}
+};
+static thread_local ThreadCache thread_cache;
+
+static int pool_size_class(size_t size) {
+	for (int c = 0; c < POOL_CLASSES; ++c) {
+		if (size <= POOL_CLASS_SIZES[c]) return c;
+	}
+	return -1;
+}
+
+// caller holds pool_mutex: carves a new slab into blocks of class c
+static void pool_grow(int c) {
+	size_t block_bytes = sizeof(PoolBlock) + POOL_CLASS_SIZES[c];
+	size_t count = POOL_SLAB_BYTES / block_bytes;
+	char* slab = (char*)malloc(count * block_bytes);
+	if (!slab) return;
+
+	for (size_t i = 0; i < count; ++i) {
+		PoolBlock* b = new (slab + i * block_bytes) PoolBlock();
+		b->capacity = POOL_CLASS_SIZES[c];
+		b->size_class = c;
+		b->next = pool_free_lists[c];
+		pool_free_lists[c] = b;
+	}
+	pool_reserved += count * block_bytes;
+	pool_slabs++;
+}
+
+static PoolBlock* pool_take(int c) {
+	ThreadCache& tc = thread_cache;
+	if (tc.head[c]) {
+		PoolBlock* b = tc.head[c];
+		tc.head[c] = b->next;
+		tc.count[c]--;
+		return b;
+	}
+
+	lock_guard<mutex> lock(pool_mutex);
+	if (!pool_free_lists[c]) pool_grow(c);
+	PoolBlock* b = pool_free_lists[c];
+	if (b) pool_free_lists[c] = b->next;
+	return b;
+}
+
+// pool_alloc: block with at least `size` bytes, charged to `conn`.
+// Waits up to POOL_WAIT_MS for memory if the global budget is exhausted,
+// returns nullptr if there still is none.
+PoolBlock* pool_alloc(size_t size, ConnMemory& conn) {
+	int c = pool_size_class(size);
+	size_t charge = (c >= 0) ? POOL_CLASS_SIZES[c] : size;
+
+	size_t used = pool_used.fetch_add(charge) + charge;
+	if (used > pool_budget) {
+		pool_used -= charge;
+		pool_backpressure_waits++;
+
+		pool_waiters++;
+		unique_lock<mutex> lock(pool_mutex);
+		bool ok = pool_released.wait_for(lock, chrono::milliseconds(POOL_WAIT_MS), [&]() {
+			size_t cur = pool_used.load();
+			return cur + charge <= pool_budget && pool_used.compare_exchange_strong(cur, cur + charge);
+		});
+		pool_waiters--;
+		if (!ok) {
+			pool_rejected++;
+			return nullptr;
+		}
+	}
+
+	PoolBlock* b = nullptr;
+	if (c >= 0) {
+		b = pool_take(c);
+	} else {
+		void* mem = malloc(sizeof(PoolBlock) + size);
+		if (mem) {
+			b = new (mem) PoolBlock();
+			b->capacity = size;
+		}
+	}
+	if (!b) {
+		pool_used -= charge;
+		return nullptr;
+	}
+
+	b->next = nullptr;
+	b->length = 0;
+	conn.used += charge;
+	if (conn.used > conn.peak) {
+		conn.peak = conn.used;
+		size_t seen = pool_conn_peak;
+		while (conn.peak > seen && !pool_conn_peak.compare_exchange_weak(seen, conn.peak)) {}
+	}
+	return b;
+}
+
+void pool_free(PoolBlock* b, ConnMemory& conn) {
+	int c = b->size_class;
+	size_t charge = (c >= 0) ? POOL_CLASS_SIZES[c] : b->capacity;
+
+	if (c < 0) {
+		b->~PoolBlock();
+		free(b);
+	} else {
+		ThreadCache& tc = thread_cache;
+		if (tc.count[c] < POOL_THREAD_CACHE) {
+			b->next = tc.head[c];
+			tc.head[c] = b;
+			tc.count[c]++;
+		} else {
+			lock_guard<mutex> lock(pool_mutex);
+			b->next = pool_free_lists[c];
+			pool_free_lists[c] = b;
+		}
+	}
+
+	conn.used -= charge;
+	pool_used -= charge;
+	// only allocations waiting for the budget need a wake-up; taking the mutex orders
+	// the notify after a waiter's predicate check
+	if (pool_waiters > 0) {
+		{ lock_guard<mutex> lock(pool_mutex); }
+		pool_released.notify_all();
+	}
+}
+
+// BufferChain: request/response bytes in a list of pooled blocks
+class BufferChain {
+public:
+	explicit BufferChain(ConnMemory& conn) : conn(conn) {}
+	~BufferChain() { clear(); }
+
+	BufferChain(const BufferChain&) = delete;
+	BufferChain& operator=(const BufferChain&) = delete;
+
+	// reserve: free space at the end of the chain (at least RECV_MIN_SPACE bytes or the
+	// rest of the last block), nullptr if out of memory
+	char* reserve(size_t hint, size_t& available) {
+		if (!tail || tail->capacity - tail->length < min(hint, (size_t)RECV_MIN_SPACE)) {
+			// grow geometrically: first block small, later ones larger
+			size_t want = max(hint, tail ? min(tail->capacity * 4, POOL_CLASS_SIZES[POOL_CLASSES - 1]) : hint);
+			PoolBlock* b = pool_alloc(want, conn);
+			if (!b) return nullptr;
+			if (tail) tail->next = b;
+			else head = b;
+			tail = b;
+		}
+		available = tail->capacity - tail->length;
+		return tail->data() + tail->length;
+	}
+
+	void commit(size_t n) {
+		tail->length += n;
+		total += n;
+	}
+
+	size_t size() const { return total; }
+
+	// reserve_total: room for `size` bytes in one block (framed request of known length,
+	// contiguous() then needs no copy). Only while the chain is a single block.
+	bool reserve_total(size_t size) {
+		if (!head || head != tail || head->capacity >= size) return true;
+		PoolBlock* b = pool_alloc(size, conn);
+		if (!b) return false;
+		memcpy(b->data(), head->data(), head->length);
+		b->length = head->length;
+		pool_free(head, conn);
+		head = tail = b;
+		return true;
+	}
+
+	// first: bytes of the first block (a frame header is always in there)
+	string_view first() const { return head ? string_view(head->data(), head->length) : string_view(); }
+
+	// append: copies `len` bytes to the end, false if out of memory
+	bool append(const char* data, size_t len) {
+		while (len > 0) {
+			size_t available = 0;
+			char* space = reserve(min(len, POOL_CLASS_SIZES[POOL_CLASSES - 1]), available);
+			if (!space) return false;
+			size_t n = min(len, available);
+			memcpy(space, data, n);
+			commit(n);
+			data += n;
+			len -= n;
+		}
+		return true;
+	}
+
+	// iovecs: the blocks as iovecs for sendmsg()
+	void iovecs(vector<iovec>& iov) const {
+		for (PoolBlock* b = head; b; b = b->next) {
+			if (b->length) iov.push_back({b->data(), b->length});
+		}
+	}
+
+	// contiguous: pointer to all bytes in one piece (copies into one block if chained).
+	// The data is followed by a '\0'.
+	const char* contiguous() {
+		if (!head) return "";
+		if (head == tail && head->length < head->capacity) {
+			head->data()[head->length] = '\0';
+			return head->data();
+		}
+		PoolBlock* flat = pool_alloc(total + 1, conn);
+		if (!flat) return nullptr;
+		for (PoolBlock* b = head; b; b = b->next) {
+			memcpy(flat->data() + flat->length, b->data(), b->length);
+			flat->length += b->length;
+		}
+		size_t keep = total;
+		clear();
+		head = tail = flat;
+		total = keep;
+		flat->data()[flat->length] = '\0';
+		return flat->data();
+	}
+
+	void clear() {
+		while (head) {
+			PoolBlock* next = head->next;
+			pool_free(head, conn);
+			head = next;
+		}
+		tail = nullptr;
+		total = 0;
+	}
+
+private:
+	ConnMemory& conn;
+	PoolBlock* head = nullptr;
+	PoolBlock* tail = nullptr;
+	size_t total = 0;
+};
+
+// frame_header: parses "#<length>|" at the start of data[0..n). Returns the header
+// size (`body` = length), 0 if the header is incomplete, -1 if it is invalid
+static long frame_header(const char* data, size_t n, size_t& body) {
+	body = 0;
+	for (size_t i = 1; i < n && i < FRAME_HEADER_MAX; ++i) {
+		if (data[i] == '|') return i > 1 ? (long)i + 1 : -1;
+		if (data[i] < '0' || data[i] > '9') return -1;
+		body = body * 10 + (data[i] - '0');
+	}
+	return n < FRAME_HEADER_MAX ? 0 : -1;
+}
+
+// aput_length: an unframed "APUT|<id>|<offset>|<length>|<crc32c>|<bytes>" carries its
+// own size. Returns the size of the whole request, 0 if `data` is no complete APUT head.
+static size_t aput_length(const char* data, size_t n) {
+	if (n < 5 || strncasecmp(data, "APUT|", 5) != 0) return 0;
+	size_t pos = 5, length = 0;
+	for (int field = 0; field < 4; ++field) { // id, offset, length, crc
+		const char* pipe = (const char*)memchr(data + pos, '|', n - pos);
+		if (!pipe) return 0;
+		size_t end = pipe - data;
+		if (field == 2) {
+			if (end == pos || end - pos > 9) return 0;
+			for (size_t i = pos; i < end; ++i) {
+				if (data[i] < '0' || data[i] > '9') return 0;
+				length = length * 10 + (data[i] - '0');
+			}
+		}
+		pos = end + 1;
+	}
+	return pos + length;
+}
+
+// recv_request: receives one request into `chain`. A framed request is read exactly,
+// `header` gets the size of its "#<length>|" header (0 for an unframed request).
+// An unframed APUT is read exactly as well (aput_length), binary chunks may pause.
+// Any other unframed request that does not fit into the first block is continued as
+// long as more data arrives within RECV_MORE_TIMEOUT_MS.
+// Returns bytes received (header included), 0 if the peer closed, -1 on error or a
+// broken frame, -2 if out of memory/too large.
+long recv_request(int sock, BufferChain& chain, size_t first_block, size_t& header) {
+	chain.clear();
+	header = 0;
+	bool framed = false;
+	size_t total = 0; // framed: header + body, once the header is complete; APUT: whole request
+	while (true) {
+		size_t available = 0;
+		// rest of a framed request in one block (+1 for the '\0' of contiguous())
+		char* space = chain.reserve(total ? total + 1 - chain.size() : first_block, available);
+		if (!space) return -2;
+
+		size_t want = total ? min(available, total - chain.size()) : available;
+		ssize_t n = recv(sock, space, want, 0);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			if (framed || total) return -1; // connection lost within a frame / an APUT
+			return chain.size() > 0 ? (long)chain.size() : n;
+		}
+		bool first_recv = chain.size() == 0;
+		chain.commit(n);
+
+		if (first_recv) framed = space[0] == FRAME_MARK;
+		if (framed) {
+			if (!total) {
+				string_view head = chain.first();
+				size_t body;
+				long h = frame_header(head.data(), head.size(), body);
+				if (h < 0) return -1;
+				if (h == 0) continue;
+				if (body > MAX_REQUEST_SIZE) return -2;
+				header = h;
+				total = h + body;
+				if (chain.size() > total) return -1; // next request sent before the reply
+				if (!chain.reserve_total(total + 1)) return -2;
+			}
+			if (chain.size() == total) break;
+			continue;
+		}
+
+		if (first_recv && (total = aput_length(space, n)) > 0) {
+			if (total > MAX_REQUEST_SIZE) return -2;
+			if (chain.size() > total) return -1;
+			if (!chain.reserve_total(total + 1)) return -2;
+		}
+		if (total) {
+			if (chain.size() == total) break;
+			continue;
+		}
+
+		// unframed: first block not filled -> small request, complete
+		if (first_recv && (size_t)n < available) break;
+		if (chain.size() >= MAX_REQUEST_SIZE) return -2;
+
+		struct pollfd pfd = {sock, POLLIN, 0};
+		if (poll(&pfd, 1, RECV_MORE_TIMEOUT_MS) <= 0) break;
+	}
+	return (long)chain.size();
+}
+
+// frame_text: a short reply, framed if the request was
+string frame_text(const string& text, bool framed) {
+	return framed ? FRAME_MARK + to_string(text.size()) + "|" + text : text;
+}
+
+// Reply: response to one request, collected in pooled blocks (charged to the
+// connection like the request) and written by send() after the command ran.
+// A file range (append_file) follows the buffered bytes and is sent with sendfile.
+class Reply {
+public:
+	explicit Reply(ConnMemory& conn) : body(conn) {}
+	~Reply() { clear(); }
+
+	Reply(const Reply&) = delete;
+	Reply& operator=(const Reply&) = delete;
+
+	void append(const char* data, size_t len) {
+		if (!failed && !body.append(data, len)) failed = true;
+	}
+	void append(const string& s) { append(s.data(), s.size()); }
+
+	// append_file: `length` bytes of `fd` from `offset`, closed by the reply
+	void append_file(int fd, uint64_t offset, uint64_t length) {
+		file_fd = fd;
+		file_offset = offset;
+		file_length = length;
+	}
+
+	bool empty() const { return body.size() == 0 && file_fd < 0; }
+
+	// send: writes the reply ("#<length>|" first if `framed`), false if the connection broke
+	bool send(int sock, bool framed) {
+		if (failed) {
+			// out of memory while building the reply: a complete error instead of a truncated reply
+			clear();
+			body.append(ERR "Server busy", strlen(ERR "Server busy"));
+		}
+		string head = framed ? FRAME_MARK + to_string(body.size() + file_length) + "|" : "";
+		vector<iovec> iov;
+		if (!head.empty()) iov.push_back({&head[0], head.size()});
+		body.iovecs(iov);
+
+		bool ok = true;
+		for (size_t i = 0; ok && i < iov.size();) {
+			msghdr msg{};
+			msg.msg_iov = &iov[i];
+			msg.msg_iovlen = min<size_t>(iov.size() - i, IOV_MAX);
+			ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL | (file_fd >= 0 ? MSG_MORE : 0));
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0) ok = false;
+			// skip what was sent, continue in a partly sent block
+			for (; n > 0 && i < iov.size(); ++i) {
+				if ((size_t)n < iov[i].iov_len) {
+					iov[i].iov_base = (char*)iov[i].iov_base + n;
+					iov[i].iov_len -= n;
+					break;
+				}
+				n -= iov[i].iov_len;
+			}
+		}
+		off_t pos = (off_t)file_offset;
+		for (uint64_t left = file_length; ok && left > 0;) {
+			ssize_t n = sendfile(sock, file_fd, &pos, left);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) ok = false;
+			else left -= n;
+		}
+		clear();
+		return ok;
+	}
+
+	void clear() {
+		body.clear();
+		if (file_fd >= 0) close(file_fd);
+		file_fd = -1;
+		file_length = 0;
+		failed = false;
+	}
+
+private:
+	BufferChain body;
+	int file_fd = -1;
+	uint64_t file_offset = 0;
+	uint64_t file_length = 0;
+	bool failed = false;
+};
+
+string pool_stats() {
+	size_t free_blocks[POOL_CLASSES] = {};
+	{
+		lock_guard<mutex> lock(pool_mutex);
+		for (int c = 0; c < POOL_CLASSES; ++c) {
+			for (PoolBlock* b = pool_free_lists[c]; b; b = b->next) free_blocks[c]++;
+		}
+	}
+	ostringstream oss;
+	oss << "bufpool: used=" << pool_used << " budget=" << pool_budget
+	    << " reserved=" << pool_reserved << " slabs=" << pool_slabs
+	    << " backpressure_waits=" << pool_backpressure_waits << " rejected=" << pool_rejected
+	    << " conn_peak=" << pool_conn_peak
+	    << " free_blocks=";
+	for (int c = 0; c < POOL_CLASSES; ++c) {
+		oss << (c ? "," : "") << POOL_CLASS_SIZES[c] << ":" << free_blocks[c];
+	}
+	oss << "\n";
+	return oss.str();
+}
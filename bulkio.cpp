@@ -0,0 +1,622 @@
+// bulkio.cpp
+// Offline bulk import/export of whole mailboxes (twmail-admin import/export).
+//
+//   import: scan -> parse -> transform -> write
+//     scan       one thread: reads an mbox file in BULK_READ_SIZE chunks and splits it
+//                at "From " lines, or lists the files of a Maildir (cur/ and new/)
+//     parse      worker threads: RFC 822 headers (From, Subject, Date) + body,
+//     transform  spool file content (compressed if --compress)
+//     write      writer threads: one file per mail directly in the spool layout,
+//                id = mail date + import sequence, one syncfs() at the end
+//   export: scan (mailbox index) -> load + render (workers) -> write
+//     mbox       one writer, restores the mailbox order, BULK_WRITE_SIZE buffered writes
+//     Maildir    writer threads, tmp/ + rename into new/
+//
+// Stages are connected by bounded queues of batches (BULK_BATCH mails), so memory
+// stays flat however large the mailbox is. mbox is read/written as mboxrd ("From "
+// lines in bodies are quoted with '>'). Only sender, subject, date and body survive
+// an import - the spool format has no other headers. The server should not run on
+// the spool during an import (imported mails are not in the mutation log).
+
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <dirent.h>
+
+#define BULK_BATCH 256
+#define BULK_QUEUE_BATCHES 16
+#define BULK_READ_SIZE (8 * 1024 * 1024)
+#define BULK_WRITE_SIZE (8 * 1024 * 1024)
+#define BULK_IMPORT_WORKER 0xfffe // worker field of imported message ids
+
+template <typename T>
+class BoundedQueue {
+public:
+	explicit BoundedQueue(size_t capacity) : capacity(capacity) {}
+
+	// push: blocks while the queue is full, false if it was closed
+	bool push(T item) {
+		unique_lock<mutex> lock(m);
+		not_full.wait(lock, [&] { return closed || items.size() < capacity; });
+		if (closed) return false;
+		items.push_back(move(item));
+		not_empty.notify_one();
+		return true;
+	}
+
+	// pop: blocks while the queue is empty, false once it is closed and drained
+	bool pop(T& item) {
+		unique_lock<mutex> lock(m);
+		not_empty.wait(lock, [&] { return closed || !items.empty(); });
+		if (items.empty()) return false;
+		item = move(items.front());
+		items.pop_front();
+		not_full.notify_one();
+		return true;
+	}
+
+	void close() {
+		lock_guard<mutex> lock(m);
+		closed = true;
+		not_empty.notify_all();
+		not_full.notify_all();
+	}
+
+private:
+	mutex m;
+	condition_variable not_empty, not_full;
+	deque<T> items;
+	size_t capacity;
+	bool closed = false;
+};
+
+struct BulkStats {
+	atomic<unsigned long> mails{0};
+	atomic<unsigned long long> bytes{0};
+	atomic<unsigned long> failed{0};
+	chrono::steady_clock::time_point start = chrono::steady_clock::now();
+
+	void report(const char* what) const {
+		double s = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		cout << what << ": " << mails << " mails, " << bytes / (1024 * 1024) << " MB in " << fixed << setprecision(1) << s
+		     << "s (" << (unsigned long)(mails / max(s, 0.001)) << " mails/s, " << (bytes / (1024.0 * 1024) / max(s, 0.001))
+		     << " MB/s)" << (failed ? ", " + to_string(failed) + " failed" : "") << endl;
+	}
+};
+
+// --- helpers -----------------------------------------------------------------
+
+// rfc822_date: epoch ms of an RFC 2822 date ("Tue, 1 Jul 2003 10:52:37 +0200"), -1 if unparsable
+static long long rfc822_date(const string& value) {
+	static const char* formats[] = {"%a, %d %b %Y %H:%M:%S %z", "%d %b %Y %H:%M:%S %z", "%a, %d %b %Y %H:%M %z",
+	                                "%a, %d %b %Y %H:%M:%S", "%d %b %Y %H:%M:%S"};
+	for (const char* f : formats) {
+		tm t{};
+		const char* end = strptime(value.c_str(), f, &t);
+		if (!end) continue;
+		long offset = t.tm_gmtoff; // from %z, 0 otherwise (treated as UTC)
+		return ((long long)timegm(&t) - offset) * 1000;
+	}
+	return -1;
+}
+
+// mbox_from_date: date of an mbox "From sender Tue Jul  1 10:52:37 2003" line (UTC)
+static long long mbox_from_date(const string& line) {
+	size_t sp = line.find(' ', 5);
+	if (sp == string::npos) return -1;
+	tm t{};
+	if (!strptime(line.c_str() + sp + 1, "%a %b %d %H:%M:%S %Y", &t)) return -1;
+	return (long long)timegm(&t) * 1000;
+}
+
+// header_value: unfolded value of header `name` (case-insensitive) in `headers`
+static string header_value(string_view headers, string_view name) {
+	size_t pos = 0;
+	while (pos < headers.size()) {
+		size_t eol = headers.find('\n', pos);
+		if (eol == string_view::npos) eol = headers.size();
+		string_view line = headers.substr(pos, eol - pos);
+		pos = eol + 1;
+		if (line.size() <= name.size() || line[name.size()] != ':' || !equals_ignore_case(line.substr(0, name.size()), name)) {
+			continue;
+		}
+		string value(line.substr(name.size() + 1));
+		// continuation lines start with whitespace
+		while (pos < headers.size() && (headers[pos] == ' ' || headers[pos] == '\t')) {
+			eol = headers.find('\n', pos);
+			if (eol == string_view::npos) eol = headers.size();
+			value += " " + string(headers.substr(pos, eol - pos));
+			pos = eol + 1;
+		}
+		value.erase(remove(value.begin(), value.end(), '\r'), value.end());
+		value.erase(0, value.find_first_not_of(" \t"));
+		value.erase(value.find_last_not_of(" \t") + 1);
+		return value;
+	}
+	return "";
+}
+
+// protocol_field: '|' separates LIST fields, newlines separate entries
+static string protocol_field(string s) {
+	for (char& c : s) {
+		if (c == '|') c = '/';
+		else if (c == '\n' || c == '\r' || c == '\t') c = ' ';
+	}
+	return s;
+}
+
+// sender_address: "Name <user@host>" -> "user@host"
+static string sender_address(const string& from) {
+	size_t lt = from.rfind('<'), gt = from.rfind('>');
+	if (lt != string::npos && gt != string::npos && gt > lt) return from.substr(lt + 1, gt - lt - 1);
+	return from;
+}
+
+// mboxrd_unquote: ">From " -> "From ", ">>From " -> ">From ", ...
+static void mboxrd_unquote(string& body) {
+	string out;
+	out.reserve(body.size());
+	size_t pos = 0;
+	while (pos < body.size()) {
+		size_t eol = body.find('\n', pos);
+		size_t end = (eol == string::npos) ? body.size() : eol + 1;
+		size_t gt = body.find_first_not_of('>', pos);
+		if (gt > pos && gt != string::npos && body.compare(gt, 5, "From ") == 0) pos++;
+		out.append(body, pos, end - pos);
+		pos = end;
+	}
+	body.swap(out);
+}
+
+// mboxrd_quote: appends `body` to `out`, "From " lines quoted with one more '>'
+static void mboxrd_quote(const string& body, string& out) {
+	size_t pos = 0;
+	while (pos < body.size()) {
+		size_t eol = body.find('\n', pos);
+		size_t end = (eol == string::npos) ? body.size() : eol + 1;
+		size_t gt = body.find_first_not_of('>', pos);
+		if (gt != string::npos && gt < end && body.compare(gt, 5, "From ") == 0) out += '>';
+		out.append(body, pos, end - pos);
+		pos = end;
+	}
+}
+
+// --- import ------------------------------------------------------------------
+
+struct ImportItem {
+	string data;      // raw message (mbox: including the "From " line)
+	fs::path path;    // Maildir: file to read instead
+	long long date_ms = -1;
+};
+
+struct SpoolItem {
+	long long date_ms;
+	string content;
+};
+
+// parse_import: raw RFC 822 message -> spool file content for `username`
+static bool parse_import(ImportItem& item, const string& username, SpoolItem& out) {
+	if (!item.path.empty()) {
+		if (!read_file(item.path, item.data)) return false;
+		struct stat st;
+		if (stat(item.path.c_str(), &st) == 0) item.date_ms = (long long)st.st_mtime * 1000;
+	}
+	string& raw = item.data;
+	long long from_line_date = -1;
+	size_t start = 0;
+	if (raw.compare(0, 5, "From ") == 0) {
+		start = raw.find('\n');
+		start = (start == string::npos) ? raw.size() : start + 1;
+		from_line_date = mbox_from_date(raw.substr(0, start));
+	}
+
+	size_t sep = raw.find("\n\n", start);
+	size_t crlf = raw.find("\r\n\r\n", start);
+	size_t body_start;
+	if (crlf != string::npos && (sep == string::npos || crlf < sep)) {
+		sep = crlf;
+		body_start = crlf + 4;
+	} else {
+		body_start = (sep == string::npos) ? raw.size() : sep + 2;
+	}
+	string_view headers(raw.data() + start, (sep == string::npos ? raw.size() : sep + 1) - start);
+
+	string sender = protocol_field(sender_address(header_value(headers, "From")));
+	string subject = protocol_field(header_value(headers, "Subject"));
+	long long date_ms = rfc822_date(header_value(headers, "Date"));
+	if (date_ms < 0) date_ms = from_line_date;
+	if (date_ms < 0) date_ms = item.date_ms;
+	if (date_ms < 0) date_ms = epoch_ms_now();
+
+	string body = raw.substr(body_start);
+	if (item.path.empty()) {
+		mboxrd_unquote(body);
+		// the blank line before the next "From " belongs to the mbox format
+		if (body.size() >= 2 && body.compare(body.size() - 2, 2, "\n\n") == 0) body.pop_back();
+	}
+
+	string spool_headers = "Sender: " + (sender.empty() ? string("unknown") : sender) + "\n";
+	spool_headers += "Recipient: " + username + "\n";
+	spool_headers += "Subject: " + subject + "\n";
+	spool_headers += "Date: " + to_string(date_ms) + "\n";
+	out.date_ms = date_ms;
+	out.content = compose_mail_file(spool_headers, body);
+	return true;
+}
+
+// scan_mbox: splits an mbox file ("-" = stdin) into messages
+static bool scan_mbox(const string& path, BoundedQueue<vector<ImportItem>>& out) {
+	int fd = (path == "-") ? STDIN_FILENO : open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		cerr << "import: cannot open " << path << ": " << strerror(errno) << endl;
+		return false;
+	}
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	vector<ImportItem> batch;
+	auto emit = [&](string&& message) {
+		if (message.compare(0, 5, "From ") != 0 && message.find_first_not_of("\r\n") == string::npos) return;
+		batch.push_back(ImportItem{move(message), {}, -1});
+		if (batch.size() == BULK_BATCH) {
+			out.push(move(batch));
+			batch.clear();
+		}
+	};
+
+	string pending;
+	vector<char> chunk(BULK_READ_SIZE);
+	ssize_t n;
+	while ((n = read(fd, chunk.data(), chunk.size())) > 0 || (n < 0 && errno == EINTR)) {
+		if (n < 0) continue;
+		size_t scan_from = pending.size() >= 6 ? pending.size() - 6 : 0;
+		pending.append(chunk.data(), n);
+		// a "From " line after an empty line ends the message before it
+		size_t msg_start = 0, pos = scan_from;
+		while ((pos = pending.find("\n\nFrom ", pos)) != string::npos) {
+			emit(pending.substr(msg_start, pos + 2 - msg_start));
+			msg_start = pos + 2;
+			pos = pos + 1;
+		}
+		pending.erase(0, msg_start);
+	}
+	if (fd != STDIN_FILENO) close(fd);
+	if (!pending.empty()) emit(move(pending));
+	if (!batch.empty()) out.push(move(batch));
+	return n == 0;
+}
+
+// scan_maildir: one item per file in cur/ and new/
+static bool scan_maildir(const string& path, BoundedQueue<vector<ImportItem>>& out) {
+	vector<ImportItem> batch;
+	bool found = false;
+	for (const char* sub : {"cur", "new"}) {
+		fs::path dir = fs::path(path) / sub;
+		DIR* d = opendir(dir.c_str());
+		if (!d) continue;
+		found = true;
+		while (dirent* e = readdir(d)) {
+			if (e->d_name[0] == '.') continue;
+			batch.push_back(ImportItem{"", dir / e->d_name, -1});
+			if (batch.size() == BULK_BATCH) {
+				out.push(move(batch));
+				batch.clear();
+			}
+		}
+		closedir(d);
+	}
+	if (!batch.empty()) out.push(move(batch));
+	if (!found) cerr << "import: " << path << " is not a Maildir (no cur/ or new/)" << endl;
+	return found;
+}
+
+// write_spool_file: new file for the mail, O_EXCL so an existing mail is never replaced
+static bool write_spool_file(const string& username, const SpoolItem& item, atomic<uint32_t>& sequence,
+                             set<fs::path>& created_dirs) {
+	for (int attempt = 0; attempt < 8; ++attempt) {
+		uint64_t suffix = ((uint64_t)BULK_IMPORT_WORKER << 48) | ((uint64_t)msgid_salt << 32) | sequence++;
+		fs::path path = mail_write_path(username, format_message_id(item.date_ms, suffix));
+		if (created_dirs.insert(path.parent_path()).second) {
+			error_code ec;
+			fs::create_directories(path.parent_path(), ec);
+		}
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+		if (fd < 0 && errno == EEXIST) continue; // id of an earlier import
+		if (fd < 0) return false;
+		bool ok = write(fd, item.content.data(), item.content.size()) == (ssize_t)item.content.size();
+		close(fd);
+		return ok;
+	}
+	return false;
+}
+
+// import_mailbox: imports an mbox file or a Maildir into the mailbox of `username`
+bool import_mailbox(const string& username, const string& format, const string& path, unsigned threads) {
+	if (!valid_mailbox_name(username)) {
+		cerr << "import: invalid mailbox name '" << username << "'" << endl;
+		return false;
+	}
+	BulkStats stats;
+	BoundedQueue<vector<ImportItem>> raw_queue(BULK_QUEUE_BATCHES);
+	BoundedQueue<vector<SpoolItem>> write_queue(BULK_QUEUE_BATCHES);
+	atomic<uint32_t> sequence(0);
+	bool scanned = false;
+
+	thread scanner([&] {
+		scanned = (format == "mbox") ? scan_mbox(path, raw_queue) : scan_maildir(path, raw_queue);
+		raw_queue.close();
+	});
+
+	vector<thread> parsers;
+	for (unsigned i = 0; i < threads; ++i) {
+		parsers.emplace_back([&] {
+			vector<ImportItem> batch;
+			while (raw_queue.pop(batch)) {
+				vector<SpoolItem> out;
+				out.reserve(batch.size());
+				for (ImportItem& item : batch) {
+					SpoolItem spool;
+					if (parse_import(item, username, spool)) out.push_back(move(spool));
+					else stats.failed++;
+				}
+				write_queue.push(move(out));
+			}
+		});
+	}
+
+	vector<thread> writers;
+	for (unsigned i = 0; i < max(1u, threads / 2); ++i) {
+		writers.emplace_back([&] {
+			set<fs::path> created_dirs;
+			vector<SpoolItem> batch;
+			while (write_queue.pop(batch)) {
+				for (const SpoolItem& item : batch) {
+					if (write_spool_file(username, item, sequence, created_dirs)) {
+						stats.mails++;
+						stats.bytes += item.content.size();
+					} else {
+						stats.failed++;
+					}
+				}
+			}
+		});
+	}
+
+	scanner.join();
+	for (thread& t : parsers) t.join();
+	write_queue.close();
+	for (thread& t : writers) t.join();
+
+	// one flush for the whole import instead of an fsync per mail
+	int dir_fd = open(BASE_DIR.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd >= 0) {
+		syncfs(dir_fd);
+		close(dir_fd);
+	}
+	stats.report("import");
+	return scanned && stats.failed == 0;
+}
+
+// --- export ------------------------------------------------------------------
+
+struct ExportItem {
+	size_t seq;
+	string id;
+	string text; // rendered message (mbox: with "From " line and quoting)
+	long long date_ms = 0;
+};
+
+// render_export: spool mail -> RFC 822 message (mbox entry if `mbox`)
+static bool render_export(const string& username, ExportItem& item, bool mbox) {
+	string content;
+	if (!load_mail_by_id(username, item.id, content)) return false;
+	string headers, body;
+	split_mail_file(content, headers, body);
+
+	string sender = header_value(headers, "Sender");
+	string recipient = header_value(headers, "Recipient");
+	string subject = header_value(headers, "Subject");
+	string date = header_value(headers, "Date");
+	if (!date.empty() && date.find_first_not_of("0123456789") == string::npos) {
+		item.date_ms = strtoll(date.c_str(), nullptr, 10);
+	} else {
+		// older mails: "dd.mm.yyyy HH:MM:SS" local time
+		tm t{};
+		t.tm_isdst = -1;
+		item.date_ms = strptime(date.c_str(), "%d.%m.%Y %H:%M:%S", &t) ? (long long)mktime(&t) * 1000
+		                                                                : strtoll(item.id.c_str(), nullptr, 10);
+	}
+	time_t sec = (time_t)(item.date_ms / 1000);
+	tm local, utc;
+	localtime_r(&sec, &local);
+	gmtime_r(&sec, &utc);
+	char rfc_date[64], from_date[64];
+	strftime(rfc_date, sizeof(rfc_date), "%a, %d %b %Y %H:%M:%S %z", &local);
+	strftime(from_date, sizeof(from_date), "%a %b %e %H:%M:%S %Y", &utc);
+
+	string& out = item.text;
+	out.reserve(body.size() + 256);
+	if (mbox) out += "From " + (sender.empty() ? string("MAILER-DAEMON") : sender) + " " + from_date + "\n";
+	out += "From: " + sender + "\n";
+	out += "To: " + recipient + "\n";
+	out += "Subject: " + subject + "\n";
+	out += "Date: " + string(rfc_date) + "\n";
+	out += "Message-ID: <" + item.id + "@twmailer>\n";
+	out += "Content-Type: text/plain; charset=utf-8\n\n";
+	if (mbox) {
+		mboxrd_quote(body, out);
+		if (!body.empty() && body.back() != '\n') out += '\n';
+		out += '\n';
+	} else {
+		out += body;
+	}
+	return true;
+}
+
+// export_mailbox: writes the mailbox of `username` as mbox file ("-" = stdout) or Maildir
+bool export_mailbox(const string& username, const string& format, const string& path, unsigned threads) {
+	bool mbox = (format == "mbox");
+	// the mbox may go to stdout: messages (also those of load_tombstones) go to stderr
+	streambuf* saved_cout = (mbox && path == "-") ? cout.rdbuf(cerr.rdbuf()) : nullptr;
+	struct RestoreCout {
+		streambuf* saved;
+		~RestoreCout() {
+			if (saved) cout.rdbuf(saved);
+		}
+	} restore_cout{saved_cout};
+
+	load_tombstones(); // deleted mails whose files are not reclaimed yet
+	vector<string> ids;
+	{
+		shared_ptr<Mailbox> mb = get_mailbox(username);
+		lock_guard<mutex> lock(mb->lock);
+		if (!mb->exists) {
+			cerr << "export: mailbox '" << username << "' not found" << endl;
+			return false;
+		}
+		for (const MailEntry& e : mb->mails) ids.push_back(e.id);
+	}
+
+	int out_fd = -1;
+	if (mbox) {
+		out_fd = (path == "-") ? STDOUT_FILENO : open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	} else {
+		error_code ec;
+		for (const char* sub : {"tmp", "new", "cur"}) fs::create_directories(fs::path(path) / sub, ec);
+		out_fd = ec ? -1 : 0;
+	}
+	if (out_fd < 0) {
+		cerr << "export: cannot create " << path << endl;
+		return false;
+	}
+
+	BulkStats stats;
+	BoundedQueue<vector<ExportItem>> id_queue(BULK_QUEUE_BATCHES);
+	BoundedQueue<vector<ExportItem>> write_queue(BULK_QUEUE_BATCHES);
+
+	thread scanner([&] {
+		vector<ExportItem> batch;
+		for (size_t i = 0; i < ids.size(); ++i) {
+			batch.push_back(ExportItem{i, ids[i], "", 0});
+			if (batch.size() == BULK_BATCH || i + 1 == ids.size()) {
+				id_queue.push(move(batch));
+				batch.clear();
+			}
+		}
+		id_queue.close();
+	});
+
+	// mbox: the writer reorders the batches, a renderer only takes a batch that starts
+	// within `window` mails of the one written next (bounds the reorder map to about
+	// `threads` batches if one batch is slow)
+	mutex window_mutex;
+	condition_variable window_cv;
+	size_t written = 0;
+	const size_t window = (size_t)max(1u, threads) * BULK_BATCH;
+
+	vector<thread> renderers;
+	for (unsigned i = 0; i < threads; ++i) {
+		renderers.emplace_back([&] {
+			vector<ExportItem> batch;
+			while (id_queue.pop(batch)) {
+				if (mbox) {
+					unique_lock<mutex> lock(window_mutex);
+					window_cv.wait(lock, [&] { return batch.front().seq < written + window; });
+				}
+				for (ExportItem& item : batch) {
+					if (!render_export(username, item, mbox)) {
+						cerr << "export: failed to read mail " << item.id << endl;
+						stats.failed++;
+						item.text.clear();
+					}
+				}
+				write_queue.push(move(batch));
+			}
+		});
+	}
+
+	auto write_maildir = [&](const ExportItem& item) {
+		string name = to_string(item.date_ms / 1000) + "." + item.id + ".twmailer";
+		fs::path tmp = fs::path(path) / "tmp" / name;
+		if (!write_file_atomic(tmp, item.text)) return false;
+		error_code ec;
+		fs::rename(tmp, fs::path(path) / "new" / name, ec);
+		return !ec;
+	};
+
+	vector<thread> writers;
+	bool write_ok = true;
+	if (mbox) {
+		// one writer: batches arrive out of order, the mbox keeps the mailbox order
+		writers.emplace_back([&] {
+			map<size_t, vector<ExportItem>> reorder;
+			size_t next = 0;
+			string buffer;
+			vector<ExportItem> batch;
+			auto flush = [&] {
+				size_t off = 0;
+				while (off < buffer.size()) {
+					ssize_t n = write(out_fd, buffer.data() + off, buffer.size() - off);
+					if (n < 0 && errno == EINTR) continue;
+					if (n <= 0) {
+						write_ok = false;
+						break;
+					}
+					off += n;
+				}
+				buffer.clear();
+			};
+			while (write_queue.pop(batch)) {
+				size_t first = batch.front().seq;
+				reorder[first] = move(batch);
+				while (!reorder.empty() && reorder.begin()->first == next) {
+					for (const ExportItem& item : reorder.begin()->second) {
+						buffer += item.text;
+						if (!item.text.empty()) {
+							stats.mails++;
+							stats.bytes += item.text.size();
+						}
+					}
+					next += reorder.begin()->second.size();
+					reorder.erase(reorder.begin());
+					{
+						lock_guard<mutex> lock(window_mutex);
+						written = next;
+					}
+					window_cv.notify_all();
+					if (buffer.size() >= BULK_WRITE_SIZE) flush();
+				}
+			}
+			flush();
+		});
+	} else {
+		for (unsigned i = 0; i < max(1u, threads / 2); ++i) {
+			writers.emplace_back([&] {
+				vector<ExportItem> batch;
+				while (write_queue.pop(batch)) {
+					for (const ExportItem& item : batch) {
+						if (item.text.empty()) continue;
+						if (write_maildir(item)) {
+							stats.mails++;
+							stats.bytes += item.text.size();
+						} else {
+							stats.failed++;
+						}
+					}
+				}
+			});
+		}
+	}
+
+	scanner.join();
+	for (thread& t : renderers) t.join();
+	write_queue.close();
+	for (thread& t : writers) t.join();
+	if (mbox && out_fd != STDOUT_FILENO) {
+		if (fsync(out_fd) != 0) write_ok = false;
+		close(out_fd);
+	}
+	if (!write_ok) cerr << "export: write to " << path << " failed" << endl;
+	stats.report("export");
+	return write_ok && stats.failed == 0;
+}
@@ -0,0 +1,161 @@
+// cache.cpp
+// Sharded, memory-budgeted LRU cache for hot READ responses and rendered LIST output.
+// All entries of a mailbox live in the same shard, so save_mail()/delete can drop
+// exactly the entries of the touched mailbox (cache_invalidate).
+// A response built while the mailbox changed must not be cached: callers take
+// cache_generation() before reading the mailbox and pass it to cache_put(), which
+// drops the entry if cache_invalidate() ran in between. Generations are counted in a
+// fixed array per shard, indexed by a hash of the user: users sharing a counter only
+// drop each other's puts now and then, the memory stays constant however many
+// mailboxes were ever touched.
+//
+// Keys: "L|<user>"          -> LIST response
+//       "R|<user>|<index>"  -> READ response
+
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <atomic>
+
+#define CACHE_SHARDS 16
+#define CACHE_DEFAULT_MB 32
+#define CACHE_GENERATIONS 1024 // invalidation counters per shard
+
+struct CacheShard {
+	mutex lock;
+	list<pair<string, string>> lru; // front = most recently used
+	unordered_map<string, list<pair<string, string>>::iterator> entries;
+	unordered_map<string, unordered_set<string>> mailbox_keys; // user -> keys
+	uint64_t generations[CACHE_GENERATIONS] = {};               // invalidations, by cache_generation_slot
+	size_t bytes = 0;
+};
+
+static CacheShard cache_shards[CACHE_SHARDS];
+static size_t cache_shard_budget = (size_t)CACHE_DEFAULT_MB * 1024 * 1024 / CACHE_SHARDS;
+
+static atomic<unsigned long> cache_hits(0);
+static atomic<unsigned long> cache_misses(0);
+static atomic<unsigned long> cache_evictions(0);
+static atomic<unsigned long> cache_invalidations(0);
+static atomic<unsigned long> cache_stale_puts(0);
+
+// set_cache_size: total budget in MB, 0 disables the cache
+void set_cache_size(size_t mb) {
+	cache_shard_budget = mb * 1024 * 1024 / CACHE_SHARDS;
+}
+
+static CacheShard& cache_shard(const string& user) {
+	return cache_shards[hash<string>()(user) % CACHE_SHARDS];
+}
+
+// cache_generation_slot: counter of `user` within its shard (the shard took hash % CACHE_SHARDS)
+static uint64_t& cache_generation_slot(CacheShard& shard, const string& user) {
+	return shard.generations[hash<string>()(user) / CACHE_SHARDS % CACHE_GENERATIONS];
+}
+
+static size_t cache_entry_size(const string& key, const string& value) {
+	return key.size() + value.size() + 64; // + rough node overhead
+}
+
+// caller holds shard.lock
+static void cache_erase(CacheShard& shard, const string& user, const string& key) {
+	auto it = shard.entries.find(key);
+	if (it == shard.entries.end()) return;
+	shard.bytes -= cache_entry_size(key, it->second->second);
+	shard.lru.erase(it->second);
+	shard.entries.erase(it);
+
+	auto keys = shard.mailbox_keys.find(user);
+	if (keys != shard.mailbox_keys.end()) {
+		keys->second.erase(key);
+		if (keys->second.empty()) shard.mailbox_keys.erase(keys);
+	}
+}
+
+bool cache_get(const string& user, const string& key, string& value) {
+	CacheShard& shard = cache_shard(user);
+	lock_guard<mutex> lock(shard.lock);
+
+	auto it = shard.entries.find(key);
+	if (it == shard.entries.end()) {
+		cache_misses++;
+		return false;
+	}
+	shard.lru.splice(shard.lru.begin(), shard.lru, it->second);
+	value = it->second->second;
+	cache_hits++;
+	return true;
+}
+
+// cache_generation: take before reading the mailbox for a response that is cached later
+uint64_t cache_generation(const string& user) {
+	CacheShard& shard = cache_shard(user);
+	lock_guard<mutex> lock(shard.lock);
+	return cache_generation_slot(shard, user);
+}
+
+// cache_put: `generation` from cache_generation(), the entry is dropped if the
+// mailbox was invalidated since then (the response may be stale)
+void cache_put(const string& user, const string& key, const string& value, uint64_t generation) {
+	size_t size = cache_entry_size(key, value);
+	if (size > cache_shard_budget) return; // too big (or cache disabled)
+
+	CacheShard& shard = cache_shard(user);
+	lock_guard<mutex> lock(shard.lock);
+	if (cache_generation_slot(shard, user) != generation) {
+		cache_stale_puts++;
+		return;
+	}
+
+	cache_erase(shard, user, key);
+	shard.lru.emplace_front(key, value);
+	shard.entries[key] = shard.lru.begin();
+	shard.mailbox_keys[user].insert(key);
+	shard.bytes += size;
+
+	// evict least recently used entries until the shard fits its budget again
+	while (shard.bytes > cache_shard_budget && !shard.lru.empty()) {
+		string victim = shard.lru.back().first;
+		// key format: <type>|<user>[|...]
+		size_t start = victim.find('|') + 1;
+		string victim_user = victim.substr(start, victim.find('|', start) - start);
+		cache_erase(shard, victim_user, victim);
+		cache_evictions++;
+	}
+}
+
+// cache_invalidate: drops every cached entry of `user`'s mailbox
+void cache_invalidate(const string& user) {
+	CacheShard& shard = cache_shard(user);
+	lock_guard<mutex> lock(shard.lock);
+	cache_generation_slot(shard, user)++;
+
+	auto keys = shard.mailbox_keys.find(user);
+	if (keys == shard.mailbox_keys.end()) return;
+	unordered_set<string> victims = keys->second;
+	for (const string& key : victims) cache_erase(shard, user, key);
+	cache_invalidations++;
+}
+
+string cache_list_key(const string& user) {
+	return "L|" + user;
+}
+string cache_read_key(const string& user, int index) {
+	return "R|" + user + "|" + to_string(index);
+}
+
+string cache_stats() {
+	size_t bytes = 0, entries = 0;
+	for (CacheShard& shard : cache_shards) {
+		lock_guard<mutex> lock(shard.lock);
+		bytes += shard.bytes;
+		entries += shard.entries.size();
+	}
+	ostringstream oss;
+	oss << "cache: hits=" << cache_hits << " misses=" << cache_misses
+	    << " evictions=" << cache_evictions << " invalidations=" << cache_invalidations
+	    << " stale_puts=" << cache_stale_puts
+	    << " entries=" << entries << " bytes=" << bytes
+	    << " budget=" << cache_shard_budget * CACHE_SHARDS << "\n";
+	return oss.str();
+}
@@ -0,0 +1,58 @@
+// catalog.cpp
+// Global message-id catalog: message id -> owning mailbox. Lets READ/DELETE by id
+// find a mail in O(1) without scanning the spool. The location of the mail follows
+// from mailbox + id (mail_path()).
+//
+// Concurrent hash map: CATALOG_SHARDS independent unordered_maps, each behind its own
+// shared_mutex (lookups take the shared lock only). Kept up to date by the mailbox
+// index (mailindex.cpp) whenever a mailbox is loaded, a mail is saved or deleted.
+
+#include <shared_mutex>
+
+#define CATALOG_SHARDS 64
+
+struct CatalogShard {
+	shared_mutex lock;
+	unordered_map<string, string> mailbox_of; // id -> mailbox
+};
+
+static CatalogShard catalog_shards[CATALOG_SHARDS];
+static atomic<unsigned long> catalog_size(0);
+static atomic<unsigned long> catalog_lookups(0);
+static atomic<unsigned long> catalog_misses(0);
+
+static CatalogShard& catalog_shard(const string& id) {
+	return catalog_shards[hash<string>()(id) % CATALOG_SHARDS];
+}
+
+void catalog_put(const string& id, const string& mailbox) {
+	CatalogShard& shard = catalog_shard(id);
+	unique_lock<shared_mutex> lock(shard.lock);
+	if (shard.mailbox_of.insert_or_assign(id, mailbox).second) catalog_size++;
+}
+
+void catalog_erase(const string& id) {
+	CatalogShard& shard = catalog_shard(id);
+	unique_lock<shared_mutex> lock(shard.lock);
+	if (shard.mailbox_of.erase(id)) catalog_size--;
+}
+
+bool catalog_get(const string& id, string& mailbox) {
+	catalog_lookups++;
+	CatalogShard& shard = catalog_shard(id);
+	shared_lock<shared_mutex> lock(shard.lock);
+	auto it = shard.mailbox_of.find(id);
+	if (it == shard.mailbox_of.end()) {
+		catalog_misses++;
+		return false;
+	}
+	mailbox = it->second;
+	return true;
+}
+
+string catalog_stats() {
+	ostringstream oss;
+	oss << "catalog: ids=" << catalog_size << " lookups=" << catalog_lookups
+	    << " misses=" << catalog_misses << "\n";
+	return oss.str();
+}
@@ -19,11 +19,12 @@ string connected_msg = "connected";
 #define ERR "ERR"
 
 bool login_success = false;
+string username;
+string server_key; // "<ip>:<port>", Schlüssel für gespeicherte Session-Tokens
 
 atomic<bool> running(true); // Flag für laufende Threads
 
 void user_input_thread(int sock) {
-    std::string username;
     while (running) {
         cout << ">> ";
         string command;
@@ -47,7 +48,7 @@ void user_input_thread(int sock) {
 
         // LOGIN nur möglich, wenn noch nicht eingeloggt
         if (cmd == "login" && !login_success) {
-            if(handle_login(sock, username)) login_success = true;
+            if(handle_login(sock, server_key, username)) login_success = true;
             continue;
         }
 
@@ -62,6 +63,7 @@ void user_input_thread(int sock) {
             send_message(sock);
             res = handle_ack(sock);
             if (res) {
+                pending_attachments.clear();
                 cout << "Message sent successfully.\n";
             } else {
                 cout << "Failed to send message.\n";
@@ -72,14 +74,14 @@ void user_input_thread(int sock) {
         }
         else if (cmd == "read") {
             if (arg.empty()) {
-                cout << "Usage: read <index>"<< endl;
+                cout << "Usage: read <index|message-id>"<< endl;
                 continue;
             }
-            read_message(sock,username, arg); // arg = Index
+            read_message(sock,username, arg); // arg = Index oder Message-Id
         }
         else if (cmd == "delete") {
             if (arg.empty()) {
-                cout << "Usage: delete <index>"<< endl;
+                cout << "Usage: delete <index|message-id>"<< endl;
                 continue;
             }
             delete_message(sock, username, arg);
@@ -91,6 +93,30 @@ void user_input_thread(int sock) {
                 cout << "Server-error: Failed to delete message.\n";
             }
         }
+        else if (cmd == "stats") {
+            show_stats(sock);
+        }
+        else if (cmd == "idle") {
+            idle_mailbox(sock);
+        }
+        else if (cmd == "attach") {
+            if (arg.empty()) {
+                cout << "Usage: attach <file>" << endl;
+                continue;
+            }
+            upload_attachment(sock, arg);
+        }
+        else if (cmd == "download") {
+            // download <message-id> <n> [file]
+            istringstream args(arg);
+            string message_id, n, path;
+            args >> message_id >> n >> path;
+            if (n.empty()) {
+                cout << "Usage: download <message-id> <attachment-number> [file]" << endl;
+                continue;
+            }
+            download_attachment(sock, message_id, n, path.empty() ? message_id + "-" + n : path);
+        }
         else {
             cout << "Unknown command: " << command << endl;
             continue;
@@ -102,23 +128,9 @@ int main(int argc, char* argv[]) {
     if (argc >= 2) server_ip = argv[1];
     if (argc >= 3) server_port = atoi(argv[2]);
 
-    // Socket erstellen
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Verbindung aufbauen: IPv4/IPv6/Hostname über TCP oder unix:/pfad (lokaler Server)
+    int sock = connect_server(server_ip, server_port);
     if (sock < 0) {
-        cerr << "Error creating socket\n";
-        return 1;
-    }
-
-    sockaddr_in server_addr;
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(server_port);
-    if (inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) <= 0) {
-        cerr << "Invalid Address\n";
-        return 1;
-    }
-
-    if (connect(sock, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         cerr << "Connection Failed\n";
         return 1;
     }
@@ -148,7 +160,15 @@ int main(int argc, char* argv[]) {
         return 1;
     }
 
-    cout << "Successfully connected to Server(" << server_ip << ") over Port " << server_port << "!\n";
+    if (server_ip.rfind("unix:", 0) == 0) cout << "Successfully connected to Server(" << server_ip << ")!\n";
+    else cout << "Successfully connected to Server(" << server_ip << ") over Port " << server_port << "!\n";
+
+    // gespeicherte Session wiederaufnehmen (kein erneutes Login nötig)
+    server_key = (server_ip.rfind("unix:", 0) == 0) ? server_ip : server_ip + ":" + to_string(server_port);
+    if (resume_session(sock, server_key, username)) {
+        login_success = true;
+        cout << "Resumed session as " << username << ".\n";
+    }
 
     // Starte Thread für User-Input
     thread input_thread(user_input_thread, sock);
@@ -2,18 +2,67 @@
 #include <cstring>
 #include <sys/socket.h>
 #include <arpa/inet.h>
+#include <sys/un.h>
+#include <netdb.h>
 #include <atomic>
 #include <thread>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <fstream>
+#include <sstream>
+#include <sys/stat.h>
+#include <vector>
 
 #define ACK "OK"
 #define ERR "ERR"
 
 #include "mypw.cpp"
+#include "crc32c.cpp"
 
 
 using namespace std;
 
+// connect_server: connects to "unix:/path" (AF_UNIX) or host/IPv4/IPv6 + port (TCP).
+// Returns the socket or -1.
+int connect_server(const string& host, int port) {
+    if (host.rfind("unix:", 0) == 0) {
+        sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        string path = host.substr(5);
+        if (path.empty() || path.size() >= sizeof(addr.sun_path)) return -1;
+        strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (sock < 0) return -1;
+        if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(sock);
+            return -1;
+        }
+        return sock;
+    }
+
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result = nullptr;
+    string name = (host.size() > 2 && host.front() == '[' && host.back() == ']') ? host.substr(1, host.size() - 2) : host;
+    if (getaddrinfo(name.c_str(), to_string(port).c_str(), &hints, &result) != 0) return -1;
+
+    int sock = -1;
+    for (addrinfo* ai = result; ai; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) continue;
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) break;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(result);
+    return sock;
+}
+
 string str_tolower(const string& s) {
     string result = s;
     for (char& c : result) {
@@ -28,21 +77,65 @@ string trim(const string& s) {
     return (start == string::npos) ? "" : s.substr(start, end - start + 1);
 }
 
+// send_all: sends the whole buffer (large requests need more than one send())
+bool send_all(int sock, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(sock, data, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+// send_request: sends one command framed as "#<length>|<command>", the server reads
+// exactly these bytes and frames its reply the same way
+bool send_request(int sock, const string& request) {
+    string frame = "#" + to_string(request.size()) + "|" + request;
+    return send_all(sock, frame.data(), frame.size());
+}
+
+// recv_reply: the reply to a framed request, any size ("#<length>|" is removed)
+bool recv_reply(int sock, string& reply) {
+    string header;
+    size_t length = 0;
+    char buffer[65536];
+    reply.clear();
+    while (header.empty() || header.back() != '|' || reply.size() < length) {
+        bool in_header = header.empty() || header.back() != '|';
+        ssize_t bytes_received = recv(sock, buffer, in_header ? sizeof(buffer) : min(sizeof(buffer), length - reply.size()), 0);
+        if (bytes_received < 0 && errno == EINTR) continue;
+        if (bytes_received <= 0) return false;
+
+        ssize_t pos = 0;
+        while (in_header && pos < bytes_received) {
+            header += buffer[pos++];
+            if (header[0] != '#' || header.size() > 24) return false;
+            in_header = header.back() != '|';
+            if (!in_header) {
+                length = strtoull(header.c_str() + 1, nullptr, 10);
+                reply.reserve(length);
+            }
+        }
+        reply.append(buffer + pos, bytes_received - pos);
+    }
+    return true;
+}
+
 bool handle_ack(int sock) {
-    char buffer[1024] = {0};
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-    if (bytes_received <= 0) {
+    string response;
+    if (!recv_reply(sock, response)) {
         cerr << "[ACK_handler] Error receiving ACK/ERR from server.\n";
         return false;
     }
-    buffer[bytes_received] = '\0';
-    string response(buffer);
 
     if (response.rfind(ACK, 0) == 0) {
         // cout << "[ACK_handler] Operation successful (ACK received).\n";
         return true;
     } else if (response.rfind(ERR, 0) == 0) {
         // cout << "[ACK_handler] Operation failed (ERR received).\n";
+        if (response.size() > strlen(ERR)) cerr << "Server Error: " << response.substr(strlen(ERR)) << endl;
         return false;
     } else {
         // cout << "[ACK_handler] Unexpected response from server: " << response << endl;
@@ -50,10 +143,157 @@ bool handle_ack(int sock) {
     }
 }
 
+#define ATTACH_CHUNK (256 * 1024) // bytes per APUT/AGET
+#define ATTACH_RETRIES 5
+
+vector<string> pending_attachments; // upload ids for the next send
+
+// file_crc32c: checksum of the first `size` bytes of a file
+bool file_crc32c(int fd, uint64_t size, uint32_t& crc) {
+    vector<char> buf(1024 * 1024);
+    crc = 0;
+    for (uint64_t off = 0; off < size;) {
+        ssize_t n = pread(fd, buf.data(), min<uint64_t>(buf.size(), size - off), off);
+        if (n <= 0) return false;
+        crc = crc32c_update(crc, buf.data(), n);
+        off += n;
+    }
+    return true;
+}
+
+// upload_attachment: uploads a file in chunks (ATTACH/APUT). An interrupted upload
+// continues where the server stopped when the same file is attached again.
+void upload_attachment(int sock, const string& path) {
+    int fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        cerr << "Cannot read " << path << " (or file is empty)." << endl;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    uint64_t size = st.st_size;
+    uint32_t crc;
+    if (!file_crc32c(fd, size, crc)) {
+        cerr << "Error reading " << path << endl;
+        close(fd);
+        return;
+    }
+    string name = path.substr(path.find_last_of('/') + 1);
+
+    vector<char> chunk(ATTACH_CHUNK);
+    for (int attempt = 0; attempt < ATTACH_RETRIES; ++attempt) {
+        // ATTACH liefert die Upload-Id und wie weit der Server schon ist
+        string cmd = "ATTACH|" + name + "|" + to_string(size) + "|" + crc32c_hex(crc), reply;
+        if (!send_request(sock, cmd) || !recv_reply(sock, reply)) break;
+        if (reply.rfind(ACK, 0) != 0) {
+            cerr << "Server Error: " << reply.substr(strlen(ERR)) << endl;
+            break;
+        }
+        size_t sep = reply.find('|', 3);
+        string id = reply.substr(3, sep - 3);
+        uint64_t offset = strtoull(reply.c_str() + sep + 1, nullptr, 10);
+        if (offset > 0 && offset < size) cout << "Resuming upload at " << offset << " bytes." << endl;
+
+        while (offset < size) {
+            ssize_t n = pread(fd, chunk.data(), min<uint64_t>(chunk.size(), size - offset), offset);
+            if (n <= 0) break;
+            string msg = "APUT|" + id + "|" + to_string(offset) + "|" + to_string(n) + "|" +
+                         crc32c_hex(crc32c_update(0, chunk.data(), n)) + "|";
+            msg.append(chunk.data(), n);
+            if (!send_request(sock, msg) || !recv_reply(sock, reply)) {
+                close(fd);
+                cerr << "Connection lost, attach the file again to resume." << endl;
+                return;
+            }
+            if (reply.rfind(ACK, 0) != 0) {
+                cerr << "Server Error: " << reply.substr(strlen(ERR)) << endl;
+                break; // neu synchronisieren (ATTACH)
+            }
+            offset = strtoull(reply.c_str() + 3, nullptr, 10);
+            cout << "\r  " << offset * 100 / size << "% (" << offset << "/" << size << " bytes)" << flush;
+        }
+        if (offset == size) {
+            cout << "\nAttachment " << name << " uploaded (" << id << "), it is sent with the next message." << endl;
+            pending_attachments.push_back(id);
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+    cerr << "Upload of " << path << " failed." << endl;
+}
+
+// download_attachment: fetches attachment n of a message in chunks (AGET) into `path`.
+// An existing partial file is continued.
+void download_attachment(int sock, const string& message_id, const string& n, const string& path) {
+    int fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        cerr << "Cannot write " << path << endl;
+        if (fd >= 0) close(fd);
+        return;
+    }
+    uint64_t offset = st.st_size;
+    if (offset > 0) cout << "Resuming download at " << offset << " bytes." << endl;
+
+    int errors = 0;
+    while (errors < ATTACH_RETRIES) {
+        string cmd = "AGET|" + message_id + "|" + n + "|" + to_string(offset) + "|" + to_string(ATTACH_CHUNK);
+        string data;
+        if (!send_request(sock, cmd) || !recv_reply(sock, data)) {
+            close(fd);
+            cerr << "Connection lost, download again to resume." << endl;
+            return;
+        }
+        if (data.rfind(ERR, 0) == 0) {
+            cerr << "Server Error: " << data.substr(strlen(ERR)) << endl;
+            close(fd);
+            return;
+        }
+
+        // OK|<offset>|<length>|<size>|<chunk crc>|<file crc>|<bytes>
+        size_t header_end = 0;
+        for (int i = 0; i < 6 && header_end != string::npos; ++i) header_end = data.find('|', header_end + (i ? 1 : 0));
+        uint64_t chunk_offset, length, size;
+        char chunk_crc[9] = {0}, file_crc[9] = {0};
+        if (header_end == string::npos ||
+            sscanf(data.c_str(), "OK|%lu|%lu|%lu|%8[0-9a-f]|%8[0-9a-f]|", &chunk_offset, &length, &size, chunk_crc, file_crc) != 5 ||
+            data.size() - header_end - 1 != length) {
+            cerr << "Unexpected response from server." << endl;
+            break;
+        }
+        data.erase(0, header_end + 1);
+
+        uint32_t expected;
+        parse_crc32c(chunk_crc, expected);
+        if (chunk_offset != offset || crc32c_update(0, data.data(), length) != expected) {
+            errors++; // Chunk neu anfordern
+            continue;
+        }
+        if (pwrite(fd, data.data(), length, offset) != (ssize_t)length) break;
+        offset += length;
+        cout << "\r  " << (size ? offset * 100 / size : 100) << "% (" << offset << "/" << size << " bytes)" << flush;
+
+        if (offset >= size) {
+            uint32_t crc, whole;
+            parse_crc32c(file_crc, whole);
+            if (ftruncate(fd, size) != 0 || !file_crc32c(fd, size, crc) || crc != whole) {
+                cerr << "\nChecksum of " << path << " does not match, remove it and download again." << endl;
+            } else {
+                cout << "\nSaved attachment to " << path << "." << endl;
+            }
+            close(fd);
+            return;
+        }
+    }
+    close(fd);
+    cerr << "Download of attachment failed." << endl;
+}
+
 void send_message(int sock) {
     string recipient, subject, message, line;
 
-    cout << "<< Recipient" << endl <<">> ";
+    cout << "<< Recipient(s) (comma separated)" << endl <<">> ";
     getline(cin, recipient);
     recipient = trim(recipient);
 
@@ -75,10 +315,16 @@ void send_message(int sock) {
         return;
     }
 
-    // Construct message string (format: SEND|recipient|subject|message)
+    // Construct message string (format: SEND|recipient[,recipient...]|subject|message),
+    // with uploaded attachments: SENDATT|recipients|subject|upload-id[,upload-id...]|message
     string full_msg = "SEND|" + recipient + "|" + subject + "|" + message;
+    if (!pending_attachments.empty()) {
+        string ids;
+        for (const string& id : pending_attachments) ids += (ids.empty() ? "" : ",") + id;
+        full_msg = "SENDATT|" + recipient + "|" + subject + "|" + ids + "|" + message;
+    }
 
-    if (send(sock, full_msg.c_str(), full_msg.size(), 0) == -1) {
+    if (!send_request(sock, full_msg)) {
         cerr << "Error Sending The Message.\n";
     } else {
         cout << "Message Sent To Server.\n";
@@ -92,35 +338,17 @@ void read_message(int sock,std::string& username, const std::string& index_str)
         return;
     }
 
-    // Prüfen, ob es eine Zahl ist
-    for (char c : input) {
-        if (!isdigit(c)) {
-            cout << "Invalid index. Please enter a number.\n";
-            return;
-        }
-    }
-
-    // Nachricht an Server senden: READ|index
-    string txt = "READ|" + username + "|" + input;
-    if (send(sock, txt.c_str(), txt.size(), 0) == -1) {
+    // Zahl -> READ|username|index, sonst Message-Id (aus LIST) -> READID|id
+    bool is_index = input.find_first_not_of("0123456789") == string::npos;
+    string txt = is_index ? "READ|" + username + "|" + input : "READID|" + input;
+    if (!send_request(sock, txt)) {
         cerr << "Fehler beim Senden der Nachricht.\n";
         return;
     }
 
-    // Server-Antwort empfangen (Loop für längere Nachrichten)
-    const int BUFFER_SIZE = 4096;
+    // Server-Antwort empfangen (gerahmt, beliebig lang)
     string response;
-    char buffer[BUFFER_SIZE];
-    int bytes_received = 0;
-
-    while ((bytes_received = recv(sock, buffer, BUFFER_SIZE - 1, 0)) > 0) {
-        buffer[bytes_received] = '\0';
-        response += buffer;
-        if (bytes_received < BUFFER_SIZE - 1)
-            break;
-    }
-
-    if (bytes_received < 0) {
+    if (!recv_reply(sock, response)) {
         cerr << "Fehler beim Empfangen der Server-Antwort.\n";
         return;
     }
@@ -134,7 +362,84 @@ void read_message(int sock,std::string& username, const std::string& index_str)
     }
 }
 
-bool handle_login(int sock, string& username) {
+// Session-Token (vom Server beim Login ausgestellt) pro Server in ~/.twmailer_session:
+// eine Zeile "<server>:<port> <token>". Damit meldet sich der Client beim nächsten
+// Verbindungsaufbau mit RESUME|<token> an, ohne Passwort (und ohne LDAP-Bind am Server).
+#define SESSION_FILE ".twmailer_session"
+
+string session_file() {
+    const char* home = getenv("HOME");
+    return string(home ? home : ".") + "/" + SESSION_FILE;
+}
+
+string load_session_token(const string& server) {
+    ifstream ifs(session_file());
+    string key, token;
+    while (ifs >> key >> token) {
+        if (key == server) return token;
+    }
+    return "";
+}
+
+// save_session_token: replaces the token of `server`, an empty token removes it
+void save_session_token(const string& server, const string& token) {
+    vector<pair<string, string>> entries;
+    {
+        ifstream ifs(session_file());
+        string key, value;
+        while (ifs >> key >> value) {
+            if (key != server) entries.push_back({key, value});
+        }
+    }
+    if (!token.empty()) entries.push_back({server, token});
+
+    int fd = open(session_file().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) return;
+    string content;
+    for (const auto& e : entries) content += e.first + " " + e.second + "\n";
+    if (write(fd, content.data(), content.size()) != (ssize_t)content.size()) {
+        cerr << "Could not store session token.\n";
+    }
+    close(fd);
+}
+
+// token_user: username part of "<user>:<expires>:<nonce>:<mac>"
+string token_user(const string& token) {
+    size_t pos = token.size();
+    for (int i = 0; i < 3 && pos != string::npos && pos > 0; ++i) pos = token.rfind(':', pos - 1);
+    return (pos == string::npos || pos == 0) ? "" : token.substr(0, pos);
+}
+
+// store_login_token: keeps the token from an "OK|<token>" login response
+void store_login_token(const string& server, const string& response) {
+    if (response.rfind(string(ACK) + "|", 0) == 0) save_session_token(server, response.substr(strlen(ACK) + 1));
+}
+
+// resume_session: logs in with a stored token, returns false if there is none or it was rejected
+bool resume_session(int sock, const string& server, string& username) {
+    string token = load_session_token(server);
+    if (token.empty()) return false;
+
+    string msg = "RESUME|" + token;
+    if (send(sock, msg.c_str(), msg.size(), 0) == -1) return false;
+
+    char buffer[1024] = {0};
+    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
+    if (bytes_received <= 0) return false;
+    buffer[bytes_received] = '\0';
+    string response(buffer);
+
+    if (response.rfind(ACK, 0) != 0) {
+        // abgelaufen oder ungültig -> normales Login
+        save_session_token(server, "");
+        return false;
+    }
+    username = token_user(token);
+    store_login_token(server, response);
+    return true;
+}
+
+bool handle_login(int sock, const string& server, string& username) {
     //TESTING PURPOSES ONLY - NO SECURITY
     cout << "=== LOGIN CREDENTIALS ===" << endl;
     cout << "Username: testuser" << endl;
@@ -173,6 +478,7 @@ bool handle_login(int sock, string& username) {
 
     if (response.rfind(ACK, 0) == 0) {
         cout << "Login successful!\n";
+        store_login_token(server, response);
         return true;
     } else {
         cout << "Login failed: " << response << endl;
@@ -183,22 +489,17 @@ bool handle_login(int sock, string& username) {
 
 void list_messages(int sock) {
     string cmd = "LIST";
-    if (send(sock, cmd.c_str(), cmd.size(), 0) == -1) {
+    if (!send_request(sock, cmd)) {
         cerr << "Error Sending LIST-Command."<< endl;
         return;
     }
 
-    char buffer[8192] = {0}; // größerer Buffer für mehrere Nachrichten
-    int bytes_received = recv(sock, buffer, sizeof(buffer) - 1, 0);
-
-    if (bytes_received <= 0) {
+    string response; // ganze Liste, auch bei vielen Nachrichten
+    if (!recv_reply(sock, response)) {
         cerr << "Error Receiving Message List."<< endl;
         return;
     }
 
-    buffer[bytes_received] = '\0';
-    string response = buffer;
-
     // Fehlermeldung prüfen
     if (response.rfind(ERR, 0) == 0) {
         cerr << "Server Error: " << response.substr(strlen(ERR)) << endl;
@@ -235,18 +536,94 @@ void delete_message(int sock, const std::string& username, const std::string& in
         return;
     }
 
-    for (char c : input) {
-        if (!isdigit(c)) {
-            std::cout << "Invalid index. Please enter a number.\n";
-            return;
-        }
-    }
-
-    std::string txt = "DELETE|" + username + "|" + input;
-    if (send(sock, txt.c_str(), txt.size(), 0) == -1) {
+    // Zahl -> DELETE|username|index, sonst Message-Id (aus LIST) -> DELID|id
+    bool is_index = input.find_first_not_of("0123456789") == std::string::npos;
+    std::string txt = is_index ? "DELETE|" + username + "|" + input : "DELID|" + input;
+    if (!send_request(sock, txt)) {
         std::cerr << "Fehler beim Senden der Nachricht.\n";
         return;
     }
 
     //ack handling is done in caller
-}
\ No newline at end of file
+}
+
+void show_stats(int sock) {
+    string cmd = "STATS";
+    if (!send_request(sock, cmd)) {
+        cerr << "Error Sending STATS-Command."<< endl;
+        return;
+    }
+
+    string response;
+    if (!recv_reply(sock, response)) {
+        cerr << "Error Receiving Server Stats."<< endl;
+        return;
+    }
+
+    cout << "<< Server Stats >>" << endl;
+    cout << response;
+}
+
+// idle_mailbox: waits for new-mail notifications (IDLE) until the user presses Enter.
+// IDLE/DONE are sent unframed, the server answers with lines
+void idle_mailbox(int sock) {
+    string cmd = "IDLE";
+    if (send(sock, cmd.c_str(), cmd.size(), 0) == -1) {
+        cerr << "Error Sending IDLE-Command." << endl;
+        return;
+    }
+    cout << "Waiting for new messages, press Enter to stop..." << endl;
+
+    bool done_sent = false;
+    string pending;
+    while (true) {
+        pollfd fds[2] = {{sock, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(fds, done_sent ? 1 : 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        if (!done_sent && fds[1].revents) {
+            string line;
+            getline(cin, line);
+            cmd = "DONE";
+            if (send(sock, cmd.c_str(), cmd.size(), 0) == -1) return;
+            done_sent = true;
+        }
+        if (!fds[0].revents) continue;
+
+        char buffer[4096];
+        int bytes_received = recv(sock, buffer, sizeof(buffer), 0);
+        if (bytes_received <= 0) {
+            cerr << "Connection closed by server." << endl;
+            return;
+        }
+        pending.append(buffer, bytes_received);
+
+        // one notification per line
+        size_t nl;
+        while ((nl = pending.find('\n')) != string::npos) {
+            string line = pending.substr(0, nl);
+            pending.erase(0, nl + 1);
+            if (line.rfind("NEW|", 0) == 0) {
+                cout << "New message: " << line.substr(4) << endl;
+            } else if (line.rfind("DELETED|", 0) == 0) {
+                cout << "Message deleted: " << line.substr(8) << endl;
+            } else if (line == "RESTART") {
+                // Server wurde neu gestartet: IDLE erneut anmelden (ein schon gesendetes DONE
+                // beantwortet der neue Server mit OK)
+                cmd = "IDLE";
+                if (!done_sent && send(sock, cmd.c_str(), cmd.size(), 0) == -1) return;
+            } else if (line == ACK) {
+                if (done_sent) return;
+            } else if (line.rfind(ERR, 0) == 0) {
+                cerr << "Server Error: " << line.substr(strlen(ERR)) << endl;
+                if (!done_sent) return;
+            }
+        }
+        // ERR without newline (IDLE rejected)
+        if (pending.rfind(ERR, 0) == 0) {
+            cerr << "Server Error: " << pending.substr(strlen(ERR)) << endl;
+            return;
+        }
+    }
+}
@@ -0,0 +1,294 @@
+// compression.cpp
+// Optional at-rest compression of mail bodies with a shared zstd dictionary.
+// Headers (Sender, Subject, Date, ...) always stay plain text so LIST can parse
+// them without decompressing anything. Only the part after "Message:" is packed.
+//
+// On-disk layout (compressed mail):
+//   Sender: ...
+//   Recipient: ...
+//   Subject: ...
+//   Date: ...
+//   Encoding: zstd;dict=<id>
+//   Message:
+//   <zstd frame>
+//
+// Dictionaries live in <BASE_DIR>/.dict/<id>.dict, <BASE_DIR>/.dict/current holds the
+// id used for new mails. Old dictionaries are kept so older mails stay readable.
+
+#include <zstd.h>
+#include <zdict.h>
+#include <mutex>
+#include <map>
+#include <vector>
+
+#define DICT_DIR ".dict"
+#define DICT_CURRENT "current"
+#define DICT_MAX_SIZE (16 * 1024)
+#define ZSTD_LEVEL 3
+#define ENCODING_PREFIX "Encoding: zstd;dict="
+#define MESSAGE_MARKER "Message:\n"
+
+static bool COMPRESS_BODIES = false;
+
+static mutex dict_mutex;
+static map<unsigned, ZSTD_DDict*> ddicts;   // dict id -> decompression dict
+static ZSTD_CDict* current_cdict = nullptr;
+static unsigned current_dict_id = 0;
+
+void set_compression(bool enabled) {
+	COMPRESS_BODIES = enabled;
+}
+bool get_compression() {
+	return COMPRESS_BODIES;
+}
+
+static fs::path dict_dir() {
+	return BASE_DIR / DICT_DIR;
+}
+
+static bool read_file(const fs::path& path, string& out) {
+	ifstream ifs(path, ios::binary);
+	if (!ifs) return false;
+	ostringstream oss;
+	oss << ifs.rdbuf();
+	out = oss.str();
+	return true;
+}
+
+// write to a temp file first and rename afterwards -> readers never see half a file
+static bool write_file_atomic(const fs::path& path, const string& data) {
+	fs::path tmp = path;
+	tmp += ".tmp";
+	{
+		ofstream ofs(tmp, ios::binary | ios::trunc);
+		if (!ofs) return false;
+		ofs.write(data.data(), data.size());
+		ofs.close();
+		if (!ofs) return false;
+	}
+	error_code ec;
+	fs::rename(tmp, path, ec);
+	if (ec) {
+		fs::remove(tmp, ec);
+		return false;
+	}
+	return true;
+}
+
+// load_dictionary: caller holds dict_mutex
+static ZSTD_DDict* load_dictionary(unsigned id) {
+	auto it = ddicts.find(id);
+	if (it != ddicts.end()) return it->second;
+
+	string data;
+	if (!read_file(dict_dir() / (to_string(id) + ".dict"), data)) {
+		cerr << "compression: dictionary " << id << " not found\n";
+		return nullptr;
+	}
+	ZSTD_DDict* ddict = ZSTD_createDDict(data.data(), data.size());
+	ddicts[id] = ddict;
+	return ddict;
+}
+
+// load_current_dictionary: (re)loads the dictionary new mails are compressed with.
+// Without a trained dictionary bodies are compressed plain (dict=0).
+bool load_current_dictionary() {
+	lock_guard<mutex> lock(dict_mutex);
+
+	string id_str;
+	if (!read_file(dict_dir() / DICT_CURRENT, id_str)) {
+		cout << "compression: no trained dictionary, compressing without dictionary\n";
+		return false;
+	}
+	unsigned id = (unsigned)strtoul(id_str.c_str(), nullptr, 10);
+
+	string data;
+	if (id == 0 || !read_file(dict_dir() / (to_string(id) + ".dict"), data)) {
+		cerr << "compression: current dictionary " << id_str << " is missing\n";
+		return false;
+	}
+	if (current_cdict) ZSTD_freeCDict(current_cdict);
+	current_cdict = ZSTD_createCDict(data.data(), data.size(), ZSTD_LEVEL);
+	current_dict_id = id;
+	cout << "compression: using dictionary " << id << " (" << data.size() << " bytes)\n";
+	return true;
+}
+
+// compress_body: returns the zstd frame for `body`, dict_id is set to the dictionary used
+static string compress_body(const string& body, unsigned& dict_id) {
+	thread_local ZSTD_CCtx* cctx = ZSTD_createCCtx();
+
+	string out(ZSTD_compressBound(body.size()), '\0');
+	size_t n;
+	{
+		lock_guard<mutex> lock(dict_mutex);
+		dict_id = current_cdict ? current_dict_id : 0;
+		if (current_cdict)
+			n = ZSTD_compress_usingCDict(cctx, &out[0], out.size(), body.data(), body.size(), current_cdict);
+		else
+			n = ZSTD_compressCCtx(cctx, &out[0], out.size(), body.data(), body.size(), ZSTD_LEVEL);
+	}
+	if (ZSTD_isError(n)) {
+		cerr << "compression: " << ZSTD_getErrorName(n) << "\n";
+		return "";
+	}
+	out.resize(n);
+	return out;
+}
+
+static bool decompress_body(const string& frame, unsigned dict_id, string& body) {
+	thread_local ZSTD_DCtx* dctx = ZSTD_createDCtx();
+
+	unsigned long long size = ZSTD_getFrameContentSize(frame.data(), frame.size());
+	if (size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN) return false;
+	body.assign(size, '\0');
+
+	size_t n;
+	if (dict_id != 0) {
+		lock_guard<mutex> lock(dict_mutex);
+		ZSTD_DDict* ddict = load_dictionary(dict_id);
+		if (!ddict) return false;
+		n = ZSTD_decompress_usingDDict(dctx, &body[0], body.size(), frame.data(), frame.size(), ddict);
+	} else {
+		n = ZSTD_decompressDCtx(dctx, &body[0], body.size(), frame.data(), frame.size());
+	}
+	if (ZSTD_isError(n)) {
+		cerr << "compression: " << ZSTD_getErrorName(n) << "\n";
+		return false;
+	}
+	body.resize(n);
+	return true;
+}
+
+// compose_mail_file: headers ("Sender: ...\n" lines) + body -> file content.
+// Body is compressed if at-rest compression is enabled.
+string compose_mail_file(const string& headers, const string& body) {
+	if (!COMPRESS_BODIES) return headers + MESSAGE_MARKER + body;
+
+	unsigned dict_id = 0;
+	string frame = compress_body(body, dict_id);
+	if (frame.empty() && !body.empty()) return headers + MESSAGE_MARKER + body;
+
+	return headers + ENCODING_PREFIX + to_string(dict_id) + "\n" + MESSAGE_MARKER + frame;
+}
+
+// split_mail_file: splits raw file content into headers and (still encoded) body
+static void split_mail_file(const string& raw, string& headers, string& body) {
+	size_t pos = (raw.compare(0, strlen(MESSAGE_MARKER), MESSAGE_MARKER) == 0) ? 0 : raw.find("\n" MESSAGE_MARKER);
+	if (pos == string::npos) {
+		headers = raw;
+		body.clear();
+		return;
+	}
+	if (pos != 0) pos += 1;
+	headers = raw.substr(0, pos);
+	body = raw.substr(pos + strlen(MESSAGE_MARKER));
+}
+
+// decode_mail_file: raw file content -> plain text content (as if never compressed)
+bool decode_mail_file(const string& raw, string& content) {
+	string headers, body;
+	split_mail_file(raw, headers, body);
+
+	size_t enc = headers.find(ENCODING_PREFIX);
+	if (enc == string::npos) {
+		content = raw;
+		return true;
+	}
+
+	size_t enc_end = headers.find('\n', enc);
+	unsigned dict_id = (unsigned)strtoul(headers.c_str() + enc + strlen(ENCODING_PREFIX), nullptr, 10);
+	string plain;
+	if (!decompress_body(body, dict_id, plain)) return false;
+
+	headers.erase(enc, enc_end == string::npos ? string::npos : enc_end - enc + 1);
+	content = headers + MESSAGE_MARKER + plain;
+	return true;
+}
+
+// read_mail_file: reads a stored mail and transparently decompresses the body
+bool read_mail_file(const fs::path& path, string& content) {
+	string raw;
+	if (!read_file(path, raw)) return false;
+	return decode_mail_file(raw, content);
+}
+
+// mail_body: extracts the plain body of a decoded mail
+static string mail_body(const string& content) {
+	string headers, body;
+	split_mail_file(content, headers, body);
+	return body;
+}
+
+// train_dictionary: trains a new dictionary from all bodies in the spool and makes it current
+bool train_dictionary(string& err) {
+	string samples;
+	vector<size_t> sizes;
+
+	for (const auto& entry : fs::recursive_directory_iterator(BASE_DIR)) {
+		if (!entry.is_regular_file() || entry.path().extension() != ".txt") continue;
+		// skip internal directories (.dict, ...)
+		if (entry.path().parent_path().filename().string().rfind(".", 0) == 0) continue;
+
+		string content;
+		if (!read_mail_file(entry.path(), content)) continue;
+		string body = mail_body(content);
+		if (body.empty()) continue;
+		samples += body;
+		sizes.push_back(body.size());
+	}
+
+	if (sizes.empty()) {
+		err = "no mails to train from";
+		return false;
+	}
+
+	string dict(DICT_MAX_SIZE, '\0');
+	size_t n = ZDICT_trainFromBuffer(&dict[0], dict.size(), samples.data(), sizes.data(), (unsigned)sizes.size());
+	if (ZDICT_isError(n)) {
+		err = string("training failed: ") + ZDICT_getErrorName(n) + " (" + to_string(sizes.size()) + " samples)";
+		return false;
+	}
+	dict.resize(n);
+	unsigned id = ZDICT_getDictID(dict.data(), dict.size());
+
+	error_code ec;
+	fs::create_directories(dict_dir(), ec);
+	if (!write_file_atomic(dict_dir() / (to_string(id) + ".dict"), dict) ||
+	    !write_file_atomic(dict_dir() / DICT_CURRENT, to_string(id))) {
+		err = "failed to write dictionary to " + dict_dir().string();
+		return false;
+	}
+
+	cout << "train_dictionary: trained dictionary " << id << " (" << n << " bytes) from "
+	     << sizes.size() << " mails\n";
+	return load_current_dictionary();
+}
+
+// recompress_mailbox: rewrites every mail of `username` with the current dictionary.
+// Returns the number of rewritten mails, -1 on error.
+int recompress_mailbox(const string& username) {
+	vector<fs::path> dirs = mailbox_dirs(username);
+	if (dirs.empty()) return -1;
+
+	int count = 0;
+	for (const fs::path& dir : dirs) {
+		for (const auto& entry : fs::directory_iterator(dir)) {
+			if (!entry.is_regular_file() || entry.path().extension() != ".txt") continue;
+
+			string content;
+			if (!read_mail_file(entry.path(), content)) {
+				cerr << "recompress_mailbox: failed to read " << entry.path() << "\n";
+				continue;
+			}
+			string headers, body;
+			split_mail_file(content, headers, body);
+			if (!write_file_atomic(entry.path(), compose_mail_file(headers, body))) {
+				cerr << "recompress_mailbox: failed to write " << entry.path() << "\n";
+				continue;
+			}
+			count++;
+		}
+	}
+	return count;
+}
@@ -0,0 +1,100 @@
+// crc32c.cpp
+// CRC-32C (Castagnoli) of attachment chunks and files, used by server and client.
+// The SSE4.2 crc32 instruction is used if the CPU has it (picked once at startup),
+// otherwise a slicing-by-8 table (8 bytes per step).
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78 // reflected
+
+static uint32_t crc32c_table[8][256];
+
+static bool crc32c_init_table() {
+	for (uint32_t i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; ++k) c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crc32c_table[0][i] = c;
+	}
+	for (uint32_t i = 0; i < 256; ++i) {
+		for (int t = 1; t < 8; ++t) {
+			uint32_t c = crc32c_table[t - 1][i];
+			crc32c_table[t][i] = (c >> 8) ^ crc32c_table[0][c & 0xff];
+		}
+	}
+	return true;
+}
+
+static uint32_t crc32c_sw(uint32_t c, const unsigned char* p, size_t n) {
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		v ^= c;
+		c = crc32c_table[7][v & 0xff] ^ crc32c_table[6][(v >> 8) & 0xff] ^ crc32c_table[5][(v >> 16) & 0xff] ^
+		    crc32c_table[4][(v >> 24) & 0xff] ^ crc32c_table[3][(v >> 32) & 0xff] ^ crc32c_table[2][(v >> 40) & 0xff] ^
+		    crc32c_table[1][(v >> 48) & 0xff] ^ crc32c_table[0][v >> 56];
+	}
+	for (; n; --n, ++p) c = (c >> 8) ^ crc32c_table[0][(c ^ *p) & 0xff];
+	return c;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t c, const unsigned char* p, size_t n) {
+	uint64_t c64 = c;
+	for (; n >= 8; n -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		c64 = _mm_crc32_u64(c64, v);
+	}
+	c = (uint32_t)c64;
+	for (; n; --n, ++p) c = _mm_crc32_u8(c, *p);
+	return c;
+}
+#endif
+
+using Crc32cFn = uint32_t (*)(uint32_t c, const unsigned char* p, size_t n);
+
+static Crc32cFn crc32c_pick() {
+#ifdef CRC32C_X86
+	if (__builtin_cpu_supports("sse4.2")) return crc32c_hw;
+#endif
+	static bool table_ready = crc32c_init_table();
+	(void)table_ready;
+	return crc32c_sw;
+}
+
+static const Crc32cFn crc32c_impl = crc32c_pick();
+
+// crc32c_update: continues `crc` (0 for a new checksum) over `n` bytes of `data`
+uint32_t crc32c_update(uint32_t crc, const void* data, size_t n) {
+	return ~crc32c_impl(~crc, (const unsigned char*)data, n);
+}
+
+// crc32c_hex: 8 lowercase hex digits
+std::string crc32c_hex(uint32_t crc) {
+	static const char hex[] = "0123456789abcdef";
+	std::string out(8, '0');
+	for (int i = 7; i >= 0; --i, crc >>= 4) out[i] = hex[crc & 0xf];
+	return out;
+}
+
+// parse_crc32c: 8 hex digits -> checksum
+bool parse_crc32c(std::string_view s, uint32_t& crc) {
+	if (s.size() != 8) return false;
+	crc = 0;
+	for (char ch : s) {
+		int v = (ch >= '0' && ch <= '9') ? ch - '0' : (ch >= 'a' && ch <= 'f') ? ch - 'a' + 10 : (ch >= 'A' && ch <= 'F') ? ch - 'A' + 10 : -1;
+		if (v < 0) return false;
+		crc = (crc << 4) | (uint32_t)v;
+	}
+	return true;
+}
@@ -0,0 +1,296 @@
+// idle.cpp
+// IDLE: new-mail notifications pushed to the client instead of LIST polling.
+//
+//   client: IDLE           server: "OK\n", then one line per change of the mailbox:
+//                                  "NEW|<message-id>\n", "DELETED|<message-id>\n"
+//   client: DONE           server: remaining notifications, "OK\n"; normal commands again
+//
+// An idle connection has no thread: serve_client() parks the socket here and returns,
+// one watcher thread waits for all parked sockets with epoll. Mailbox changes
+// (mailbox_changed(), mailindex.cpp) append the line to every connection subscribed to
+// that mailbox and wake the watcher through an eventfd, the watcher sends without
+// blocking. DONE hands the socket to a new connection thread (serve_client). A client
+// that does not read its notifications is disconnected at IDLE_MAX_PENDING bytes.
+// On a restart (upgrade.cpp) idle connections get "RESTART\n" and are handed over
+// with the others; IDLE has to be sent again (a DONE outside IDLE is answered "OK\n").
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unordered_map>
+
+#define IDLE_MAX_EVENTS 64
+#define IDLE_MAX_PENDING (64 * 1024) // unsent notification bytes per connection
+#define IDLE_OK "OK\n"
+
+int sendall(int socket, const char *buffer, size_t length); // server.cpp
+
+struct IdleConn {
+	int fd;
+	string peer;
+	string username;
+	string out;            // lines not sent yet (idle_mutex)
+	string in;             // received while idle, should become "DONE"
+	bool dirty = false;    // in idle_dirty
+	bool want_write = false;
+	bool gone = false;     // closed or resumed, freed after the current epoll batch
+	ActiveConnection active; // parked connections are drained on a restart like the others
+};
+
+static int idle_epoll = -1;
+static int idle_wake = -1; // eventfd: notifications queued
+static mutex idle_mutex;
+static unordered_map<string, vector<IdleConn*>> idle_subscribers; // mailbox -> parked connections
+static vector<IdleConn*> idle_dirty;                               // connections with new lines
+static vector<IdleConn*> idle_gone;                                // watcher thread only
+static function<void(int, const string&, const string&)> idle_resume;
+static atomic<unsigned> idle_connections(0);
+static atomic<unsigned long> idle_notifications(0);
+static atomic<unsigned long> idle_dropped(0);
+
+// idle_notify: queues a notification for the parked connections of `username`
+// (mailbox_notify_hook, runs in the thread that changed the mailbox)
+static void idle_notify(char op, const string& username, const string& id) {
+	const string line = (op == 'A' ? "NEW|" : "DELETED|") + id + "\n";
+	bool wake = false;
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		auto it = idle_subscribers.find(username);
+		if (it == idle_subscribers.end()) return;
+		for (IdleConn* c : it->second) {
+			c->out += line;
+			idle_notifications++;
+			if (!c->dirty) {
+				c->dirty = true;
+				idle_dirty.push_back(c);
+				wake = true;
+			}
+		}
+	}
+	uint64_t one = 1;
+	if (wake && write(idle_wake, &one, sizeof(one)) < 0) {}
+}
+
+static void idle_unsubscribe(IdleConn* c) {
+	vector<IdleConn*>& subs = idle_subscribers[c->username];
+	subs.erase(remove(subs.begin(), subs.end(), c), subs.end());
+	if (subs.empty()) idle_subscribers.erase(c->username);
+	idle_dirty.erase(remove(idle_dirty.begin(), idle_dirty.end(), c), idle_dirty.end());
+}
+
+// idle_close: client gone or too slow
+static void idle_close(IdleConn* c) {
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		idle_unsubscribe(c);
+	}
+	epoll_ctl(idle_epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+	close(c->fd);
+	std::cout << "IDLE: connection with client (" << c->peer << ") closed" << endl;
+	idle_connections--;
+	c->gone = true;
+	idle_gone.push_back(c);
+}
+
+// idle_end: leaves IDLE, the rest of the queued lines + `last` are sent by the
+// connection thread that takes the socket over
+static void idle_end(IdleConn* c, const char* last) {
+	string rest;
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		idle_unsubscribe(c);
+		rest = move(c->out);
+	}
+	epoll_ctl(idle_epoll, EPOLL_CTL_DEL, c->fd, nullptr);
+	rest += last;
+	idle_connections--;
+	c->gone = true;
+	idle_gone.push_back(c);
+	// still counted for the drain until serve_client has taken over
+	auto hold = make_shared<ActiveConnection>();
+	thread([fd = c->fd, peer = c->peer, username = c->username, rest, hold]() {
+		if (sendall(fd, rest.c_str(), rest.size()) == -1) {
+			close(fd);
+			return;
+		}
+		idle_resume(fd, peer, username);
+	}).detach();
+}
+
+// idle_flush: sends queued lines without blocking, false if the connection was closed
+static bool idle_flush(IdleConn* c) {
+	if (c->gone) return false;
+	bool overflow = false, want_write = false;
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		c->dirty = false;
+		while (!c->out.empty()) {
+			ssize_t n = send(c->fd, c->out.data(), c->out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+			if (n > 0) {
+				c->out.erase(0, n);
+				continue;
+			}
+			if (n < 0 && errno == EINTR) continue;
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) want_write = true;
+			else overflow = true; // send error
+			break;
+		}
+		if (c->out.size() > IDLE_MAX_PENDING) overflow = true;
+	}
+	if (overflow) {
+		if (!c->out.empty()) idle_dropped++;
+		idle_close(c);
+		return false;
+	}
+	if (want_write != c->want_write) {
+		// socket buffer full: continue when it is writable again
+		epoll_event ev{};
+		ev.events = EPOLLIN | EPOLLRDHUP | (want_write ? EPOLLOUT : 0);
+		ev.data.ptr = c;
+		epoll_ctl(idle_epoll, EPOLL_CTL_MOD, c->fd, &ev);
+		c->want_write = want_write;
+	}
+	return true;
+}
+
+// idle_input: the client may only say DONE (or QUIT) while idle
+static void idle_input(IdleConn* c) {
+	if (c->gone) return;
+	char buf[256];
+	while (true) {
+		ssize_t n = recv(c->fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (n > 0) {
+			c->in.append(buf, n);
+			continue;
+		}
+		if (n < 0 && errno == EINTR) continue;
+		if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			idle_close(c);
+			return;
+		}
+		break;
+	}
+
+	string_view cmd(c->in);
+	if (!cmd.empty() && cmd[0] == FRAME_MARK) cmd.remove_prefix(min(cmd.size(), cmd.find('|') + 1)); // "#4|DONE"
+	while (!cmd.empty() && (cmd.back() == '\n' || cmd.back() == '\r')) cmd.remove_suffix(1);
+	Opcode op = lookup_opcode(cmd);
+	if (op == Opcode::DONE) {
+		idle_end(c, IDLE_OK);
+	} else if (op == Opcode::QUIT || op == Opcode::EXIT) {
+		idle_close(c);
+	} else if (cmd.size() >= 4) {
+		c->in.clear();
+		{
+			lock_guard<mutex> lock(idle_mutex);
+			c->out += string(ERR) + "IDLE active, send DONE first\n";
+		}
+		idle_flush(c);
+	}
+}
+
+// idle_park: takes over the socket of a client that sent IDLE. The connection
+// thread must not touch the socket afterwards.
+bool idle_park(int client_socket, const string& peer, const string& username) {
+	if (idle_epoll < 0) return false;
+	IdleConn* c = new IdleConn{client_socket, peer, username};
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		c->out = IDLE_OK;
+		c->dirty = true;
+		idle_dirty.push_back(c);
+		idle_subscribers[username].push_back(c);
+	}
+	idle_connections++;
+
+	epoll_event ev{};
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = c;
+	if (epoll_ctl(idle_epoll, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+		lock_guard<mutex> lock(idle_mutex);
+		idle_unsubscribe(c);
+		idle_connections--;
+		delete c;
+		return false;
+	}
+	uint64_t one = 1;
+	if (write(idle_wake, &one, sizeof(one)) < 0) {}
+	return true;
+}
+
+static void idle_watch() {
+	epoll_event events[IDLE_MAX_EVENTS];
+	bool drained = false;
+	while (true) {
+		int n = epoll_wait(idle_epoll, events, IDLE_MAX_EVENTS, -1);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			cerr << "IDLE: epoll_wait failed: " << strerror(errno) << endl;
+			return;
+		}
+		for (int i = 0; i < n; ++i) {
+			void* ptr = events[i].data.ptr;
+			if (ptr == &idle_wake) {
+				uint64_t count;
+				if (read(idle_wake, &count, sizeof(count)) < 0) {}
+				vector<IdleConn*> dirty;
+				{
+					lock_guard<mutex> lock(idle_mutex);
+					dirty.swap(idle_dirty);
+				}
+				for (IdleConn* c : dirty) idle_flush(c);
+			} else if (ptr == &idle_epoll) {
+				// restart: hand every parked connection over (serve_client does it)
+				if (drained) continue;
+				drained = true;
+				epoll_ctl(idle_epoll, EPOLL_CTL_DEL, drain_fd(), nullptr);
+				vector<IdleConn*> parked;
+				{
+					lock_guard<mutex> lock(idle_mutex);
+					for (auto& entry : idle_subscribers) parked.insert(parked.end(), entry.second.begin(), entry.second.end());
+				}
+				for (IdleConn* c : parked) idle_end(c, "RESTART\n");
+			} else {
+				IdleConn* c = (IdleConn*)ptr;
+				if (events[i].events & EPOLLOUT) {
+					if (!idle_flush(c)) continue;
+				}
+				if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) idle_input(c);
+			}
+		}
+		for (IdleConn* c : idle_gone) delete c;
+		idle_gone.clear();
+	}
+}
+
+// start_idle_watcher: watcher thread for parked connections, `resume` serves a
+// connection again after DONE
+bool start_idle_watcher(const function<void(int, const string&, const string&)>& resume) {
+	idle_resume = resume;
+	idle_epoll = epoll_create1(EPOLL_CLOEXEC);
+	idle_wake = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (idle_epoll < 0 || idle_wake < 0) {
+		cerr << "IDLE: epoll/eventfd failed: " << strerror(errno) << endl;
+		return false;
+	}
+	epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.ptr = &idle_wake;
+	epoll_ctl(idle_epoll, EPOLL_CTL_ADD, idle_wake, &ev);
+	if (drain_fd() >= 0) {
+		ev.data.ptr = &idle_epoll;
+		epoll_ctl(idle_epoll, EPOLL_CTL_ADD, drain_fd(), &ev);
+	}
+	mailbox_notify_hook = idle_notify;
+	thread(idle_watch).detach();
+	return true;
+}
+
+string idle_stats() {
+	size_t mailboxes;
+	{
+		lock_guard<mutex> lock(idle_mutex);
+		mailboxes = idle_subscribers.size();
+	}
+	return "idle: connections=" + to_string(idle_connections) + " mailboxes=" + to_string(mailboxes) +
+	       " notifications=" + to_string(idle_notifications) + " dropped=" + to_string(idle_dropped) + "\n";
+}
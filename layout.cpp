@@ -0,0 +1,219 @@
+// layout.cpp
+// Spool directory layout and path resolver. Every storage function asks here where
+// a mailbox or a mail lives instead of building "<BASE_DIR>/<user>/<id>.txt" itself.
+//
+//   flat   : <BASE_DIR>/<user>/<id>.txt                       (original layout)
+//   hashed : <BASE_DIR>/.hashed/<ab>/<cd>/<user>/<yyyy-mm>/<id>.txt
+//            ab/cd = first two bytes of a hash of the user name, yyyy-mm (UTC)
+//            from the millisecond prefix of the message id
+//
+// The hashed layout keeps directories small with many users and large mailboxes.
+// New mails are always written in the configured layout; mails still in the other
+// layout are found through a fallback, so a running server can be migrated
+// (start_layout_migration) without downtime. The shards live below their own
+// dot directory, so every other top-level directory is a flat mailbox (also a user
+// named like a shard) and listing the mailboxes never reads inside one.
+
+#include <thread>
+#include <functional>
+#include <unordered_set>
+#include <atomic>
+
+#define LAYOUT_MIGRATION_PAUSE_MS 10 // pause between migrated mailboxes
+#define LAYOUT_HASHED_DIR ".hashed"
+
+enum SpoolLayout {
+	LAYOUT_FLAT,
+	LAYOUT_HASHED,
+};
+
+static SpoolLayout SPOOL_LAYOUT = LAYOUT_FLAT;
+
+bool set_layout(const string& name) {
+	if (name == "flat") SPOOL_LAYOUT = LAYOUT_FLAT;
+	else if (name == "hashed") SPOOL_LAYOUT = LAYOUT_HASHED;
+	else return false;
+	return true;
+}
+
+static string user_shard(const string& username) {
+	// FNV-1a 32 -> two levels of 256 directories
+	uint32_t h = 2166136261u;
+	for (char c : username) {
+		h ^= (unsigned char)c;
+		h *= 16777619u;
+	}
+	char buf[6];
+	snprintf(buf, sizeof(buf), "%02x/%02x", (h >> 24) & 0xff, (h >> 16) & 0xff);
+	return buf;
+}
+
+// month_of: "yyyy-mm" of the timestamp prefix of a message id
+static string month_of(const string& id) {
+	size_t digits = id.find_first_not_of("0123456789");
+	if (digits == 0 || id.empty()) return "misc";
+	time_t sec = (time_t)(strtoll(id.c_str(), nullptr, 10) / 1000);
+	tm utc;
+	gmtime_r(&sec, &utc);
+	char buf[16];
+	strftime(buf, sizeof(buf), "%Y-%m", &utc);
+	return buf;
+}
+
+// valid_mailbox_name: mailbox names share the top level with the internal dot
+// directories (.dict, .wal, .session, .attachments, .hashed ...): no '.' at the
+// start, no '/', not empty
+bool valid_mailbox_name(string_view name) {
+	return !name.empty() && name[0] != '.' && name.find('/') == string_view::npos && name.find('\0') == string_view::npos;
+}
+
+fs::path mailbox_dir_in(SpoolLayout layout, const string& username) {
+	if (layout == LAYOUT_HASHED) return BASE_DIR / LAYOUT_HASHED_DIR / user_shard(username) / username;
+	return BASE_DIR / username;
+}
+
+// mailbox_dir: directory of `username` in the configured layout
+fs::path mailbox_dir(const string& username) {
+	return mailbox_dir_in(SPOOL_LAYOUT, username);
+}
+
+static fs::path mail_path_in(SpoolLayout layout, const string& username, const string& id) {
+	if (layout == LAYOUT_HASHED) return mailbox_dir_in(layout, username) / month_of(id) / (id + ".txt");
+	return mailbox_dir_in(layout, username) / (id + ".txt");
+}
+
+// mail_write_path: where a new mail is stored
+fs::path mail_write_path(const string& username, const string& id) {
+	return mail_path_in(SPOOL_LAYOUT, username, id);
+}
+
+// mail_path: location of an existing mail (falls back to the other layout while migrating)
+fs::path mail_path(const string& username, const string& id) {
+	fs::path primary = mail_path_in(SPOOL_LAYOUT, username, id);
+	error_code ec;
+	if (fs::exists(primary, ec)) return primary;
+	fs::path other = mail_path_in(SPOOL_LAYOUT == LAYOUT_FLAT ? LAYOUT_HASHED : LAYOUT_FLAT, username, id);
+	return fs::exists(other, ec) ? other : primary;
+}
+
+// mailbox_dirs: all existing directories holding mails of `username` (both layouts)
+vector<fs::path> mailbox_dirs(const string& username) {
+	vector<fs::path> dirs;
+	error_code ec;
+
+	fs::path flat = mailbox_dir_in(LAYOUT_FLAT, username);
+	if (fs::is_directory(flat, ec)) dirs.push_back(flat);
+
+	fs::path hashed = mailbox_dir_in(LAYOUT_HASHED, username);
+	if (fs::is_directory(hashed, ec)) {
+		dirs.push_back(hashed);
+		for (const auto& e : fs::directory_iterator(hashed, ec)) {
+			if (e.is_directory()) dirs.push_back(e.path());
+		}
+	}
+	return dirs;
+}
+
+// for_each_mailbox: calls fn(username) for every mailbox in the spool (both layouts).
+// Only reads BASE_DIR and the shard directories, never the mailboxes themselves.
+void for_each_mailbox(const function<void(const string&)>& fn) {
+	error_code ec;
+	// flat: every top-level directory except the dot directories (.hashed, .archive, ...)
+	for (const auto& top : fs::directory_iterator(BASE_DIR, ec)) {
+		string name = top.path().filename().string();
+		if (top.is_directory() && name[0] != '.') fn(name);
+	}
+	// hashed: .hashed/<ab>/<cd>/<user>; users in both layouts are reported twice
+	for (const auto& level1 : fs::directory_iterator(BASE_DIR / LAYOUT_HASHED_DIR, ec)) {
+		if (!level1.is_directory()) continue;
+		for (const auto& level2 : fs::directory_iterator(level1.path(), ec)) {
+			if (!level2.is_directory()) continue;
+			for (const auto& user : fs::directory_iterator(level2.path(), ec)) {
+				if (user.is_directory()) fn(user.path().filename().string());
+			}
+		}
+	}
+}
+
+// migrate_mailbox: moves all mails of `username` that are still in the other layout.
+// rename() is atomic, readers find every mail either at the old or at the new place.
+static int migrate_mailbox(const string& username) {
+	SpoolLayout from = (SPOOL_LAYOUT == LAYOUT_FLAT) ? LAYOUT_HASHED : LAYOUT_FLAT;
+	fs::path old_dir = mailbox_dir_in(from, username);
+	int moved = 0;
+	error_code ec;
+
+	vector<fs::path> files;
+	for (const auto& e : fs::recursive_directory_iterator(old_dir, ec)) {
+		if (e.is_regular_file() && e.path().extension() == ".txt") files.push_back(e.path());
+	}
+	for (const fs::path& file : files) {
+		fs::path target = mail_write_path(username, file.stem().string());
+		fs::create_directories(target.parent_path(), ec);
+		fs::rename(file, target, ec);
+		if (ec) {
+			cerr << "layout: failed to move " << file << ": " << ec.message() << "\n";
+			continue;
+		}
+		moved++;
+	}
+	// leftover (now empty) directories of the old layout; remove() keeps non-empty ones
+	if (from == LAYOUT_HASHED) {
+		vector<fs::path> months;
+		for (const auto& e : fs::directory_iterator(old_dir, ec)) {
+			if (e.is_directory()) months.push_back(e.path());
+		}
+		for (const fs::path& month : months) fs::remove(month, ec);
+	}
+	fs::remove(old_dir, ec);
+	if (from == LAYOUT_HASHED) {
+		fs::remove(old_dir.parent_path(), ec);               // cd (only if empty)
+		fs::remove(old_dir.parent_path().parent_path(), ec); // ab (only if empty)
+	}
+	return moved;
+}
+
+static void with_mailbox_locked(const string& username, const function<void()>& fn); // mailindex.cpp
+
+static atomic<bool> layout_migrating(false);
+static atomic<unsigned long> layout_migrated_mailboxes(0);
+static atomic<unsigned long> layout_migrated_mails(0);
+
+// start_layout_migration: converts mailboxes stored in the other layout in the background.
+// Ids do not change, so the mailbox indexes, the catalog and the cache stay valid.
+void start_layout_migration() {
+	layout_migrating = true;
+	thread([]() {
+		vector<string> pending;
+		unordered_set<string> seen;
+		SpoolLayout from = (SPOOL_LAYOUT == LAYOUT_FLAT) ? LAYOUT_HASHED : LAYOUT_FLAT;
+		for_each_mailbox([&](const string& user) {
+			error_code ec;
+			fs::path old_dir = mailbox_dir_in(from, user);
+			if (fs::is_directory(old_dir, ec) && seen.insert(user).second) pending.push_back(user);
+		});
+		if (!pending.empty())
+			cout << "layout: migrating " << pending.size() << " mailboxes to the "
+			     << (SPOOL_LAYOUT == LAYOUT_HASHED ? "hashed" : "flat") << " layout\n";
+
+		for (const string& user : pending) {
+			// no index load of this mailbox may scan while its files move
+			int moved = 0;
+			with_mailbox_locked(user, [&]() { moved = migrate_mailbox(user); });
+			layout_migrated_mailboxes++;
+			layout_migrated_mails += moved;
+			this_thread::sleep_for(chrono::milliseconds(LAYOUT_MIGRATION_PAUSE_MS));
+		}
+		if (!pending.empty()) cout << "layout: migration done (" << layout_migrated_mails << " mails)\n";
+		layout_migrating = false;
+	}).detach();
+}
+
+string layout_stats() {
+	ostringstream oss;
+	oss << "layout: " << (SPOOL_LAYOUT == LAYOUT_HASHED ? "hashed" : "flat")
+	    << " migrating=" << (layout_migrating ? "yes" : "no")
+	    << " migrated_mailboxes=" << layout_migrated_mailboxes
+	    << " migrated_mails=" << layout_migrated_mails << "\n";
+	return oss.str();
+}
@@ -15,6 +15,7 @@ using namespace std;
 //initializes connection to ldap server ( from example code in lecture )
 int ldap_connect()
 {
+   TraceSpan span("ldap_connect");
    // If there's an existing connection, close it first
    if (ldapHandle != NULL)
    {
@@ -54,6 +55,7 @@ int ldap_connect()
 }
 
 int ldap_login( const char *ldapBindUser, const char *ldapBindPassword ) {
+   TraceSpan span("ldap_login");
    ////////////////////////////////////////////////////////////////////////////
    // start connection secure (initialize TLS)
    // https://linux.die.net/man/3/ldap_start_tls_s
@@ -79,10 +81,13 @@ int ldap_login( const char *ldapBindUser, const char *ldapBindPassword ) {
    }
    cout << "LDAP connection established for login." << endl;
 
-   rc = ldap_start_tls_s(
-       ldapHandle,
-       NULL,
-       NULL);
+   {
+      TraceSpan tls_span("ldap_start_tls");
+      rc = ldap_start_tls_s(
+          ldapHandle,
+          NULL,
+          NULL);
+   }
    if (rc != LDAP_SUCCESS)
    {
       fprintf(stderr, "ldap_start_tls_s(): %s\n", ldap_err2string(rc));
@@ -117,14 +122,17 @@ int ldap_login( const char *ldapBindUser, const char *ldapBindPassword ) {
    bindCredentials.bv_len = strlen(ldapBindPassword);
 
    BerValue *servercredp = NULL; // server's credentials
-   rc = ldap_sasl_bind_s(
-       ldapHandle,
-       ldapBindDN,
-       LDAP_SASL_SIMPLE,
-       &bindCredentials,
-       NULL,
-       NULL,
-       &servercredp);
+   {
+      TraceSpan bind_span("ldap_bind");
+      rc = ldap_sasl_bind_s(
+          ldapHandle,
+          ldapBindDN,
+          LDAP_SASL_SIMPLE,
+          &bindCredentials,
+          NULL,
+          NULL,
+          &servercredp);
+   }
    if (rc != LDAP_SUCCESS)
    {
       fprintf(stderr, "LDAP bind error: %s\n", ldap_err2string(rc));
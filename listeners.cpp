@@ -0,0 +1,222 @@
+// listeners.cpp
+// Listening sockets of the server. Any number of listeners can be configured with
+// --listen=<spec> (repeatable), all of them are served by one poll() accept loop:
+//
+//   unix:/path/to.sock        AF_UNIX stream socket (co-located clients, no TCP stack)
+//   tcp:<ipv4>:<port>         e.g. tcp:0.0.0.0:8080
+//   tcp:[<ipv6>]:<port>       e.g. tcp:[::1]:8080
+//   <ipv4>:<port>, [<ipv6>]:<port>   same without the "tcp:" prefix
+//   <port>                    127.0.0.1:<port>, other interfaces only when named
+//
+// Without --listen the server listens on SERVER_IP:<port> (server.cpp) as before.
+
+#include <poll.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <functional>
+
+#define LISTEN_DEFAULT_IP "127.0.0.1"   // address of a bare "<port>" spec
+#define ACCEPT_BACKOFF_MS 100           // pause after accept() ran out of descriptors/memory
+
+struct Listener {
+	string spec;       // as given on the command line
+	int family = AF_INET;
+	string address;    // ip, or the socket path for AF_UNIX
+	int port = 0;
+	int fd = -1;
+};
+
+static vector<Listener> listeners;
+
+// parse_listener: fills family/address/port from `spec`, false if malformed
+bool parse_listener(const string& spec, Listener& l) {
+	l = Listener();
+	l.spec = spec;
+	string rest = spec;
+	if (rest.empty()) return false;
+	if (rest.rfind("unix:", 0) == 0) {
+		l.family = AF_UNIX;
+		l.address = rest.substr(5);
+		return !l.address.empty() && l.address.size() < sizeof(sockaddr_un::sun_path);
+	}
+	if (rest.rfind("tcp:", 0) == 0) rest = rest.substr(4);
+	if (rest.empty()) return false;
+
+	size_t colon = rest.rfind(':');
+	if (rest[0] == '[') {
+		size_t close = rest.find(']');
+		if (close == string::npos || close + 1 != colon) return false;
+		l.family = AF_INET6;
+		l.address = rest.substr(1, close - 1);
+	} else if (colon == string::npos) {
+		l.address = LISTEN_DEFAULT_IP;
+		colon = (size_t)-1; // whole string is the port
+	} else {
+		l.address = rest.substr(0, colon);
+	}
+	string port = rest.substr(colon + 1);
+	if (port.empty() || port.find_first_not_of("0123456789") != string::npos) return false;
+	l.port = atoi(port.c_str());
+	return l.port > 0 && l.port < 65536;
+}
+
+// add_listener: registers a listener given with --listen
+bool add_listener(const string& spec) {
+	Listener l;
+	if (!parse_listener(spec, l)) return false;
+	listeners.push_back(l);
+	return true;
+}
+
+// listener_address: socket address of `l`, 0 if the address is invalid
+static socklen_t listener_address(const Listener& l, sockaddr_storage& addr) {
+	addr = sockaddr_storage{};
+	if (l.family == AF_UNIX) {
+		sockaddr_un* un = (sockaddr_un*)&addr;
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, l.address.c_str(), sizeof(un->sun_path) - 1);
+		return sizeof(sockaddr_un);
+	}
+	if (l.family == AF_INET6) {
+		sockaddr_in6* in6 = (sockaddr_in6*)&addr;
+		in6->sin6_family = AF_INET6;
+		in6->sin6_port = htons(l.port);
+		if (inet_pton(AF_INET6, l.address.c_str(), &in6->sin6_addr) <= 0) return 0;
+		return sizeof(sockaddr_in6);
+	}
+	sockaddr_in* in = (sockaddr_in*)&addr;
+	in->sin_family = AF_INET;
+	in->sin_port = htons(l.port);
+	if (inet_pton(AF_INET, l.address.c_str(), &in->sin_addr) <= 0) return 0;
+	return sizeof(sockaddr_in);
+}
+
+static bool open_listener(Listener& l, int backlog) {
+	sockaddr_storage addr;
+	socklen_t addr_len = listener_address(l, addr);
+	if (addr_len == 0) return false;
+	if (l.family == AF_UNIX) {
+		// stale socket of a previous run: only removed if nobody accepts on it anymore
+		struct stat st;
+		if (lstat(l.address.c_str(), &st) == 0 && S_ISSOCK(st.st_mode)) {
+			int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+			bool live = probe >= 0 && connect(probe, (sockaddr*)&addr, addr_len) == 0;
+			int probe_errno = errno;
+			if (probe >= 0) close(probe);
+			if (live || (probe_errno != ECONNREFUSED && probe_errno != ENOENT)) {
+				errno = EADDRINUSE;
+				return false;
+			}
+			unlink(l.address.c_str());
+		}
+	}
+
+	l.fd = socket(l.family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (l.fd < 0) return false;
+
+	int opt = 1;
+	if (l.family != AF_UNIX) setsockopt(l.fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+	// [::] only takes IPv6, IPv4 gets its own listener
+	if (l.family == AF_INET6) setsockopt(l.fd, IPPROTO_IPV6, IPV6_V6ONLY, &opt, sizeof(opt));
+
+	if (bind(l.fd, (sockaddr*)&addr, addr_len) < 0 || listen(l.fd, backlog) < 0) {
+		close(l.fd);
+		l.fd = -1;
+		return false;
+	}
+	return true;
+}
+
+// adopt_listener: an already listening socket inherited from the previous server
+// process (upgrade.cpp); replaces the listeners from the command line
+bool adopt_listener(const string& spec, int fd) {
+	static bool adopted = false;
+	if (!adopted) listeners.clear();
+	adopted = true;
+	Listener l;
+	if (!parse_listener(spec, l)) return false;
+	l.fd = fd;
+	listeners.push_back(l);
+	return true;
+}
+
+// open_listeners: binds all configured listeners, `default_spec` if there are none
+bool open_listeners(const string& default_spec, int backlog) {
+	if (listeners.empty() && !add_listener(default_spec)) return false;
+	for (Listener& l : listeners) {
+		if (l.fd >= 0) {
+			std::cout << "Listening On " << l.spec << " (inherited)" << endl;
+			continue;
+		}
+		if (!open_listener(l, backlog)) {
+			cerr << "Bind Failed: " << l.spec << " (" << strerror(errno) << ")" << endl;
+			return false;
+		}
+		std::cout << "Listening On " << l.spec << endl;
+	}
+	return true;
+}
+
+// close_listeners: closes all listening sockets and removes unix socket files
+// (async-signal-safe, used by the signal handler)
+void close_listeners() {
+	for (const Listener& l : listeners) {
+		if (l.fd < 0) continue;
+		close(l.fd);
+		if (l.family == AF_UNIX) unlink(l.address.c_str());
+	}
+}
+
+// peer_name: "ip:port", "[ipv6]:port" or "unix:<path>" of an accepted connection
+static string peer_name(const Listener& l, const sockaddr_storage& addr) {
+	char ip[INET6_ADDRSTRLEN] = "?";
+	if (addr.ss_family == AF_INET) {
+		const sockaddr_in* in = (const sockaddr_in*)&addr;
+		inet_ntop(AF_INET, &in->sin_addr, ip, sizeof(ip));
+		return string(ip) + ":" + to_string(ntohs(in->sin_port));
+	}
+	if (addr.ss_family == AF_INET6) {
+		const sockaddr_in6* in6 = (const sockaddr_in6*)&addr;
+		inet_ntop(AF_INET6, &in6->sin6_addr, ip, sizeof(ip));
+		return "[" + string(ip) + "]:" + to_string(ntohs(in6->sin6_port));
+	}
+	return "unix:" + l.address;
+}
+
+// accept_loop: waits on all listeners at once and hands every new connection to
+// `handler(socket, peer)`. Returns when `stop_fd` becomes readable (-1: never).
+void accept_loop(const function<void(int, const string&)>& handler, int stop_fd) {
+	vector<pollfd> fds;
+	for (const Listener& l : listeners) fds.push_back({l.fd, POLLIN, 0});
+	fds.push_back({stop_fd, POLLIN, 0}); // negative fd is ignored by poll
+	bool backing_off = false;
+
+	while (true) {
+		if (poll(fds.data(), fds.size(), -1) < 0) {
+			if (errno == EINTR) continue;
+			cerr << "poll failed: " << strerror(errno) << endl;
+			return;
+		}
+		if (fds.back().revents & POLLIN) return;
+		for (size_t i = 0; i + 1 < fds.size(); ++i) {
+			if (!(fds[i].revents & POLLIN)) continue;
+			// drain the backlog of this listener
+			while (true) {
+				sockaddr_storage addr{};
+				socklen_t addr_len = sizeof(addr);
+				int client_socket = accept4(fds[i].fd, (sockaddr*)&addr, &addr_len, SOCK_CLOEXEC);
+				if (client_socket < 0) {
+					if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR || errno == ECONNABORTED) break;
+					// out of descriptors or memory: the connection stays in the backlog and the
+					// listener readable, so pause instead of spinning on poll (stop_fd still counts)
+					if (!backing_off) cerr << "Failed To Accept Connection (" << strerror(errno) << "), pausing accepts" << endl;
+					backing_off = true;
+					if (poll(&fds.back(), 1, ACCEPT_BACKOFF_MS) > 0 && (fds.back().revents & POLLIN)) return;
+					break;
+				}
+				backing_off = false;
+				handler(client_socket, peer_name(listeners[i], addr));
+			}
+		}
+	}
+}
@@ -0,0 +1,357 @@
+// mailindex.cpp
+// In-memory mailbox index: per user a vector of mail metadata sorted by message id.
+// Because ids are k-sortable (msgid.cpp), new mails are appended at the end and the
+// index never has to be re-sorted. LIST, READ and DELETE resolve "mail #n" through
+// the same sorted index, so the numbering is identical for all three commands.
+//
+// Mailboxes are loaded lazily on first use (one directory scan) and afterwards kept
+// up to date by save_mail()/delete.
+
+#include <unordered_map>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+struct MailEntry {
+	string id;          // file name without ".txt"
+	string sender;
+	string subject;
+	string date;        // rendered for display
+	long long date_ms = 0; // 0 for old mails with a formatted Date header
+	uintmax_t size = 0;
+};
+
+struct Mailbox {
+	mutex lock;
+	bool loaded = false;
+	bool exists = false;      // user directory exists
+	int pending_changes = 0;  // file writes/deletes whose index update is still outstanding
+	vector<MailEntry> mails;  // sorted by id
+};
+
+static mutex mailboxes_mutex;
+static unordered_map<string, shared_ptr<Mailbox>> mailboxes;
+
+static bool entry_less(const MailEntry& a, const MailEntry& b) {
+	return a.id < b.id;
+}
+
+#define HEADER_READ_SIZE 4096 // headers are tiny, the body is never read here
+#define MAX_HEADER_LINES 16
+
+// parse_header_block: parses "Sender:/Subject:/Date:" lines up to "Message:"
+static void parse_header_block(const char* data, size_t len, MailEntry& entry) {
+	string_view lines[MAX_HEADER_LINES];
+	size_t body;
+	size_t n = scan_headers(data, len, lines, MAX_HEADER_LINES, body); // body is not needed (may be compressed)
+	for (size_t i = 0; i < n; ++i) {
+		string_view l = lines[i];
+		if (l.rfind("Sender: ", 0) == 0) entry.sender = string(l.substr(8));
+		else if (l.rfind("Subject: ", 0) == 0) entry.subject = string(l.substr(9));
+		else if (l.rfind("Date: ", 0) == 0) {
+			string value(l.substr(6));
+			if (!value.empty() && value.find_first_not_of("0123456789") == string::npos)
+				entry.date_ms = strtoll(value.c_str(), nullptr, 10);
+			entry.date = render_date(value);
+		}
+	}
+}
+
+// parse_mail_headers_at: headers of file `name` in the directory `dir_fd`
+static bool parse_mail_headers_at(int dir_fd, const char* name, MailEntry& entry) {
+	int fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	char buf[HEADER_READ_SIZE];
+	ssize_t n = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (n < 0) return false;
+	parse_header_block(buf, n, entry);
+	return true;
+}
+
+// parse_mail_headers: reads the headers of a mail file (stops at "Message:")
+bool parse_mail_headers(const fs::path& path, MailEntry& entry) {
+	int dir_fd = open(path.parent_path().c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) return false;
+	bool ok = parse_mail_headers_at(dir_fd, path.filename().c_str(), entry);
+	close(dir_fd);
+	entry.id = path.stem().string();
+	error_code ec;
+	entry.size = fs::file_size(path, ec);
+	return ok;
+}
+
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+#define DIRENT_BUFFER_SIZE (64 * 1024)
+
+// scan_directory: calls fn(name, d_type) for every entry of `dir_fd` except "." and "..".
+// Reads the directory in large getdents64 batches instead of one readdir per entry.
+template <typename Fn>
+static bool scan_directory(int dir_fd, Fn fn) {
+	vector<char> buf(DIRENT_BUFFER_SIZE);
+	while (true) {
+		long n = syscall(SYS_getdents64, dir_fd, buf.data(), buf.size());
+		if (n < 0) return false;
+		if (n == 0) return true;
+		for (long pos = 0; pos < n;) {
+			linux_dirent64* d = (linux_dirent64*)(buf.data() + pos);
+			pos += d->d_reclen;
+			if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0) continue;
+			fn(d->d_name, d->d_type);
+		}
+	}
+}
+
+// scan_mailbox: reads the metadata of all mails in `user_dir` (unsorted).
+// Sizes/types come from statx relative to the directory fd, headers from one small read.
+// Returns false if the directory does not exist.
+static bool scan_mailbox(const fs::path& user_dir, vector<MailEntry>& mails) {
+	TraceSpan span("scan_mailbox");
+	int dir_fd = open(user_dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) return false;
+
+	scan_directory(dir_fd, [&](const char* name, unsigned char type) {
+		size_t len = strlen(name);
+		if (len <= 4 || strcmp(name + len - 4, ".txt") != 0) return;
+		if (type != DT_REG && type != DT_UNKNOWN) return;
+
+		struct statx stx;
+		if (statx(dir_fd, name, AT_STATX_DONT_SYNC | AT_SYMLINK_NOFOLLOW, STATX_TYPE | STATX_SIZE, &stx) != 0) return;
+		if (!S_ISREG(stx.stx_mode)) return;
+
+		MailEntry entry;
+		entry.id = string(name, len - 4);
+		entry.size = stx.stx_size;
+		if (parse_mail_headers_at(dir_fd, name, entry)) mails.push_back(move(entry));
+	});
+	close(dir_fd);
+	return true;
+}
+
+static bool snapshot_load_mailbox(const string& username, vector<MailEntry>& mails); // snapshot.cpp
+static void drop_tombstoned(vector<MailEntry>& mails); // reclaim.cpp
+bool archive_list(const string& username, vector<MailEntry>& mails); // archive.cpp
+bool archive_load(const string& username, const string& id, string& content);
+
+// caller holds mb.lock
+static void load_mailbox(const string& username, Mailbox& mb) {
+	TraceSpan span("load_mailbox");
+	mb.loaded = true;
+	// unchanged since the last checkpoint -> no directory scan needed
+	if (snapshot_load_mailbox(username, mb.mails)) {
+		mb.exists = true;
+	} else {
+		mb.mails.clear();
+		mb.exists = false;
+		for (const fs::path& dir : mailbox_dirs(username)) {
+			if (scan_mailbox(dir, mb.mails)) mb.exists = true;
+		}
+		// after the directories: a mail being archived meanwhile is seen at least once
+		if (archive_list(username, mb.mails)) mb.exists = true;
+		sort(mb.mails.begin(), mb.mails.end(), entry_less);
+		// archived, but the file is not unlinked yet
+		mb.mails.erase(unique(mb.mails.begin(), mb.mails.end(),
+		                      [](const MailEntry& a, const MailEntry& b) { return a.id == b.id; }),
+		               mb.mails.end());
+	}
+	// deleted, but not reclaimed yet
+	drop_tombstoned(mb.mails);
+	for (const MailEntry& e : mb.mails) catalog_put(e.id, username);
+}
+
+// get_mailbox: index of `username`, loaded from disk on first access
+shared_ptr<Mailbox> get_mailbox(const string& username) {
+	shared_ptr<Mailbox> mb;
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		shared_ptr<Mailbox>& slot = mailboxes[username];
+		if (!slot) slot = make_shared<Mailbox>();
+		mb = slot;
+	}
+	lock_guard<mutex> lock(mb->lock);
+	if (!mb->loaded) load_mailbox(username, *mb);
+	return mb;
+}
+
+// with_mailbox_locked: runs fn while holding the lock of `username`'s index (loaded or not)
+static void with_mailbox_locked(const string& username, const function<void()>& fn) {
+	shared_ptr<Mailbox> mb;
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		shared_ptr<Mailbox>& slot = mailboxes[username];
+		if (!slot) slot = make_shared<Mailbox>();
+		mb = slot;
+	}
+	lock_guard<mutex> lock(mb->lock);
+	fn();
+}
+
+// begin_change/end_change: bracket a file write or delete and the matching index
+// update, snapshots skip mailboxes with changes in flight
+shared_ptr<Mailbox> begin_change(const string& username) {
+	shared_ptr<Mailbox> mb;
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		shared_ptr<Mailbox>& slot = mailboxes[username];
+		if (!slot) slot = make_shared<Mailbox>();
+		mb = slot;
+	}
+	lock_guard<mutex> lock(mb->lock);
+	mb->pending_changes++;
+	return mb;
+}
+void end_change(const shared_ptr<Mailbox>& mb) {
+	lock_guard<mutex> lock(mb->lock);
+	mb->pending_changes--;
+}
+
+// mailbox_change_hook: told about every saved ('A') and deleted ('D') mail. Set while
+// a restarting server hands over to its successor, which has its own indexes (upgrade.cpp).
+static atomic<void (*)(char op, const string& username, const string& id)> mailbox_change_hook(nullptr);
+// mailbox_notify_hook: the same for IDLE clients of the mailbox (idle.cpp)
+static atomic<void (*)(char op, const string& username, const string& id)> mailbox_notify_hook(nullptr);
+
+static void mailbox_changed(char op, const string& username, const string& id) {
+	auto hook = mailbox_change_hook.load();
+	if (hook) hook(op, username, id);
+	auto notify = mailbox_notify_hook.load();
+	if (notify) notify(op, username, id);
+}
+
+// index_reload: drops the index of `username`, the next access rescans the mailbox
+void index_reload(const string& username) {
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		mailboxes.erase(username);
+	}
+	get_mailbox(username);
+}
+
+// index_add: registers a newly saved mail. New ids are the largest ones -> append.
+void index_add(const string& username, const MailEntry& entry) {
+	catalog_put(entry.id, username);
+	mailbox_changed('A', username, entry.id);
+
+	shared_ptr<Mailbox> mb;
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		auto it = mailboxes.find(username);
+		if (it == mailboxes.end()) return; // not loaded yet, will be scanned on first use
+		mb = it->second;
+	}
+	lock_guard<mutex> lock(mb->lock);
+	if (!mb->loaded) return;
+	mb->exists = true;
+	if (mb->mails.empty() || mb->mails.back().id < entry.id) {
+		mb->mails.push_back(entry);
+		return;
+	}
+	// ids from another thread of the same millisecond may arrive out of order,
+	// a scan running concurrently with the write may already have picked it up
+	auto it = lower_bound(mb->mails.begin(), mb->mails.end(), entry, entry_less);
+	if (it != mb->mails.end() && it->id == entry.id) return;
+	mb->mails.insert(it, entry);
+}
+
+// index_remove: forgets a deleted mail
+void index_remove(const string& username, const string& id) {
+	catalog_erase(id);
+
+	shared_ptr<Mailbox> mb = get_mailbox(username);
+	lock_guard<mutex> lock(mb->lock);
+	MailEntry key;
+	key.id = id;
+	auto it = lower_bound(mb->mails.begin(), mb->mails.end(), key, entry_less);
+	if (it != mb->mails.end() && it->id == id) mb->mails.erase(it);
+}
+
+// mailbox_entry: mail #index (1-based) of `username`.
+// Returns 1 on success, 0 if the index is out of range, -1 if the mailbox does not exist.
+int mailbox_entry(const string& username, int index, MailEntry& entry) {
+	shared_ptr<Mailbox> mb = get_mailbox(username);
+	lock_guard<mutex> lock(mb->lock);
+	if (!mb->exists) return -1;
+	if (index < 1 || index > (int)mb->mails.size()) return 0;
+	entry = mb->mails[index - 1];
+	return 1;
+}
+
+// catalog_complete: every mailbox of the spool is loaded (set by the warm-up, warmup.cpp),
+// a catalog miss then means the id does not exist
+static atomic<bool> catalog_complete(false);
+
+// valid_message_id: "<13 digit epoch ms>_<suffix>", the suffix is 16 hex digits (msgid.cpp)
+// or a uuid for older mails. Ids stamped more than MSGID_FUTURE_SLACK_MS ahead are rejected.
+static bool valid_message_id(const string& id) {
+	if (id.size() < 15 || id.size() > 64 || id[13] != '_') return false;
+	long long ms = 0;
+	for (size_t i = 0; i < 13; ++i) {
+		if (id[i] < '0' || id[i] > '9') return false;
+		ms = ms * 10 + (id[i] - '0');
+	}
+	for (size_t i = 14; i < id.size(); ++i) {
+		if (!isxdigit((unsigned char)id[i]) && id[i] != '-') return false;
+	}
+	return ms <= epoch_ms_now() + MSGID_FUTURE_SLACK_MS;
+}
+
+// find_message: mailbox holding message `id`. The catalog knows every loaded mailbox;
+// on a miss only the mailbox of `owner` (the requesting user) is loaded, never the
+// whole spool. Callers reject ids outside `owner`'s mailbox anyway.
+bool find_message(const string& id, const string& owner, string& mailbox) {
+	if (!valid_message_id(id)) return false;
+	if (catalog_get(id, mailbox)) return true;
+	if (catalog_complete || owner.empty()) return false;
+	get_mailbox(owner);
+	return catalog_get(id, mailbox);
+}
+
+// load_mail_by_id: reads mail `id` of `username`. Looks the path up a second time
+// if the layout migrator moved the file between resolving and opening it, then
+// in the archive segments (archive.cpp).
+bool load_mail_by_id(const string& username, const string& id, string& content) {
+	TraceSpan span("load_mail");
+	return load_mail(mail_path(username, id), content) || load_mail(mail_path(username, id), content) ||
+	       archive_load(username, id, content);
+}
+
+// render_list: LIST response for `username`
+string render_list(const string& username) {
+	TraceSpan span("render_list");
+	shared_ptr<Mailbox> mb = get_mailbox(username);
+	lock_guard<mutex> lock(mb->lock);
+	if (!mb->exists) return string(ERR) + "User directory not found";
+	if (mb->mails.empty()) return "No messages available";
+
+	string result = to_string(mb->mails.size()) + "\n";
+	for (size_t i = 0; i < mb->mails.size(); ++i) {
+		const MailEntry& e = mb->mails[i];
+		result += "[" + to_string(i + 1) + "] " + e.sender + "|" + e.subject + "|" + e.date + "|" + e.id + "\n";
+	}
+	return result;
+}
+
+// render_mail_dates: replaces an epoch-milliseconds "Date:" header with the display format
+string render_mail_dates(const string& content) {
+	string_view lines[MAX_HEADER_LINES];
+	size_t body;
+	size_t n = scan_headers(content.data(), content.size(), lines, MAX_HEADER_LINES, body);
+	for (size_t i = 0; i < n; ++i) {
+		if (lines[i].rfind("Date: ", 0) != 0) continue;
+		size_t value = lines[i].data() - content.data() + 6;
+		size_t end = lines[i].data() - content.data() + lines[i].size();
+		return content.substr(0, value) + render_date(content.substr(value, end - value)) + content.substr(end);
+	}
+	return content;
+}
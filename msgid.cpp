@@ -0,0 +1,114 @@
+// msgid.cpp
+// Lock-free, k-sortable message ids and a cached date formatter.
+//
+// Id layout (128 bit): 64 bit epoch milliseconds | 16 bit worker (thread) |
+// 16 bit process salt | 32 bit sequence, rendered as "<13 digit ms>_<16 hex>".
+// The decimal millisecond prefix keeps new ids sortable together with the
+// older "<ms>_<uuid>" file names. Each thread owns its own generator state, so
+// ids are strictly increasing per thread without any locking and ordered by
+// time across threads. Worker numbers are unique among live threads: when a
+// thread ends, its worker (with its last timestamp and sequence) is handed to
+// the next new thread, so one thread per connection never runs out of them.
+
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <ctime>
+#include <mutex>
+#include <vector>
+
+#define MSGID_LENGTH 30 // 13 digits + '_' + 16 hex
+#define MSGID_FUTURE_SLACK_MS (3600LL * 1000) // clock skew accepted on ids from other servers
+
+struct MessageIdState {
+	long long last_ms = 0;
+	uint32_t sequence = 0;
+	uint16_t worker = 0;
+};
+
+static mutex msgid_workers_mutex;
+static uint16_t msgid_next_worker = 0;
+static vector<MessageIdState> msgid_free_workers; // workers of ended threads
+static const uint16_t msgid_salt = (uint16_t)random_device()();
+
+// MessageIdGenerator: per-thread state, the worker is returned when the thread ends
+// (0xfffe is never handed out, bulkio.cpp uses it for imports)
+struct MessageIdGenerator : MessageIdState {
+	MessageIdGenerator() {
+		lock_guard<mutex> lock(msgid_workers_mutex);
+		if (!msgid_free_workers.empty()) {
+			// continue after the previous owner's last id
+			*(MessageIdState*)this = msgid_free_workers.back();
+			msgid_free_workers.pop_back();
+		} else {
+			worker = msgid_next_worker++;
+		}
+	}
+	~MessageIdGenerator() {
+		lock_guard<mutex> lock(msgid_workers_mutex);
+		msgid_free_workers.push_back(*this);
+	}
+};
+
+static long long epoch_ms_now() {
+	return chrono::duration_cast<chrono::milliseconds>(
+		chrono::system_clock::now().time_since_epoch()).count();
+}
+
+string format_message_id(long long ms, uint64_t suffix);
+
+// generate_message_id: new id, `ms` is set to the timestamp encoded in it
+string generate_message_id(long long& ms) {
+	thread_local MessageIdGenerator gen;
+
+	ms = epoch_ms_now();
+	if (ms <= gen.last_ms) {
+		// same millisecond (or clock went backwards) -> stay monotonic
+		ms = gen.last_ms;
+		if (++gen.sequence == 0) ms = ++gen.last_ms; // sequence exhausted
+	} else {
+		gen.last_ms = ms;
+		gen.sequence = 0;
+	}
+
+	return format_message_id(ms, ((uint64_t)gen.worker << 48) | ((uint64_t)msgid_salt << 32) | gen.sequence);
+}
+
+// format_message_id: "<13 digit ms>_<16 hex suffix>"
+string format_message_id(long long ms, uint64_t suffix) {
+	char buf[MSGID_LENGTH];
+	long long t = ms;
+	for (int i = 12; i >= 0; --i) {
+		buf[i] = (char)('0' + t % 10);
+		t /= 10;
+	}
+	buf[13] = '_';
+	static const char hex[] = "0123456789abcdef";
+	for (int i = 0; i < 16; ++i) {
+		buf[14 + i] = hex[(suffix >> (60 - 4 * i)) & 0xf];
+	}
+	return string(buf, MSGID_LENGTH);
+}
+
+// format_date_ms: epoch milliseconds -> "dd.mm.yyyy HH:MM:SS" (local time).
+// Thread-safe (localtime_r), the last formatted second is cached per thread.
+string format_date_ms(long long ms) {
+	thread_local time_t cached_sec = -1;
+	thread_local char cached[32];
+
+	time_t sec = (time_t)(ms / 1000);
+	if (sec != cached_sec) {
+		tm local_tm;
+		localtime_r(&sec, &local_tm);
+		strftime(cached, sizeof(cached), "%d.%m.%Y %H:%M:%S", &local_tm);
+		cached_sec = sec;
+	}
+	return string(cached);
+}
+
+// render_date: value of a "Date:" header for display. New mails store epoch
+// milliseconds, older ones already contain the formatted date.
+string render_date(const string& value) {
+	if (value.empty() || value.find_first_not_of("0123456789") != string::npos) return value;
+	return format_date_ms(strtoll(value.c_str(), nullptr, 10));
+}
@@ -0,0 +1,171 @@
+// parser.cpp
+// Non-allocating request parser for the TwMailer protocol.
+// A request "CMD|field|field|..." is tokenized in a single pass into string_views
+// pointing into the receive buffer, the command is resolved through a constexpr
+// perfect-hash table (case-insensitive). Nothing here touches the heap.
+// The '|' separators are found with memchr (vectorized in glibc already).
+
+#include <string_view>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+
+#define MAX_FIELDS 4
+#define OPCODE_TABLE_SIZE 32
+#define OPCODE_SEED 84
+
+enum class Opcode : uint8_t {
+    NONE,
+    SEND,
+    READ,
+    LIST,
+    DELETE,
+    STATS,
+    READID,
+    DELID,
+    TRACE,
+    IDLE,
+    DONE,
+    ATTACH,
+    APUT,
+    AGET,
+    SENDATT,
+    QUIT,
+    EXIT,
+};
+
+struct OpcodeName {
+    std::string_view name;
+    Opcode op;
+};
+
+constexpr OpcodeName OPCODE_NAMES[] = {
+    {"SEND", Opcode::SEND},
+    {"READ", Opcode::READ},
+    {"LIST", Opcode::LIST},
+    {"DELETE", Opcode::DELETE},
+    {"STATS", Opcode::STATS},
+    {"READID", Opcode::READID},
+    {"DELID", Opcode::DELID},
+    {"TRACE", Opcode::TRACE},
+    {"IDLE", Opcode::IDLE},
+    {"DONE", Opcode::DONE},
+    {"ATTACH", Opcode::ATTACH},
+    {"APUT", Opcode::APUT},
+    {"AGET", Opcode::AGET},
+    {"SENDATT", Opcode::SENDATT},
+    {"QUIT", Opcode::QUIT},
+    {"EXIT", Opcode::EXIT},
+};
+
+struct Request {
+    Opcode op = Opcode::NONE;
+    std::string_view command;            // opcode token as sent
+    std::string_view args;               // everything after "CMD|"
+    std::string_view fields[MAX_FIELDS]; // '|' separated args, the last one holds the rest
+    size_t field_count = 0;
+};
+
+constexpr char fold_case(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c | 0x20) : c;
+}
+
+// opcode_hash: case-insensitive hash over length, first, middle and last character
+constexpr uint32_t opcode_hash(std::string_view s) {
+    if (s.empty()) return 0;
+    uint32_t h = (uint32_t)s.size() * OPCODE_SEED;
+    h = h * 31 + (uint8_t)fold_case(s[0]);
+    h = h * 31 + (uint8_t)fold_case(s[s.size() / 2]);
+    h = h * 31 + (uint8_t)fold_case(s[s.size() - 1]);
+    return (h ^ (h >> 5)) & (OPCODE_TABLE_SIZE - 1);
+}
+
+struct OpcodeTable {
+    OpcodeName slots[OPCODE_TABLE_SIZE] = {};
+    bool collision = false;
+};
+
+constexpr OpcodeTable build_opcode_table() {
+    OpcodeTable table;
+    for (const OpcodeName& entry : OPCODE_NAMES) {
+        OpcodeName& slot = table.slots[opcode_hash(entry.name)];
+        if (slot.op != Opcode::NONE) table.collision = true;
+        slot = entry;
+    }
+    return table;
+}
+
+constexpr OpcodeTable OPCODE_TABLE = build_opcode_table();
+static_assert(!OPCODE_TABLE.collision, "opcode hash collision - change OPCODE_SEED or OPCODE_TABLE_SIZE");
+
+constexpr bool equals_ignore_case(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (fold_case(a[i]) != fold_case(b[i])) return false;
+    }
+    return true;
+}
+
+constexpr Opcode lookup_opcode(std::string_view command) {
+    const OpcodeName& slot = OPCODE_TABLE.slots[opcode_hash(command)];
+    return (slot.op != Opcode::NONE && equals_ignore_case(slot.name, command)) ? slot.op : Opcode::NONE;
+}
+
+// parse_request: tokenizes `len` bytes of `buffer` into `req`.
+// Returns false if the command is unknown.
+bool parse_request(const char* buffer, size_t len, Request& req) {
+    req = Request();
+    const char* end = buffer + len;
+    const char* pipe = (const char*)memchr(buffer, '|', len);
+
+    req.command = std::string_view(buffer, (pipe ? pipe : end) - buffer);
+    req.op = lookup_opcode(req.command);
+    if (!pipe) return req.op != Opcode::NONE;
+
+    const char* pos = pipe + 1;
+    req.args = std::string_view(pos, end - pos);
+    while (req.field_count < MAX_FIELDS - 1) {
+        const char* next = (const char*)memchr(pos, '|', end - pos);
+        if (!next) break;
+        req.fields[req.field_count++] = std::string_view(pos, next - pos);
+        pos = next + 1;
+    }
+    req.fields[req.field_count++] = std::string_view(pos, end - pos);
+
+    return req.op != Opcode::NONE;
+}
+
+// scan_headers: splits the header block of a stored mail into lines (without '\n')
+// up to the "Message:" line. `body` is set to the offset of the body, or `len` if
+// the block has no "Message:" line. Returns the number of lines stored in `lines`.
+size_t scan_headers(const char* data, size_t len, std::string_view* lines, size_t max_lines, size_t& body) {
+    size_t n = 0;
+    const char* end = data + len;
+    const char* line = data;
+    body = len;
+    while (line < end) {
+        const char* nl = (const char*)memchr(line, '\n', end - line);
+        std::string_view l(line, (nl ? nl : end) - line);
+        if (l.size() >= 8 && memcmp(l.data(), "Message:", 8) == 0) {
+            body = nl ? nl + 1 - data : len;
+            break;
+        }
+        if (n < max_lines) lines[n++] = l;
+        if (!nl) break;
+        line = nl + 1;
+    }
+    return n;
+}
+
+// field_rest: field `i` up to the end of the request (keeps embedded '|')
+std::string_view field_rest(const Request& req, size_t i) {
+    if (i >= req.field_count) return std::string_view();
+    return std::string_view(req.fields[i].data(), req.args.data() + req.args.size() - req.fields[i].data());
+}
+
+// parse_index: decimal number without allocating (replaces stoi)
+bool parse_index(std::string_view s, int& out) {
+    while (!s.empty() && (s.back() == '\n' || s.back() == '\r' || s.back() == ' ')) s.remove_suffix(1);
+    auto result = std::from_chars(s.data(), s.data() + s.size(), out);
+    return result.ec == std::errc() && result.ptr == s.data() + s.size();
+}
@@ -0,0 +1,182 @@
+// perfcount.cpp
+// Hardware counters per command type (--perf-counters). Every connection thread opens
+// one perf_event counter group for itself (cycles, instructions, cache references/
+// misses, context switches, task clock), handle_commands() reads the group before and
+// after each command and adds the delta to the totals of the command's opcode.
+// STATS reports per command: count, cycles and instructions per command, IPC, cache
+// miss rate, misses per 1000 instructions, context switches and CPU time per command.
+//
+// Kernel time is counted if perf_event_paranoid allows it, otherwise user space only
+// (shown as "user-only"). Events the CPU/VM does not offer are left out (no PMU in a
+// VM: software counters only); if nothing can be opened, STATS says why and commands
+// run without counters.
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+
+enum PerfEvent { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_CACHE_REFS, PERF_CACHE_MISSES, PERF_CTX_SWITCHES, PERF_TASK_CLOCK, PERF_EVENT_COUNT };
+
+static const struct {
+	uint32_t type;
+	uint64_t config;
+} PERF_EVENT_CONFIG[PERF_EVENT_COUNT] = {
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_REFERENCES},
+	{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+	{PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+};
+
+#define PERF_OPCODES ((size_t)Opcode::EXIT + 1)
+
+struct PerfTotals {
+	atomic<unsigned long> commands{0};
+	atomic<uint64_t> value[PERF_EVENT_COUNT] = {};
+};
+
+static bool PERF_ENABLED = false;
+static atomic<bool> perf_unavailable(false);
+static atomic<bool> perf_user_only(false);
+static atomic<unsigned> perf_available(0); // bit per PerfEvent opened by any thread
+static mutex perf_error_mutex;
+static string perf_error;
+static PerfTotals perf_totals[PERF_OPCODES];
+
+// set_perf_counters: count cycles/instructions/cache misses per command type
+void set_perf_counters(bool enabled) {
+	PERF_ENABLED = enabled;
+}
+
+static int perf_open(PerfEvent e, int group_fd, bool exclude_kernel) {
+	perf_event_attr attr{};
+	attr.size = sizeof(attr);
+	attr.type = PERF_EVENT_CONFIG[e].type;
+	attr.config = PERF_EVENT_CONFIG[e].config;
+	attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	attr.exclude_kernel = exclude_kernel;
+	attr.exclude_hv = 1;
+	attr.disabled = group_fd < 0; // the leader starts the whole group
+	return (int)syscall(SYS_perf_event_open, &attr, 0 /* this thread */, -1, group_fd, PERF_FLAG_FD_CLOEXEC);
+}
+
+// counter group of one thread, opened on the first command
+struct PerfGroup {
+	bool tried = false;
+	int leader = -1;
+	vector<int> fds;                  // in group read order
+	vector<PerfEvent> events;         // event of fds[i]
+
+	bool open() {
+		tried = true;
+		if (perf_unavailable) return false;
+		bool exclude_kernel = perf_user_only;
+		// cycles lead the group, without a PMU (VM) the task clock does
+		for (PerfEvent e : {PERF_CYCLES, PERF_TASK_CLOCK}) {
+			leader = perf_open(e, -1, exclude_kernel);
+			if (leader < 0 && errno == EACCES && !exclude_kernel) {
+				// perf_event_paranoid >= 2: own user-space events only
+				exclude_kernel = true;
+				leader = perf_open(e, -1, exclude_kernel);
+				if (leader >= 0) perf_user_only = true;
+			}
+			if (leader >= 0) {
+				fds.push_back(leader);
+				events.push_back(e);
+				break;
+			}
+		}
+		if (leader < 0) {
+			lock_guard<mutex> lock(perf_error_mutex);
+			if (!perf_unavailable.exchange(true)) {
+				perf_error = string("perf_event_open: ") + strerror(errno);
+				cerr << "perf: counters unavailable (" << perf_error << "), commands run without them\n";
+			}
+			return false;
+		}
+		for (int e = 0; e < PERF_EVENT_COUNT; ++e) {
+			if (e == events[0]) continue;
+			int fd = perf_open((PerfEvent)e, leader, exclude_kernel);
+			if (fd < 0) continue; // not offered here (VM, CPU)
+			fds.push_back(fd);
+			events.push_back((PerfEvent)e);
+		}
+		for (PerfEvent e : events) perf_available |= 1u << e;
+		ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+		return true;
+	}
+
+	// read: current values (scaled up if the group was multiplexed), false if unavailable
+	bool read(uint64_t out[PERF_EVENT_COUNT]) {
+		if (!tried) open();
+		if (leader < 0) return false;
+		uint64_t buf[3 + PERF_EVENT_COUNT];
+		if (::read(leader, buf, sizeof(buf)) < (ssize_t)((3 + fds.size()) * sizeof(uint64_t))) return false;
+		uint64_t enabled = buf[1], running = buf[2];
+		for (int e = 0; e < PERF_EVENT_COUNT; ++e) out[e] = 0;
+		for (size_t i = 0; i < events.size(); ++i) {
+			uint64_t v = buf[3 + i];
+			out[events[i]] = (running && running < enabled) ? (uint64_t)((double)v * enabled / running) : v;
+		}
+		return true;
+	}
+
+	~PerfGroup() {
+		for (int fd : fds) close(fd);
+	}
+};
+
+static thread_local PerfGroup perf_group;
+
+// PerfScope: attributes the counter deltas between construction and destruction to `op`
+class PerfScope {
+public:
+	explicit PerfScope(Opcode op) : op(op) {
+		active = PERF_ENABLED && (size_t)op < PERF_OPCODES && perf_group.read(start);
+	}
+	~PerfScope() {
+		uint64_t end[PERF_EVENT_COUNT];
+		if (!active || !perf_group.read(end)) return;
+		PerfTotals& t = perf_totals[(size_t)op];
+		t.commands.fetch_add(1, memory_order_relaxed);
+		for (int e = 0; e < PERF_EVENT_COUNT; ++e) t.value[e].fetch_add(end[e] - start[e], memory_order_relaxed);
+	}
+	PerfScope(const PerfScope&) = delete;
+	PerfScope& operator=(const PerfScope&) = delete;
+
+private:
+	Opcode op;
+	bool active;
+	uint64_t start[PERF_EVENT_COUNT];
+};
+
+string perf_stats() {
+	ostringstream oss;
+	if (!PERF_ENABLED) return "perf: off\n";
+	if (perf_unavailable) {
+		lock_guard<mutex> lock(perf_error_mutex);
+		return "perf: unavailable (" + perf_error + ")\n";
+	}
+	oss << fixed << setprecision(2);
+	unsigned available = perf_available;
+	auto has = [&](PerfEvent e) { return (available >> e) & 1; };
+	oss << "perf: counters=" << (perf_user_only ? "user-only" : "user+kernel")
+	    << (has(PERF_CYCLES) ? "" : " (no hardware counters)") << "\n";
+	for (const OpcodeName& entry : OPCODE_NAMES) {
+		const PerfTotals& t = perf_totals[(size_t)entry.op];
+		unsigned long n = t.commands;
+		if (n == 0) continue;
+		double cycles = t.value[PERF_CYCLES], instructions = t.value[PERF_INSTRUCTIONS];
+		double refs = t.value[PERF_CACHE_REFS], misses = t.value[PERF_CACHE_MISSES];
+		oss << "perf: " << entry.name << " n=" << n;
+		if (has(PERF_CYCLES)) oss << " cycles/cmd=" << (uint64_t)(cycles / n);
+		if (has(PERF_INSTRUCTIONS)) oss << " instructions/cmd=" << (uint64_t)(instructions / n);
+		if (has(PERF_CYCLES) && has(PERF_INSTRUCTIONS)) oss << " ipc=" << (cycles ? instructions / cycles : 0.0);
+		if (has(PERF_CACHE_REFS) && has(PERF_CACHE_MISSES)) oss << " cache_miss_rate=" << (refs ? 100.0 * misses / refs : 0.0) << "%";
+		if (has(PERF_INSTRUCTIONS) && has(PERF_CACHE_MISSES)) oss << " mpki=" << (instructions ? 1000.0 * misses / instructions : 0.0);
+		if (has(PERF_CTX_SWITCHES)) oss << " ctx_switches/cmd=" << (double)t.value[PERF_CTX_SWITCHES] / n;
+		if (has(PERF_TASK_CLOCK)) oss << " cpu_us/cmd=" << (double)t.value[PERF_TASK_CLOCK] / n / 1000;
+		oss << "\n";
+	}
+	return oss.str();
+}
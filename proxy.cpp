@@ -0,0 +1,437 @@
+// proxy.cpp
+// twmail-proxy: routing front-end for a TwMailer installation sharded over several
+// server processes/machines. It speaks the client protocol, authenticates the user
+// once (LDAP) and forwards the session to the backend that owns the mailbox
+// according to the consistent-hash ring (ring.cpp). Backends never see a password:
+// the proxy logs in with "RESUME|<token>" (session.cpp), signed with the session
+// secret that proxy and backends share (<dir>/.session/secret, copy it to every
+// backend spool).
+//
+// Usage:
+//   twmail-proxy [port] [ring-file] [secret-dir] [--listen=<spec>] [--vnodes=N]
+//   twmail-proxy plan <old-ring-file> <new-ring-file> < usernames
+//
+// Routing:
+//   SEND                          recipients grouped by owner, one SEND per backend,
+//                                 OK if every backend accepted its part, otherwise
+//                                 ERR naming the delivered and the failed recipients
+//   READ, DELETE                  owner of the mailbox named in the request
+//   LIST, READID, DELID, STATS    backend of the logged-in user
+//
+// SIGHUP reloads the ring file, open sessions use the new owners from their next
+// command on. "plan" lists the mailboxes that change owner between two ring files
+// (the ones to copy before switching).
+//
+// Proxy and backend always talk framed ("#<length>|", bufpool.cpp), whatever the client uses.
+
+#include <iostream>
+#include <cstring>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <signal.h>
+#include <thread>
+#include <fcntl.h>
+#include <map>
+
+#include "serverfunctions.cpp"
+#include "bufpool.cpp"
+#include "listeners.cpp"
+#include "ring.cpp"
+
+#define PROXY_PORT 8080
+#define PROXY_IP "127.0.0.1"
+#define RING_FILE "./ring.conf"
+#define SECRET_DIR "./mailspool"
+#define BUFFER_SIZE 1024
+#define BACKLOG 10
+#define connected_msg "connected"
+#define RESUME_PREFIX "RESUME|"
+
+static string ring_file = RING_FILE;
+static mutex ring_mutex;
+static shared_ptr<const Ring> ring;
+static int reload_pipe[2] = {-1, -1}; // SIGHUP -> reload thread
+static atomic<long> proxy_sessions(0);
+static atomic<long> proxy_backend_connections(0);
+static atomic<unsigned long> proxy_cross_shard_sends(0);
+
+// Backend-Verbindungen einer Client-Session (Knotenname -> eingeloggter Socket)
+struct ProxySession {
+    string username;
+    map<string, int> backends;
+    ConnMemory memory;
+};
+
+int sendall(int socket, const char *buffer, size_t length) {
+    size_t total_sent = 0;
+    while (total_sent < length) {
+        ssize_t bytes_sent = send(socket, buffer + total_sent, length - total_sent, MSG_NOSIGNAL);
+        if (bytes_sent == -1) return -1;
+        total_sent += bytes_sent;
+    }
+    return total_sent;
+}
+
+static shared_ptr<const Ring> current_ring() {
+    lock_guard<mutex> lock(ring_mutex);
+    return ring;
+}
+
+static bool reload_ring() {
+    auto next = make_shared<Ring>();
+    string err;
+    if (!load_ring(ring_file, *next, err)) {
+        cerr << "proxy: " << err << endl;
+        return false;
+    }
+    lock_guard<mutex> lock(ring_mutex);
+    ring = next;
+    cout << "proxy: ring with " << next->nodes.size() << " nodes, " << next->points.size() << " points" << endl;
+    return true;
+}
+
+// recv_reply: one short handshake message (backends answer with a single send)
+static bool recv_reply(int fd, string& reply) {
+    char buffer[256];
+    ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+    if (n <= 0) return false;
+    reply.assign(buffer, n);
+    return true;
+}
+
+// connect_backend: connects to `node` and logs in as `username` with a fresh token
+static int connect_backend(const RingNode& node, const string& username) {
+    sockaddr_storage addr;
+    socklen_t addr_len = listener_address(node.address, addr);
+    int fd = addr_len ? socket(node.address.family, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+    if (fd < 0) return -1;
+
+    string token = issue_session_token(username);
+    string reply;
+    string resume = RESUME_PREFIX + token;
+    bool ok = !token.empty() && connect(fd, (sockaddr*)&addr, addr_len) == 0 &&
+              sendall(fd, connected_msg, strlen(connected_msg)) != -1 && recv_reply(fd, reply) && reply == ACK &&
+              sendall(fd, resume.c_str(), resume.size()) != -1 && recv_reply(fd, reply) && reply.rfind(ACK, 0) == 0;
+    if (!ok) {
+        cerr << "proxy: login of '" << username << "' at backend " << node.name << " (" << node.address.spec << ") failed" << endl;
+        close(fd);
+        return -1;
+    }
+    proxy_backend_connections++;
+    return fd;
+}
+
+static void drop_backend(ProxySession& s, const string& name) {
+    auto it = s.backends.find(name);
+    if (it == s.backends.end()) return;
+    close(it->second);
+    s.backends.erase(it);
+    proxy_backend_connections--;
+}
+
+// discard_pending: drops stray bytes between two replies (there should be none, they
+// would break the framing), false if the backend closed the connection
+static bool discard_pending(int fd) {
+    char buffer[256];
+    ssize_t n;
+    while ((n = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT)) > 0) {}
+    return n != 0;
+}
+
+// recv_framed: one framed reply "#<length>|<bytes>", exactly `length` bytes go to `reply`.
+// No size limit here: the backend already bounded what it sends (LIST, READ of a big mail).
+static bool recv_framed(int fd, string& reply) {
+    char head[FRAME_HEADER_MAX];
+    size_t got = 0, body = 0;
+    long h = 0;
+    while (h == 0) {
+        ssize_t n = recv(fd, head + got, 1, 0); // header byte by byte, the body follows directly
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0 || head[0] != FRAME_MARK) return false;
+        h = frame_header(head, ++got, body);
+    }
+    if (h < 0) return false;
+
+    reply.resize(body);
+    size_t done = 0;
+    while (done < body) {
+        ssize_t n = recv(fd, &reply[done], body - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+// forward: sends `request` framed to the backend `node` of the session and receives the
+// framed reply, so large replies are never cut at a pause (RECV_MORE_TIMEOUT_MS).
+// A broken connection is dropped and opened again by the next command.
+static bool forward(ProxySession& s, const RingNode& node, string_view request, string& reply) {
+    auto it = s.backends.find(node.name);
+    if (it != s.backends.end() && !discard_pending(it->second)) {
+        drop_backend(s, node.name);
+        it = s.backends.end();
+    }
+    if (it == s.backends.end()) {
+        int fd = connect_backend(node, s.username);
+        if (fd < 0) return false;
+        it = s.backends.emplace(node.name, fd).first;
+    }
+
+    string framed = frame_text(string(request), true);
+    if (sendall(it->second, framed.c_str(), framed.size()) == -1 || !recv_framed(it->second, reply)) {
+        cerr << "proxy: backend " << node.name << " failed for '" << s.username << "'" << endl;
+        drop_backend(s, node.name);
+        return false;
+    }
+    return true;
+}
+
+// route_send: one SEND per owning backend, the recipient list is split accordingly.
+// The backends commit independently, so a partial failure is reported per shard
+// ("ERR" + delivered/failed recipients): the client must only resend to the failed
+// ones, a blind retry of the whole SEND would deliver twice.
+static string route_send(ProxySession& s, const Ring& r, const Request& req, string_view raw) {
+    if (req.field_count < 3) return ERR; // recipient|subject|message
+
+    vector<pair<const RingNode*, string>> parts; // backend, its recipients
+    for (const string& recipient : split_recipients(req.fields[0])) {
+        const RingNode* owner = &ring_owner(r, recipient);
+        auto part = find_if(parts.begin(), parts.end(), [&](const auto& p) { return p.first == owner; });
+        if (part == parts.end()) part = parts.insert(parts.end(), {owner, ""});
+        part->second += (part->second.empty() ? "" : ",") + recipient;
+    }
+    if (parts.empty()) parts.emplace_back(&ring_owner(r, s.username), string(req.fields[0]));
+    if (parts.size() > 1) proxy_cross_shard_sends++;
+
+    string delivered, failed;
+    for (const auto& part : parts) {
+        string request = string(req.command) + "|" + part.second + "|" + string(req.fields[1]) + "|" + string(field_rest(req, 2));
+        string reply;
+        bool ok = forward(s, *part.first, parts.size() == 1 ? raw : request, reply);
+        if (parts.size() == 1) return ok ? reply : ERR; // single shard: the backend's own answer
+        if (!ok || reply.rfind(ACK, 0) != 0) {
+            cerr << "proxy: SEND to " << part.second << " on " << part.first->name << " failed" << endl;
+            failed += (failed.empty() ? "" : ",") + part.second;
+        } else {
+            delivered += (delivered.empty() ? "" : ",") + part.second;
+        }
+    }
+    if (failed.empty()) return ACK;
+    if (delivered.empty()) return ERR;
+    return string(ERR) + "Partial delivery - delivered to " + delivered + ", not delivered to " + failed;
+}
+
+static string proxy_stats(const Ring& r, const string& username) {
+    ostringstream oss;
+    oss << "proxy: nodes=" << r.nodes.size() << " points=" << r.points.size() << " sessions=" << proxy_sessions
+        << " backend_connections=" << proxy_backend_connections << " cross_shard_sends=" << proxy_cross_shard_sends
+        << " home=" << ring_owner(r, username).name << "\n";
+    return oss.str();
+}
+
+// route: forwards one client request, returns the reply for the client
+static string route(ProxySession& s, const char* data, size_t len) {
+    shared_ptr<const Ring> r = current_ring();
+    string_view raw(data, len);
+    Request req;
+    parse_request(data, len, req);
+
+    if (req.op == Opcode::SEND) return route_send(s, *r, req, raw);
+    // replies are read one per request, pushed notifications would get lost
+    if (req.op == Opcode::IDLE) return string(ERR) + "IDLE is not supported through the proxy";
+    // uploads and attachments live on the sender's backend, SENDATT cannot be split per shard
+    if (req.op == Opcode::SENDATT && req.field_count >= 4) {
+        const string& home = ring_owner(*r, s.username).name;
+        for (const string& recipient : split_recipients(req.fields[0])) {
+            if (ring_owner(*r, recipient).name != home) return ERR;
+        }
+    }
+
+    // READ/DELETE name the mailbox, everything else works on the own one
+    const RingNode* node = &ring_owner(*r, s.username);
+    if ((req.op == Opcode::READ || req.op == Opcode::DELETE) && req.field_count == 2) {
+        node = &ring_owner(*r, string(req.fields[0]));
+    }
+    string reply;
+    if (!forward(s, *node, raw, reply)) return ERR;
+    if (req.op == Opcode::STATS) reply += proxy_stats(*r, s.username);
+    return reply;
+}
+
+// proxy_login: "<username>" + "<password>" or "RESUME|<token>", empty string if it failed
+static string proxy_login(int client_socket, const string& host) {
+    char buffer[256];
+    ssize_t n = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) return "";
+    string username(buffer, n);
+    if (username.rfind(RESUME_PREFIX, 0) == 0) {
+        return validate_resume(string_view(username).substr(strlen(RESUME_PREFIX)), host);
+    }
+
+    n = recv(client_socket, buffer, sizeof(buffer) - 1, 0);
+    if (n <= 0) return "";
+    string password(buffer, n);
+    return validate_login(username, password, host) ? username : "";
+}
+
+void handle_client(int client_socket, const string& peer) {
+    ProxySession s;
+    string hello;
+    if (!recv_reply(client_socket, hello) || hello != connected_msg) {
+        sendall(client_socket, ERR, strlen(ERR));
+        close(client_socket);
+        return;
+    }
+    sendall(client_socket, ACK, strlen(ACK));
+
+    // Login einmal hier, die Backends bekommen nur noch Tokens
+    for (int attempt = 0; attempt < LOGIN_MAX_TRIES && s.username.empty(); ++attempt) {
+        s.username = proxy_login(client_socket, peer_host(peer));
+        if (!s.username.empty()) break;
+        std::cout << "proxy: failed login from " << peer << endl;
+        if (sendall(client_socket, ERR, strlen(ERR)) == -1) break;
+
+        // flush the rest of the failed attempt, stop if the client is gone
+        char flush_buffer[1024];
+        ssize_t flushed;
+        while ((flushed = recv(client_socket, flush_buffer, sizeof(flush_buffer), MSG_DONTWAIT)) > 0) {}
+        if (flushed == 0) break;
+    }
+    if (s.username.empty()) {
+        close(client_socket);
+        return;
+    }
+    string token = issue_session_token(s.username);
+    string ack = token.empty() ? string(ACK) : string(ACK) + "|" + token;
+    sendall(client_socket, ack.c_str(), ack.size());
+    std::cout << "proxy: " << s.username << " (" << peer << ") -> " << ring_owner(*current_ring(), s.username).name << endl;
+
+    proxy_sessions++;
+    BufferChain request(s.memory);
+    while (true) {
+        size_t header = 0; // framed client request -> framed reply
+        long n = recv_request(client_socket, request, BUFFER_SIZE, header);
+        const char* data = (n > 0) ? request.contiguous() : nullptr;
+        if (!data) break;
+
+        Request req;
+        parse_request(data + header, n - header, req);
+        if (req.op == Opcode::QUIT || req.op == Opcode::EXIT) break;
+
+        string reply = frame_text(route(s, data + header, n - header), header > 0);
+        request.clear();
+        if (sendall(client_socket, reply.c_str(), reply.size()) == -1) break;
+    }
+    proxy_sessions--;
+
+    while (!s.backends.empty()) drop_backend(s, s.backends.begin()->first);
+    close(client_socket);
+    std::cout << "proxy: connection with " << peer << " closed" << endl;
+}
+
+// plan: users (stdin) whose owner differs between two ring files
+static int plan(const string& old_file, const string& new_file) {
+    Ring old_ring, new_ring;
+    string err;
+    if (!load_ring(old_file, old_ring, err) || !load_ring(new_file, new_ring, err)) {
+        cerr << "plan: " << err << endl;
+        return EXIT_FAILURE;
+    }
+    long total = 0, moved = 0;
+    string user;
+    while (cin >> user) {
+        total++;
+        const string& from = ring_owner(old_ring, user).name;
+        const string& to = ring_owner(new_ring, user).name;
+        if (from == to) continue;
+        moved++;
+        cout << user << " " << from << " -> " << to << "\n";
+    }
+    cerr << "plan: " << moved << " of " << total << " mailboxes move" << endl;
+    return EXIT_SUCCESS;
+}
+
+void signal_handler(int signal_number) {
+    if (signal_number == SIGHUP) {
+        if (write(reload_pipe[1], "r", 1) < 0) {}
+        return;
+    }
+    std::cout << endl << "Closing Proxy..." << endl;
+    close_listeners();
+    exit(EXIT_SUCCESS);
+}
+
+int main(int argc, char* argv[]) {
+    if (argc >= 2 && string(argv[1]) == "plan") {
+        for (int i = 4; i < argc; ++i) {
+            if (string(argv[i]).rfind("--vnodes=", 0) == 0) set_ring_vnodes(strtoul(argv[i] + 9, nullptr, 10));
+        }
+        if (argc < 4) {
+            cerr << "Usage: twmail-proxy plan <old-ring-file> <new-ring-file> [--vnodes=N] < usernames" << endl;
+            return EXIT_FAILURE;
+        }
+        return plan(argv[2], argv[3]);
+    }
+
+    int port = PROXY_PORT;
+    string secret_dir = SECRET_DIR;
+
+    // Argumente: [port] [ring-file] [secret-dir] [--option ...]
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--listen=", 0) == 0) {
+            if (!add_listener(arg.substr(9))) {
+                cerr << "Invalid listener: " << arg << endl;
+                return EXIT_FAILURE;
+            }
+        } else if (arg.rfind("--vnodes=", 0) == 0) {
+            set_ring_vnodes(strtoul(arg.c_str() + 9, nullptr, 10));
+        } else if (arg.rfind("--", 0) == 0) {
+            cerr << "Unknown option: " << arg << endl;
+            return EXIT_FAILURE;
+        } else if (positional == 0) {
+            port = atoi(arg.c_str());
+            positional++;
+        } else if (positional == 1) {
+            ring_file = arg;
+            positional++;
+        } else {
+            secret_dir = arg;
+            positional++;
+        }
+    }
+
+    if (!reload_ring()) return EXIT_FAILURE;
+
+    // gemeinsames Session-Secret mit den Backends
+    set_base_dir(secret_dir);
+    if (!load_session_secret()) return EXIT_FAILURE;
+
+    if (pipe2(reload_pipe, O_CLOEXEC) < 0) return EXIT_FAILURE;
+    thread([] {
+        char c;
+        while (read(reload_pipe[0], &c, 1) == 1 || errno == EINTR) reload_ring();
+    }).detach();
+    signal(SIGINT, signal_handler);
+    signal(SIGHUP, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (!open_listeners(string(PROXY_IP) + ":" + to_string(port), BACKLOG)) {
+        return EXIT_FAILURE;
+    }
+    if (ldap_connect() != EXIT_SUCCESS) {
+        cerr << "LDAP connection failed" << endl;
+        return EXIT_FAILURE;
+    }
+    std::cout << "Proxy Started, Ring: " << ring_file << endl;
+
+    accept_loop([](int client_socket, const string& peer) {
+        thread(handle_client, client_socket, peer).detach();
+    }, -1);
+    close_listeners();
+    return 0;
+}
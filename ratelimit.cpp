@@ -0,0 +1,239 @@
+// ratelimit.cpp
+// Per-user and per-address limits:
+//  - token buckets for commands (--rate-limit=<per s>[:<burst>] per user,
+//    --ip-rate-limit=... per client address), both off by default
+//  - login lockout: after LOGIN_MAX_TRIES failed logins of a user (LOGIN_MAX_TRIES_IP
+//    of an address) further attempts are refused without an LDAP bind, the lock
+//    doubles with every further failure (LOGIN_LOCK_BASE_MS .. LOGIN_LOCK_MAX_MS).
+//    Failures are forgotten LOGIN_FAILURE_WINDOW_MS after the last one, a successful
+//    login clears the user's count.
+//
+// State lives in a fixed table of RATE_SHARDS * RATE_SHARD_SLOTS entries, a key
+// ("u:<user>", "i:<address>") is hashed to a shard and probed linearly within
+// RATE_PROBE slots. Entries are claimed and updated with compare-and-swap only, every
+// counter is packed into one 64-bit word. Entries idle for RATE_IDLE_MS (and not
+// locked) are taken over by new keys; slots are never emptied, so probe chains stay
+// intact. If all probed slots are in use the least recently seen unlocked one is
+// evicted (counted as table_full). If every one of them is locked, a new address is
+// refused (fail closed) and a new user is let through.
+
+#define RATE_SHARDS 64
+#define RATE_SHARD_SLOTS 1024
+#define RATE_PROBE 16
+#define RATE_IDLE_MS (10 * 60 * 1000)
+#define RATE_TOKEN_UNIT 1000                 // fixed point: 1 token = 1000
+#define RATE_TOKEN_BITS 24
+#define RATE_MAX_BURST (((1 << RATE_TOKEN_BITS) - 1) / RATE_TOKEN_UNIT)
+#define LOGIN_MAX_TRIES 3
+#define LOGIN_MAX_TRIES_IP 10
+#define LOGIN_LOCK_BASE_MS 1000
+#define LOGIN_LOCK_MAX_MS (15 * 60 * 1000)
+#define LOGIN_FAILURE_WINDOW_MS (15 * 60 * 1000)
+#define LOGIN_FAILURE_BITS 16
+
+struct RateEntry {
+	atomic<uint64_t> key{0};       // hash of the key, 0 = never used
+	atomic<uint64_t> bucket{0};    // last refill ms << 24 | tokens (0 = full bucket)
+	atomic<uint64_t> login{0};     // last failure or end of lock (ms) << 16 | failures
+	atomic<uint64_t> last_seen{0}; // ms
+};
+
+struct RateLimit {
+	unsigned rate = 0; // tokens per second, 0 = unlimited
+	unsigned burst = 0;
+};
+
+static RateEntry rate_table[RATE_SHARDS][RATE_SHARD_SLOTS];
+static RateLimit USER_RATE;
+static RateLimit IP_RATE;
+static const auto rate_epoch = chrono::steady_clock::now();
+static atomic<unsigned long> rate_throttled(0);
+static atomic<unsigned long> rate_table_full(0);
+static atomic<unsigned long> login_lockouts(0);
+static atomic<unsigned long> login_refused(0);
+
+// parse_rate_limit: "<per second>[:<burst>]", burst defaults to 2 seconds worth
+static bool parse_rate_limit(const string& spec, RateLimit& limit) {
+	char* end;
+	unsigned long rate = strtoul(spec.c_str(), &end, 10);
+	if (end == spec.c_str()) return false;
+	unsigned long burst = (*end == ':') ? strtoul(end + 1, &end, 10) : rate * 2;
+	if (*end != '\0') return false;
+	limit.rate = rate;
+	limit.burst = (unsigned)min<unsigned long>(max<unsigned long>(burst, 1), RATE_MAX_BURST);
+	return true;
+}
+
+// set_rate_limit: commands per second (and burst) of one user
+bool set_rate_limit(const string& spec) {
+	return parse_rate_limit(spec, USER_RATE);
+}
+
+// set_ip_rate_limit: commands per second (and burst) of one client address
+bool set_ip_rate_limit(const string& spec) {
+	return parse_rate_limit(spec, IP_RATE);
+}
+
+// peer_host: address part of a peer name ("1.2.3.4:5678" -> "1.2.3.4"),
+// all unix socket clients share one key
+string peer_host(const string& peer) {
+	if (peer.rfind("unix:", 0) == 0) return "unix";
+	size_t colon = peer.rfind(':');
+	return colon == string::npos ? peer : peer.substr(0, colon);
+}
+
+static uint64_t rate_now_ms() {
+	return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - rate_epoch).count() + 1;
+}
+
+static bool rate_stale(const RateEntry& e, uint64_t now) {
+	return e.last_seen.load(memory_order_relaxed) + RATE_IDLE_MS < now &&
+	       (e.login.load(memory_order_relaxed) >> LOGIN_FAILURE_BITS) < now;
+}
+
+// rate_entry: entry of `key`, created if `create`; nullptr if not found/no free slot
+static RateEntry* rate_entry(const string& key, bool create) {
+	uint64_t h = hash<string>()(key);
+	if (h == 0) h = 1;
+	RateEntry* shard = rate_table[h % RATE_SHARDS];
+	size_t start = (h / RATE_SHARDS) % RATE_SHARD_SLOTS;
+	uint64_t now = rate_now_ms();
+
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		RateEntry* reuse = nullptr;
+		for (size_t i = 0; i < RATE_PROBE; ++i) {
+			RateEntry& e = shard[(start + i) % RATE_SHARD_SLOTS];
+			uint64_t k = e.key.load(memory_order_acquire);
+			if (k == h) {
+				e.last_seen.store(now, memory_order_relaxed);
+				return &e;
+			}
+			if (!reuse && (k == 0 || rate_stale(e, now))) reuse = &e;
+			if (k == 0) break; // end of the chain, the key is not further down
+		}
+		if (!create) return nullptr;
+		bool evict = !reuse;
+		if (evict) {
+			// probe window full of live keys: evict the least recently seen one that is
+			// not locked out (rotating addresses must not push out a lockout)
+			for (size_t i = 0; i < RATE_PROBE; ++i) {
+				RateEntry& e = shard[(start + i) % RATE_SHARD_SLOTS];
+				if ((e.login.load(memory_order_relaxed) >> LOGIN_FAILURE_BITS) > now) continue;
+				if (!reuse || e.last_seen.load(memory_order_relaxed) < reuse->last_seen.load(memory_order_relaxed)) reuse = &e;
+			}
+			rate_table_full++;
+			if (!reuse) return nullptr;
+		}
+		uint64_t k = reuse->key.load(memory_order_acquire);
+		if ((k == 0 || evict || rate_stale(*reuse, now)) && k != h && reuse->key.compare_exchange_strong(k, h)) {
+			reuse->bucket.store(0, memory_order_relaxed);
+			reuse->login.store(0, memory_order_relaxed);
+			reuse->last_seen.store(now, memory_order_relaxed);
+			return reuse;
+		}
+		// another thread claimed the slot meanwhile -> probe again
+	}
+	return nullptr;
+}
+
+// take_token: one token from the bucket of `e`, false if it is empty
+static bool take_token(RateEntry& e, const RateLimit& limit, uint64_t now) {
+	const uint64_t full = (uint64_t)limit.burst * RATE_TOKEN_UNIT;
+	const uint64_t token_mask = (1ull << RATE_TOKEN_BITS) - 1;
+	uint64_t old = e.bucket.load(memory_order_relaxed);
+	while (true) {
+		uint64_t last = old >> RATE_TOKEN_BITS;
+		uint64_t tokens = full;
+		if (last != 0 && now > last) {
+			uint64_t elapsed = min<uint64_t>(now - last, full * 1000 / limit.rate + 1);
+			tokens = min(full, (old & token_mask) + elapsed * limit.rate * RATE_TOKEN_UNIT / 1000);
+		} else if (last != 0) {
+			tokens = old & token_mask;
+		}
+		if (tokens < RATE_TOKEN_UNIT) return false;
+		uint64_t next = (now << RATE_TOKEN_BITS) | (tokens - RATE_TOKEN_UNIT);
+		if (e.bucket.compare_exchange_weak(old, next, memory_order_relaxed)) return true;
+	}
+}
+
+static bool allow(const string& key, const RateLimit& limit, uint64_t now) {
+	if (limit.rate == 0) return true;
+	RateEntry* e = rate_entry(key, true);
+	if (!e) return key[0] != 'i'; // no slot: addresses fail closed
+	return take_token(*e, limit, now);
+}
+
+// rate_allow_command: false if `username` or its address exceeded its command rate
+bool rate_allow_command(const string& username, const string& host) {
+	uint64_t now = rate_now_ms();
+	if (allow("u:" + username, USER_RATE, now) && allow("i:" + host, IP_RATE, now)) return true;
+	rate_throttled++;
+	return false;
+}
+
+static bool is_locked(const string& key) {
+	// an address gets its slot here already: no free slot means refused, not unlimited guesses
+	RateEntry* e = rate_entry(key, key[0] == 'i');
+	if (!e) return key[0] == 'i';
+	uint64_t state = e->login.load(memory_order_relaxed);
+	return (state & ((1u << LOGIN_FAILURE_BITS) - 1)) >= (key[0] == 'u' ? LOGIN_MAX_TRIES : LOGIN_MAX_TRIES_IP) &&
+	       (state >> LOGIN_FAILURE_BITS) > rate_now_ms();
+}
+
+// login_locked: true while the user or the address is locked out
+bool login_locked(const string& username, const string& host) {
+	if ((!username.empty() && is_locked("u:" + username)) || is_locked("i:" + host)) {
+		login_refused++;
+		return true;
+	}
+	return false;
+}
+
+static void record_failure(const string& key, unsigned max_tries) {
+	RateEntry* e = rate_entry(key, true);
+	if (!e) return; // only if every probed slot is locked out already
+	uint64_t now = rate_now_ms();
+	uint64_t old = e->login.load(memory_order_relaxed);
+	uint64_t next;
+	do {
+		uint64_t failures = old & ((1u << LOGIN_FAILURE_BITS) - 1);
+		uint64_t until = old >> LOGIN_FAILURE_BITS;
+		if (until + LOGIN_FAILURE_WINDOW_MS < now) failures = 0; // old failures expire
+		failures = min<uint64_t>(failures + 1, (1u << LOGIN_FAILURE_BITS) - 1);
+		until = now;
+		if (failures >= max_tries) {
+			// exponential backoff: 1s, 2s, 4s, ... up to LOGIN_LOCK_MAX_MS
+			unsigned shift = (unsigned)min<uint64_t>(failures - max_tries, 20);
+			until = now + min<uint64_t>((uint64_t)LOGIN_LOCK_BASE_MS << shift, LOGIN_LOCK_MAX_MS);
+		}
+		next = (until << LOGIN_FAILURE_BITS) | failures;
+	} while (!e->login.compare_exchange_weak(old, next, memory_order_relaxed));
+	if ((next & ((1u << LOGIN_FAILURE_BITS) - 1)) >= max_tries) login_lockouts++;
+}
+
+// login_failed: counts a failed login (unknown user or bad token: address only)
+void login_failed(const string& username, const string& host) {
+	if (!username.empty()) record_failure("u:" + username, LOGIN_MAX_TRIES);
+	record_failure("i:" + host, LOGIN_MAX_TRIES_IP);
+}
+
+// login_succeeded: clears the failures of the user (not of the address)
+void login_succeeded(const string& username) {
+	RateEntry* e = rate_entry("u:" + username, false);
+	if (e) e->login.store(0, memory_order_relaxed);
+}
+
+string ratelimit_stats() {
+	size_t used = 0;
+	uint64_t now = rate_now_ms();
+	for (auto& shard : rate_table) {
+		for (RateEntry& e : shard) {
+			if (e.key.load(memory_order_relaxed) != 0 && !rate_stale(e, now)) used++;
+		}
+	}
+	ostringstream oss;
+	oss << "ratelimit: user=" << USER_RATE.rate << "/s:" << USER_RATE.burst << " ip=" << IP_RATE.rate << "/s:" << IP_RATE.burst
+	    << " entries=" << used << " throttled=" << rate_throttled << " lockouts=" << login_lockouts
+	    << " refused_logins=" << login_refused << " table_full=" << rate_table_full << "\n";
+	return oss.str();
+}
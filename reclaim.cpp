@@ -0,0 +1,305 @@
+// reclaim.cpp
+// Deferred deletion. DELETE only writes a tombstone to the journal, drops the mail
+// from the mailbox index and ACKs; the file unlink (and blob release) is done later
+// by a background reclaimer in rate-limited batches, off the request path.
+//
+// Journal <BASE_DIR>/.trash/tombstones.log, one "<mailbox> <id>" line per delete,
+// fdatasync'ed before the ACK. At startup all tombstones are read back: the ids are
+// filtered out of every mailbox load (directory scan or snapshot) and queued for
+// reclamation again, so a deleted mail never reappears after a crash. When the queue
+// is empty the journal is truncated, after the directories of the unlinked files are
+// fsync'ed; replaying an already unlinked tombstone is a no-op. A file that cannot be
+// removed is retried with exponential backoff and keeps the journal from truncating.
+// Every RECLAIM_SWEEP_INTERVAL_MS the reclaimer also expires abandoned attachment
+// uploads (attach.cpp).
+
+#include <condition_variable>
+#include <deque>
+#include <unordered_set>
+
+void attach_expire_uploads(); // attach.cpp
+
+#define RECLAIM_DIR ".trash"
+#define RECLAIM_JOURNAL "tombstones.log"
+#define RECLAIM_BATCHES_PER_SEC 10
+#define RECLAIM_DEFAULT_RATE 1000 // unlinks per second
+#define RECLAIM_RETRY_MIN_MS 1000
+#define RECLAIM_RETRY_MAX_MS (3600 * 1000)
+#define RECLAIM_SWEEP_INTERVAL_MS (3600 * 1000)
+
+struct Tombstone {
+	string mailbox;
+	string id;
+	unsigned attempts = 0;   // failed unlinks so far
+	long long retry_ms = 0;  // not before this time (epoch ms)
+};
+
+static mutex reclaim_mutex;
+static condition_variable reclaim_cv;
+static deque<Tombstone> reclaim_queue;
+static vector<Tombstone> reclaim_retry; // failed, waiting for their retry_ms
+static unordered_set<string> reclaim_unsynced_dirs; // unlinks not fsync'ed yet (reclaimer thread only)
+static unordered_set<string> tombstoned_ids;
+static int reclaim_journal_fd = -1;
+static bool reclaim_paused = false;
+static unsigned RECLAIM_RATE = RECLAIM_DEFAULT_RATE;
+static atomic<unsigned long> reclaim_deleted(0);
+static atomic<unsigned long> reclaim_unlinked(0);
+static atomic<unsigned long> reclaim_failed(0);
+
+// set_reclaim_rate: max unlinks per second of the background reclaimer
+void set_reclaim_rate(unsigned per_second) {
+	RECLAIM_RATE = max(1u, per_second);
+}
+
+static fs::path reclaim_journal_path() {
+	return BASE_DIR / RECLAIM_DIR / RECLAIM_JOURNAL;
+}
+
+// drop_tombstoned: removes deleted mails whose files are still on disk from a freshly
+// loaded mailbox
+static void drop_tombstoned(vector<MailEntry>& mails) {
+	lock_guard<mutex> lock(reclaim_mutex);
+	if (tombstoned_ids.empty()) return;
+	mails.erase(remove_if(mails.begin(), mails.end(),
+	                      [](const MailEntry& e) { return tombstoned_ids.count(e.id) > 0; }),
+	            mails.end());
+}
+
+bool wal_log_delete(const string& mailbox, const string& id); // wal.cpp
+void wal_wait_open();
+
+// is_tombstoned: deleted, file not reclaimed yet (archive.cpp leaves those alone)
+static bool is_tombstoned(const string& id) {
+	lock_guard<mutex> lock(reclaim_mutex);
+	return tombstoned_ids.count(id) > 0;
+}
+
+// delete_mail: removes mail `id` from `username`'s mailbox. The mail is gone for all
+// readers when this returns, the file is unlinked later by the reclaimer.
+// Returns an empty string on success, otherwise the error message
+string delete_mail(const string& username, const string& id) {
+	// not while holding reclaim_mutex: the predecessor's deletes are adopted meanwhile
+	wal_wait_open();
+	{
+		lock_guard<mutex> lock(reclaim_mutex);
+		if (tombstoned_ids.count(id)) return string(ERR) + "Mail already deleted";
+
+		string line = username + " " + id + "\n";
+		off_t journal_size = reclaim_journal_fd >= 0 ? lseek(reclaim_journal_fd, 0, SEEK_END) : -1;
+		if (journal_size < 0 ||
+		    write(reclaim_journal_fd, line.data(), line.size()) != (ssize_t)line.size() ||
+		    fdatasync(reclaim_journal_fd) != 0) {
+			cerr << "delete_mail: failed to write tombstone for " << id << "\n";
+			return string(ERR) + "Failed to delete mail";
+		}
+		// logged after the tombstone (replication): followers never delete a mail the
+		// leader kept. Without the log record the tombstone is taken back, the client
+		// gets an error and the mail stays everywhere.
+		if (!wal_log_delete(username, id)) {
+			if (ftruncate(reclaim_journal_fd, journal_size) != 0 || fdatasync(reclaim_journal_fd) != 0)
+				cerr << "delete_mail: failed to take back the tombstone for " << id << "\n";
+			return string(ERR) + "Failed to log delete";
+		}
+		tombstoned_ids.insert(id);
+		reclaim_queue.push_back({username, id});
+	}
+	index_remove(username, id);
+	cache_invalidate(username);
+	reclaim_deleted++;
+	reclaim_cv.notify_one();
+	mailbox_changed('D', username, id);
+	return "";
+}
+
+// adopt_tombstone: a delete that another server process already journaled
+// (predecessor draining during a restart, upgrade.cpp)
+void adopt_tombstone(const string& username, const string& id) {
+	{
+		lock_guard<mutex> lock(reclaim_mutex);
+		if (!tombstoned_ids.insert(id).second) return;
+		reclaim_queue.push_back({username, id});
+		// journal it again, our own truncate may have raced with the predecessor's append
+		string line = username + " " + id + "\n";
+		if (reclaim_journal_fd < 0 ||
+		    write(reclaim_journal_fd, line.data(), line.size()) != (ssize_t)line.size() ||
+		    fdatasync(reclaim_journal_fd) != 0) {
+			cerr << "reclaim: failed to journal adopted tombstone for " << id << "\n";
+		}
+	}
+	index_remove(username, id);
+	cache_invalidate(username);
+	reclaim_cv.notify_one();
+}
+
+// reclaim_pause: stops unlinking and journal truncation for good; the successor
+// process owns the journal from now on
+void reclaim_pause() {
+	lock_guard<mutex> lock(reclaim_mutex);
+	reclaim_paused = true;
+}
+
+// sync_dir: makes the unlinks in `dir` durable
+static bool sync_dir(const fs::path& dir) {
+	int fd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) return errno == ENOENT; // removed itself (emptied hashed month, archive)
+	bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+// reclaim_one: unlinks the file of `t`, the directories that changed go to reclaim_unsynced_dirs
+static bool reclaim_one(Tombstone& t) {
+	error_code ec;
+	shared_ptr<Mailbox> mb = begin_change(t.mailbox);
+	fs::path path = mail_path(t.mailbox, t.id);
+	delete_mail_file(path, ec);
+	// moved by the layout migrator in the meantime
+	if (ec == errc::no_such_file_or_directory) {
+		ec.clear();
+		path = mail_path(t.mailbox, t.id);
+		delete_mail_file(path, ec);
+	}
+	end_change(mb);
+	if (!ec) reclaim_unsynced_dirs.insert(path.parent_path().string());
+	// packed into an archive segment (before or while the file was removed)
+	if ((!ec || ec == errc::no_such_file_or_directory) && archive_remove(t.mailbox, t.id)) {
+		reclaim_unsynced_dirs.insert(archive_dir(t.mailbox).string());
+	}
+
+	if (ec && ec != errc::no_such_file_or_directory) {
+		// log the first failure and then only every doubling of the attempts
+		t.attempts++;
+		long long delay = RECLAIM_RETRY_MAX_MS;
+		if (t.attempts <= 20) delay = min<long long>(delay, (long long)RECLAIM_RETRY_MIN_MS << (t.attempts - 1));
+		t.retry_ms = epoch_ms_now() + delay;
+		if ((t.attempts & (t.attempts - 1)) == 0) {
+			cerr << "reclaim: failed to remove " << t.id << ": " << ec.message() << " (attempt "
+			     << t.attempts << ", next in " << delay / 1000 << "s)\n";
+		}
+		reclaim_failed++;
+		return false;
+	}
+	reclaim_unlinked++;
+	return true;
+}
+
+// due_retries: moves failed tombstones whose backoff is over back to the queue,
+// returns the time of the next one still waiting (0: none). Caller holds reclaim_mutex.
+static long long due_retries() {
+	long long now = epoch_ms_now(), next = 0;
+	for (size_t i = 0; i < reclaim_retry.size();) {
+		if (reclaim_retry[i].retry_ms <= now) {
+			reclaim_queue.push_back(move(reclaim_retry[i]));
+			reclaim_retry[i] = move(reclaim_retry.back());
+			reclaim_retry.pop_back();
+			continue;
+		}
+		if (next == 0 || reclaim_retry[i].retry_ms < next) next = reclaim_retry[i].retry_ms;
+		i++;
+	}
+	return next;
+}
+
+static void reclaim_loop() {
+	size_t per_batch = max(1u, RECLAIM_RATE / RECLAIM_BATCHES_PER_SEC);
+	long long next_sweep = 0; // first sweep right at startup
+	for (;;) {
+		if (epoch_ms_now() >= next_sweep) {
+			attach_expire_uploads();
+			next_sweep = epoch_ms_now() + RECLAIM_SWEEP_INTERVAL_MS;
+		}
+
+		vector<Tombstone> batch;
+		{
+			unique_lock<mutex> lock(reclaim_mutex);
+			for (;;) {
+				long long next = due_retries();
+				if (!reclaim_queue.empty() && !reclaim_paused) break;
+				if (epoch_ms_now() >= next_sweep) break;
+				if (next == 0 || next > next_sweep) next = next_sweep;
+				reclaim_cv.wait_for(lock, chrono::milliseconds(max(0LL, next - epoch_ms_now())));
+			}
+			while (!reclaim_queue.empty() && batch.size() < per_batch) {
+				batch.push_back(move(reclaim_queue.front()));
+				reclaim_queue.pop_front();
+			}
+		}
+
+		vector<Tombstone> retry;
+		vector<string> done;
+		for (Tombstone& t : batch) {
+			if (reclaim_one(t)) done.push_back(t.id);
+			else retry.push_back(move(t));
+		}
+		// the unlinks must be on disk before their tombstones can be dropped
+		for (auto it = reclaim_unsynced_dirs.begin(); it != reclaim_unsynced_dirs.end();) {
+			if (sync_dir(*it)) it = reclaim_unsynced_dirs.erase(it);
+			else ++it;
+		}
+		bool synced = reclaim_unsynced_dirs.empty();
+
+		{
+			lock_guard<mutex> lock(reclaim_mutex);
+			for (const string& id : done) tombstoned_ids.erase(id);
+			for (Tombstone& t : retry) reclaim_retry.push_back(move(t));
+			// everything reclaimed -> the journal can start over
+			if (synced && reclaim_queue.empty() && reclaim_retry.empty() && reclaim_journal_fd >= 0 && !reclaim_paused) {
+				if (ftruncate(reclaim_journal_fd, 0) != 0) cerr << "reclaim: failed to truncate journal\n";
+			}
+		}
+		// rate limit
+		this_thread::sleep_for(chrono::milliseconds(batch.size() * 1000 / RECLAIM_RATE));
+	}
+}
+
+// load_tombstones: reads the journal back (ids are filtered from mailbox loads and
+// queued for reclamation), returns its raw content
+static string load_tombstones() {
+	string journal;
+	if (read_file(reclaim_journal_path(), journal)) {
+		size_t pos = 0;
+		for (;;) {
+			size_t nl = journal.find('\n', pos);
+			if (nl == string::npos) break; // torn last line: its delete was never ACKed
+			string line = journal.substr(pos, nl - pos);
+			pos = nl + 1;
+			size_t sp = line.find(' ');
+			if (sp == string::npos || sp == 0 || sp + 1 == line.size()) continue;
+			string id = line.substr(sp + 1);
+			if (tombstoned_ids.insert(id).second) reclaim_queue.push_back({line.substr(0, sp), id});
+		}
+		if (!reclaim_queue.empty()) cout << "reclaim: " << reclaim_queue.size() << " deletes to finish from the journal\n";
+	}
+	return journal;
+}
+
+// start_reclaimer: replays the tombstone journal and starts the reclaimer thread.
+// Must run before mailboxes are loaded (warm-up, snapshots).
+bool start_reclaimer() {
+	error_code ec;
+	fs::create_directories(reclaim_journal_path().parent_path(), ec);
+	string journal = load_tombstones();
+
+	// O_APPEND: after a truncate the next tombstone goes to offset 0 again
+	reclaim_journal_fd = open(reclaim_journal_path().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (reclaim_journal_fd < 0) {
+		cerr << "reclaim: failed to open " << reclaim_journal_path() << "\n";
+		return false;
+	}
+	// drop the torn tail so new tombstones start on a fresh line
+	if (journal.size() != journal.rfind('\n') + 1 && ftruncate(reclaim_journal_fd, journal.rfind('\n') + 1) != 0) {
+		cerr << "reclaim: failed to repair journal\n";
+	}
+	thread(reclaim_loop).detach();
+	return true;
+}
+
+string reclaim_stats() {
+	lock_guard<mutex> lock(reclaim_mutex);
+	ostringstream oss;
+	oss << "reclaim: deleted=" << reclaim_deleted << " unlinked=" << reclaim_unlinked
+	    << " failed=" << reclaim_failed << " pending=" << reclaim_queue.size() + reclaim_retry.size()
+	    << " rate=" << RECLAIM_RATE << "/s\n";
+	return oss.str();
+}
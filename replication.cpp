@@ -0,0 +1,394 @@
+// replication.cpp
+// Streaming replication of the mutation log (wal.cpp) to standby servers.
+//
+//   leader:   server 8080 ./mailspool --replication-listen=tcp:127.0.0.1:9080
+//   follower: server 8081 ./standby   --follow=tcp:127.0.0.1:9080
+//
+// The follower connects and sends "FOLLOW <next lsn>\n", the leader answers "OK\n" or
+// "ERR <reason>\n" and then streams the log records exactly as they are on disk. An
+// idle leader sends a heartbeat every second (record without payload, lsn = its last
+// lsn) so the follower knows how far behind it is.
+// The follower applies records in batches (everything that arrived together), keeps
+// the last applied lsn in <BASE_DIR>/.wal/applied and answers "ACK <lsn>\n" after each
+// batch. After restarts and reconnects it resumes at that lsn. A follower is seeded
+// with a copy of the leader's spool taken when the log was started (an empty spool for
+// a new leader) and serves LIST/READ only; SEND and DELETE are rejected.
+// Attachment files (attach.cpp) are not in the log, only their header lines: a
+// follower that replays a mail with an attachment it does not have yet connects once
+// more and sends "FETCH <sha256>\n", the leader answers "OK <size>\n" and the file, or
+// "ERR <reason>\n" if it is gone (all mails with it deleted meanwhile).
+
+#include <list>
+
+#define REPLICATION_BACKLOG 4
+#define REPLICATION_HEARTBEAT_MS 1000
+#define REPLICATION_RETRY_MS 1000
+#define REPLICATION_BATCH_BYTES (1024 * 1024)
+#define REPLICATION_RECV_SIZE (64 * 1024)
+#define REPLICATION_APPLIED_FILE "applied"
+
+int sendall(int socket, const char *buffer, size_t length); // server.cpp
+bool has_predecessor(); // upgrade.cpp
+
+struct FollowerState {
+	string peer;
+	uint64_t acked = 0;
+	long long ack_ms = 0;
+};
+
+// leader
+static bool REPLICATION_LEADER = false;
+static Listener replication_listener;
+static mutex followers_mutex;
+static list<FollowerState> followers;
+
+// follower
+static bool REPLICATION_FOLLOWER = false;
+static Listener replication_leader;
+static atomic<bool> follower_connected(false);
+static atomic<uint64_t> follower_applied(0);
+static atomic<uint64_t> follower_leader_lsn(0);
+static atomic<long long> follower_apply_delay_ms(0);
+
+// set_replication_listen: serve the mutation log to followers on `spec` (listeners.cpp syntax)
+bool set_replication_listen(const string& spec) {
+	REPLICATION_LEADER = parse_listener(spec, replication_listener);
+	return REPLICATION_LEADER;
+}
+
+// set_follow: replicate from the leader at `spec`, this server becomes read-only
+bool set_follow(const string& spec) {
+	REPLICATION_FOLLOWER = parse_listener(spec, replication_leader);
+	return REPLICATION_FOLLOWER;
+}
+
+bool replica_read_only() {
+	return REPLICATION_FOLLOWER;
+}
+
+// recv_line: one "\n"-terminated handshake line (without the "\n")
+static bool recv_line(int fd, string& line) {
+	line.clear();
+	char c;
+	while (line.size() < 256) {
+		if (recv(fd, &c, 1, 0) != 1) return false;
+		if (c == '\n') return true;
+		line += c;
+	}
+	return false;
+}
+
+// --- leader ------------------------------------------------------------------
+
+// send_attachment: answers a FETCH of a follower
+static void send_attachment(int fd, const string& hash) {
+	Attachment a;
+	a.hash = hash;
+	bool valid = hash.size() == 64 && hash.find_first_not_of("0123456789abcdef") == string::npos;
+	int file = valid ? attach_open(a) : -1;
+	struct stat st;
+	if (file < 0 || fstat(file, &st) != 0) {
+		sendall(fd, "ERR unknown attachment\n", 23);
+		if (file >= 0) close(file);
+		return;
+	}
+	string head = "OK " + to_string(st.st_size) + "\n";
+	bool ok = sendall(fd, head.c_str(), head.size()) != -1;
+	off_t pos = 0;
+	while (ok && pos < st.st_size) ok = sendfile(fd, file, &pos, st.st_size - pos) > 0;
+	close(file);
+}
+
+static void leader_session(int fd, string peer) {
+	string line;
+	if (recv_line(fd, line) && line.rfind("FETCH ", 0) == 0) {
+		send_attachment(fd, line.substr(6));
+		close(fd);
+		return;
+	}
+	if (line.rfind("FOLLOW ", 0) != 0) {
+		close(fd);
+		return;
+	}
+	uint64_t lsn = strtoull(line.c_str() + 7, nullptr, 10);
+	WalCursor cur;
+	if (!wal_seek(cur, lsn)) {
+		string err = "ERR lsn " + to_string(lsn) + " is not in the log (last " + to_string(wal_last_lsn()) + ")\n";
+		sendall(fd, err.c_str(), err.size());
+		cerr << "replication: follower " << peer << " asked for lsn " << lsn << ", needs a new copy of the spool\n";
+		close(fd);
+		return;
+	}
+	sendall(fd, "OK\n", 3);
+	cout << "replication: follower " << peer << " connected at lsn " << lsn << "\n";
+
+	list<FollowerState>::iterator self;
+	{
+		lock_guard<mutex> lock(followers_mutex);
+		self = followers.insert(followers.end(), FollowerState{peer, lsn - 1, epoch_ms_now()});
+	}
+
+	string acks;
+	for (;;) {
+		string frames;
+		long n = wal_next(cur, frames, REPLICATION_BATCH_BYTES);
+		if (n < 0) {
+			cerr << "replication: log of follower " << peer << " is gone (retention)\n";
+			break;
+		}
+		if (n == 0) {
+			wal_wait(cur.next_lsn - 1, REPLICATION_HEARTBEAT_MS);
+			if (wal_last_lsn() >= cur.next_lsn) continue;
+			frames = encode_wal_record(wal_last_lsn(), epoch_ms_now(), "");
+		}
+		if (sendall(fd, frames.data(), frames.size()) == -1) break;
+
+		// "ACK <lsn>\n" lines (never blocks)
+		char buf[256];
+		ssize_t r;
+		while ((r = recv(fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) acks.append(buf, r);
+		if (r == 0) break;
+		size_t nl;
+		while ((nl = acks.find('\n')) != string::npos) {
+			if (acks.rfind("ACK ", 0) == 0) {
+				lock_guard<mutex> lock(followers_mutex);
+				self->acked = strtoull(acks.c_str() + 4, nullptr, 10);
+				self->ack_ms = epoch_ms_now();
+			}
+			acks.erase(0, nl + 1);
+		}
+	}
+
+	{
+		lock_guard<mutex> lock(followers_mutex);
+		followers.erase(self);
+	}
+	close(fd);
+	cout << "replication: follower " << peer << " disconnected\n";
+}
+
+static void leader_accept_loop() {
+	// after a restart: not before the predecessor handed over the log
+	wal_wait_open();
+	// the predecessor of a restart (upgrade.cpp) may still hold the port
+	while (!open_listener(replication_listener, REPLICATION_BACKLOG)) {
+		this_thread::sleep_for(chrono::milliseconds(REPLICATION_RETRY_MS));
+	}
+	cout << "replication: serving the log on " << replication_listener.spec << "\n";
+
+	pollfd pfd{replication_listener.fd, POLLIN, 0};
+	for (;;) {
+		if (poll(&pfd, 1, -1) < 0) continue;
+		sockaddr_storage addr{};
+		socklen_t addr_len = sizeof(addr);
+		int fd = accept4(replication_listener.fd, (sockaddr*)&addr, &addr_len, SOCK_CLOEXEC);
+		if (fd < 0) continue;
+		thread(leader_session, fd, peer_name(replication_listener, addr)).detach();
+	}
+}
+
+// --- follower ----------------------------------------------------------------
+
+static fs::path applied_path() {
+	return wal_dir() / REPLICATION_APPLIED_FILE;
+}
+
+static int connect_leader() {
+	sockaddr_storage addr;
+	socklen_t addr_len = listener_address(replication_leader, addr);
+	int fd = addr_len ? socket(replication_leader.family, SOCK_STREAM | SOCK_CLOEXEC, 0) : -1;
+	if (fd >= 0 && connect(fd, (sockaddr*)&addr, addr_len) < 0) {
+		close(fd);
+		fd = -1;
+	}
+	return fd;
+}
+
+// fetch_attachment: downloads attachment `a` from the leader to `path`.
+// Returns 1 if it is there, 0 if the leader no longer has it, -1 on errors.
+static int fetch_attachment(const Attachment& a, const fs::path& path) {
+	int fd = connect_leader();
+	if (fd < 0) return -1;
+	string request = "FETCH " + a.hash + "\n", line;
+	if (sendall(fd, request.c_str(), request.size()) == -1 || !recv_line(fd, line) || line.rfind("OK ", 0) != 0) {
+		close(fd);
+		return line.rfind("ERR ", 0) == 0 ? 0 : -1;
+	}
+	uint64_t size = strtoull(line.c_str() + 3, nullptr, 10);
+	int out = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	vector<char> chunk(REPLICATION_RECV_SIZE);
+	bool ok = out >= 0;
+	for (uint64_t got = 0; ok && got < size;) {
+		ssize_t n = recv(fd, chunk.data(), min<uint64_t>(chunk.size(), size - got), 0);
+		ok = n > 0 && write(out, chunk.data(), n) == n;
+		got += ok ? n : 0;
+	}
+	ok = ok && fdatasync(out) == 0;
+	if (out >= 0) close(out);
+	close(fd);
+	return ok ? 1 : -1;
+}
+
+// replicate_attachment: `refs` references to `a`, fetched from the leader if missing
+static bool replicate_attachment(const Attachment& a, int refs) {
+	fs::path fetched;
+	if (!attach_stored(a.hash)) {
+		fetched = attach_fetch_path();
+		int got = fetch_attachment(a, fetched);
+		if (got < 0) {
+			cerr << "replication: failed to fetch attachment " << a.hash << "\n";
+			return false;
+		}
+		if (got == 0) {
+			// only happens if the mails with it are deleted further on in the log
+			cerr << "replication: attachment " << a.hash << " is gone on the leader, mail stored without it\n";
+			return true;
+		}
+	}
+	if (attach_adopt(a, fetched, refs)) return true;
+	cerr << "replication: failed to store attachment " << a.hash << "\n";
+	return false;
+}
+
+// apply_record: replays one log record on the local spool (idempotent)
+static bool apply_record(const WalRecord& rec) {
+	if (rec.payload[0] == 'S') {
+		string sender, subject, message, headers;
+		long long date_ms;
+		vector<pair<string, string>> targets;
+		if (!decode_wal_save(rec.payload, sender, date_ms, subject, message, targets, headers)) return false;
+		// the applied lsn is stored per batch: after a crash the records of the last
+		// batch come again, mailboxes that have the mail already (and hold their blob
+		// and attachment references) are skipped
+		targets.erase(remove_if(targets.begin(), targets.end(),
+		                        [](const pair<string, string>& t) {
+			                        error_code ec;
+			                        return is_tombstoned(t.second) || fs::exists(mail_path(t.first, t.second), ec);
+		                        }),
+		              targets.end());
+		if (targets.empty()) return true;
+		// attachment files first, a mail never references a file the follower lacks
+		vector<Attachment> attachments = mail_attachments(headers);
+		for (const Attachment& a : attachments) {
+			if (!replicate_attachment(a, (int)targets.size())) return false;
+		}
+		size_t wanted = targets.size();
+		bool ok = store_mail(sender, targets, subject, message, date_ms, headers);
+		for (size_t i = targets.size(); i < wanted; ++i) {
+			for (const Attachment& a : attachments) attach_release(a.hash);
+		}
+		return ok;
+	}
+	if (rec.payload[0] == 'D') {
+		string mailbox, id;
+		if (!decode_wal_delete(rec.payload, mailbox, id)) return false;
+		delete_mail(mailbox, id); // "already deleted" after a replay is fine
+		return true;
+	}
+	return false;
+}
+
+static void follower_loop() {
+	string applied;
+	if (read_file(applied_path(), applied)) follower_applied = strtoull(applied.c_str(), nullptr, 10);
+	error_code ec;
+	fs::create_directories(wal_dir(), ec);
+
+	for (;; this_thread::sleep_for(chrono::milliseconds(REPLICATION_RETRY_MS))) {
+		int fd = connect_leader();
+		if (fd < 0) continue;
+		string hello = "FOLLOW " + to_string(follower_applied + 1) + "\n";
+		string line;
+		if (sendall(fd, hello.c_str(), hello.size()) == -1 || !recv_line(fd, line) || line != "OK") {
+			if (!line.empty()) cerr << "replication: leader refused: " << line << "\n";
+			close(fd);
+			continue;
+		}
+		follower_connected = true;
+		cout << "replication: following " << replication_leader.spec << " from lsn " << follower_applied + 1 << "\n";
+
+		string buf;
+		vector<char> chunk(REPLICATION_RECV_SIZE);
+		bool ok = true;
+		while (ok) {
+			ssize_t n = recv(fd, chunk.data(), chunk.size(), 0);
+			if (n <= 0) break;
+			buf.append(chunk.data(), n);
+
+			// one batch: all complete records received so far
+			uint64_t before = follower_applied;
+			size_t pos = 0;
+			WalRecord rec;
+			long used;
+			while ((used = decode_wal_record(buf.data() + pos, buf.size() - pos, rec)) > 0) {
+				pos += used;
+				if (rec.lsn > follower_leader_lsn) follower_leader_lsn = rec.lsn;
+				if (rec.payload.empty()) continue; // heartbeat
+				if (rec.lsn != follower_applied + 1) {
+					cerr << "replication: expected lsn " << follower_applied + 1 << ", got " << rec.lsn << "\n";
+					ok = false;
+					break;
+				}
+				if (!apply_record(rec)) {
+					// not skipped: reconnect and retry from this lsn (replay is idempotent)
+					cerr << "replication: failed to apply lsn " << rec.lsn << ", retrying\n";
+					ok = false;
+					break;
+				}
+				follower_applied = rec.lsn;
+				follower_apply_delay_ms = epoch_ms_now() - rec.time_ms;
+			}
+			if (used < 0) {
+				cerr << "replication: damaged record after lsn " << follower_applied << "\n";
+				ok = false;
+			}
+			buf.erase(0, pos);
+
+			if (follower_applied != before) {
+				if (!write_file_synced(applied_path(), to_string(follower_applied)))
+					cerr << "replication: failed to store applied lsn\n";
+				string ack = "ACK " + to_string(follower_applied) + "\n";
+				if (sendall(fd, ack.c_str(), ack.size()) == -1) break;
+			}
+		}
+		close(fd);
+		follower_connected = false;
+		cerr << "replication: lost the leader at lsn " << follower_applied << ", reconnecting\n";
+	}
+}
+
+// start_replication: leader (log + stream) or follower, depending on the options
+bool start_replication() {
+	if (REPLICATION_LEADER && REPLICATION_FOLLOWER) {
+		cerr << "replication: a server cannot be leader and follower at once\n";
+		return false;
+	}
+	if (REPLICATION_LEADER) {
+		if (!wal_start(has_predecessor())) return false;
+		thread(leader_accept_loop).detach();
+	}
+	if (REPLICATION_FOLLOWER) thread(follower_loop).detach();
+	return true;
+}
+
+string replication_stats() {
+	ostringstream oss;
+	if (REPLICATION_LEADER) {
+		uint64_t last = wal_last_lsn();
+		lock_guard<mutex> lock(followers_mutex);
+		oss << "replication: role=leader lsn=" << last << " followers=" << followers.size() << "\n";
+		for (const FollowerState& f : followers) {
+			oss << "replication: follower " << f.peer << " acked=" << f.acked << " lag=" << last - min(last, f.acked)
+			    << " last_ack=" << epoch_ms_now() - f.ack_ms << "ms ago\n";
+		}
+	} else if (REPLICATION_FOLLOWER) {
+		uint64_t applied = follower_applied, leader = follower_leader_lsn;
+		oss << "replication: role=follower leader=" << replication_leader.spec
+		    << " connected=" << (follower_connected ? "yes" : "no") << " applied=" << applied
+		    << " leader_lsn=" << leader << " lag=" << leader - min(leader, applied)
+		    << " apply_delay=" << follower_apply_delay_ms << "ms\n";
+	} else {
+		oss << "replication: off\n";
+	}
+	return oss.str();
+}
@@ -0,0 +1,101 @@
+// ring.cpp
+// Consistent-hash ring mapping mailboxes (usernames) to backend servers, used by the
+// routing proxy (proxy.cpp). Every node is placed on the ring vnodes * weight times
+// (virtual nodes at hash("<name>#<i>")), a user belongs to the first point at or after
+// hash(user). Adding or removing a node only moves the users between its points and
+// their predecessors - about 1/N of all mailboxes, everything else stays where it is.
+//
+// Ring file, one node per line ("#" starts a comment):
+//
+//   <name> <address> [weight]
+//   a tcp:127.0.0.1:8081
+//   b unix:/run/twmailer-b.sock 2
+//
+// Points depend on the name only: a node can move to another address (listeners.cpp
+// syntax) without moving a single mailbox.
+
+#include <openssl/evp.h>
+
+#define RING_DEFAULT_VNODES 160
+
+struct RingNode {
+	string name;
+	Listener address;
+	unsigned weight = 1;
+};
+
+struct Ring {
+	vector<RingNode> nodes;
+	vector<pair<uint64_t, uint32_t>> points; // sorted (hash, node index)
+};
+
+static unsigned RING_VNODES = RING_DEFAULT_VNODES;
+
+// set_ring_vnodes: virtual nodes per node and weight unit
+void set_ring_vnodes(unsigned vnodes) {
+	RING_VNODES = vnodes ? vnodes : 1;
+}
+
+// ring_hash: first 8 bytes of SHA-256 (evenly spread, unlike short FNV keys)
+static uint64_t ring_hash(const string& key) {
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	EVP_Digest(key.data(), key.size(), digest, &len, EVP_sha256(), nullptr);
+	uint64_t h = 0;
+	for (int i = 0; i < 8; ++i) h = (h << 8) | digest[i];
+	return h;
+}
+
+// load_ring: reads a ring file, false (and `err`) if it is malformed or empty
+bool load_ring(const string& path, Ring& ring, string& err) {
+	ring = Ring();
+	ifstream in(path);
+	if (!in) {
+		err = "cannot open " + path;
+		return false;
+	}
+	string line;
+	for (int line_no = 1; getline(in, line); ++line_no) {
+		line = line.substr(0, line.find('#'));
+		istringstream fields(line);
+		RingNode node;
+		string address;
+		if (!(fields >> node.name)) continue;
+		if (!(fields >> address) || !parse_listener(address, node.address)) {
+			err = path + ":" + to_string(line_no) + ": expected <name> <address> [weight]";
+			return false;
+		}
+		if (fields >> node.weight && node.weight == 0) {
+			err = path + ":" + to_string(line_no) + ": weight must be >= 1";
+			return false;
+		}
+		for (const RingNode& n : ring.nodes) {
+			if (n.name == node.name) {
+				err = path + ":" + to_string(line_no) + ": node '" + node.name + "' listed twice";
+				return false;
+			}
+		}
+		ring.nodes.push_back(node);
+	}
+	if (ring.nodes.empty()) {
+		err = path + ": no nodes";
+		return false;
+	}
+
+	for (uint32_t n = 0; n < ring.nodes.size(); ++n) {
+		unsigned count = RING_VNODES * ring.nodes[n].weight;
+		for (unsigned i = 0; i < count; ++i) {
+			ring.points.emplace_back(ring_hash(ring.nodes[n].name + "#" + to_string(i)), n);
+		}
+	}
+	sort(ring.points.begin(), ring.points.end());
+	return true;
+}
+
+// ring_owner: node that holds the mailbox of `username`
+const RingNode& ring_owner(const Ring& ring, const string& username) {
+	uint64_t h = ring_hash(username);
+	auto it = lower_bound(ring.points.begin(), ring.points.end(), make_pair(h, (uint32_t)0));
+	if (it == ring.points.end()) it = ring.points.begin(); // wrap around
+	return ring.nodes[it->second];
+}
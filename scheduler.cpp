@@ -0,0 +1,207 @@
+// scheduler.cpp
+// Fair scheduling of request execution across users. Connection threads still receive
+// and parse their requests, but a command only runs while it holds one of SCHED_SLOTS
+// execution slots (--sched-slots, default 2 per core, 0 = no scheduling). Waiting
+// requests are queued per user and slots are handed out by deficit round robin:
+// a user's turn adds quantum * weight to its deficit, requests are served while
+// their cost (SEND/DELETE 2, the rest 1) fits into it. A user with many connections
+// therefore gets its weighted share of the slots, not one slot per connection.
+//
+//   --user-weight=<user>:<weight>   (repeatable, default 1)
+//   --user-concurrency=<n>          slots one user may hold at once, 0 = no cap
+//                                   (default half of the slots, at least 1)
+//
+// STATS shows slots in use, queued requests and, for the users that waited longest,
+// how long their requests were queued (average, p99 from a log2 histogram, max).
+
+#include <deque>
+#include <unordered_map>
+
+#define SCHED_QUANTUM 2
+#define SCHED_HIST_BUCKETS 32 // log2 microseconds
+#define SCHED_STATS_USERS 10
+#define SCHED_USER_CAP_AUTO UINT_MAX // --user-concurrency not given
+
+struct SchedWaiter {
+	condition_variable cv;
+	bool granted = false;
+	unsigned cost;
+};
+
+struct SchedUser {
+	deque<SchedWaiter*> queue;
+	long deficit = 0;
+	unsigned running = 0;
+	bool active = false; // in sched_active
+	// queue time of served requests
+	unsigned long served = 0;
+	uint64_t wait_total_us = 0;
+	uint64_t wait_max_us = 0;
+	unsigned long wait_hist[SCHED_HIST_BUCKETS] = {};
+};
+
+static unsigned SCHED_SLOTS = 2 * max(1u, thread::hardware_concurrency());
+static unsigned SCHED_USER_CAP = SCHED_USER_CAP_AUTO;
+static unordered_map<string, unsigned> sched_weights;
+static mutex sched_mutex;
+static unordered_map<string, SchedUser> sched_users;
+static deque<string> sched_active; // users with queued requests, round-robin order
+static unsigned sched_running = 0;
+static unsigned long sched_queued_total = 0; // requests that had to wait
+
+// set_sched_slots: commands executing at once, 0 disables the scheduler
+void set_sched_slots(unsigned slots) {
+	SCHED_SLOTS = slots;
+}
+
+// set_user_concurrency: slots one user may hold at once, 0 = no cap
+void set_user_concurrency(unsigned cap) {
+	SCHED_USER_CAP = cap;
+}
+
+// set_user_weight: "<user>:<weight>", share of the slots relative to weight 1
+bool set_user_weight(const string& spec) {
+	size_t colon = spec.rfind(':');
+	if (colon == string::npos || colon == 0) return false;
+	unsigned long weight = strtoul(spec.c_str() + colon + 1, nullptr, 10);
+	if (weight == 0) return false;
+	sched_weights[spec.substr(0, colon)] = (unsigned)weight;
+	return true;
+}
+
+static unsigned sched_weight(const string& username) {
+	auto it = sched_weights.find(username);
+	return it == sched_weights.end() ? 1 : it->second;
+}
+
+// sched_user_cap: slots one user may hold, 0 = no cap. Without --user-concurrency one
+// user can take at most half of the slots, the others always find one free.
+static unsigned sched_user_cap() {
+	return SCHED_USER_CAP == SCHED_USER_CAP_AUTO ? max(1u, SCHED_SLOTS / 2) : SCHED_USER_CAP;
+}
+
+static unsigned sched_cost(Opcode op) {
+	return (op == Opcode::SEND || op == Opcode::SENDATT || op == Opcode::DELETE || op == Opcode::DELID) ? 2 : 1;
+}
+
+// sched_dispatch: hands free slots to queued requests (caller holds sched_mutex)
+static void sched_dispatch() {
+	size_t capped = 0; // users in a row skipped because of their cap
+	const unsigned cap = sched_user_cap();
+	while (sched_running < SCHED_SLOTS && !sched_active.empty() && capped < sched_active.size()) {
+		SchedUser& u = sched_users[sched_active.front()];
+		if (cap && u.running >= cap) {
+			sched_active.push_back(sched_active.front());
+			sched_active.pop_front();
+			capped++;
+			continue;
+		}
+		SchedWaiter* w = u.queue.front();
+		if (u.deficit < (long)w->cost) {
+			// turn over: next round this user has its quantum
+			u.deficit += SCHED_QUANTUM * sched_weight(sched_active.front());
+			sched_active.push_back(sched_active.front());
+			sched_active.pop_front();
+			continue;
+		}
+		u.deficit -= w->cost;
+		u.queue.pop_front();
+		u.running++;
+		sched_running++;
+		w->granted = true;
+		w->cv.notify_one();
+		capped = 0;
+		if (u.queue.empty()) {
+			u.deficit = 0;
+			u.active = false;
+			sched_active.pop_front();
+		}
+	}
+}
+
+// SchedSlot: waits for an execution slot for a command of `username`, releases it
+// when destroyed
+class SchedSlot {
+public:
+	SchedSlot(const string& username, Opcode op) : username(username) {
+		if (SCHED_SLOTS == 0) return;
+		TraceSpan span("sched_wait");
+		auto start = chrono::steady_clock::now();
+		SchedWaiter w;
+		w.cost = sched_cost(op);
+
+		unique_lock<mutex> lock(sched_mutex);
+		SchedUser& u = sched_users[username];
+		u.queue.push_back(&w);
+		if (!u.active) {
+			u.active = true;
+			sched_active.push_back(username);
+		}
+		sched_dispatch();
+		if (!w.granted) {
+			sched_queued_total++;
+			w.cv.wait(lock, [&] { return w.granted; });
+		}
+		held = true;
+
+		uint64_t waited = chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+		u.served++;
+		u.wait_total_us += waited;
+		u.wait_max_us = max(u.wait_max_us, waited);
+		int bucket = 0;
+		while (bucket + 1 < SCHED_HIST_BUCKETS && (1ull << (bucket + 1)) <= waited) bucket++;
+		u.wait_hist[bucket]++;
+	}
+
+	~SchedSlot() {
+		if (!held) return;
+		lock_guard<mutex> lock(sched_mutex);
+		sched_users[username].running--;
+		sched_running--;
+		sched_dispatch();
+	}
+
+	SchedSlot(const SchedSlot&) = delete;
+	SchedSlot& operator=(const SchedSlot&) = delete;
+
+private:
+	const string& username;
+	bool held = false;
+};
+
+// upper bound of the histogram bucket holding the p-th percentile
+static uint64_t sched_percentile(const SchedUser& u, double p) {
+	unsigned long target = (unsigned long)(u.served * p), seen = 0;
+	for (int b = 0; b < SCHED_HIST_BUCKETS; ++b) {
+		seen += u.wait_hist[b];
+		if (seen > target) return 1ull << (b + 1);
+	}
+	return u.wait_max_us;
+}
+
+string sched_stats() {
+	if (SCHED_SLOTS == 0) return "sched: off\n";
+	lock_guard<mutex> lock(sched_mutex);
+	size_t queued = 0;
+	vector<pair<uint64_t, const string*>> by_wait;
+	for (const auto& entry : sched_users) {
+		queued += entry.second.queue.size();
+		by_wait.emplace_back(entry.second.wait_total_us, &entry.first);
+	}
+	size_t shown = min<size_t>(by_wait.size(), SCHED_STATS_USERS);
+	partial_sort(by_wait.begin(), by_wait.begin() + shown, by_wait.end(),
+	             [](const auto& a, const auto& b) { return a.first > b.first; });
+
+	ostringstream oss;
+	oss << "sched: slots=" << SCHED_SLOTS << " running=" << sched_running << " queued=" << queued
+	    << " user_cap=" << sched_user_cap() << " users=" << sched_users.size() << " waited=" << sched_queued_total << "\n";
+	for (size_t i = 0; i < shown; ++i) {
+		const string& name = *by_wait[i].second;
+		const SchedUser& u = sched_users.at(name);
+		oss << "sched: user " << name << " weight=" << sched_weight(name) << " running=" << u.running
+		    << " queued=" << u.queue.size() << " served=" << u.served
+		    << " wait_avg=" << (u.served ? u.wait_total_us / u.served : 0) << "us"
+		    << " wait_p99<=" << sched_percentile(u, 0.99) << "us wait_max=" << u.wait_max_us << "us\n";
+	}
+	return oss.str();
+}
@@ -9,6 +9,13 @@
 #include <fcntl.h>
 
 #include "serverfunctions.cpp"
+#include "bufpool.cpp"
+#include "perfcount.cpp"
+#include "scheduler.cpp"
+#include "listeners.cpp"
+#include "replication.cpp"
+#include "upgrade.cpp"
+#include "idle.cpp"
 
 // Konfigurationsvariablen
 #define SERVER_PORT 8080
@@ -19,11 +26,11 @@
 #define ACK "OK"
 #define ERR "ERR"
 #define connected_msg "connected"
-
-int server_socket; // Globale Variable für sauberes Beenden bei Signalen
+#define RESUME_PREFIX "RESUME|"
 
 // Funktion zum sicheren Senden aller Daten ( von lecture notes )
 int sendall(int socket, const char *buffer, size_t length) {
+    TraceSpan span("sendall");
     size_t total_sent = 0;
     size_t bytes_left = length;
     int bytes_sent;
@@ -41,10 +48,26 @@ int sendall(int socket, const char *buffer, size_t length) {
 }
 
 // Signal-Handler für sauberes Beenden
+// leave_process: _exit statt exit/return aus main, sobald Hintergrund-Threads laufen:
+// statische condition_variables mit wartenden Threads (z.B. der Reclaimer) blockieren
+// sonst beim Zerstören
+[[noreturn]] static void leave_process(int status) {
+    std::cout.flush();
+    std::cerr.flush();
+    _exit(status);
+}
+
 void signal_handler(int signal_number) {
     std::cout << endl << "Closing Server..." << endl;
-    close(server_socket);
-    exit(EXIT_SUCCESS);
+    // after a handover the listeners (and unix socket files) belong to the new process
+    if (!is_draining()) close_listeners();
+    leave_process(EXIT_SUCCESS);
+}
+
+static int trace_pipe[2] = {-1, -1};
+
+void trace_signal_handler(int signal_number) {
+    if (write(trace_pipe[1], "t", 1) < 0) {}
 }
 
 // handler um ACK/ERR meldungen jenach befehlserfolg zu senden
@@ -68,9 +91,9 @@ bool ack_handler(int client_socket, bool rtrn) {
     }
 }
 
-// login handler function
+// login handler function: "<username>" + "<password>" or "RESUME|<token>"
 // returns username if successful, empty string if not
-string function_login(int client_socket) {
+string function_login(int client_socket, const string& peer) {
     string username, password;
 
     // 1. recv user from Client
@@ -83,6 +106,13 @@ string function_login(int client_socket) {
     buffer[bytes_received] = '\0';
     username = buffer;
 
+    // Reconnect mit Session-Token statt Passwort: kein LDAP-Bind
+    if (username.rfind(RESUME_PREFIX, 0) == 0) {
+        string user = validate_resume(string_view(username).substr(strlen(RESUME_PREFIX)), peer_host(peer));
+        if (user.empty()) std::cout << "Rejected session token.\n";
+        return user;
+    }
+
     // 2. recv password from Client
     memset(buffer, 0, sizeof(buffer));
     bytes_received = recv(client_socket, buffer, sizeof(buffer)-1, 0);
@@ -94,7 +124,7 @@ string function_login(int client_socket) {
     password = buffer;
 
     // 3. Login prüfen
-    if (validate_login(username, password)) {
+    if (validate_login(username, password, peer_host(peer))) {
         // ack handler handels response
         return username;
     } else {
@@ -104,148 +134,395 @@ string function_login(int client_socket) {
     }
 }
 
-bool function_send(char* buffer, string username) {
-    // Extrahiere den Nachrichtentext nach "SEND|"
-    const char* msg_start = buffer + 5; // 5 ist die Länge von "SEND|"
-    string message(msg_start);
+bool function_send(const Request& req, const string& username) {
+    // Felder nach "SEND|": recipients|subject|message (message darf '|' enthalten)
+    if (req.field_count < 3) {
+        cerr << "function_send: invalid message format (expected: recipient|subject|message)\n";
+        return false;
+    }
 
-    std::cout << "SEND Function Called With Message: " << message << endl;
+    std::cout << "SEND Function Called With Message: " << req.args << endl;
 
-    bool rtrn = save_mail(username, message);
+    bool rtrn = save_mail(username, req.fields[0], req.fields[1], field_rest(req, 2));
     return rtrn;
 }
 
+// SENDATT|recipients|subject|upload-id[,upload-id...]|message: SEND mit Anhängen (attach.cpp)
+bool function_send_attach(const Request& req, const string& username) {
+    if (req.field_count < 4) {
+        cerr << "function_send_attach: invalid message format (expected: recipient|subject|upload-ids|message)\n";
+        return false;
+    }
+
+    std::cout << "SENDATT Function Called With Attachments: " << req.fields[2] << endl;
+    return save_mail(username, req.fields[0], req.fields[1], field_rest(req, 3), req.fields[2]);
+}
+
 // list all messages of user
-bool function_list(int client_socket, const std::string& username) {
+bool function_list(Reply& out, const std::string& username) {
     std::cout << "LIST Function Called" << std::endl;
 
     string list_result = list_mails(username); 
-    // Sende Ergebnis an Client
-    int bytes_sent = send(client_socket, list_result.c_str(), list_result.size(), 0);
-    if (bytes_sent < 0) {
-        cerr << "function_list: Failed To Send Mail-List To Client" << std::endl;
-        return false;
-    }
+    // Ergebnis in die Antwort (gesendet nach dem Kommando)
+    out.append(list_result);
 
-    std::cout << "LIST: Sent Mail-List For User '" << username << "'" << std::endl;
+    std::cout << "LIST: Mail-List For User '" << username << "'" << std::endl;
     return true;
 }
 
-bool function_read(int client_socket, char* buffer) {
-    // Nachricht nach "READ|" extrahieren
-    const char* msg_start = buffer + 5; // Länge von "READ|"
-    string message(msg_start);
-
-    cout << "READ Function Called With Message: " << message << endl;
+bool function_read(Reply& out, const Request& req) {
+    TraceSpan span("function_read");
+    cout << "READ Function Called With Message: " << req.args << endl;
 
     // Parse: username|index
-    size_t pipe_pos = message.find('|');
-    if (pipe_pos == string::npos) {
+    if (req.field_count != 2) {
         cerr << "function_read: Invalid message format (expected: username|index)\n";
-        string err = string(ERR) + "Invalid message format";
-        send(client_socket, err.c_str(), err.size(), 0);
+        out.append(string(ERR) + "Invalid message format");
         return false;
     }
 
-    string username = message.substr(0, pipe_pos);
-    string index_str = message.substr(pipe_pos + 1);
+    string username(req.fields[0]);
+    if (!valid_mailbox_name(username)) {
+        out.append(string(ERR) + "Invalid mailbox name");
+        return false;
+    }
     int mail_index = 0;
-    try {
-        mail_index = stoi(index_str);
-    } catch (...) {
-        string err = string(ERR) + "Invalid mail index";
-        send(client_socket, err.c_str(), err.size(), 0);
+    if (!parse_index(req.fields[1], mail_index)) {
+        out.append(string(ERR) + "Invalid mail index");
         return false;
     }
 
     if (mail_index <= 0) {
-        string err = string(ERR) + "Mail index must be >= 1";
-        send(client_socket, err.c_str(), err.size(), 0);
+        out.append(string(ERR) + "Mail index must be >= 1");
         return false;
     }
 
-    // Liste alle Mails für den User
-    vector<filesystem::path> user_mails;
-    fs::path user_dir = BASE_DIR / username;
-    if (!fs::exists(user_dir) || !fs::is_directory(user_dir)) {
-        string err = string(ERR) + "User directory not found";
-        send(client_socket, err.c_str(), err.size(), 0);
-        return false;
+    // Hot path: Antwort aus dem Cache, kein Dateisystemzugriff
+    string cached;
+    bool hit;
+    {
+        TraceSpan span("cache_get");
+        hit = cache_get(username, cache_read_key(username, mail_index), cached);
     }
-
-    for (const auto& entry : fs::directory_iterator(user_dir)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".txt") {
-            user_mails.push_back(entry.path());
-        }
+    if (hit) {
+        out.append(cached);
+        cout << "function_read: cached mail #" << mail_index << "\n";
+        return true;
     }
 
-    if (mail_index > (int)user_mails.size()) {
-        string err = string(ERR) + "Mail index out of range";
-        send(client_socket, err.c_str(), err.size(), 0);
+    // Mail über den Mailbox-Index auflösen (Generation vorher: Änderungen dazwischen -> nicht cachen)
+    uint64_t generation = cache_generation(username);
+    MailEntry entry;
+    int found;
+    {
+        TraceSpan span("mailbox_entry");
+        found = mailbox_entry(username, mail_index, entry);
+    }
+    if (found < 0) {
+        out.append(string(ERR) + "User directory not found");
         return false;
     }
-
-    // Mail-Datei lesen
-    ifstream ifs(user_mails[mail_index - 1]);
-    if (!ifs) {
-        string err = string(ERR) + "Failed to open mail";
-        send(client_socket, err.c_str(), err.size(), 0);
+    if (found == 0) {
+        out.append(string(ERR) + "Mail index out of range");
         return false;
     }
 
-    string line, content;
-    while (getline(ifs, line)) {
-        content += line + "\n";
+    // Mail-Datei lesen (Body wird bei Kompression transparent entpackt)
+    string content;
+    if (!load_mail_by_id(username, entry.id, content)) {
+        out.append(string(ERR) + "Failed to open mail");
+        return false;
     }
-    ifs.close();
+    if (!content.empty() && content.back() != '\n') content += "\n";
 
-    string resp = content;
-    send(client_socket, resp.c_str(), resp.size(), 0);
-    cout << "function_read: sent mail #" << mail_index << " to client\n";
+    string resp = render_mail_dates(content);
+    cache_put(username, cache_read_key(username, mail_index), resp, generation);
+    out.append(resp);
+    cout << "function_read: mail #" << mail_index << "\n";
     return true;
 }
 
+// READID|<message-id>: reads a mail of the logged-in user by its id
+bool function_read_id(Reply& out, const Request& req, const string& username) {
+    cout << "READID Function Called With Message: " << req.args << endl;
 
-bool handle_commands(int client_socket, char* buffer, const std::string& username) {
-    // SEND
-    if (strncmp(buffer, "SEND", 4) == 0) {
-        bool rtrn = function_send(buffer, username);
-        return rtrn;
-    }
+    string resp = (req.field_count == 1 && !req.args.empty())
+        ? read_mail(username, string(req.args))
+        : string(ERR) + "Invalid message format";
+    out.append(resp);
+    return resp.rfind(ERR, 0) != 0;
+}
+
+// ATTACH|<name>|<size>|<crc32c>: starts or resumes an attachment upload
+bool function_attach(Reply& out, const Request& req, const string& username) {
+    string resp = (req.field_count == 3)
+        ? attach_begin(username, req.fields[0], req.fields[1], req.fields[2])
+        : string(ERR) + "Invalid message format";
+    out.append(resp);
+    return resp.rfind(ERR, 0) != 0;
+}
 
-    // READ
-    if (strncmp(buffer, "READ", 4) == 0) {
-        bool rtrn = function_read(client_socket, buffer);
-        return rtrn;
+// APUT|<upload-id>|<offset>|<length>|<crc32c>|<bytes>: one chunk of an upload
+bool function_attach_put(Reply& out, const Request& req, const string& username) {
+    // das letzte Feld (MAX_FIELDS) enthält "<crc32c>|<bytes>"
+    string_view rest = (req.field_count == 4) ? req.fields[3] : string_view();
+    size_t pipe = rest.find('|');
+    string resp = (pipe != string_view::npos)
+        ? attach_put(username, req.fields[0], req.fields[1], req.fields[2], rest.substr(0, pipe), rest.substr(pipe + 1))
+        : string(ERR) + "Invalid message format";
+    out.append(resp);
+    return resp.rfind(ERR, 0) != 0;
+}
+
+// AGET|<message-id>|<n>|<offset>[|<length>]: chunk of an attachment, direkt aus der
+// Datei gesendet (sendfile), der Server hält davon nichts im Speicher
+bool function_attach_get(Reply& out, const Request& req, const string& username) {
+    TraceSpan span("function_attach_get");
+    Attachment a;
+    string err;
+    int index = 0;
+    uint64_t offset = 0, length = ATTACH_CHUNK_MAX;
+    if (req.field_count < 3 || !parse_index(req.fields[1], index) || !parse_u64(req.fields[2], offset) ||
+        (req.field_count == 4 && !parse_u64(req.fields[3], length))) {
+        err = "Invalid message format";
+    } else if (attach_find(username, string(req.fields[0]), index, a, err) && offset > a.size) {
+        err = "Offset beyond end of attachment";
     }
 
-    // LIST
-    if (strncmp(buffer, "LIST", 4) == 0) {
-        bool rtrn = function_list(client_socket, username);
-        return rtrn;
+    int fd = -1;
+    uint32_t crc = 0;
+    if (err.empty()) {
+        length = min<uint64_t>(min<uint64_t>(length, ATTACH_CHUNK_MAX), a.size - offset);
+        fd = attach_open(a);
+        if (fd < 0) err = "Attachment missing";
+        else if (!attach_range_crc(fd, offset, length, crc)) err = "Failed to read attachment";
+    }
+    if (!err.empty()) {
+        if (fd >= 0) close(fd);
+        out.append(string(ERR) + err);
+        return false;
     }
 
-    // DELETE
-    if (strncmp(buffer, "DELETE", 6) == 0) {
-        bool rtrn = function_delete(client_socket, buffer);
-        return rtrn;
+    // OK|<offset>|<length>|<size>|<chunk crc>|<file crc>|<bytes>, die Bytes per sendfile
+    string header = string(ACK) + "|" + to_string(offset) + "|" + to_string(length) + "|" + to_string(a.size) + "|" +
+                    crc32c_hex(crc) + "|" + crc32c_hex(a.crc) + "|";
+    out.append(header);
+    out.append_file(fd, offset, length);
+    attach_sent_bytes += length;
+    return true;
+}
+
+// server statistics (cache, buffer pool, ...)
+bool function_stats(Reply& out) {
+    std::cout << "STATS Function Called" << std::endl;
+
+    string stats = cache_stats() + pool_stats() + warmup_progress() + snapshot_stats() + catalog_stats() + layout_stats() + archive_stats() + reclaim_stats() + session_stats() + replication_stats() + trace_stats() + perf_stats() + ratelimit_stats() + sched_stats() + idle_stats() + attach_stats();
+    out.append(stats);
+    return true;
+}
+
+// write_trace: dumps the trace buffers to <BASE_DIR>/.trace, returns the file name
+string write_trace() {
+    fs::path dir = get_base_dir() / TRACE_DIR;
+    error_code ec;
+    fs::create_directories(dir, ec);
+    string path = trace_dump(dir.string());
+    if (path.empty()) cerr << "Failed to write trace to " << dir << endl;
+    else std::cout << "Trace written to " << path << endl;
+    return path;
+}
+
+// TRACE: dumps the sampled spans (Chrome trace JSON), answers with the file name
+bool function_trace(Reply& out) {
+    std::cout << "TRACE Function Called" << std::endl;
+    string path = write_trace();
+    out.append(path.empty() ? string(ERR) + "Failed to write trace" : path);
+    return !path.empty();
+}
+
+// handle_commands: führt ein Kommando aus, die Antwort landet in `out`
+bool handle_commands(Reply& out, const Request& req, const std::string& username) {
+    TraceSpan span("handle_commands");
+    PerfScope perf(req.op); // --perf-counters
+    // Standby-Server: nur lesende Kommandos, Änderungen kommen über die Replikation
+    if (replica_read_only() && (req.op == Opcode::SEND || req.op == Opcode::DELETE || req.op == Opcode::DELID ||
+                                req.op == Opcode::SENDATT || req.op == Opcode::ATTACH || req.op == Opcode::APUT)) {
+        std::cout << "Rejected " << req.command << " on read-only replica" << endl;
+        out.append(string(ERR) + "Read-only replica");
+        return false;
     }
 
-    // QUIT is handled in server.cpp->handle_client
+    switch (req.op) {
+        case Opcode::SEND:
+            return function_send(req, username);
+        case Opcode::READ:
+            return function_read(out, req);
+        case Opcode::LIST:
+            return function_list(out, username);
+        case Opcode::DELETE: {
+            string err;
+            if (function_delete(req, err)) return true;
+            out.append(err);
+            return false;
+        }
+        case Opcode::READID:
+            return function_read_id(out, req, username);
+        case Opcode::DELID: {
+            string err;
+            if (function_delete_id(req, username, err)) return true;
+            out.append(err);
+            return false;
+        }
+        case Opcode::STATS:
+            return function_stats(out);
+        case Opcode::TRACE:
+            return function_trace(out);
+        case Opcode::SENDATT:
+            return function_send_attach(req, username);
+        case Opcode::ATTACH:
+            return function_attach(out, req, username);
+        case Opcode::APUT:
+            return function_attach_put(out, req, username);
+        case Opcode::AGET:
+            return function_attach_get(out, req, username);
+        case Opcode::DONE:
+            // nur nach IDLE sinnvoll (z.B. nach einem Neustart schon beendet) -> einfach bestätigen
+            out.append(IDLE_OK);
+            return true;
+        default:
+            // QUIT is handled in server.cpp->handle_client
+            break;
+    }
 
     // Unbekanntes Kommando
-    std::cout << "Unknown command received: " << buffer << endl;
+    std::cout << "Unknown command received: " << req.command << endl;
+    out.append(string(ERR) + "Unknown command");
     return false;
 }
 
 
+// Mail-Commands eines eingeloggten Clients (auch für vom Vorgänger übernommene Verbindungen)
+void serve_client(int client_socket, const string& peer, const string& username) {
+    ActiveConnection active;
+
+    // requests are received into pooled buffers charged to this connection
+    ConnMemory conn_memory;
+    BufferChain request(conn_memory);
+    Reply reply(conn_memory); // Antworten ebenfalls in Pool-Blöcken
+    const string host = peer_host(peer);
+
+    bool is_running = true;
+    while (is_running) {
+        // Neustart (SIGUSR2): Verbindung zwischen zwei Kommandos an den neuen Prozess übergeben
+        if (!wait_for_request(client_socket)) {
+            if (handoff_connection(client_socket, username, peer)) {
+                std::cout << "Connection with client (" << peer << ") handed over" << std::endl;
+                close(client_socket);
+                return;
+            }
+            std::cerr << "Handover of client (" << peer << ") failed - closing connection" << std::endl;
+            break;
+        }
+
+        size_t header = 0; // "#<length>|" (framed request), die Antwort wird genauso gerahmt
+        long request_size = recv_request(client_socket, request, BUFFER_SIZE, header);
+        const char* data = (request_size > 0) ? request.contiguous() : nullptr;
+        const bool framed = header > 0;
+        if (request_size == 0) {
+            // Client has closed Socket properly
+            std::cout << "Client (" << peer << ") has closed connection" << std::endl;
+            break;
+        } else if (request_size == -2 || (request_size > 0 && !data)) {
+            // memory budget exhausted or request too large -> rest of the request is lost
+            std::cerr << "Request rejected (memory budget) - closing connection" << std::endl;
+            string err = frame_text(string(ERR) + "Server busy", framed);
+            sendall(client_socket, err.c_str(), err.size());
+            break;
+        } else if (request_size < 0) {
+            std::cerr << "Failed receiving data - closing connection" << std::endl;
+            break;
+        }
+
+        // Stichprobe: nur jeder N-te Request wird getraced (--trace-sample)
+        trace_sample_request();
+        TraceSpan span("request");
+
+        // single pass, no allocation: fields are views into the request buffer
+        Request req;
+        {
+            TraceSpan parse_span("parse_request");
+            parse_request(data + header, request_size - header, req);
+        }
+
+        //Quit is handled here instead of handle_commands -> loop break necessary
+        if (req.op == Opcode::QUIT || req.op == Opcode::EXIT) {
+            std::cout << "Client (" << peer << ") requested to quit" << std::endl;
+            break;
+        }
+
+        // Token-Bucket pro User/Adresse: zu schnelle Clients bekommen ERR statt Arbeit
+        if (!rate_allow_command(username, host)) {
+            string err = frame_text(string(ERR) + "Rate limit exceeded", framed);
+            sendall(client_socket, err.c_str(), err.size());
+            request.clear();
+            trace_end_request();
+            continue;
+        }
+
+        // IDLE: Socket an den Watcher (idle.cpp) übergeben, der Thread endet hier
+        if (req.op == Opcode::IDLE) {
+            request.clear();
+            trace_end_request();
+            if (idle_park(client_socket, peer, username)) {
+                std::cout << "Client (" << peer << ") is idle, waiting for new mail" << std::endl;
+                return;
+            }
+            string err = frame_text(string(ERR) + "IDLE not available", framed);
+            sendall(client_socket, err.c_str(), err.size());
+            continue;
+        }
+
+        bool rtrn;
+        {
+            // Ausführung über den Scheduler: faire Anteile pro User statt pro Verbindung.
+            // Der Slot gilt nur für das Kommando, nicht für das Senden (langsame Clients)
+            SchedSlot slot(username, req.op);
+            rtrn = handle_commands(reply, req, username);
+        }
+
+        // ACK/ERR für SEND, SENDATT, DELETE, DELID (eine Fehlermeldung des Kommandos ersetzt das ERR)
+        if ((req.op == Opcode::SEND || req.op == Opcode::SENDATT || req.op == Opcode::DELETE || req.op == Opcode::DELID) &&
+            (rtrn || reply.empty())) {
+            reply.append(rtrn ? ACK : ERR);
+        }
+        bool sent;
+        {
+            TraceSpan send_span("send");
+            sent = reply.send(client_socket, framed);
+        }
+        if (!sent) {
+            std::cerr << "Failed sending reply - closing connection" << std::endl;
+            request.clear();
+            trace_end_request();
+            break;
+        }
+
+        // idle connections hold no buffers
+        request.clear();
+        trace_end_request();
+    }
+
+    close(client_socket);
+    std::cout << "Connection with client (" << peer << ") closed" << std::endl;
+}
+
 // Funktion zur Behandlung einer Client-Verbindung (für Thread)
-void handle_client(int client_socket, sockaddr_in client_addr) {
+void handle_client(int client_socket, const string& peer) {
+    ActiveConnection active; // auch in der Login-Phase, für den Drain beim Neustart
     char buffer[BUFFER_SIZE];
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
+    trace_sample_request(); // Handshake + Login zählen als ein Request
 
-    std::cout << "Connection Established With " << client_ip << ":" << ntohs(client_addr.sin_port) << std::endl;
+    std::cout << "Connection Established With " << peer << std::endl;
 
     // --- Initiale Verbindungsbestätigung ---
     memset(buffer, 0, BUFFER_SIZE);
@@ -277,71 +554,157 @@ void handle_client(int client_socket, sockaddr_in client_addr) {
 
 
 
-    while (!logged_in) {
-        string result = function_login(client_socket);
+    // höchstens LOGIN_MAX_TRIES Versuche pro Verbindung (ratelimit.cpp)
+    for (int attempt = 0; attempt < LOGIN_MAX_TRIES && !logged_in; ++attempt) {
+        string result;
+        {
+            TraceSpan span("login");
+            result = function_login(client_socket, peer);
+        }
 
         if (!result.empty()) {
             logged_in = true;
             username = result;
-            // ack handler handels response
             std::cout << "User Logged In: " << username << std::endl;
+            // ACK with a fresh session token for later reconnects: "OK|<token>"
+            string token = issue_session_token(username);
+            string ack = token.empty() ? string(ACK) : string(ACK) + "|" + token;
+            if (sendall(client_socket, ack.c_str(), ack.size()) == -1) {
+                cerr << "Error Sending ACK-Response" << endl;
+            }
+        } else {
+            ack_handler(client_socket, false);
         }
-        ack_handler(client_socket, (!result.empty()));
-        
+
         // If login failed, flush any remaining data in the socket buffer
         if (!logged_in) {
             char flush_buffer[1024];
             int flags = fcntl(client_socket, F_GETFL, 0);
             fcntl(client_socket, F_SETFL, flags | O_NONBLOCK); // Set non-blocking
-            while (recv(client_socket, flush_buffer, sizeof(flush_buffer), 0) > 0) {
+            int flushed;
+            while ((flushed = recv(client_socket, flush_buffer, sizeof(flush_buffer), 0)) > 0) {
                 // Flush buffer
             }
             fcntl(client_socket, F_SETFL, flags); // Restore original flags
+            if (flushed == 0) break; // client gone (e.g. dropped connection during RESUME)
         }
     }
 
+    trace_end_request();
     if (!logged_in) {
         std::cout << "Client failed to login. Closing connection." << std::endl;
         close(client_socket);
         return;
     }
 
-    // --- Mail-Commands ---
-    bool is_running = true;
-    while (is_running) {
-        memset(buffer, 0, BUFFER_SIZE);
-        bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-        if (bytes_received == 0) {
-            // Client has closed Socket properly
-            std::cout << "Client (" << client_ip << ":" << ntohs(client_addr.sin_port) << ") has closed connection" << std::endl;
-            break;
-        } else if (bytes_received < 0) {
-            std::cerr << "Failed receiving data - closing connection" << std::endl;
-            break;
-        }
-        buffer[bytes_received] = '\0';
-        std::string cmd(buffer);
-
-        //Quit is handled here instead of handle_commands -> loop break necessary
-        if (str_tolower(cmd) == "quit" || str_tolower(cmd) == "exit") {
-            std::cout << "Client (" << client_ip << ":" << ntohs(client_addr.sin_port) << ") requested to quit" << std::endl;
-            break;
-        }
+    serve_client(client_socket, peer, username);
+}
 
-        bool rtrn = handle_commands(client_socket, buffer, username);
 
-        // ACK/ERR handling for SEND, DELETE
-        if (strncmp(buffer, "SEND", 4) == 0 || strncmp(buffer, "DELETE", 6) == 0) {
-            ack_handler(client_socket, rtrn);
-        }
-    }
-
-    close(client_socket);
-    std::cout << "Connection with client (" << client_ip << ":" << ntohs(client_addr.sin_port) << ") closed" << std::endl;
-}
 
 
+// parse_option: handles "--name[=value]" command line options
+// returns false for unknown options
+bool parse_option(const string& arg) {
+    size_t eq = arg.find('=');
+    string name = arg.substr(2, eq == string::npos ? string::npos : eq - 2);
+    string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
 
+    if (name == "compress") {
+        // store new mail bodies zstd-compressed (dictionary trained with twmail-admin)
+        set_compression(value.empty() || value == "1" || value == "on");
+        return true;
+    }
+    if (name == "cache-mb") {
+        // memory budget of the READ/LIST cache, 0 disables it
+        set_cache_size(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "warmup-threads") {
+        // threads scanning the spool at startup, 0 disables the warm-up
+        set_warmup_threads(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "snapshot-interval") {
+        // seconds between index checkpoints, 0 disables writing snapshots
+        set_snapshot_interval(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "layout") {
+        // spool layout "flat" or "hashed", mails in the other layout are migrated in the background
+        return set_layout(value);
+    }
+    if (name == "archive-after") {
+        // pack mails older than this many days into compressed archive segments, 0 disables it
+        set_archive_after(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "reclaim-rate") {
+        // unlinks per second of the background reclaimer (DELETE itself only writes a tombstone)
+        set_reclaim_rate(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "session-ttl") {
+        // lifetime of session tokens (RESUME) in seconds, 0 disables them
+        set_session_ttl(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "listen") {
+        // additional listener: unix:/path, tcp:<ip>:<port>, tcp:[<ipv6>]:<port> (repeatable)
+        return add_listener(value);
+    }
+    if (name == "replication-listen") {
+        // write the mutation log and stream it to followers connecting here (tcp:<ip>:<port>, unix:/path)
+        return set_replication_listen(value);
+    }
+    if (name == "follow") {
+        // standby: replicate from the leader at this address and serve LIST/READ only
+        return set_follow(value);
+    }
+    if (name == "drain-timeout") {
+        // seconds a restarting server (SIGUSR2) waits for running commands before it exits
+        set_drain_timeout(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "trace-sample") {
+        // trace every n-th request (dump: SIGUSR1 or TRACE), 0 disables tracing
+        set_trace_sample(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "perf-counters") {
+        // hardware counters (cycles, instructions, cache misses) per command type in STATS
+        set_perf_counters(value.empty() || value == "1" || value == "on");
+        return true;
+    }
+    if (name == "rate-limit") {
+        // commands per second of one user: <rate>[:<burst>] (off by default, e.g. 50:100)
+        return set_rate_limit(value);
+    }
+    if (name == "ip-rate-limit") {
+        // commands per second of one client address (off by default, clients behind a proxy share one)
+        return set_ip_rate_limit(value);
+    }
+    if (name == "sched-slots") {
+        // commands executing at once, shared fairly between users (0 disables the scheduler)
+        set_sched_slots(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "user-weight") {
+        // <user>:<weight> share of the execution slots (repeatable, default 1)
+        return set_user_weight(value);
+    }
+    if (name == "user-concurrency") {
+        // slots one user may hold at once, 0 = no cap
+        set_user_concurrency(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    if (name == "mem-budget-mb") {
+        // global budget for request buffers, connections wait (backpressure) when it is used up
+        set_memory_budget(strtoul(value.c_str(), nullptr, 10));
+        return true;
+    }
+    return false;
+}
 
 int main(int argc, char* argv[]) {
     //std::cout << __cplusplus << std::endl; // C++ Version -> 201703L = C++17
@@ -350,62 +713,75 @@ int main(int argc, char* argv[]) {
     int port = SERVER_PORT;
     string mail_spool_dir = MAIL_SPOOL_DIR;
 
-    // Argumente auswerten
-    if (argc >= 2) {
-        port = atoi(argv[1]);
-    }
-    if (argc >= 3) {
-        mail_spool_dir = argv[2];
+    // Argumente auswerten: [port] [mail-spool-dir] [--option ...]
+    int positional = 0;
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg.rfind("--", 0) == 0) {
+            if (!parse_option(arg)) {
+                cerr << "Unknown option: " << arg << endl;
+                return EXIT_FAILURE;
+            }
+            continue;
+        }
+        if (positional == 0) port = atoi(arg.c_str());
+        else if (positional == 1) mail_spool_dir = arg;
+        positional++;
     }
 
     // Configure base dir for serverfunctions
     set_base_dir(mail_spool_dir);
 
-    struct sockaddr_in server_addr, client_addr;
-    int client_socket;
-    socklen_t client_addr_size;
+    if (get_compression()) {
+        load_current_dictionary();
+    }
 
-    // Signal-Handler einrichten
-    signal(SIGINT, signal_handler);
+    // Secret für Session-Tokens (RESUME) laden oder anlegen
+    load_session_secret();
 
-    // Socket erstellen
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        cerr << "Failed To Create Socket" << endl;
-        return EXIT_FAILURE;
+    // Lösch-Journal zuerst einlesen, gelöschte Mails dürfen beim Laden nicht wieder auftauchen.
+    // Ohne Journal schlägt jedes DELETE fehl (Follower hätten es aber schon ausgeführt)
+    if (!start_reclaimer()) {
+        leave_process(EXIT_FAILURE);
     }
-
-    // Socket-Optionen setzen (Socket-Wiederverwendung)
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-        cerr << "Failed To Set Socket Options" << endl;
-        return EXIT_FAILURE;
+    // Index-Snapshot mappen, dann nur geänderte Mailboxen im Hintergrund scannen
+    // (Server nimmt parallel Verbindungen an)
+    start_snapshots();
+    start_warmup();
+    start_layout_migration();
+    start_archiver();
+    // Mutation-Log / Replikation (Leader oder Follower)
+    if (!start_replication()) {
+        leave_process(EXIT_FAILURE);
     }
 
-    // Server-Adresse konfigurieren
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-
-    // IP-Adresse konvertieren und setzen
-    if (inet_pton(AF_INET, SERVER_IP, &server_addr.sin_addr) <= 0) {
-        cerr << "Invalid Address" << endl;
-        return EXIT_FAILURE;
+    // Signal-Handler einrichten
+    signal(SIGINT, signal_handler);
+    // abgebrochene Verbindungen: send() liefert EPIPE statt den Server zu beenden
+    signal(SIGPIPE, SIG_IGN);
+    // SIGUSR1: Trace-Puffer als JSON schreiben (im eigenen Thread, nicht im Handler)
+    if (pipe2(trace_pipe, O_CLOEXEC) == 0) {
+        signal(SIGUSR1, trace_signal_handler);
+        thread([] {
+            char c;
+            while (read(trace_pipe[0], &c, 1) == 1 || errno == EINTR) write_trace();
+        }).detach();
     }
 
-    // Socket an Adresse binden
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
-        cerr << "Bind Failed" << endl;
-        return EXIT_FAILURE;
-    }
+    // Neustart ohne Downtime: SIGUSR2 startet das neue Binary und übergibt Listener + Verbindungen
+    setup_upgrade(argc, argv);
+    // von einem Vorgänger gestartet: dessen Listener übernehmen statt neu zu binden
+    adopt_predecessor();
+    // IDLE-Verbindungen: ein Watcher-Thread statt eines Threads pro wartendem Client
+    start_idle_watcher(serve_client);
 
-    // Auf Verbindungen warten
-    if (listen(server_socket, BACKLOG) < 0) {
-        cerr << "List Failed" << endl;
-        return EXIT_FAILURE;
+    // Listener öffnen (--listen=..., sonst SERVER_IP:port)
+    if (!open_listeners(string(SERVER_IP) + ":" + to_string(port), BACKLOG)) {
+        leave_process(EXIT_FAILURE);
     }
 
     //SERVER START
-    std::cout << "Server Started On " << SERVER_IP << ":" << port << endl;
+    std::cout << "Server Started" << endl;
     std::cout << "Mail-Spool-Directory: " << get_base_dir() << endl;
     std::cout << "Waiting For Connection..." << endl;
 
@@ -415,26 +791,25 @@ int main(int argc, char* argv[]) {
     // 1. try connect to ldap server
     if (ldap_connect() != EXIT_SUCCESS) {
         cerr << "LDAP connection failed" << endl;
-        return 1;
+        leave_process(1);
     } else cout << "LDAP connection successful." << endl;
 
 
-    while (true) {
-        client_addr_size = sizeof(client_addr);
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_addr_size);
-        if (client_socket < 0) {
-            cerr << "Failed To Accept Connection" << endl;
-            continue;
-        }
-        // Starte neuen Thread für den Client (Lambda für sichere Übergabe)
-        thread t([client_socket, client_addr]() {
-            handle_client(client_socket, client_addr);
-        });
+    // Vorgänger (falls vorhanden) übergibt ab jetzt seine Verbindungen
+    predecessor_ready(serve_client);
+
+    // ein Accept-Loop für alle Listener, ein Thread pro Client (endet beim Neustart)
+    accept_loop([](int client_socket, const string& peer) {
+        thread t(handle_client, client_socket, peer);
         t.detach(); // Thread im Hintergrund laufen lassen
-    }
+    }, drain_fd());
 
-    // Server-Socket schließen
-    close(server_socket);
+    if (is_draining()) {
+        // Listener gehören jetzt dem neuen Prozess: nicht schließen/unlinken
+        finish_drain();
+        leave_process(EXIT_SUCCESS);
+    }
+    close_listeners();
 
-    return 0;
+    leave_process(EXIT_SUCCESS);
 }
\ No newline at end of file
@@ -11,12 +11,14 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>	
-#include <uuid/uuid.h>
+#include <sys/socket.h>
 
 #define ACK "OK"
 #define ERR "ERR"
 
+#include "trace.cpp"
 #include "ldap.cpp"
+#include "parser.cpp"
 
 using namespace std;
 
@@ -42,98 +44,218 @@ fs::path get_base_dir() {
 	return BASE_DIR;
 }
 
-// generate_uuid: wrapper around libuuid to produce a lower-case UUID string
-static string generate_uuid() {
-	uuid_t bin;
-	uuid_generate_random(bin);
-	char str[37]; // 36 chars + null
-	uuid_unparse_lower(bin, str);
-	return string(str);
+#include "layout.cpp"
+#include "compression.cpp"
+#include "blobstore.cpp"
+#include "cache.cpp"
+#include "msgid.cpp"
+#include "catalog.cpp"
+#include "mailindex.cpp"
+#include "snapshot.cpp"
+#include "archive.cpp"
+#include "warmup.cpp"
+#include "reclaim.cpp"
+#include "session.cpp"
+#include "ratelimit.cpp"
+#include "wal.cpp"
+#include "attach.cpp"
+
+// validate_login: `client_host` is the address of the client (peer_host), repeated
+// failures lock the user/address out without another LDAP bind (ratelimit.cpp)
+bool validate_login(const std::string& username, const std::string& password, const std::string& client_host) {
+    if (!valid_mailbox_name(username)) return false; // the user name becomes the mailbox
+    if (login_locked(username, client_host)) {
+        cout << "validate_login: '" << username << "' from " << client_host << " is locked out\n";
+        return false;
+    }
+
+    // first check hardcoded test user
+    bool ok = (username == test_user.username && password == test_user.password) ||
+              ldap_login(username.c_str(), password.c_str()) == EXIT_SUCCESS;
+    if (ok) login_succeeded(username);
+    else login_failed(username, client_host);
+    return ok;
 }
 
-string str_tolower(const string& s) {
-    string result = s;
-    for (char& c : result) {
-        c = tolower(c);
-    }
-    return result;
+// validate_resume: user of a valid session token, bad tokens count against the address
+string validate_resume(string_view token, const string& client_host) {
+    if (login_locked("", client_host)) return "";
+    string user = validate_session_token(token);
+    if (user.empty()) login_failed("", client_host);
+    return user;
 }
 
-bool validate_login(const std::string& username, const std::string& password) {
-    // first check hardcoded test user
-    if (username == test_user.username && password == test_user.password) {
-        return true;
-    }
-    
-    // TODO implement max 3 tries
-    return (ldap_login(username.c_str(), password.c_str()) == EXIT_SUCCESS);
+// split_recipients: "a, b,c" -> {a, b, c} (duplicates and empty entries removed)
+static vector<string> split_recipients(string_view list) {
+	vector<string> recipients;
+	size_t start = 0;
+	while (start <= list.size()) {
+		size_t end = list.find(',', start);
+		if (end == string::npos) end = list.size();
+		string r(list.substr(start, end - start));
+		r.erase(0, r.find_first_not_of(" \t"));
+		r.erase(r.find_last_not_of(" \t") + 1);
+		if (!r.empty() && find(recipients.begin(), recipients.end(), r) == recipients.end())
+			recipients.push_back(r);
+		start = end + 1;
+	}
+	return recipients;
 }
 
-// save_mail: saves `msg` for `username` under <BASE_DIR>/<username>/<uuid>.txt
+// write_mail: writes one mail file at mail_write_path() (layout.cpp)
+static bool write_mail(const string& recipient, const string& id, const string& content) {
+	TraceSpan span("write_mail");
+	if (!valid_mailbox_name(recipient)) {
+		cerr << "save_mail: invalid mailbox name '" << recipient << "'\n";
+		return false;
+	}
+	// Ensure base users directory and user directory exist
+	fs::path file_path = mail_write_path(recipient, id); // Speichere im Verzeichnis des Empfängers
+	fs::path user_dir = file_path.parent_path();
+	error_code ec;
+	if (!fs::create_directories(user_dir, ec) && ec) {
+		cerr << "save_mail: failed to create directory '" << user_dir << "': " << ec.message() << "\n";
+		return false;
+	}
+
+	ofstream ofs(file_path, ios::binary);
+	if (!ofs) {
+		cerr << "save_mail: failed to open file '" << file_path << "' for writing\n";
+		return false;
+	}
+	ofs << content;
+	ofs.close();
+	if (!ofs) {
+		cerr << "save_mail: error while writing file '" << file_path << "'\n";
+		return false;
+	}
+
+	cout << "save_mail: saved mail for user '" << recipient << "' to '" << file_path << "'\n";
+	return true;
+}
+
+// store_mail: writes the mail to every mailbox in `targets` (recipient, id) and
+// updates the indexes. Targets that could not be written are removed.
+// With more than one recipient the body is stored once in the blob store and
+// each mailbox only gets a reference record.
+// Returns true if all targets were written.
+static bool store_mail(const string& username, vector<pair<string, string>>& targets, const string& subject,
+                       const string& message, long long date_ms, const string& extra_headers = "") {
+	string recipient_list;
+	for (const auto& t : targets) {
+		if (!recipient_list.empty()) recipient_list += ", ";
+		recipient_list += t.first;
+	}
+
+	// Compose content with structured format
+	string headers = "Sender: " + username + "\n";
+	headers += "Recipient: " + recipient_list + "\n";
+	headers += "Subject: " + subject + "\n";
+	headers += "Date: " + to_string(date_ms) + "\n";
+	headers += extra_headers; // Attachment: lines (attach.cpp)
+
+	string content;
+	string blob_hash;
+	if (targets.size() > 1) {
+		// fan-out: body once in the blob store, small reference record per mailbox
+		blob_hash = blob_put(message, (int)targets.size());
+		if (blob_hash.empty()) return false;
+		content = headers + BLOB_PREFIX + blob_hash + "\n" + MESSAGE_MARKER;
+	} else {
+		// body is compressed here if at-rest compression is enabled
+		content = compose_mail_file(headers, message);
+	}
+
+	MailEntry entry;
+	entry.sender = username;
+	entry.subject = subject;
+	entry.date_ms = date_ms;
+	entry.date = format_date_ms(date_ms);
+	entry.size = content.size();
+
+	bool ok = true;
+	for (size_t i = 0; i < targets.size();) {
+		const string& recipient = targets[i].first;
+		entry.id = targets[i].second;
+		shared_ptr<Mailbox> mb = begin_change(recipient);
+		bool written = write_mail(recipient, entry.id, content);
+		if (written) {
+			index_add(recipient, entry);
+		} else {
+			ok = false;
+			if (!blob_hash.empty()) blob_release(blob_hash);
+		}
+		end_change(mb);
+		cache_invalidate(recipient);
+		if (written) i++;
+		else targets.erase(targets.begin() + i);
+	}
+	return ok;
+}
+
+// save_mail: saves the mail for every recipient (one file per recipient mailbox)
+// recipient_field: recipient[,recipient...]
+// attachment_field: upload-id[,upload-id...] of completed uploads (SENDATT), may be empty
 // Returns true on success, false otherwise.
-bool save_mail(const string& username, const string& msg) {
+bool save_mail(const string& username, string_view recipient_field, string_view subject_field, string_view message_field,
+               string_view attachment_field = string_view()) {
+	TraceSpan span("save_mail");
 	try {
-		
-		// Parse message format: recipient|subject|message
-		size_t first_pipe = msg.find('|');
-		size_t second_pipe = msg.find('|', first_pipe + 1);
-		
-		if (first_pipe == string::npos || second_pipe == string::npos) {
-			cerr << "save_mail: invalid message format (expected: recipient|subject|message)\n";
+		vector<string> recipients = split_recipients(recipient_field);
+		string subject(subject_field);
+		string message(message_field);
+
+		if (recipients.empty()) {
+			cerr << "save_mail: no recipient given\n";
 			return false;
 		}
-		
-		string recipient = msg.substr(0, first_pipe);
-		string subject = msg.substr(first_pipe + 1, second_pipe - first_pipe - 1);
-		string message = msg.substr(second_pipe + 1);
-
-		// Ensure base users directory and user directory exist
-		fs::path base = BASE_DIR;
-		fs::path user_dir = base / recipient; // Speichere im Verzeichnis des Empfängers
-		error_code ec;
-		if (!fs::create_directories(user_dir, ec) && ec) {
-			cerr << "save_mail: failed to create directory '" << user_dir << "': " << ec.message() << "\n";
-			return false;
+		for (const string& r : recipients) {
+			if (!valid_mailbox_name(r)) {
+				cerr << "save_mail: invalid recipient '" << r << "'\n";
+				return false;
+			}
 		}
 
-		// Generate a UUID v4 (using libuuid)
-		string uuid = generate_uuid();
-
-		// Timestamp (milliseconds since epoch) für Dateiname
-		auto now = chrono::system_clock::now();
-		auto ms = chrono::duration_cast<chrono::milliseconds>(now.time_since_epoch()).count();
-		string timestamp_ms = to_string(ms);
-
-		// Formatiertes Datum und Uhrzeit für Anzeige
-		time_t now_c = chrono::system_clock::to_time_t(now);
-		tm local_tm = *localtime(&now_c);
-		ostringstream oss;
-		oss << put_time(&local_tm, "%d.%m.%Y %H:%M:%S");
-		string datetime_str = oss.str();
-
-		// Compose id and content with structured format
-		string id = timestamp_ms + "_" + uuid;
-		string content = "Sender: " + username + "\n";
-		content += "Recipient: " + recipient + "\n";
-		content += "Subject: " + subject + "\n";
-		content += "Date: " + datetime_str + "\n";
-		content += "Message:\n" + message;
-
-		fs::path file_path = user_dir / (id + ".txt");
-		ofstream ofs(file_path, ios::binary);
-		if (!ofs) {
-			cerr << "save_mail: failed to open file '" << file_path << "' for writing\n";
-			return false;
+		// k-sortable ids (own id per mailbox), Date header is stored as epoch milliseconds
+		long long date_ms = 0;
+		vector<pair<string, string>> targets;
+		for (const string& r : recipients) {
+			long long ms;
+			targets.emplace_back(r, generate_message_id(ms));
+			if (targets.size() == 1) date_ms = ms;
 		}
-		ofs << content;
-		ofs.close();
-		if (!ofs) {
-			cerr << "save_mail: error while writing file '" << file_path << "'\n";
+
+		// attachments move from the upload area into the store, one reference per mailbox
+		string attachment_headers;
+		vector<string> attachment_hashes;
+		string err;
+		if (!attachment_field.empty() &&
+		    !attach_claim(username, attachment_field, (int)targets.size(), attachment_headers, attachment_hashes, err)) {
+			cerr << "save_mail: " << err << "\n";
 			return false;
 		}
 
-		cout << "save_mail: saved mail for user '" << recipient << "' to '" << file_path << "'\n";
-		return true;
+		// mutation log (replication) before the mail becomes visible: a delete of it is
+		// always logged after it, and a failed log leaves nothing behind to retry over
+		size_t wanted = targets.size();
+		if (!wal_log_save(username, date_ms, subject, message, targets, attachment_headers)) {
+			for (size_t i = 0; i < wanted; ++i) {
+				for (const string& hash : attachment_hashes) attach_release(hash);
+			}
+			return false;
+		}
+		vector<pair<string, string>> logged = targets;
+		bool ok = store_mail(username, targets, subject, message, date_ms, attachment_headers);
+		for (size_t i = targets.size(); i < wanted; ++i) {
+			for (const string& hash : attachment_hashes) attach_release(hash);
+		}
+		// mailboxes that could not be written: followers drop their copy again
+		for (const auto& t : logged) {
+			if (find(targets.begin(), targets.end(), t) != targets.end()) continue;
+			if (!wal_log_delete(t.first, t.second))
+				cerr << "save_mail: failed to log the undo of " << t.second << ", followers keep it\n";
+		}
+		return ok;
 	} catch (const exception& e) {
 		cerr << "save_mail: exception: " << e.what() << "\n";
 		return false;
@@ -142,49 +264,16 @@ bool save_mail(const string& username, const string& msg) {
 
 
 string list_mails(const string& username) {
-    try {
-        fs::path user_dir = BASE_DIR / username;
+    TraceSpan span("list_mails");
+    string cached;
+    if (cache_get(username, cache_list_key(username), cached)) return cached;
+    uint64_t generation = cache_generation(username); // vor dem Lesen des Index
 
-        if (!fs::exists(user_dir) || !fs::is_directory(user_dir)) {
-            return string(ERR) + "User directory not found";
-        }
-
-        ostringstream result;
-        vector<filesystem::path> mails;
-
-        // Alle .txt Dateien sammeln
-        for (const auto& entry : fs::directory_iterator(user_dir)) {
-            if (entry.is_regular_file() && entry.path().extension() == ".txt") {
-                mails.push_back(entry.path());
-            }
-        }
-
-        if (mails.empty()) {
-            return "No messages available";
-        }
-
-        // Mails sortieren (optional nach Dateiname)
-        //sort(mails.begin(), mails.end());
-        // DARF MAN NICHT SORTIEREN, WEIL SONST INDEX NICHT STIMMT BEIM LÖSCHEN/LESEN!!!
-        // TODO sort immer (Datum) dann beim Lesen/delete auch danach sortieren
-
-        // Indexierte Ausgabe
-        for (size_t i = 0; i < mails.size(); ++i) {
-            ifstream ifs(mails[i]);
-            if (!ifs) continue;
-
-            string line, sender, subject, date;
-            while (getline(ifs, line)) {
-                if (line.find("Sender: ") == 0) sender = line.substr(8);
-                else if (line.find("Subject: ") == 0) subject = line.substr(9);
-                else if (line.find("Date: ") == 0) date = line.substr(6);
-            }
-            ifs.close();
-
-            result << "[" << (i + 1) << "] " << sender << "|" << subject << "|" << date << "\n";
-        }
-
-        return to_string(mails.size()) + "\n" + result.str();
+    try {
+        // Indexierte Ausgabe, sortiert nach Message-Id (= Datum)
+        string response = render_list(username);
+        if (response.rfind(ERR, 0) != 0) cache_put(username, cache_list_key(username), response, generation);
+        return response;
 
     } catch (const exception& e) {
         cerr << "list_mails: exception: " << e.what() << "\n";
@@ -192,135 +281,102 @@ string list_mails(const string& username) {
     }
 }
 
-// read_mail: searches for mails in username's directory matching the subject (partial match)
-// Returns a string with all matching mails or an error message
-string read_mail(const string& username, int index) {
-    fs::path base = BASE_DIR;
-
-    vector<fs::path> mail_files;
-
-    // Rekursiv alle .txt Dateien sammeln
-    for (const auto& entry : fs::recursive_directory_iterator(base)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".txt")
-            mail_files.push_back(entry.path());
-    }
-
-    if (mail_files.empty()) return string(ERR) + "No mails available";
-    
-    //sort so that index matches
-    sort(mail_files.begin(), mail_files.end());
-
-
-    if (index < 1 || index > (int)mail_files.size())
-        return string(ERR) + "Index out of range";
-
-    fs::path target_file = mail_files[index - 1];
-
-    // Mail aus Datei lesen
-    ifstream ifs(target_file);
-    if (!ifs) return string(ERR) + "Failed to open mail file";
-
-    string line, sender, recipient, subject, date, message;
-    bool in_message = false;
-
-    while (getline(ifs, line)) {
-        if (line.find("Sender: ") == 0) sender = line.substr(8);
-        else if (line.find("Recipient: ") == 0) recipient = line.substr(11);
-        else if (line.find("Subject: ") == 0) subject = line.substr(9);
-        else if (line.find("Date: ") == 0) date = line.substr(6);
-        else if (line.find("Message:") == 0) in_message = true;
-        else if (in_message) {
-            if (!message.empty()) message += "\n";
-            message += line;
-        }
+// read_mail: mail `id` of `username`, resolved through the global message-id catalog
+// (no spool scan). Returns the formatted mail or an error message
+string read_mail(const string& username, const string& id) {
+    string mailbox;
+    if (!find_message(id, username, mailbox)) return string(ERR) + "Unknown message id";
+    if (mailbox != username) return string(ERR) + "Message belongs to another mailbox";
+
+    // Mail aus Datei lesen (Body ggf. dekomprimieren)
+    string content;
+    if (!load_mail_by_id(mailbox, id, content)) return string(ERR) + "Failed to open mail file";
+
+    // Header-Zeilen und Body-Beginn in einem Durchlauf (parser.cpp)
+    string_view lines[MAX_HEADER_LINES];
+    size_t body;
+    size_t n = scan_headers(content.data(), content.size(), lines, MAX_HEADER_LINES, body);
+
+    string sender, recipient, subject, date, attachments;
+    for (size_t i = 0; i < n; ++i) {
+        string_view line = lines[i];
+        if (line.rfind("Sender: ", 0) == 0) sender = string(line.substr(8));
+        else if (line.rfind("Recipient: ", 0) == 0) recipient = string(line.substr(11));
+        else if (line.rfind("Subject: ", 0) == 0) subject = string(line.substr(9));
+        else if (line.rfind("Date: ", 0) == 0) date = render_date(string(line.substr(6)));
+        else if (line.rfind(ATTACH_PREFIX, 0) == 0) attachments += string(line) + "\n";
     }
-    ifs.close();
+    string_view message(content.data() + body, content.size() - body);
+    if (!message.empty() && message.back() == '\n') message.remove_suffix(1);
 
     ostringstream oss;
     oss << "From: " << sender << "\n";
     oss << "To: " << recipient << "\n";
     oss << "Subject: " << subject << "\n";
     oss << "Date: " << date << "\n";
+    oss << attachments;
     oss << "Message:\n" << message << "\n";
 
     return oss.str();
 }
 
-bool function_delete(int client_socket, char* buffer) {
-    // Nachricht nach "DELETE|" extrahieren
-    const char* msg_start = buffer + 7; // Länge von "DELETE|"
-    std::string message(msg_start);
-
-    std::cout << "DELETE Function Called With Message: " << message << std::endl;
+// function_delete: DELETE|username|index, `err` gets the error message
+bool function_delete(const Request& req, string& err) {
+    std::cout << "DELETE Function Called With Message: " << req.args << std::endl;
 
     // Format: username|index
-    size_t pipe_pos = message.find('|');
-    if (pipe_pos == std::string::npos) {
-        std::string err = string(ERR) + "Invalid message format";
-        send(client_socket, err.c_str(), err.size(), 0);
+    if (req.field_count != 2) {
+        err = string(ERR) + "Invalid message format";
         return false;
     }
 
-    std::string username = message.substr(0, pipe_pos);
-    std::string index_str = message.substr(pipe_pos + 1);
-
+    std::string username(req.fields[0]);
+    if (!valid_mailbox_name(username)) {
+        err = string(ERR) + "Invalid mailbox name";
+        return false;
+    }
     int mail_index = 0;
-    try {
-        mail_index = std::stoi(index_str);
-    } catch (...) {
-        std::string err = string(ERR) + "Invalid mail index";
-        send(client_socket, err.c_str(), err.size(), 0);
+    if (!parse_index(req.fields[1], mail_index)) {
+        err = string(ERR) + "Invalid mail index";
         return false;
     }
 
     if (mail_index <= 0) {
-        std::string err = string(ERR) + "Mail index must be >= 1";
-        send(client_socket, err.c_str(), err.size(), 0);
+        err = string(ERR) + "Mail index must be >= 1";
         return false;
     }
 
-    // Benutzerverzeichnis prüfen
-    fs::path user_dir = BASE_DIR / username;
-    if (!fs::exists(user_dir) || !fs::is_directory(user_dir)) {
-        std::string err = string(ERR) + "User directory not found";
-        send(client_socket, err.c_str(), err.size(), 0);
+    // Mail über den Mailbox-Index auflösen (gleiche Sortierung wie LIST/READ)
+    MailEntry entry;
+    int found = mailbox_entry(username, mail_index, entry);
+    if (found < 0) {
+        err = string(ERR) + "User directory not found";
         return false;
     }
-
-    // Alle Mails auflisten
-    std::vector<fs::path> user_mails;
-    for (const auto& entry : fs::directory_iterator(user_dir)) {
-        if (entry.is_regular_file() && entry.path().extension() == ".txt")
-            user_mails.push_back(entry.path());
-    }
-
-    //sort so that index matches
-    sort(user_mails.begin(), user_mails.end());
-
-    if (mail_index > (int)user_mails.size()) {
-        std::string err = string(ERR) + "Mail index out of range";
-        send(client_socket, err.c_str(), err.size(), 0);
+    if (found == 0) {
+        err = string(ERR) + "Mail index out of range";
         return false;
     }
 
     // Datei löschen
-    cout << mail_index - 1 << endl;
-    cout << user_mails[mail_index - 1] << endl;
-    cout << user_mails.size() << endl;
-    for (const auto& mail : user_mails) {
-        std::cout << "Mail file: " << mail << std::endl;
-    }
+    err = delete_mail(username, entry.id);
+    if (!err.empty()) return false;
+    std::cout << "function_delete: deleted mail #" << mail_index << " for user '" << username << "'\n";
+    return true;
+}
 
-    fs::path mail_to_delete = user_mails[mail_index - 1];
-    std::error_code ec;
-    fs::remove(mail_to_delete, ec);
+// DELID|<message-id>: deletes a mail of the logged-in user by its id, `err` gets the error message
+bool function_delete_id(const Request& req, const string& username, string& err) {
+    std::cout << "DELID Function Called With Message: " << req.args << std::endl;
 
-    if (ec) {
-        std::string err = string(ERR) + "Failed to delete mail";
-        send(client_socket, err.c_str(), err.size(), 0);
-        return false;
-    }
+    string id(req.args);
+    string mailbox;
+    if (req.field_count != 1 || id.empty()) err = string(ERR) + "Invalid message format";
+    else if (!find_message(id, username, mailbox)) err = string(ERR) + "Unknown message id";
+    else if (mailbox != username) err = string(ERR) + "Message belongs to another mailbox";
+    else err = delete_mail(username, id);
 
-    std::cout << "function_delete: deleted mail #" << mail_index << " for user '" << username << "'\n";
+    if (!err.empty()) return false;
+    std::cout << "function_delete_id: deleted mail " << id << " for user '" << username << "'\n";
     return true;
-}
\ No newline at end of file
+}
@@ -0,0 +1,200 @@
+// session.cpp
+// Session tokens: after a successful login the server hands out a signed, expiring
+// token, a reconnecting client sends "RESUME|<token>" instead of username/password.
+// The token is checked in-process (HMAC-SHA256, no LDAP bind), so reconnect storms
+// do not turn into directory load.
+//
+//   token = <user>:<issued (epoch ms)>:<expires (epoch ms)>:<nonce hex>:<hmac hex>
+//   hmac  = HMAC-SHA256(secret, "<user>:<issued>:<expires>:<nonce hex>")
+//
+// The secret is generated once and kept in <BASE_DIR>/.session/secret (mode 0600),
+// tokens therefore stay valid across server restarts. A token lives at most as long
+// as the current --session-ttl, 0 rejects every token.
+//
+// Revocation: <BASE_DIR>/.session/revoked holds "<user> <epoch ms>" lines written by
+// "twmail-admin revoke-sessions"; tokens of <user> ("*": of everyone) issued before
+// that moment are rejected, a login right after the revocation gets a valid one.
+// A running server rereads the file when it changes.
+
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/crypto.h>
+
+#define SESSION_DIR ".session"
+#define SESSION_SECRET_FILE "secret"
+#define SESSION_SECRET_SIZE 32
+#define SESSION_NONCE_SIZE 8
+#define SESSION_DEFAULT_TTL 3600 // seconds
+#define SESSION_REVOKED_FILE "revoked"
+#define SESSION_REVOKED_ALL "*"
+#define SESSION_REVOKED_CHECK_MS 1000 // how often the revocation file is stat'ed
+
+static string session_secret;
+static unsigned SESSION_TTL = SESSION_DEFAULT_TTL;
+static atomic<unsigned long> sessions_issued(0);
+static atomic<unsigned long> sessions_resumed(0);
+static atomic<unsigned long> sessions_rejected(0);
+static atomic<unsigned long> sessions_revoked(0);
+
+static mutex session_revoked_mutex;
+static unordered_map<string, long long> session_revoked; // user -> tokens issued before this ms are invalid
+static long long session_revoked_checked_ms = 0;
+static timespec session_revoked_mtime = {};
+
+// set_session_ttl: lifetime of new tokens in seconds, 0 disables tokens
+void set_session_ttl(unsigned seconds) {
+	SESSION_TTL = seconds;
+}
+
+static string to_hex(const unsigned char* data, size_t len) {
+	static const char hex[] = "0123456789abcdef";
+	string out;
+	out.reserve(len * 2);
+	for (size_t i = 0; i < len; ++i) {
+		out += hex[data[i] >> 4];
+		out += hex[data[i] & 0x0f];
+	}
+	return out;
+}
+
+static string session_hmac(const string& payload) {
+	unsigned char mac[EVP_MAX_MD_SIZE];
+	unsigned int len = 0;
+	HMAC(EVP_sha256(), session_secret.data(), session_secret.size(),
+	     (const unsigned char*)payload.data(), payload.size(), mac, &len);
+	return to_hex(mac, len);
+}
+
+// load_session_secret: reads the signing key, creates it on first start
+bool load_session_secret() {
+	fs::path path = BASE_DIR / SESSION_DIR / SESSION_SECRET_FILE;
+	if (read_file(path, session_secret) && session_secret.size() == SESSION_SECRET_SIZE) return true;
+
+	unsigned char key[SESSION_SECRET_SIZE];
+	if (RAND_bytes(key, sizeof(key)) != 1) {
+		cerr << "session: failed to generate secret\n";
+		return false;
+	}
+	session_secret.assign((const char*)key, sizeof(key));
+
+	error_code ec;
+	fs::create_directories(path.parent_path(), ec);
+	int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0 || write(fd, key, sizeof(key)) != (ssize_t)sizeof(key) || fsync(fd) != 0) {
+		// tokens still work until the next restart
+		cerr << "session: failed to store secret in " << path << "\n";
+	}
+	if (fd >= 0) close(fd);
+	return true;
+}
+
+// issue_session_token: new token for `username`, empty if tokens are disabled
+string issue_session_token(const string& username) {
+	if (SESSION_TTL == 0 || session_secret.empty()) return "";
+	unsigned char nonce[SESSION_NONCE_SIZE];
+	if (RAND_bytes(nonce, sizeof(nonce)) != 1) return "";
+
+	long long issued = epoch_ms_now();
+	string payload = username + ":" + to_string(issued) + ":" + to_string(issued + SESSION_TTL * 1000LL) + ":" +
+	                 to_hex(nonce, sizeof(nonce));
+	sessions_issued++;
+	return payload + ":" + session_hmac(payload);
+}
+
+static fs::path session_revoked_path() {
+	return BASE_DIR / SESSION_DIR / SESSION_REVOKED_FILE;
+}
+
+// reload_revocations: rereads the revocation file if it changed (at most every
+// SESSION_REVOKED_CHECK_MS). Caller holds session_revoked_mutex.
+static void reload_revocations() {
+	long long now = epoch_ms_now();
+	if (now - session_revoked_checked_ms < SESSION_REVOKED_CHECK_MS) return;
+	session_revoked_checked_ms = now;
+
+	struct stat st;
+	timespec mtime = {};
+	if (stat(session_revoked_path().c_str(), &st) == 0) mtime = st.st_mtim;
+	if (mtime.tv_sec == session_revoked_mtime.tv_sec && mtime.tv_nsec == session_revoked_mtime.tv_nsec) return;
+	session_revoked_mtime = mtime;
+
+	session_revoked.clear();
+	string data;
+	if (!read_file(session_revoked_path(), data)) return;
+	istringstream lines(data);
+	string user;
+	long long until;
+	while (lines >> user >> until) {
+		long long& entry = session_revoked[user];
+		entry = max(entry, until);
+	}
+}
+
+// session_revoked_until: tokens of `username` issued before this time (epoch ms) are revoked
+static long long session_revoked_until(const string& username) {
+	lock_guard<mutex> lock(session_revoked_mutex);
+	reload_revocations();
+	long long until = 0;
+	auto it = session_revoked.find(username);
+	if (it != session_revoked.end()) until = it->second;
+	it = session_revoked.find(SESSION_REVOKED_ALL);
+	if (it != session_revoked.end()) until = max(until, it->second);
+	return until;
+}
+
+// revoke_sessions: invalidates all tokens of `username` ("*": of every user) issued
+// so far (twmail-admin, the server picks the change up within a second)
+bool revoke_sessions(const string& username) {
+	error_code ec;
+	fs::create_directories(session_revoked_path().parent_path(), ec);
+	string line = username + " " + to_string(epoch_ms_now()) + "\n";
+	int fd = open(session_revoked_path().c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	bool ok = fd >= 0 && write(fd, line.data(), line.size()) == (ssize_t)line.size() && fsync(fd) == 0;
+	if (fd >= 0) close(fd);
+	return ok;
+}
+
+// validate_session_token: username of a valid, unexpired and not revoked token, empty otherwise
+string validate_session_token(string_view token) {
+	// <user>:<issued>:<expires>:<nonce>:<hmac>, the user name may contain ':'
+	size_t seps[4];
+	size_t end = token.size();
+	bool well_formed = true;
+	for (size_t& sep : seps) {
+		sep = (end == 0 || end == string_view::npos) ? string_view::npos : token.rfind(':', end - 1);
+		if (sep == string_view::npos || sep == 0) well_formed = false;
+		end = sep;
+	}
+	if (!well_formed || SESSION_TTL == 0 || session_secret.empty()) {
+		sessions_rejected++;
+		return "";
+	}
+	size_t mac_sep = seps[0], exp_sep = seps[2], issued_sep = seps[3];
+
+	string payload(token.substr(0, mac_sep));
+	string expected = session_hmac(payload);
+	string_view mac = token.substr(mac_sep + 1);
+	long long issued = strtoll(string(token.substr(issued_sep + 1, exp_sep - issued_sep - 1)).c_str(), nullptr, 10);
+	long long expires = strtoll(string(token.substr(exp_sep + 1, seps[1] - exp_sep - 1)).c_str(), nullptr, 10);
+	long long now = epoch_ms_now();
+	// a shorter --session-ttl also applies to tokens issued before the change
+	if (mac.size() != expected.size() || CRYPTO_memcmp(mac.data(), expected.data(), mac.size()) != 0 ||
+	    expires < now || expires - issued > SESSION_TTL * 1000LL) {
+		sessions_rejected++;
+		return "";
+	}
+	string username(token.substr(0, issued_sep));
+	if (issued < session_revoked_until(username)) {
+		sessions_revoked++;
+		return "";
+	}
+	sessions_resumed++;
+	return username;
+}
+
+string session_stats() {
+	ostringstream oss;
+	oss << "sessions: issued=" << sessions_issued << " resumed=" << sessions_resumed
+	    << " rejected=" << sessions_rejected << " revoked=" << sessions_revoked << " ttl=" << SESSION_TTL << "s\n";
+	return oss.str();
+}
@@ -0,0 +1,326 @@
+// snapshot.cpp
+// Persistent index snapshots: the mailbox indexes are checkpointed periodically into
+// <BASE_DIR>/.index/snapshot.bin and mmap'ed at the next start. A mailbox whose
+// directory mtime still matches the one recorded in the snapshot is loaded straight
+// from the mapping instead of being rescanned, so restart time depends on the number
+// of changed mailboxes, not on the total number of mails.
+//
+// File layout (little endian, all integers fixed size):
+//   header : magic "TWIX" | u32 version | u32 mailbox count | u32 reserved |
+//            u64 table offset | u64 table checksum
+//   records: per mailbox  u32 mail count, per mail: str id | str sender |
+//            str subject | str date | i64 date_ms | u64 size   (str = u16 len + bytes)
+//   table  : per mailbox  str name | i64 mtime sec | u32 mtime nsec |
+//            u64 record offset | u64 record length | u64 record checksum
+// The mail location is not stored, it follows from mailbox + id (mail_path()).
+// Every record has its own checksum, so startup only has to verify the table.
+
+#include <sys/mman.h>
+#include <thread>
+
+#define SNAPSHOT_DIR ".index"
+#define SNAPSHOT_FILE "snapshot.bin"
+#define SNAPSHOT_MAGIC "TWIX"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_HEADER_SIZE 32
+#define SNAPSHOT_DEFAULT_INTERVAL 300 // seconds
+#define SNAPSHOT_RACY_NS 2000000000LL  // directories changed this recently are not trusted
+
+struct SnapshotRecord {
+	long long mtime_sec = 0;
+	unsigned mtime_nsec = 0;
+	uint64_t offset = 0;
+	uint64_t length = 0;
+	uint64_t checksum = 0;
+};
+
+static mutex snapshot_mutex;
+static const char* snapshot_map = nullptr;
+static size_t snapshot_map_size = 0;
+static unordered_map<string, SnapshotRecord> snapshot_table;
+static unsigned SNAPSHOT_INTERVAL = SNAPSHOT_DEFAULT_INTERVAL;
+static atomic<unsigned long> snapshot_hits(0);
+static atomic<unsigned long> snapshot_stale(0);
+static atomic<unsigned long> snapshot_writes(0);
+
+void set_snapshot_interval(unsigned seconds) {
+	SNAPSHOT_INTERVAL = seconds;
+}
+
+static fs::path snapshot_path() {
+	return BASE_DIR / SNAPSHOT_DIR / SNAPSHOT_FILE;
+}
+
+// FNV-1a 64
+static uint64_t snapshot_checksum(const char* data, size_t len) {
+	uint64_t h = 1469598103934665603ULL;
+	for (size_t i = 0; i < len; ++i) {
+		h ^= (unsigned char)data[i];
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static void put_u16(string& out, uint16_t v) { out.append((const char*)&v, sizeof(v)); }
+static void put_u32(string& out, uint32_t v) { out.append((const char*)&v, sizeof(v)); }
+static void put_u64(string& out, uint64_t v) { out.append((const char*)&v, sizeof(v)); }
+static void put_str(string& out, const string& s) {
+	uint16_t len = (uint16_t)min(s.size(), (size_t)UINT16_MAX);
+	put_u16(out, len);
+	out.append(s.data(), len);
+}
+
+// bounds-checked reader over a mapped region
+struct SnapshotReader {
+	const char* pos;
+	const char* end;
+	bool ok = true;
+
+	template <typename T> T get() {
+		T v{};
+		if (end - pos < (long)sizeof(T)) { ok = false; return v; }
+		memcpy(&v, pos, sizeof(T));
+		pos += sizeof(T);
+		return v;
+	}
+	string get_str() {
+		uint16_t len = get<uint16_t>();
+		if (!ok || end - pos < len) { ok = false; return ""; }
+		string s(pos, len);
+		pos += len;
+		return s;
+	}
+};
+
+static fs::path archive_dir(const string& username); // archive.cpp
+
+// newest directory mtime of a mailbox (all of its directories, layout.cpp, and its
+// archive directory), false if it does not exist
+static bool mailbox_mtime(const string& username, long long& sec, unsigned& nsec) {
+	bool found = false;
+	vector<fs::path> dirs = mailbox_dirs(username);
+	if (dirs.empty()) return false;
+	dirs.push_back(archive_dir(username));
+	for (const fs::path& dir : dirs) {
+		struct statx stx;
+		if (statx(AT_FDCWD, dir.c_str(), AT_STATX_DONT_SYNC, STATX_MTIME, &stx) != 0) continue;
+		if (!found || stx.stx_mtime.tv_sec > sec ||
+		    (stx.stx_mtime.tv_sec == sec && stx.stx_mtime.tv_nsec > nsec)) {
+			sec = stx.stx_mtime.tv_sec;
+			nsec = stx.stx_mtime.tv_nsec;
+		}
+		found = true;
+	}
+	return found;
+}
+
+// snapshot_open: maps the snapshot and reads its mailbox table
+bool snapshot_open() {
+	lock_guard<mutex> lock(snapshot_mutex);
+
+	int fd = open(snapshot_path().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) return false;
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < SNAPSHOT_HEADER_SIZE) {
+		close(fd);
+		return false;
+	}
+	void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) return false;
+
+	const char* data = (const char*)map;
+	SnapshotReader header{data + 4, data + SNAPSHOT_HEADER_SIZE};
+	uint32_t version = header.get<uint32_t>();
+	uint32_t count = header.get<uint32_t>();
+	header.get<uint32_t>();
+	uint64_t table_offset = header.get<uint64_t>();
+	uint64_t table_checksum = header.get<uint64_t>();
+
+	bool valid = memcmp(data, SNAPSHOT_MAGIC, 4) == 0 && version == SNAPSHOT_VERSION &&
+	             table_offset >= SNAPSHOT_HEADER_SIZE && table_offset <= (uint64_t)st.st_size &&
+	             snapshot_checksum(data + table_offset, st.st_size - table_offset) == table_checksum;
+
+	unordered_map<string, SnapshotRecord> table;
+	SnapshotReader reader{data + table_offset, data + st.st_size};
+	for (uint32_t i = 0; valid && i < count; ++i) {
+		string name = reader.get_str();
+		SnapshotRecord rec;
+		rec.mtime_sec = reader.get<int64_t>();
+		rec.mtime_nsec = reader.get<uint32_t>();
+		rec.offset = reader.get<uint64_t>();
+		rec.length = reader.get<uint64_t>();
+		rec.checksum = reader.get<uint64_t>();
+		valid = reader.ok && rec.offset + rec.length <= table_offset;
+		table[name] = rec;
+	}
+	if (!valid) {
+		cerr << "snapshot: " << snapshot_path() << " is invalid, ignoring it\n";
+		munmap(map, st.st_size);
+		return false;
+	}
+
+	if (snapshot_map) munmap((void*)snapshot_map, snapshot_map_size);
+	snapshot_map = data;
+	snapshot_map_size = st.st_size;
+	snapshot_table = move(table);
+	cout << "snapshot: mapped " << snapshot_table.size() << " mailboxes from " << snapshot_path() << "\n";
+	return true;
+}
+
+// snapshot_valid: mailbox is in the snapshot and its directory did not change since
+bool snapshot_valid(const string& username) {
+	long long sec;
+	unsigned nsec;
+	if (!mailbox_mtime(username, sec, nsec)) return false;
+	lock_guard<mutex> lock(snapshot_mutex);
+	auto it = snapshot_table.find(username);
+	return it != snapshot_table.end() && it->second.mtime_sec == sec && it->second.mtime_nsec == nsec;
+}
+
+// snapshot_load_mailbox: fills `mails` from the snapshot if the mailbox is unchanged
+static bool snapshot_load_mailbox(const string& username, vector<MailEntry>& mails) {
+	long long sec;
+	unsigned nsec;
+	if (!mailbox_mtime(username, sec, nsec)) return false;
+
+	lock_guard<mutex> lock(snapshot_mutex);
+	auto it = snapshot_table.find(username);
+	if (it == snapshot_table.end()) return false;
+	const SnapshotRecord& rec = it->second;
+	if (rec.mtime_sec != sec || rec.mtime_nsec != nsec ||
+	    snapshot_checksum(snapshot_map + rec.offset, rec.length) != rec.checksum) {
+		snapshot_stale++;
+		return false;
+	}
+
+	SnapshotReader reader{snapshot_map + rec.offset, snapshot_map + rec.offset + rec.length};
+	uint32_t count = reader.get<uint32_t>();
+	mails.clear();
+	mails.reserve(count);
+	for (uint32_t i = 0; i < count && reader.ok; ++i) {
+		MailEntry e;
+		e.id = reader.get_str();
+		e.sender = reader.get_str();
+		e.subject = reader.get_str();
+		e.date = reader.get_str();
+		e.date_ms = reader.get<int64_t>();
+		e.size = reader.get<uint64_t>();
+		mails.push_back(move(e));
+	}
+	if (!reader.ok) {
+		mails.clear();
+		return false;
+	}
+	snapshot_hits++;
+	return true;
+}
+
+static string encode_mailbox(const vector<MailEntry>& mails) {
+	string out;
+	put_u32(out, (uint32_t)mails.size());
+	for (const MailEntry& e : mails) {
+		put_str(out, e.id);
+		put_str(out, e.sender);
+		put_str(out, e.subject);
+		put_str(out, e.date);
+		put_u64(out, (uint64_t)e.date_ms);
+		put_u64(out, (uint64_t)e.size);
+	}
+	return out;
+}
+
+// snapshot_write: checkpoints all consistent mailboxes. Mailboxes that are not
+// loaded but still valid in the previous snapshot are carried over unchanged.
+bool snapshot_write() {
+	vector<pair<string, shared_ptr<Mailbox>>> boxes;
+	{
+		lock_guard<mutex> lock(mailboxes_mutex);
+		for (auto& it : mailboxes) boxes.push_back(it);
+	}
+
+	long long now_ns = (long long)epoch_ms_now() * 1000000LL;
+	string records(SNAPSHOT_HEADER_SIZE, '\0');
+	string table;
+	uint32_t count = 0;
+	unordered_set<string> written;
+
+	auto add_record = [&](const string& name, long long sec, unsigned nsec, const char* data, size_t len) {
+		put_str(table, name);
+		put_u64(table, (uint64_t)sec);
+		put_u32(table, nsec);
+		put_u64(table, records.size());
+		put_u64(table, len);
+		put_u64(table, snapshot_checksum(data, len));
+		records.append(data, len);
+		written.insert(name);
+		count++;
+	};
+
+	for (auto& [name, mb] : boxes) {
+		lock_guard<mutex> lock(mb->lock);
+		// writes/deletes in flight: file and index may disagree right now
+		if (!mb->loaded || !mb->exists || mb->pending_changes > 0) continue;
+		long long sec;
+		unsigned nsec;
+		if (!mailbox_mtime(name, sec, nsec)) continue;
+		// changed too recently: a later change within the same timestamp tick would go unnoticed
+		if (now_ns - (sec * 1000000000LL + nsec) < SNAPSHOT_RACY_NS) continue;
+		string rec = encode_mailbox(mb->mails);
+		add_record(name, sec, nsec, rec.data(), rec.size());
+	}
+
+	{
+		lock_guard<mutex> lock(snapshot_mutex);
+		for (auto& [name, rec] : snapshot_table) {
+			if (written.count(name)) continue;
+			long long sec;
+			unsigned nsec;
+			if (!mailbox_mtime(name, sec, nsec) || sec != rec.mtime_sec || nsec != rec.mtime_nsec) continue;
+			add_record(name, sec, nsec, snapshot_map + rec.offset, rec.length);
+		}
+	}
+
+	// header
+	uint64_t table_offset = records.size();
+	string header = SNAPSHOT_MAGIC;
+	put_u32(header, SNAPSHOT_VERSION);
+	put_u32(header, count);
+	put_u32(header, 0);
+	put_u64(header, table_offset);
+	put_u64(header, snapshot_checksum(table.data(), table.size()));
+	records.replace(0, SNAPSHOT_HEADER_SIZE, header);
+	records += table;
+
+	error_code ec;
+	fs::create_directories(snapshot_path().parent_path(), ec);
+	if (!write_file_atomic(snapshot_path(), records)) {
+		cerr << "snapshot: failed to write " << snapshot_path() << "\n";
+		return false;
+	}
+	snapshot_writes++;
+	cout << "snapshot: checkpointed " << count << " mailboxes (" << records.size() << " bytes)\n";
+	return snapshot_open();
+}
+
+static void snapshot_loop() {
+	while (true) {
+		this_thread::sleep_for(chrono::seconds(SNAPSHOT_INTERVAL));
+		snapshot_write();
+	}
+}
+
+// start_snapshots: maps an existing snapshot and starts the periodic checkpoint thread
+void start_snapshots() {
+	snapshot_open();
+	if (SNAPSHOT_INTERVAL > 0) thread(snapshot_loop).detach();
+}
+
+string snapshot_stats() {
+	lock_guard<mutex> lock(snapshot_mutex);
+	ostringstream oss;
+	oss << "snapshot: mailboxes=" << snapshot_table.size() << " bytes=" << snapshot_map_size
+	    << " loaded_from_snapshot=" << snapshot_hits << " stale=" << snapshot_stale
+	    << " checkpoints=" << snapshot_writes << " interval=" << SNAPSHOT_INTERVAL << "s\n";
+	return oss.str();
+}
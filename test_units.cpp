@@ -0,0 +1,244 @@
+// test_units.cpp
+// Round-trip and edge-case checks of the pure functions: request parser and opcode
+// table, message ids, mutation log records, CRC-32C and the attachment chunk framing.
+// Nothing here touches the spool or the network.
+//
+// Build/run: make test
+
+#include <iostream>
+#include <thread>
+
+#include "serverfunctions.cpp"
+#include "bufpool.cpp"
+
+static int failures = 0;
+
+#define CHECK(cond)                                                             \
+    do {                                                                        \
+        if (!(cond)) {                                                          \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": failed: " #cond "\n"; \
+            failures++;                                                         \
+        }                                                                       \
+    } while (0)
+
+// the fields point into `text`, literals only
+static bool parse(std::string_view text, Request& req) {
+    return parse_request(text.data(), text.size(), req);
+}
+
+static void test_opcodes() {
+    for (const OpcodeName& entry : OPCODE_NAMES) {
+        CHECK(lookup_opcode(entry.name) == entry.op);
+        std::string lower(entry.name);
+        for (char& c : lower) c = fold_case(c);
+        CHECK(lookup_opcode(lower) == entry.op);
+        // one character more or less never resolves to a command
+        CHECK(lookup_opcode(std::string(entry.name) + "X") == Opcode::NONE);
+        CHECK(lookup_opcode(entry.name.substr(0, entry.name.size() - 1)) != entry.op);
+    }
+    CHECK(lookup_opcode("") == Opcode::NONE);
+    CHECK(lookup_opcode("SENDX") == Opcode::NONE);
+    CHECK(lookup_opcode("|") == Opcode::NONE);
+}
+
+static void test_parser() {
+    Request req;
+    CHECK(parse("LIST", req) && req.op == Opcode::LIST && req.field_count == 0 && req.args.empty());
+    CHECK(parse("quit", req) && req.op == Opcode::QUIT);
+    CHECK(!parse("NOPE|a|b", req) && req.op == Opcode::NONE && req.field_count == 2);
+    CHECK(!parse("", req));
+
+    CHECK(parse("READ|testuser|42", req) && req.op == Opcode::READ);
+    CHECK(req.field_count == 2 && req.fields[0] == "testuser" && req.fields[1] == "42");
+    CHECK(req.args == "testuser|42");
+
+    // the last field keeps the rest of the request, '|' included; a message field
+    // before it is taken with field_rest
+    CHECK(parse("SEND|alice,bob|subject|body | with | pipes", req) && req.op == Opcode::SEND);
+    CHECK(req.field_count == MAX_FIELDS && req.fields[3] == " with | pipes");
+    CHECK(field_rest(req, 2) == "body | with | pipes");
+    CHECK(parse("SENDATT|bob|s|id1,id2|a|b|c", req) && req.field_count == MAX_FIELDS);
+    CHECK(req.fields[MAX_FIELDS - 1] == "a|b|c");
+    CHECK(field_rest(req, 1) == "s|id1,id2|a|b|c");
+    CHECK(field_rest(req, MAX_FIELDS).empty());
+
+    CHECK(parse("DELETE||", req) && req.field_count == 2 && req.fields[0].empty() && req.fields[1].empty());
+    CHECK(parse("STATS|", req) && req.field_count == 1 && req.fields[0].empty());
+
+    int index = -1;
+    CHECK(parse_index("42", index) && index == 42);
+    CHECK(parse_index("7\r\n", index) && index == 7);
+    CHECK(!parse_index("", index));
+    CHECK(!parse_index("4x", index));
+    CHECK(!parse_index("99999999999", index));
+
+    std::string mail = "Sender: a\nSubject: s\nMessage:\nbody\nMessage: not a header\n";
+    std::string_view lines[8];
+    size_t body = 0;
+    CHECK(scan_headers(mail.data(), mail.size(), lines, 8, body) == 2);
+    CHECK(lines[1] == "Subject: s" && mail.substr(body) == "body\nMessage: not a header\n");
+    CHECK(scan_headers(mail.data(), mail.size(), lines, 1, body) == 1 && lines[0] == "Sender: a");
+    std::string headers_only = "Attachment: x\nSender: a";
+    CHECK(scan_headers(headers_only.data(), headers_only.size(), lines, 8, body) == 2 && body == headers_only.size());
+    CHECK(scan_headers("", 0, lines, 8, body) == 0 && body == 0);
+}
+
+static void test_message_ids() {
+    long long ms = 0, prev_ms = 0;
+    std::string prev = generate_message_id(prev_ms);
+    CHECK(prev.size() == MSGID_LENGTH && valid_message_id(prev));
+    CHECK(strtoll(prev.substr(0, 13).c_str(), nullptr, 10) == prev_ms);
+    for (int i = 0; i < 100000; ++i) {
+        std::string id = generate_message_id(ms);
+        CHECK(id > prev && ms >= prev_ms);
+        prev = id;
+        prev_ms = ms;
+    }
+
+    // another thread: own worker, still after everything generated before it ended
+    std::string other;
+    std::thread([&]() { long long t; other = generate_message_id(t); }).join();
+    CHECK(other.compare(14, 4, prev, 14, 4) != 0);
+    CHECK(generate_message_id(ms) > prev);
+
+    CHECK(format_message_id(1761904462714LL, 0x0001abcd00000002ULL) == "1761904462714_0001abcd00000002");
+    CHECK(format_message_id(5, 0) == "0000000000005_0000000000000000");
+    CHECK(valid_message_id("1761211987680_133d698b-fb8d-4a53-81c9-75c691d728c5")); // older uuid ids
+    CHECK(!valid_message_id("1761211987680-0001abcd00000002"));
+    CHECK(!valid_message_id("176121198768x_0001abcd00000002"));
+    CHECK(!valid_message_id("../../etc/passwd"));
+    CHECK(!valid_message_id(format_message_id(epoch_ms_now() + 2 * MSGID_FUTURE_SLACK_MS, 0)));
+}
+
+static void test_wal_records() {
+    std::string payload = "S";
+    put_str32(payload, "alice");
+    put_u64(payload, 1761904462714ULL);
+    put_str32(payload, "subject");
+    put_str32(payload, std::string("body\0with nul", 13));
+    put_u32(payload, 2);
+    put_str32(payload, "bob");
+    put_str32(payload, "1761904462714_0000000000000001");
+    put_str32(payload, "carol");
+    put_str32(payload, "1761904462714_0000000000000002");
+    std::string old_payload = payload; // records of servers without the header block
+    put_str32(payload, "Attachment: h 1 00000000 a.bin\n");
+
+    std::string frame = encode_wal_record(17, 1234, payload);
+    WalRecord rec;
+    CHECK(decode_wal_record(frame.data(), frame.size(), rec) == (long)frame.size());
+    CHECK(rec.lsn == 17 && rec.time_ms == 1234 && rec.payload == payload);
+
+    std::string sender, subject, message, headers;
+    long long date_ms = 0;
+    std::vector<std::pair<std::string, std::string>> targets;
+    CHECK(decode_wal_save(rec.payload, sender, date_ms, subject, message, targets, headers));
+    CHECK(sender == "alice" && date_ms == 1761904462714LL && subject == "subject" && message.size() == 13);
+    CHECK(targets.size() == 2 && targets[1].first == "carol" && targets[1].second == "1761904462714_0000000000000002");
+    CHECK(headers == "Attachment: h 1 00000000 a.bin\n");
+    CHECK(decode_wal_save(old_payload, sender, date_ms, subject, message, targets, headers) && headers.empty());
+    CHECK(!decode_wal_save(payload.substr(0, payload.size() - 3), sender, date_ms, subject, message, targets, headers));
+
+    std::string mailbox, id;
+    std::string del = "D";
+    put_str32(del, "bob");
+    put_str32(del, "1761904462714_0000000000000001");
+    CHECK(decode_wal_delete(del, mailbox, id) && mailbox == "bob" && id == "1761904462714_0000000000000001");
+    CHECK(!decode_wal_delete(payload, mailbox, id));
+    CHECK(!decode_wal_save(del, sender, date_ms, subject, message, targets, headers));
+
+    // incomplete records wait for more data, damaged ones are reported
+    CHECK(decode_wal_record(frame.data(), WAL_HEADER_SIZE - 1, rec) == 0);
+    CHECK(decode_wal_record(frame.data(), frame.size() - 1, rec) == 0);
+    std::string damaged = frame;
+    damaged[WAL_HEADER_SIZE + 3] ^= 1;
+    CHECK(decode_wal_record(damaged.data(), damaged.size(), rec) == -1);
+
+    // heartbeat: record without payload
+    std::string two = encode_wal_record(18, 0, "") + frame;
+    long used = decode_wal_record(two.data(), two.size(), rec);
+    CHECK(used == WAL_HEADER_SIZE && rec.lsn == 18 && rec.payload.empty());
+    CHECK(decode_wal_record(two.data() + used, two.size() - used, rec) == (long)frame.size() && rec.lsn == 17);
+}
+
+static void test_crc32c() {
+    CHECK(crc32c_update(0, "", 0) == 0);
+    CHECK(crc32c_update(0, "123456789", 9) == 0xe3069283);
+    std::string zeros(32, '\0');
+    CHECK(crc32c_update(0, zeros.data(), zeros.size()) == 0x8a9136aa);
+
+    // incremental == in one go, and the table agrees with the instruction at every length/alignment
+    std::string data;
+    for (int i = 0; i < 1000; ++i) data += (char)(i * 7 + 3);
+    uint32_t whole = crc32c_update(0, data.data(), data.size());
+    for (size_t split : {1, 7, 8, 9, 500, 999}) {
+        uint32_t part = crc32c_update(0, data.data(), split);
+        CHECK(crc32c_update(part, data.data() + split, data.size() - split) == whole);
+    }
+    crc32c_init_table(); // only built when the CPU has no crc32 instruction
+    for (size_t off = 0; off < 9; ++off) {
+        for (size_t len = 0; len < 40; ++len) {
+            const unsigned char* p = (const unsigned char*)data.data() + off;
+            uint32_t sw = ~crc32c_sw(~0u, p, len);
+            CHECK(crc32c_update(0, p, len) == sw);
+        }
+    }
+
+    uint32_t crc = 0;
+    CHECK(crc32c_hex(0x0000abcd) == "0000abcd");
+    CHECK(parse_crc32c(crc32c_hex(whole), crc) && crc == whole);
+    CHECK(parse_crc32c("E3069283", crc) && crc == 0xe3069283);
+    CHECK(!parse_crc32c("", crc));
+    CHECK(!parse_crc32c("e306928", crc));
+    CHECK(!parse_crc32c("e30692833", crc));
+    CHECK(!parse_crc32c("e306928g", crc));
+}
+
+static void test_chunk_framing() {
+    size_t body = 0;
+    CHECK(frame_header("#12|hello", 9, body) == 4 && body == 12);
+    CHECK(frame_header("#0|", 3, body) == 3 && body == 0);
+    CHECK(frame_header("#12", 3, body) == 0);
+    CHECK(frame_header("#|", 2, body) == -1);
+    CHECK(frame_header("#1a|", 4, body) == -1);
+    std::string too_long = "#" + std::string(FRAME_HEADER_MAX, '9') + "|";
+    CHECK(frame_header(too_long.data(), too_long.size(), body) == -1);
+
+    std::string chunk = "APUT|0123456789abcdef0123456789abcdef|0|5|1a2b3c4d|";
+    CHECK(aput_length(chunk.data(), chunk.size()) == chunk.size() + 5);
+    std::string bytes = chunk + "ab|de";
+    CHECK(aput_length(bytes.data(), bytes.size()) == bytes.size()); // the bytes may contain '|'
+    CHECK(aput_length("aput|id|0|5|c|", 14) == 19);
+    CHECK(aput_length(chunk.data(), chunk.size() - 1) == 0);       // head not complete yet
+    CHECK(aput_length("APUT|id|0|x5|c|", 15) == 0);
+    CHECK(aput_length("APUT|id|0||c|", 13) == 0);
+    CHECK(aput_length("APUT|id|0|1234567890|c|", 23) == 0);        // more than 9 digits
+    CHECK(aput_length("SEND|a|b|c|d|", 13) == 0);
+}
+
+static void test_mailbox_names() {
+    CHECK(valid_mailbox_name("testuser"));
+    CHECK(valid_mailbox_name("if25b196"));
+    CHECK(!valid_mailbox_name(""));
+    CHECK(!valid_mailbox_name(".wal"));
+    CHECK(!valid_mailbox_name(".."));
+    CHECK(!valid_mailbox_name("a/b"));
+    CHECK(!valid_mailbox_name(std::string_view("a\0b", 3)));
+}
+
+int main() {
+    test_opcodes();
+    test_parser();
+    test_message_ids();
+    test_wal_records();
+    test_crc32c();
+    test_chunk_framing();
+    test_mailbox_names();
+
+    if (failures) {
+        std::cerr << failures << " checks failed\n";
+        return EXIT_FAILURE;
+    }
+    std::cout << "all checks passed\n";
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+// trace.cpp
+// Sampled span tracing. With --trace-sample=N every N-th request (and login) of a
+// connection thread is traced: TraceSpan objects record name, start and duration of
+// the stages it passes (LDAP, directory scans, file access, socket writes) into a
+// buffer owned by the thread. Writers never lock; a buffer is a ring of
+// TRACE_BUFFER_EVENTS events, old events are overwritten.
+//
+// SIGUSR1 or the TRACE command dumps all buffers as Chrome trace-event JSON
+// (<BASE_DIR>/.trace/trace-<epoch ms>.json), to be opened in chrome://tracing or
+// ui.perfetto.dev. Unsampled requests only test a thread-local flag per span.
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#define TRACE_BUFFER_EVENTS 4096
+#define TRACE_DIR ".trace"
+
+struct TraceEvent {
+	const char* name; // string literal
+	int64_t start_us;
+	int64_t dur_us;
+	uint32_t tid;
+};
+
+struct TraceBuffer {
+	TraceEvent events[TRACE_BUFFER_EVENTS];
+	std::atomic<uint64_t> head{0}; // number of events ever written
+};
+
+static std::atomic<unsigned> TRACE_SAMPLE(0); // 1 of N requests, 0 = off
+static std::atomic<unsigned long> trace_counter(0);
+static std::atomic<unsigned long> trace_sampled(0);
+static std::mutex trace_registry_mutex;
+static std::vector<TraceBuffer*> trace_buffers; // every buffer ever handed out (never freed)
+static std::vector<TraceBuffer*> trace_free;    // buffers of finished threads, reused
+static thread_local bool trace_active = false;
+
+// set_trace_sample: trace every n-th request, 0 disables tracing
+void set_trace_sample(unsigned n) {
+	TRACE_SAMPLE = n;
+}
+
+static int64_t trace_now_us() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+	           std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// per-thread buffer, taken on the first traced span, given back when the thread ends
+struct TraceThread {
+	TraceBuffer* buffer = nullptr;
+	uint32_t tid = 0;
+
+	TraceBuffer* get() {
+		if (buffer) return buffer;
+		tid = (uint32_t)syscall(SYS_gettid);
+		std::lock_guard<std::mutex> lock(trace_registry_mutex);
+		if (!trace_free.empty()) {
+			buffer = trace_free.back();
+			trace_free.pop_back();
+		} else {
+			buffer = new TraceBuffer();
+			trace_buffers.push_back(buffer);
+		}
+		return buffer;
+	}
+
+	~TraceThread() {
+		if (!buffer) return;
+		std::lock_guard<std::mutex> lock(trace_registry_mutex);
+		trace_free.push_back(buffer);
+	}
+};
+static thread_local TraceThread trace_thread;
+
+// trace_sample_request: decides whether the request about to be handled by this
+// thread is traced (call once per request)
+void trace_sample_request() {
+	unsigned n = TRACE_SAMPLE.load(std::memory_order_relaxed);
+	trace_active = n && trace_counter.fetch_add(1, std::memory_order_relaxed) % n == 0;
+	if (trace_active) trace_sampled.fetch_add(1, std::memory_order_relaxed);
+}
+
+// trace_end_request: spans after this point are not recorded
+void trace_end_request() {
+	trace_active = false;
+}
+
+// TraceSpan: records [construction, destruction) under `name` (a string literal)
+class TraceSpan {
+public:
+	explicit TraceSpan(const char* name) : name(trace_active ? name : nullptr) {
+		if (this->name) start = trace_now_us();
+	}
+	~TraceSpan() {
+		if (!name) return;
+		TraceBuffer* b = trace_thread.get();
+		uint64_t i = b->head.load(std::memory_order_relaxed);
+		b->events[i % TRACE_BUFFER_EVENTS] = TraceEvent{name, start, trace_now_us() - start, trace_thread.tid};
+		b->head.store(i + 1, std::memory_order_release);
+	}
+	TraceSpan(const TraceSpan&) = delete;
+	TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+	const char* name;
+	int64_t start = 0;
+};
+
+// trace_collect: copy of the events in all buffers. Events a writer overwrote while
+// they were copied are dropped.
+static std::vector<TraceEvent> trace_collect() {
+	std::vector<TraceBuffer*> buffers;
+	{
+		std::lock_guard<std::mutex> lock(trace_registry_mutex);
+		buffers = trace_buffers;
+	}
+	std::vector<TraceEvent> out;
+	for (TraceBuffer* b : buffers) {
+		uint64_t end = b->head.load(std::memory_order_acquire);
+		uint64_t begin = end > TRACE_BUFFER_EVENTS ? end - TRACE_BUFFER_EVENTS : 0;
+		size_t first = out.size();
+		for (uint64_t i = begin; i < end; ++i) out.push_back(b->events[i % TRACE_BUFFER_EVENTS]);
+
+		uint64_t now = b->head.load(std::memory_order_acquire);
+		uint64_t valid_from = now > TRACE_BUFFER_EVENTS ? now - TRACE_BUFFER_EVENTS : 0;
+		if (valid_from > begin) out.erase(out.begin() + first, out.begin() + first + (std::min(end, valid_from) - begin));
+	}
+	return out;
+}
+
+// trace_dump: writes the collected events as Chrome trace JSON into `dir`,
+// returns the file name (empty on error)
+std::string trace_dump(const std::string& dir) {
+	std::vector<TraceEvent> events = trace_collect();
+	std::string path = dir + "/trace-" +
+	    std::to_string(std::chrono::duration_cast<std::chrono::milliseconds>(
+	        std::chrono::system_clock::now().time_since_epoch()).count()) + ".json";
+
+	std::ofstream out(path);
+	if (!out) return "";
+	out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+	int pid = getpid();
+	for (size_t i = 0; i < events.size(); ++i) {
+		const TraceEvent& e = events[i];
+		out << (i ? ",\n" : "\n") << "{\"name\":\"" << e.name << "\",\"cat\":\"twmailer\",\"ph\":\"X\",\"ts\":"
+		    << e.start_us << ",\"dur\":" << e.dur_us << ",\"pid\":" << pid << ",\"tid\":" << e.tid << "}";
+	}
+	out << "\n]}\n";
+	out.close();
+	return out ? path : "";
+}
+
+std::string trace_stats() {
+	unsigned n = TRACE_SAMPLE;
+	size_t buffers;
+	{
+		std::lock_guard<std::mutex> lock(trace_registry_mutex);
+		buffers = trace_buffers.size();
+	}
+	return "trace: sample=" + (n ? "1/" + std::to_string(n) : std::string("off")) +
+	       " sampled=" + std::to_string(trace_sampled) + " buffers=" + std::to_string(buffers) + "\n";
+}
@@ -0,0 +1,301 @@
+// upgrade.cpp
+// Zero-downtime restart. SIGUSR2 makes the running server exec a new server binary
+// (/proc/self/exe, same arguments) and hand over to it:
+//
+//   old                                      new
+//   socketpair(SEQPACKET), fork + exec  -->  TWMAILER_HANDOFF_FD=<fd>
+//   "L <spec>" + listening fd (SCM_RIGHTS) per listener, "END"
+//                                            adopts the listeners, starts up
+//                                       <--  "READY"
+//   stops accepting (kernel queue is shared, nothing is refused)
+//   idle connections: "C <user> <peer>" + fd, the new process serves them on
+//   (logged in, no new LDAP bind); a command in flight is finished first
+//   saved/deleted mails meanwhile: "A <user> <id>" / "D <user> <id>"
+//   "DONE" once all connections are gone or the drain deadline passed, exit
+//
+// If the new binary does not come up (exec fails, no READY in time) the old
+// server keeps running as if nothing happened.
+
+#include <sys/wait.h>
+#include <sys/uio.h>
+
+#define HANDOFF_ENV "TWMAILER_HANDOFF_FD"
+#define HANDOFF_MSG_SIZE 512
+#define UPGRADE_READY_TIMEOUT_MS 60000
+#define DRAIN_DEFAULT_TIMEOUT 30 // seconds
+
+static vector<string> server_argv;
+static int upgrade_pipe[2] = {-1, -1}; // SIGUSR2 -> upgrade thread
+static int drain_pipe[2] = {-1, -1};   // readable once draining started
+static int handoff_fd = -1;            // old: to the successor, new: from the predecessor
+static mutex handoff_mutex;
+static atomic<bool> draining(false);
+static atomic<int> active_connections(0);
+static unsigned DRAIN_TIMEOUT = DRAIN_DEFAULT_TIMEOUT;
+
+// set_drain_timeout: how long a restarting server waits for in-flight commands
+void set_drain_timeout(unsigned seconds) {
+	DRAIN_TIMEOUT = seconds;
+}
+
+// send_handoff: one message, optionally with a file descriptor attached
+static bool send_handoff(int sock, const string& msg, int fd) {
+	iovec iov{(void*)msg.data(), msg.size()};
+	msghdr mh{};
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	if (fd >= 0) {
+		mh.msg_control = control;
+		mh.msg_controllen = sizeof(control);
+		cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &mh, MSG_NOSIGNAL) == (ssize_t)msg.size();
+}
+
+// recv_handoff: one message and its file descriptor (-1 if none), false on EOF/error
+static bool recv_handoff(int sock, string& msg, int& fd) {
+	char buf[HANDOFF_MSG_SIZE];
+	iovec iov{buf, sizeof(buf)};
+	msghdr mh{};
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	char control[CMSG_SPACE(sizeof(int))];
+	mh.msg_control = control;
+	mh.msg_controllen = sizeof(control);
+
+	ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	if (n <= 0) return false;
+	msg.assign(buf, n);
+	fd = -1;
+	for (cmsghdr* cm = CMSG_FIRSTHDR(&mh); cm; cm = CMSG_NXTHDR(&mh, cm)) {
+		if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	}
+	return true;
+}
+
+// --- old process -------------------------------------------------------------
+
+static void forward_mailbox_change(char op, const string& username, const string& id) {
+	lock_guard<mutex> lock(handoff_mutex);
+	if (handoff_fd >= 0) send_handoff(handoff_fd, string(1, op) + " " + username + " " + id, -1);
+}
+
+// start_successor: exec the new binary and pass the listeners, true once it is READY
+static bool start_successor() {
+	int sv[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) return false;
+
+	// everything exec needs is prepared before fork (only async-signal-safe calls in the child)
+	string env_entry = string(HANDOFF_ENV) + "=" + to_string(sv[1]);
+	vector<char*> argv;
+	for (string& a : server_argv) argv.push_back(a.data());
+	argv.push_back(nullptr);
+	vector<char*> envp;
+	for (char** e = environ; *e; ++e) {
+		if (strncmp(*e, HANDOFF_ENV "=", strlen(HANDOFF_ENV) + 1) != 0) envp.push_back(*e);
+	}
+	envp.push_back(env_entry.data());
+	envp.push_back(nullptr);
+
+	pid_t pid = fork();
+	if (pid < 0) {
+		close(sv[0]);
+		close(sv[1]);
+		return false;
+	}
+	if (pid == 0) {
+		fcntl(sv[1], F_SETFD, 0); // keep the handoff socket across exec
+		execve("/proc/self/exe", argv.data(), envp.data());
+		_exit(127);
+	}
+	close(sv[1]);
+	std::cout << "upgrade: started new server (pid " << pid << ")" << endl;
+
+	bool ok = true;
+	for (const Listener& l : listeners) ok = ok && send_handoff(sv[0], "L " + l.spec, l.fd);
+	ok = ok && send_handoff(sv[0], "END", -1);
+
+	// mails saved/deleted from now on are forwarded, the new process may already
+	// have loaded those mailboxes (queued until it reads them after READY)
+	{
+		lock_guard<mutex> lock(handoff_mutex);
+		handoff_fd = sv[0];
+	}
+	mailbox_change_hook = forward_mailbox_change;
+
+	// wait for READY (the new process connects to LDAP etc. first)
+	pollfd pfd{sv[0], POLLIN, 0};
+	string msg;
+	int fd;
+	ok = ok && poll(&pfd, 1, UPGRADE_READY_TIMEOUT_MS) == 1 && recv_handoff(sv[0], msg, fd) && msg == "READY";
+	if (!ok) {
+		cerr << "upgrade: new server did not come up, keep running" << endl;
+		mailbox_change_hook = nullptr;
+		{
+			lock_guard<mutex> lock(handoff_mutex);
+			handoff_fd = -1;
+		}
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		close(sv[0]);
+		return false;
+	}
+	return true;
+}
+
+static void upgrade_thread() {
+	char c;
+	while (read(upgrade_pipe[0], &c, 1) == 1 || errno == EINTR) {
+		if (draining) continue;
+		if (!start_successor()) continue;
+
+		std::cout << "upgrade: handing over to the new server, draining connections" << endl;
+		reclaim_pause();
+		draining = true;
+		// wakes the accept loop and all idle connections
+		if (write(drain_pipe[1], "x", 1) != 1) cerr << "upgrade: failed to start draining" << endl;
+		return;
+	}
+}
+
+static void upgrade_signal(int) {
+	int saved = errno;
+	if (write(upgrade_pipe[1], "u", 1) < 0) {}
+	errno = saved;
+}
+
+// setup_upgrade: remembers how we were started and arms SIGUSR2
+void setup_upgrade(int argc, char* argv[]) {
+	server_argv.assign(argv, argv + argc);
+	if (pipe2(upgrade_pipe, O_CLOEXEC) < 0 || pipe2(drain_pipe, O_CLOEXEC) < 0) {
+		cerr << "upgrade: pipe failed, restart without handover disabled" << endl;
+		return;
+	}
+	signal(SIGUSR2, upgrade_signal);
+	thread(upgrade_thread).detach();
+}
+
+// drain_fd: becomes readable when the server stops accepting (accept loop)
+int drain_fd() {
+	return drain_pipe[0];
+}
+
+// wait_for_request: blocks until the client sent something or draining started.
+// Returns false if the connection should be handed over now.
+bool wait_for_request(int client_socket) {
+	pollfd fds[2] = {{client_socket, POLLIN, 0}, {drain_pipe[0], POLLIN, 0}};
+	while (!draining) {
+		if (poll(fds, 2, -1) < 0 && errno != EINTR) return true; // let recv report it
+		if (fds[0].revents) return true;
+	}
+	return false;
+}
+
+// handoff_connection: passes a logged-in connection (between two commands) to the
+// successor. The caller closes its copy of the socket afterwards.
+bool handoff_connection(int client_socket, const string& username, const string& peer) {
+	lock_guard<mutex> lock(handoff_mutex);
+	return handoff_fd >= 0 && send_handoff(handoff_fd, "C " + username + " " + peer, client_socket);
+}
+
+// finish_drain: waits for the remaining connections (or the deadline) and lets
+// the successor know we are gone
+void finish_drain() {
+	long long deadline = epoch_ms_now() + DRAIN_TIMEOUT * 1000LL;
+	while (active_connections > 0 && epoch_ms_now() < deadline) {
+		this_thread::sleep_for(chrono::milliseconds(50));
+	}
+	if (active_connections > 0)
+		cerr << "upgrade: drain deadline passed, dropping " << active_connections << " connections" << endl;
+
+	// the successor continues the log after DONE, commands still running fail to log
+	wal_stop();
+	lock_guard<mutex> lock(handoff_mutex);
+	if (handoff_fd < 0) return;
+	send_handoff(handoff_fd, "DONE", -1);
+	close(handoff_fd);
+	handoff_fd = -1;
+	std::cout << "upgrade: handover complete" << endl;
+}
+
+bool is_draining() {
+	return draining;
+}
+
+// ActiveConnection: counts a client connection for the drain (scope of a thread)
+struct ActiveConnection {
+	ActiveConnection() { active_connections++; }
+	~ActiveConnection() { active_connections--; }
+};
+
+// --- new process -------------------------------------------------------------
+
+// has_predecessor: started by a restarting server (which still owns the log, wal.cpp)
+bool has_predecessor() {
+	return handoff_fd >= 0 || getenv(HANDOFF_ENV) != nullptr;
+}
+
+// adopt_predecessor: takes the listening sockets of the server we replace (if any)
+void adopt_predecessor() {
+	const char* env = getenv(HANDOFF_ENV);
+	if (!env) return;
+	handoff_fd = atoi(env);
+	unsetenv(HANDOFF_ENV);
+	fcntl(handoff_fd, F_SETFD, FD_CLOEXEC);
+
+	string msg;
+	int fd;
+	while (recv_handoff(handoff_fd, msg, fd) && msg != "END") {
+		if (msg.rfind("L ", 0) == 0 && fd >= 0 && adopt_listener(msg.substr(2), fd)) continue;
+		if (fd >= 0) close(fd);
+	}
+	std::cout << "upgrade: took over " << listeners.size() << " listeners" << endl;
+}
+
+// predecessor_ready: tells the old server to hand over, then serves the
+// connections and mailbox changes it sends until it is gone
+void predecessor_ready(const function<void(int, const string&, const string&)>& serve) {
+	if (handoff_fd < 0) return;
+	if (!send_handoff(handoff_fd, "READY", -1)) {
+		wal_takeover();
+		return;
+	}
+
+	thread([serve]() {
+		string msg;
+		int fd;
+		int adopted = 0;
+		while (recv_handoff(handoff_fd, msg, fd) && msg != "DONE") {
+			if (msg.empty()) {
+				if (fd >= 0) close(fd);
+				continue;
+			}
+			istringstream iss(msg.substr(min<size_t>(2, msg.size())));
+			string a, b;
+			iss >> a >> b;
+			if (msg[0] == 'C' && fd >= 0) {
+				adopted++;
+				thread(serve, fd, b, a).detach(); // socket, peer, username
+				continue;
+			}
+			if (fd >= 0) close(fd);
+			if (msg[0] == 'A') {
+				index_reload(a);
+				cache_invalidate(a);
+			} else if (msg[0] == 'D') {
+				adopt_tombstone(a, b);
+			}
+			// IDLE clients that were handed over already are waiting here
+			if (msg[0] == 'A' || msg[0] == 'D') mailbox_changed(msg[0], a, b);
+		}
+		close(handoff_fd);
+		handoff_fd = -1;
+		wal_takeover();
+		std::cout << "upgrade: predecessor gone, adopted " << adopted << " connections" << endl;
+	}).detach();
+}
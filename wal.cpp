@@ -0,0 +1,386 @@
+// wal.cpp
+// Mutation log: every saved mail and every delete is appended to a sequential log
+// (fdatasync'ed before the client gets its ACK) and numbered with a log sequence
+// number (LSN). replication.cpp streams the log to follower servers.
+//
+//   <BASE_DIR>/.wal/<first lsn, 20 digits>.wal   segments of WAL_SEGMENT_BYTES
+//   record : u64 lsn | i64 time_ms | u32 payload length | u32 checksum | payload
+//   payload: 'S' sender | i64 date_ms | subject | message | u32 n | n x (recipient | id)
+//                | headers     (Attachment: lines, missing in records of older servers)
+//            'D' mailbox | id                        (strings: u32 length + bytes)
+//
+// A save is logged before its mail files are written, so a mail is never deleted in
+// the log before it was saved there, and a failed append leaves nothing behind that a
+// retrying client would duplicate. A delete is logged after its tombstone is journaled
+// and the tombstone is taken back if the append fails (reclaim.cpp). A mailbox that cannot
+// be written after the save was logged gets a 'D' record. Replaying a record is
+// idempotent, the same ids are written/deleted again. The newest WAL_KEEP_SEGMENTS
+// segments are kept; a follower that falls further behind has to be seeded again with
+// a copy of the spool.
+//
+// Restart (upgrade.cpp): the successor opens the log only after its predecessor is
+// gone (wal_takeover), its appends wait until then; the predecessor stops appending
+// before it says it is done (wal_stop). Only one process ever hands out LSNs.
+
+#include <condition_variable>
+
+#define WAL_DIR ".wal"
+#define WAL_HEADER_SIZE 24
+#define WAL_SEGMENT_BYTES (64 * 1024 * 1024)
+#define WAL_KEEP_SEGMENTS 8
+#define WAL_READ_CHUNK (256 * 1024)
+
+struct WalRecord {
+	uint64_t lsn = 0;
+	long long time_ms = 0;
+	string payload;
+};
+
+// position of a reader (replication stream) in the log
+struct WalCursor {
+	fs::path segment;
+	uint64_t offset = 0;
+	uint64_t next_lsn = 1;
+};
+
+static bool WAL_ENABLED = false;
+static mutex wal_mutex;
+static condition_variable wal_cv;
+static int wal_fd = -1;
+static fs::path wal_segment;
+static uint64_t wal_segment_size = 0;
+static uint64_t wal_next_lsn = 1;
+static atomic<uint64_t> wal_committed(0); // last durable lsn
+static atomic<unsigned long> wal_failed(0);
+static bool wal_waiting = false;  // successor of a restart: the predecessor still owns the log
+static bool wal_stopped = false;  // predecessor after the handover: appends fail
+
+static fs::path wal_dir() {
+	return BASE_DIR / WAL_DIR;
+}
+
+static fs::path wal_segment_path(uint64_t first_lsn) {
+	char name[32];
+	snprintf(name, sizeof(name), "%020llu.wal", (unsigned long long)first_lsn);
+	return wal_dir() / name;
+}
+
+// wal_segments: all segment files, oldest first
+static vector<fs::path> wal_segments() {
+	vector<fs::path> segments;
+	error_code ec;
+	for (const auto& e : fs::directory_iterator(wal_dir(), ec)) {
+		if (e.path().extension() == ".wal") segments.push_back(e.path());
+	}
+	sort(segments.begin(), segments.end());
+	return segments;
+}
+
+static uint64_t segment_first_lsn(const fs::path& segment) {
+	return strtoull(segment.stem().c_str(), nullptr, 10);
+}
+
+static void put_str32(string& out, const string& s) {
+	put_u32(out, (uint32_t)s.size());
+	out += s;
+}
+
+static string get_str32(SnapshotReader& reader) {
+	uint32_t len = reader.get<uint32_t>();
+	if (!reader.ok || reader.end - reader.pos < (long)len) {
+		reader.ok = false;
+		return "";
+	}
+	string s(reader.pos, len);
+	reader.pos += len;
+	return s;
+}
+
+static uint32_t wal_checksum(const string& payload) {
+	return (uint32_t)snapshot_checksum(payload.data(), payload.size());
+}
+
+static string encode_wal_record(uint64_t lsn, long long time_ms, const string& payload) {
+	string out;
+	put_u64(out, lsn);
+	put_u64(out, (uint64_t)time_ms);
+	put_u32(out, (uint32_t)payload.size());
+	put_u32(out, wal_checksum(payload));
+	return out + payload;
+}
+
+// decode_wal_record: one record from data[0..len). Returns the bytes used, 0 if the
+// record is incomplete, -1 if it is damaged.
+long decode_wal_record(const char* data, size_t len, WalRecord& rec) {
+	if (len < WAL_HEADER_SIZE) return 0;
+	uint32_t size, checksum;
+	memcpy(&rec.lsn, data, 8);
+	memcpy(&rec.time_ms, data + 8, 8);
+	memcpy(&size, data + 16, 4);
+	memcpy(&checksum, data + 20, 4);
+	if (len < WAL_HEADER_SIZE + (size_t)size) return 0;
+	rec.payload.assign(data + WAL_HEADER_SIZE, size);
+	if (wal_checksum(rec.payload) != checksum) return -1;
+	return WAL_HEADER_SIZE + size;
+}
+
+// caller holds wal_mutex
+static bool wal_open_segment(uint64_t first_lsn) {
+	if (wal_fd >= 0) close(wal_fd);
+	wal_segment = wal_segment_path(first_lsn);
+	wal_fd = open(wal_segment.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	wal_segment_size = 0;
+	if (wal_fd < 0) {
+		cerr << "wal: failed to open " << wal_segment << "\n";
+		return false;
+	}
+	// old segments beyond the retention
+	vector<fs::path> segments = wal_segments();
+	error_code ec;
+	for (size_t i = 0; i + WAL_KEEP_SEGMENTS < segments.size(); ++i) fs::remove(segments[i], ec);
+	return true;
+}
+
+// wal_open: opens the log for appending. Continues after the last intact record,
+// a torn tail (crash during an append, never ACKed) is cut off. Caller holds wal_mutex.
+static bool wal_open() {
+	error_code ec;
+	fs::create_directories(wal_dir(), ec);
+
+	vector<fs::path> segments = wal_segments();
+	if (segments.empty()) {
+		WAL_ENABLED = wal_open_segment(1);
+		return WAL_ENABLED;
+	}
+
+	string data;
+	read_file(segments.back(), data);
+	uint64_t last = segment_first_lsn(segments.back()) - 1;
+	size_t pos = 0;
+	WalRecord rec;
+	long used;
+	while ((used = decode_wal_record(data.data() + pos, data.size() - pos, rec)) > 0) {
+		last = rec.lsn;
+		pos += used;
+	}
+	if (pos != data.size()) {
+		cerr << "wal: cutting off " << data.size() - pos << " bytes of a torn record\n";
+		fs::resize_file(segments.back(), pos, ec);
+	}
+
+	wal_next_lsn = last + 1;
+	wal_committed = last;
+	wal_segment = segments.back();
+	wal_fd = open(wal_segment.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+	wal_segment_size = pos;
+	WAL_ENABLED = wal_fd >= 0;
+	cout << "wal: continuing at lsn " << wal_next_lsn << "\n";
+	return WAL_ENABLED;
+}
+
+// wal_start: opens the log; `after_predecessor`: a restarted server whose predecessor
+// still appends, the log is opened by wal_takeover() instead
+bool wal_start(bool after_predecessor) {
+	lock_guard<mutex> lock(wal_mutex);
+	if (!after_predecessor) return wal_open();
+	WAL_ENABLED = true;
+	wal_waiting = true;
+	return true;
+}
+
+// wal_takeover: the predecessor is gone, continue its log
+void wal_takeover() {
+	{
+		lock_guard<mutex> lock(wal_mutex);
+		if (!wal_waiting) return;
+		wal_waiting = false;
+		if (!wal_open()) {
+			cerr << "wal: failed to take over the log, saves and deletes fail\n";
+			WAL_ENABLED = true;
+			wal_stopped = true;
+		}
+	}
+	wal_cv.notify_all();
+}
+
+// wal_stop: no more appends from this process (handed over to the successor)
+void wal_stop() {
+	lock_guard<mutex> lock(wal_mutex);
+	wal_stopped = true;
+}
+
+// wal_wait_open: blocks until this process owns the log (see wal_takeover)
+void wal_wait_open() {
+	unique_lock<mutex> lock(wal_mutex);
+	wal_cv.wait(lock, []() { return !wal_waiting; });
+}
+
+// wal_append: appends one record and syncs it, returns false on error
+static bool wal_append(const string& payload) {
+	if (!WAL_ENABLED) return true;
+	TraceSpan span("wal_append");
+	unique_lock<mutex> lock(wal_mutex);
+	wal_cv.wait(lock, []() { return !wal_waiting; });
+	if (wal_stopped) {
+		wal_failed++;
+		return false;
+	}
+	if (wal_segment_size >= WAL_SEGMENT_BYTES && !wal_open_segment(wal_next_lsn)) {
+		wal_failed++;
+		return false;
+	}
+	string frame = encode_wal_record(wal_next_lsn, epoch_ms_now(), payload);
+	if (wal_fd < 0 || write(wal_fd, frame.data(), frame.size()) != (ssize_t)frame.size() || fdatasync(wal_fd) != 0) {
+		cerr << "wal: failed to append record " << wal_next_lsn << "\n";
+		// the partial record would corrupt every later one
+		if (wal_fd >= 0 && ftruncate(wal_fd, wal_segment_size) != 0) cerr << "wal: failed to cut off partial record\n";
+		wal_failed++;
+		return false;
+	}
+	wal_segment_size += frame.size();
+	wal_committed = wal_next_lsn++;
+	lock.unlock();
+	wal_cv.notify_all();
+	return true;
+}
+
+// wal_log_save: a mail stored in the mailboxes `targets` (recipient, id), `headers`
+// are its extra header lines (attach.cpp)
+bool wal_log_save(const string& sender, long long date_ms, const string& subject, const string& message,
+                  const vector<pair<string, string>>& targets, const string& headers) {
+	if (!WAL_ENABLED || targets.empty()) return true;
+	string payload = "S";
+	put_str32(payload, sender);
+	put_u64(payload, (uint64_t)date_ms);
+	put_str32(payload, subject);
+	put_str32(payload, message);
+	put_u32(payload, (uint32_t)targets.size());
+	for (const auto& t : targets) {
+		put_str32(payload, t.first);
+		put_str32(payload, t.second);
+	}
+	put_str32(payload, headers);
+	return wal_append(payload);
+}
+
+// wal_log_delete: mail `id` deleted from `mailbox`
+bool wal_log_delete(const string& mailbox, const string& id) {
+	if (!WAL_ENABLED) return true;
+	string payload = "D";
+	put_str32(payload, mailbox);
+	put_str32(payload, id);
+	return wal_append(payload);
+}
+
+// wal_seek: positions `cur` at record `lsn`, false if it is no longer (or not yet) in the log
+bool wal_seek(WalCursor& cur, uint64_t lsn) {
+	if (lsn == 0 || lsn > wal_committed + 1) return false;
+	vector<fs::path> segments = wal_segments();
+	if (segments.empty()) return false;
+	size_t i = segments.size();
+	while (i > 0 && segment_first_lsn(segments[i - 1]) > lsn) i--;
+	if (i == 0) return false; // older than the oldest kept segment
+	cur.segment = segments[i - 1];
+	cur.offset = 0;
+	cur.next_lsn = segment_first_lsn(cur.segment);
+
+	// skip the records before `lsn`
+	string data;
+	if (!read_file(cur.segment, data)) return false;
+	WalRecord rec;
+	long used;
+	while (cur.next_lsn < lsn && (used = decode_wal_record(data.data() + cur.offset, data.size() - cur.offset, rec)) > 0) {
+		cur.offset += used;
+		cur.next_lsn = rec.lsn + 1;
+	}
+	return cur.next_lsn == lsn;
+}
+
+// wal_next: appends the raw records following `cur` (up to about `max_bytes`, only
+// durable ones) to `frames`. Returns the number of records, -1 if the log is gone.
+long wal_next(WalCursor& cur, string& frames, size_t max_bytes) {
+	long count = 0;
+	while (cur.next_lsn <= wal_committed && frames.size() < max_bytes) {
+		int fd = open(cur.segment.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) return -1; // removed by the retention
+		string chunk(WAL_READ_CHUNK, '\0');
+		ssize_t n = pread(fd, &chunk[0], chunk.size(), cur.offset);
+		close(fd);
+		if (n < 0) return -1;
+
+		size_t pos = 0;
+		WalRecord rec;
+		long used = 0;
+		while (cur.next_lsn <= wal_committed && (used = decode_wal_record(chunk.data() + pos, n - pos, rec)) > 0) {
+			frames.append(chunk.data() + pos, used);
+			pos += used;
+			cur.next_lsn = rec.lsn + 1;
+			count++;
+		}
+		cur.offset += pos;
+		if (used < 0) return -1;
+		if (pos > 0) continue;
+		if ((size_t)n == chunk.size()) {
+			// a record larger than the chunk
+			uint32_t size;
+			memcpy(&size, chunk.data() + 16, 4);
+			chunk.resize(WAL_HEADER_SIZE + size);
+			fd = open(cur.segment.c_str(), O_RDONLY | O_CLOEXEC);
+			n = fd >= 0 ? pread(fd, &chunk[0], chunk.size(), cur.offset) : -1;
+			if (fd >= 0) close(fd);
+			if (n != (ssize_t)chunk.size() || decode_wal_record(chunk.data(), n, rec) <= 0) return -1;
+			frames += chunk;
+			cur.offset += n;
+			cur.next_lsn = rec.lsn + 1;
+			count++;
+			continue;
+		}
+		// end of this segment, the next one starts with the next lsn
+		fs::path next = wal_segment_path(cur.next_lsn);
+		error_code ec;
+		if (!fs::exists(next, ec)) break;
+		cur.segment = next;
+		cur.offset = 0;
+	}
+	return count;
+}
+
+// wal_wait: waits up to `ms` for records after `lsn`
+void wal_wait(uint64_t lsn, int ms) {
+	unique_lock<mutex> lock(wal_mutex);
+	wal_cv.wait_for(lock, chrono::milliseconds(ms), [lsn]() { return wal_committed > lsn; });
+}
+
+uint64_t wal_last_lsn() {
+	return wal_committed;
+}
+
+bool wal_enabled() {
+	return WAL_ENABLED;
+}
+
+// decode_wal_save / decode_wal_delete: payload of an 'S' / 'D' record
+bool decode_wal_save(const string& payload, string& sender, long long& date_ms, string& subject, string& message,
+                     vector<pair<string, string>>& targets, string& headers) {
+	SnapshotReader reader{payload.data() + 1, payload.data() + payload.size()};
+	sender = get_str32(reader);
+	date_ms = (long long)reader.get<uint64_t>();
+	subject = get_str32(reader);
+	message = get_str32(reader);
+	uint32_t n = reader.get<uint32_t>();
+	targets.clear();
+	for (uint32_t i = 0; i < n && reader.ok; ++i) {
+		string mailbox = get_str32(reader);
+		string id = get_str32(reader);
+		targets.emplace_back(mailbox, id);
+	}
+	headers = reader.ok && reader.pos < reader.end ? get_str32(reader) : "";
+	return reader.ok && payload[0] == 'S';
+}
+
+bool decode_wal_delete(const string& payload, string& mailbox, string& id) {
+	SnapshotReader reader{payload.data() + 1, payload.data() + payload.size()};
+	mailbox = get_str32(reader);
+	id = get_str32(reader);
+	return reader.ok && payload[0] == 'D';
+}
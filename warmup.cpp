@@ -0,0 +1,150 @@
+// warmup.cpp
+// Startup warm-up: scans the whole mail spool in parallel and prebuilds the
+// mailbox indexes (mailindex.cpp) so the first LIST after a restart is served
+// from memory. The server accepts connections while the scan is running;
+// mailboxes that are not indexed yet are still loaded lazily on first access.
+//
+// One task per mailbox, distributed over a work-stealing thread pool:
+// each worker owns a deque, pops from its front and steals from the back of
+// the others when it runs dry.
+//
+// Mailboxes that are unchanged in the snapshot are skipped at first and loaded
+// in a second pass afterwards, so the message-id catalog (catalog.cpp) ends up
+// knowing every mailbox without a request ever having to load the spool.
+
+#include <thread>
+#include <deque>
+
+#define WARMUP_REPORT_MS 1000
+
+struct WarmupQueue {
+	mutex lock;
+	deque<string> users;
+};
+
+static unsigned WARMUP_THREADS = max(1u, thread::hardware_concurrency());
+static atomic<bool> warmup_running(false);
+static atomic<unsigned long> warmup_users_total(0);
+static atomic<unsigned long> warmup_users_done(0);
+static atomic<unsigned long> warmup_mails(0);
+static atomic<unsigned long> warmup_snapshot_skipped(0);
+static atomic<long long> warmup_started_ms(0);
+static atomic<long long> warmup_finished_ms(0);
+
+static bool warmup_pop(vector<WarmupQueue>& queues, size_t self, string& user) {
+	{
+		lock_guard<mutex> lock(queues[self].lock);
+		if (!queues[self].users.empty()) {
+			user = move(queues[self].users.front());
+			queues[self].users.pop_front();
+			return true;
+		}
+	}
+	// steal from the other workers
+	for (size_t i = 1; i < queues.size(); ++i) {
+		WarmupQueue& victim = queues[(self + i) % queues.size()];
+		lock_guard<mutex> lock(victim.lock);
+		if (!victim.users.empty()) {
+			user = move(victim.users.back());
+			victim.users.pop_back();
+			return true;
+		}
+	}
+	return false;
+}
+
+static mutex warmup_deferred_mutex;
+static vector<string> warmup_deferred;
+
+// warm_mailbox: loads the index of `username` unless a request already did.
+// Mailboxes that are unchanged in the snapshot are deferred to the second pass.
+static void warm_mailbox(const string& username) {
+	if (snapshot_valid(username)) {
+		warmup_snapshot_skipped++;
+		lock_guard<mutex> lock(warmup_deferred_mutex);
+		warmup_deferred.push_back(username);
+		return;
+	}
+	shared_ptr<Mailbox> mb = get_mailbox(username);
+	lock_guard<mutex> lock(mb->lock);
+	warmup_mails += mb->mails.size();
+	warmup_users_done++;
+}
+
+// fill_catalog: second pass, loads a deferred mailbox from its snapshot
+static void fill_catalog(const string& username) {
+	get_mailbox(username);
+	warmup_users_done++;
+}
+
+static void warmup_worker(vector<WarmupQueue>& queues, size_t self, void (*task)(const string&)) {
+	string user;
+	while (warmup_pop(queues, self, user)) task(user);
+}
+
+// run_pass: runs `task` for every user on `threads` workers
+static void run_pass(const vector<string>& users, unsigned threads, void (*task)(const string&)) {
+	vector<WarmupQueue> queues(threads);
+	for (size_t i = 0; i < users.size(); ++i) {
+		queues[i % threads].users.push_back(users[i]);
+	}
+	vector<thread> workers;
+	for (unsigned i = 0; i < threads; ++i) {
+		workers.emplace_back(warmup_worker, ref(queues), i, task);
+	}
+	for (thread& t : workers) t.join();
+}
+
+// set_warmup_threads: number of scanner threads, 0 disables the warm-up
+void set_warmup_threads(unsigned threads) {
+	WARMUP_THREADS = threads;
+}
+
+string warmup_progress() {
+	long long start = warmup_started_ms;
+	if (start == 0) return "warmup: disabled\n";
+	long long end = warmup_running ? epoch_ms_now() : warmup_finished_ms.load();
+	double seconds = max(1LL, end - start) / 1000.0;
+
+	ostringstream oss;
+	oss << "warmup: " << (warmup_running ? "running" : "done")
+	    << " mailboxes=" << warmup_users_done << "/" << warmup_users_total
+	    << " mails=" << warmup_mails << " unchanged_in_snapshot=" << warmup_snapshot_skipped
+	    << " rate=" << (unsigned long)(warmup_mails / seconds) << " mails/s"
+	    << " elapsed=" << fixed << setprecision(1) << seconds << "s\n";
+	return oss.str();
+}
+
+static void run_warmup(unsigned threads) {
+	warmup_started_ms = epoch_ms_now();
+
+	// mailboxes in either layout (layout.cpp), a mailbox being migrated shows up twice
+	vector<string> users;
+	for_each_mailbox([&](const string& name) { users.push_back(name); });
+	sort(users.begin(), users.end());
+	users.erase(unique(users.begin(), users.end()), users.end());
+	warmup_users_total = users.size();
+
+	// Fortschritt melden bis alle Worker fertig sind
+	thread reporter([]() {
+		while (warmup_running) {
+			this_thread::sleep_for(chrono::milliseconds(WARMUP_REPORT_MS));
+			if (warmup_running) cout << warmup_progress();
+		}
+	});
+
+	run_pass(users, threads, warm_mailbox);
+	run_pass(warmup_deferred, threads, fill_catalog);
+	catalog_complete = true;
+	warmup_finished_ms = epoch_ms_now();
+	warmup_running = false;
+	reporter.join();
+	cout << warmup_progress();
+}
+
+// start_warmup: scans the spool in the background
+void start_warmup() {
+	if (WARMUP_THREADS == 0) return;
+	warmup_running = true;
+	thread(run_warmup, WARMUP_THREADS).detach();
+}